@@ -2,6 +2,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "nanopore.h"
 #include "pairwiseAligner.h"
 
@@ -14,7 +19,7 @@ NanoporeRead *nanopore_nanoporeReadConstruct(int64_t readLength, int64_t nbTempl
     npRead->nbTemplateEvents = nbTemplateEvents;
     npRead->nbComplementEvents = nbComplementEvents;
 
-    npRead->twoDread = st_malloc(npRead->readLength * sizeof(char));
+    npRead->twoDread = st_malloc((npRead->readLength + 1) * sizeof(char));
 
     // the map contains the index of the event corresponding to each kmer in the read sequence so
     // the length of the map has to be the same as the read sequence, not the number of events
@@ -25,12 +30,15 @@ NanoporeRead *nanopore_nanoporeReadConstruct(int64_t readLength, int64_t nbTempl
     npRead->complementEventMap = st_malloc(npRead->readLength * sizeof(int64_t));
     npRead->complementEvents = st_malloc(npRead->nbComplementEvents * NB_EVENT_PARAMS * sizeof(double));
 
+    npRead->mapped = 0;
+    npRead->mapping = NULL;
+    npRead->mappingLength = 0;
+
     // return
     return npRead;
 }
 
-NanoporeRead *nanopore_loadNanoporeReadFromFile(const char *nanoporeReadFile) {
-    FILE *fH = fopen(nanoporeReadFile, "r");
+static NanoporeRead *nanopore_loadNanoporeReadFromTextFile(FILE *fH) {
 
     // line 1 [2D read length] [# of template events] [# of complement events]
     //        [template scale] [template shift] [template var] [template scale_sd] [template var_sd]
@@ -187,10 +195,325 @@ NanoporeRead *nanopore_loadNanoporeReadFromFile(const char *nanoporeReadFile) {
     free(string);
     stList_destruct(tokens);
 
+    return npRead;
+}
+
+///////////////////////////
+// Binary npRead files   //
+///////////////////////////
+
+// A read in binary form: this header, then the 2D read (nul terminated), the template event map and events and the
+// complement event map and events, each at the next 64 byte aligned offset from the start of the header. Records
+// are used where they are mapped, so are in the byte order of the machine that wrote them.
+typedef struct _nanoporeReadRecordHeader {
+    char magic[8];
+    int64_t byteOrder;
+    int64_t recordLength;
+    int64_t readLength;
+    int64_t nbTemplateEvents;
+    int64_t nbComplementEvents;
+    NanoporeReadAdjustmentParameters templateParams;
+    NanoporeReadAdjustmentParameters complementParams;
+} NanoporeReadRecordHeader;
+
+// A bundle: this header, the offsets of its records, the names of its reads (each nul terminated, one after the
+// other) and then the records, each at a 64 byte aligned offset.
+typedef struct _nanoporeReadBundleHeader {
+    char magic[8];
+    int64_t byteOrder;
+    int64_t readNumber;
+    int64_t namesOffset;
+    int64_t namesLength;
+    int64_t unused[3];
+} NanoporeReadBundleHeader;
+
+#define NP_READ_RECORD_MAGIC "cPnpRd01"
+#define NP_READ_BUNDLE_MAGIC "cPnpBd01"
+#define NP_READ_BYTE_ORDER 0x0102030405060708
+#define NP_READ_ALIGN(n) (((n) + 63) & ~((int64_t) 63))
+
+typedef struct _nanoporeReadRecordLayout {
+    int64_t twoDread;
+    int64_t templateEventMap;
+    int64_t templateEvents;
+    int64_t complementEventMap;
+    int64_t complementEvents;
+    int64_t length;
+} NanoporeReadRecordLayout;
+
+static NanoporeReadRecordLayout nanopore_getRecordLayout(int64_t readLength, int64_t nbTemplateEvents,
+                                                         int64_t nbComplementEvents) {
+    NanoporeReadRecordLayout layout;
+    layout.twoDread = NP_READ_ALIGN((int64_t) sizeof(NanoporeReadRecordHeader));
+    layout.templateEventMap = NP_READ_ALIGN(layout.twoDread + readLength + 1);
+    layout.templateEvents = NP_READ_ALIGN(layout.templateEventMap + readLength * (int64_t) sizeof(int64_t));
+    layout.complementEventMap = NP_READ_ALIGN(layout.templateEvents +
+                                              nbTemplateEvents * NB_EVENT_PARAMS * (int64_t) sizeof(double));
+    layout.complementEvents = NP_READ_ALIGN(layout.complementEventMap + readLength * (int64_t) sizeof(int64_t));
+    layout.length = NP_READ_ALIGN(layout.complementEvents +
+                                  nbComplementEvents * NB_EVENT_PARAMS * (int64_t) sizeof(double));
+    return layout;
+}
+
+// Makes a read whose arrays point into the record at the start of record, which has available bytes. Returns NULL
+// if it isn't a record, or doesn't fit.
+static NanoporeRead *nanopore_getReadFromRecord(char *record, int64_t available) {
+    if (available < (int64_t) sizeof(NanoporeReadRecordHeader)) {
+        return NULL;
+    }
+    NanoporeReadRecordHeader *header = (NanoporeReadRecordHeader *) record;
+    if (memcmp(header->magic, NP_READ_RECORD_MAGIC, sizeof(header->magic)) != 0
+        || header->byteOrder != NP_READ_BYTE_ORDER || header->readLength < 0 || header->nbTemplateEvents < 0
+        || header->nbComplementEvents < 0 || header->recordLength > available) {
+        return NULL;
+    }
+    NanoporeReadRecordLayout layout = nanopore_getRecordLayout(header->readLength, header->nbTemplateEvents,
+                                                               header->nbComplementEvents);
+    if (layout.length != header->recordLength) {
+        return NULL;
+    }
+    NanoporeRead *npRead = st_malloc(sizeof(NanoporeRead));
+    npRead->readLength = header->readLength;
+    npRead->nbTemplateEvents = header->nbTemplateEvents;
+    npRead->nbComplementEvents = header->nbComplementEvents;
+    npRead->templateParams = header->templateParams;
+    npRead->complementParams = header->complementParams;
+    npRead->twoDread = record + layout.twoDread;
+    npRead->templateEventMap = (int64_t *) (record + layout.templateEventMap);
+    npRead->templateEvents = (double *) (record + layout.templateEvents);
+    npRead->complementEventMap = (int64_t *) (record + layout.complementEventMap);
+    npRead->complementEvents = (double *) (record + layout.complementEvents);
+    npRead->mapped = 1;
+    npRead->mapping = NULL;
+    npRead->mappingLength = 0;
+    return npRead;
+}
+
+// Writes length bytes of data at offset, padding with zeros from position, the number of bytes written so far
+static bool nanopore_writeAt(FILE *fH, const void *data, int64_t length, int64_t offset, int64_t *position) {
+    for (; *position < offset; (*position)++) {
+        if (fputc(0, fH) == EOF) {
+            return 0;
+        }
+    }
+    if (length > 0 && fwrite(data, 1, length, fH) != (size_t) length) {
+        return 0;
+    }
+    *position += length;
+    return 1;
+}
+
+static bool nanopore_writeRecord(FILE *fH, NanoporeRead *npRead, int64_t *position) {
+    NanoporeReadRecordLayout layout = nanopore_getRecordLayout(npRead->readLength, npRead->nbTemplateEvents,
+                                                               npRead->nbComplementEvents);
+    NanoporeReadRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, NP_READ_RECORD_MAGIC, sizeof(header.magic));
+    header.byteOrder = NP_READ_BYTE_ORDER;
+    header.recordLength = layout.length;
+    header.readLength = npRead->readLength;
+    header.nbTemplateEvents = npRead->nbTemplateEvents;
+    header.nbComplementEvents = npRead->nbComplementEvents;
+    header.templateParams = npRead->templateParams;
+    header.complementParams = npRead->complementParams;
+
+    // offsets in the layout are from the start of the record
+    int64_t start = *position;
+    char nul = '\0';
+    return nanopore_writeAt(fH, &header, sizeof(header), start, position)
+           && nanopore_writeAt(fH, npRead->twoDread, npRead->readLength, start + layout.twoDread, position)
+           && nanopore_writeAt(fH, &nul, 1, start + layout.twoDread + npRead->readLength, position)
+           && nanopore_writeAt(fH, npRead->templateEventMap, npRead->readLength * sizeof(int64_t),
+                               start + layout.templateEventMap, position)
+           && nanopore_writeAt(fH, npRead->templateEvents,
+                               npRead->nbTemplateEvents * NB_EVENT_PARAMS * sizeof(double),
+                               start + layout.templateEvents, position)
+           && nanopore_writeAt(fH, npRead->complementEventMap, npRead->readLength * sizeof(int64_t),
+                               start + layout.complementEventMap, position)
+           && nanopore_writeAt(fH, npRead->complementEvents,
+                               npRead->nbComplementEvents * NB_EVENT_PARAMS * sizeof(double),
+                               start + layout.complementEvents, position)
+           && nanopore_writeAt(fH, NULL, 0, start + layout.length, position);
+}
+
+// Maps a whole file, copy on write so the events can still be changed in place. Returns NULL if it can't.
+static char *nanopore_mapFile(const char *file, size_t *length) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    *length = st.st_size;
+    return mapping;
+}
+
+bool nanopore_writeNanoporeReadToBinaryFile(NanoporeRead *npRead, const char *binaryFile) {
+    FILE *fH = fopen(binaryFile, "wb");
+    if (fH == NULL) {
+        return 0;
+    }
+    int64_t position = 0;
+    bool written = nanopore_writeRecord(fH, npRead, &position);
+    return (fclose(fH) == 0) && written;
+}
+
+NanoporeRead *nanopore_loadNanoporeReadFromBinaryFile(const char *binaryFile) {
+    size_t length;
+    char *mapping = nanopore_mapFile(binaryFile, &length);
+    if (mapping == NULL) {
+        st_errAbort("nanopore_loadNanoporeReadFromBinaryFile: couldn't map %s\n", binaryFile);
+    }
+    NanoporeRead *npRead = nanopore_getReadFromRecord(mapping, length);
+    if (npRead == NULL) {
+        st_errAbort("nanopore_loadNanoporeReadFromBinaryFile: %s isn't a binary npRead file from this build\n",
+                    binaryFile);
+    }
+    npRead->mapping = mapping;
+    npRead->mappingLength = length;
+    return npRead;
+}
+
+NanoporeRead *nanopore_loadNanoporeReadFromFile(const char *nanoporeReadFile) {
+    FILE *fH = fopen(nanoporeReadFile, "r");
+    if (fH == NULL) {
+        st_errAbort("nanopore_loadNanoporeReadFromFile: couldn't open %s\n", nanoporeReadFile);
+    }
+    // binary files are told apart by their magic
+    char magic[8];
+    bool binary = fread(magic, 1, sizeof(magic), fH) == sizeof(magic)
+                  && memcmp(magic, NP_READ_RECORD_MAGIC, sizeof(magic)) == 0;
+    if (binary) {
+        fclose(fH);
+        return nanopore_loadNanoporeReadFromBinaryFile(nanoporeReadFile);
+    }
+    rewind(fH);
+    NanoporeRead *npRead = nanopore_loadNanoporeReadFromTextFile(fH);
     fclose(fH);
     return npRead;
 }
 
+struct _nanoporeReadBundle {
+    char *mapping;
+    size_t mappingLength;
+    int64_t readNumber;
+    const int64_t *recordOffsets;
+    char **names;
+    stHash *readIndices; // name to index + 1
+};
+
+bool nanoporeReadBundle_write(stList *npReadFiles, stList *names, const char *bundleFile) {
+    assert(stList_length(npReadFiles) == stList_length(names));
+    FILE *fH = fopen(bundleFile, "wb");
+    if (fH == NULL) {
+        return 0;
+    }
+    int64_t readNumber = stList_length(npReadFiles);
+    NanoporeReadBundleHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, NP_READ_BUNDLE_MAGIC, sizeof(header.magic));
+    header.byteOrder = NP_READ_BYTE_ORDER;
+    header.readNumber = readNumber;
+    header.namesOffset = sizeof(header) + readNumber * sizeof(int64_t);
+    header.namesLength = 0;
+    for (int64_t i = 0; i < readNumber; i++) {
+        header.namesLength += strlen(stList_get(names, i)) + 1;
+    }
+
+    // the records are written one read at a time, their offsets going in once they are all written
+    int64_t *recordOffsets = st_calloc(readNumber, sizeof(int64_t));
+    int64_t position = 0;
+    bool written = nanopore_writeAt(fH, &header, sizeof(header), 0, &position)
+                   && nanopore_writeAt(fH, recordOffsets, readNumber * sizeof(int64_t), position, &position);
+    for (int64_t i = 0; i < readNumber && written; i++) {
+        char *name = stList_get(names, i);
+        written = nanopore_writeAt(fH, name, strlen(name) + 1, position, &position);
+    }
+    for (int64_t i = 0; i < readNumber && written; i++) {
+        NanoporeRead *npRead = nanopore_loadNanoporeReadFromFile(stList_get(npReadFiles, i));
+        recordOffsets[i] = NP_READ_ALIGN(position);
+        written = nanopore_writeAt(fH, NULL, 0, recordOffsets[i], &position)
+                  && nanopore_writeRecord(fH, npRead, &position);
+        nanopore_nanoporeReadDestruct(npRead);
+    }
+    written = written && fseek(fH, sizeof(header), SEEK_SET) == 0
+              && fwrite(recordOffsets, sizeof(int64_t), readNumber, fH) == (size_t) readNumber;
+    free(recordOffsets);
+    return (fclose(fH) == 0) && written;
+}
+
+NanoporeReadBundle *nanoporeReadBundle_open(const char *bundleFile) {
+    size_t length;
+    char *mapping = nanopore_mapFile(bundleFile, &length);
+    if (mapping == NULL) {
+        st_errAbort("nanoporeReadBundle_open: couldn't map %s\n", bundleFile);
+    }
+    NanoporeReadBundleHeader *header = (NanoporeReadBundleHeader *) mapping;
+    if (length < sizeof(NanoporeReadBundleHeader)
+        || memcmp(header->magic, NP_READ_BUNDLE_MAGIC, sizeof(header->magic)) != 0
+        || header->byteOrder != NP_READ_BYTE_ORDER || header->readNumber < 0
+        || header->namesOffset != (int64_t) (sizeof(NanoporeReadBundleHeader) + header->readNumber * sizeof(int64_t))
+        || header->namesLength < header->readNumber || header->namesOffset + header->namesLength > (int64_t) length
+        || (header->namesLength > 0 && mapping[header->namesOffset + header->namesLength - 1] != '\0')) {
+        st_errAbort("nanoporeReadBundle_open: %s isn't an npRead bundle from this build\n", bundleFile);
+    }
+    NanoporeReadBundle *bundle = st_malloc(sizeof(NanoporeReadBundle));
+    bundle->mapping = mapping;
+    bundle->mappingLength = length;
+    bundle->readNumber = header->readNumber;
+    bundle->recordOffsets = (const int64_t *) (mapping + sizeof(NanoporeReadBundleHeader));
+    bundle->names = st_malloc(bundle->readNumber * sizeof(char *));
+    bundle->readIndices = stHash_construct3(stHash_stringKey, stHash_stringEqualKey, NULL, NULL);
+    char *name = mapping + header->namesOffset;
+    for (int64_t i = 0; i < bundle->readNumber; i++) {
+        bundle->names[i] = name;
+        stHash_insert(bundle->readIndices, name, (void *) (intptr_t) (i + 1));
+        name += strlen(name) + 1;
+    }
+    return bundle;
+}
+
+void nanoporeReadBundle_close(NanoporeReadBundle *bundle) {
+    stHash_destruct(bundle->readIndices);
+    free(bundle->names);
+    munmap(bundle->mapping, bundle->mappingLength);
+    free(bundle);
+}
+
+int64_t nanoporeReadBundle_getReadNumber(NanoporeReadBundle *bundle) {
+    return bundle->readNumber;
+}
+
+const char *nanoporeReadBundle_getReadName(NanoporeReadBundle *bundle, int64_t readIndex) {
+    assert(readIndex >= 0 && readIndex < bundle->readNumber);
+    return bundle->names[readIndex];
+}
+
+int64_t nanoporeReadBundle_findRead(NanoporeReadBundle *bundle, const char *name) {
+    return (int64_t) (intptr_t) stHash_search(bundle->readIndices, (void *) name) - 1;
+}
+
+NanoporeRead *nanoporeReadBundle_getRead(NanoporeReadBundle *bundle, int64_t readIndex) {
+    assert(readIndex >= 0 && readIndex < bundle->readNumber);
+    int64_t offset = bundle->recordOffsets[readIndex];
+    NanoporeRead *npRead = NULL;
+    if (offset >= 0 && offset < (int64_t) bundle->mappingLength && offset % 64 == 0) {
+        npRead = nanopore_getReadFromRecord(bundle->mapping + offset, bundle->mappingLength - offset);
+    }
+    if (npRead == NULL) {
+        st_errAbort("nanoporeReadBundle_getRead: read %lld of the bundle is corrupt\n", readIndex);
+    }
+    return npRead;
+}
+
 stList *nanopore_remapAnchorPairs(stList *anchorPairs, int64_t *eventMap) {
     stList *mappedPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
 
@@ -224,10 +547,16 @@ void nanopore_descaleEvents(int64_t nb_events, double *events, double scale, dou
 }
 
 void nanopore_nanoporeReadDestruct(NanoporeRead *npRead) {
-    free(npRead->twoDread);
-    free(npRead->templateEventMap);
-    free(npRead->templateEvents);
-    free(npRead->complementEventMap);
-    free(npRead->complementEvents);
+    if (npRead->mapped) {
+        if (npRead->mapping != NULL) {
+            munmap(npRead->mapping, npRead->mappingLength);
+        }
+    } else {
+        free(npRead->twoDread);
+        free(npRead->templateEventMap);
+        free(npRead->templateEvents);
+        free(npRead->complementEventMap);
+        free(npRead->complementEvents);
+    }
     free(npRead);
 }
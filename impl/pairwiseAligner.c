@@ -23,6 +23,8 @@
 #include "continuousHmm.h"
 #include "stateMachine.h"
 #include "emissionMatrix.h"
+#include "vectorMath.h"
+#include "threadPool.h"
 
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -89,9 +91,17 @@ inline char *diagonal_getString(Diagonal diagonal) {
 //(using a set of anchor constraints)
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/*
+ * The band is kept as its segments, one per gap between consecutive anchor pairs, rather than as its diagonals,
+ * so it takes space proportional to the number of anchors. Segment i holds the diagonals from
+ * segmentEnds[i - 1] + 1 to segmentEnds[i], whose bounds are computed from the segment's xL, yL, xU and yU when
+ * they are asked for. Segment 0 is diagonal 0 alone.
+ */
 struct _band {
-    Diagonal *diagonals;
     int64_t lXalY;
+    int64_t segmentNumber;
+    int64_t *segmentEnds;
+    int64_t *segmentBounds; //xL, yL, xU, yU of each segment
 };
 
 static int64_t band_avoidOffByOne(int64_t xay, int64_t xmy) {
@@ -133,70 +143,98 @@ Band *band_construct(stList *anchorPairs, int64_t lX, int64_t lY, int64_t expans
     assert(lX >= 0);
     assert(lY >= 0);
     assert(expansion % 2 == 0);
-    //st_uglyf("---> LANDMARK!!!>>>>>>1\n");
 
     Band *band = st_malloc(sizeof(Band));
-    band->diagonals = st_malloc(sizeof(Diagonal) * (lX + lY + 1));
     band->lXalY = lX + lY;
+    band->segmentEnds = st_malloc(sizeof(int64_t) * (stList_length(anchorPairs) + 2));
+    band->segmentBounds = st_calloc(4 * (stList_length(anchorPairs) + 2), sizeof(int64_t));
 
-    //Now initialise the diagonals
+    //The first segment is the origin, with all bounds zero
+    band->segmentEnds[0] = 0;
+    band->segmentNumber = 1;
+
+    //Now add a segment for each gap between anchor pairs, the last ending at the end of the matrix
     int64_t anchorPairIndex = 0;
-    int64_t xay = 0;
     int64_t pxay = 0, pxmy = 0;
-    int64_t nxay = 0, nxmy = 0;
-    int64_t xL = 0, yL = 0, xU = 0, yU = 0;
-
-    while (xay <= band->lXalY) {
-        //st_uglyf("---> LANDMARK!!!>>>>>>2 : xay: %lld\n", xay);
-        band->diagonals[xay] = band_setCurrentDiagonal(xay, xL, yL, xU, yU);
-        if (nxay == xay++) {
-            //The previous diagonals become the next
-            pxay = nxay;
-            pxmy = nxmy;
-
-            int64_t x = lX, y = lY;
-            if (anchorPairIndex < stList_length(anchorPairs)) {
-                stIntTuple *anchorPair = stList_get(anchorPairs, anchorPairIndex++);
-                x = stIntTuple_get(anchorPair, 0) + 1; //Plus ones, because matrix coordinates are +1 the sequence ones
-                y = stIntTuple_get(anchorPair, 1) + 1;
-
-                //Check the anchor pairs
-                assert(x > diagonal_getXCoordinate(pxay, pxmy));
-                assert(y > diagonal_getYCoordinate(pxay, pxmy));
-                assert(x <= lX);
-                assert(y <= lY);
-                assert(x > 0);
-                assert(y > 0);
-            }
+    while (band->segmentEnds[band->segmentNumber - 1] < band->lXalY) {
+        int64_t x = lX, y = lY;
+        if (anchorPairIndex < stList_length(anchorPairs)) {
+            stIntTuple *anchorPair = stList_get(anchorPairs, anchorPairIndex++);
+            x = stIntTuple_get(anchorPair, 0) + 1; //Plus ones, because matrix coordinates are +1 the sequence ones
+            y = stIntTuple_get(anchorPair, 1) + 1;
+
+            //Check the anchor pairs
+            assert(x > diagonal_getXCoordinate(pxay, pxmy));
+            assert(y > diagonal_getYCoordinate(pxay, pxmy));
+            assert(x <= lX);
+            assert(y <= lY);
+            assert(x > 0);
+            assert(y > 0);
+        }
 
-            nxay = x + y;
-            nxmy = x - y;
+        int64_t nxay = x + y;
+        int64_t nxmy = x - y;
 
-            //Now call to set the lower and upper x,y coordinates
-            xL = band_boundCoordinate(diagonal_getXCoordinate(pxay, pxmy - expansion), lX);
-            yL = band_boundCoordinate(diagonal_getYCoordinate(nxay, nxmy - expansion), lY);
-            xU = band_boundCoordinate(diagonal_getXCoordinate(nxay, nxmy + expansion), lX);
-            yU = band_boundCoordinate(diagonal_getYCoordinate(pxay, pxmy + expansion), lY);
-        }
+        //Now set the lower and upper x,y coordinates
+        int64_t *bounds = &band->segmentBounds[4 * band->segmentNumber];
+        bounds[0] = band_boundCoordinate(diagonal_getXCoordinate(pxay, pxmy - expansion), lX);
+        bounds[1] = band_boundCoordinate(diagonal_getYCoordinate(nxay, nxmy - expansion), lY);
+        bounds[2] = band_boundCoordinate(diagonal_getXCoordinate(nxay, nxmy + expansion), lX);
+        bounds[3] = band_boundCoordinate(diagonal_getYCoordinate(pxay, pxmy + expansion), lY);
+        band->segmentEnds[band->segmentNumber++] = nxay;
+
+        //The next diagonals become the previous
+        pxay = nxay;
+        pxmy = nxmy;
     }
 
     return band;
 }
 
 void band_destruct(Band *band) {
-    free(band->diagonals);
+    free(band->segmentEnds);
+    free(band->segmentBounds);
     free(band);
 }
 
+//Diagonal xay of the band, starting the search for its segment from *segment, which is left holding it
+static Diagonal band_getDiagonalP(Band *band, int64_t xay, int64_t *segment) {
+    assert(xay >= 0 && xay <= band->lXalY);
+    while (band->segmentEnds[*segment] < xay) {
+        (*segment)++;
+    }
+    while (*segment > 0 && band->segmentEnds[*segment - 1] >= xay) {
+        (*segment)--;
+    }
+    int64_t *bounds = &band->segmentBounds[4 * *segment];
+    return band_setCurrentDiagonal(xay, bounds[0], bounds[1], bounds[2], bounds[3]);
+}
+
+Diagonal band_getDiagonal(Band *band, int64_t xay) {
+    //Binary search for the first segment ending at or after xay
+    int64_t i = 0, j = band->segmentNumber - 1;
+    while (i < j) {
+        int64_t k = (i + j) / 2;
+        if (band->segmentEnds[k] < xay) {
+            i = k + 1;
+        } else {
+            j = k;
+        }
+    }
+    return band_getDiagonalP(band, xay, &i);
+}
+
 struct _bandIterator {
     Band *band;
     int64_t index;
+    int64_t segment; //Segment of the last diagonal returned
 };
 
 BandIterator *bandIterator_construct(Band *band) {
     BandIterator *bandIterator = st_malloc(sizeof(BandIterator));
     bandIterator->band = band;
     bandIterator->index = 0;
+    bandIterator->segment = 0;
     return bandIterator;
 }
 
@@ -211,8 +249,9 @@ void bandIterator_destruct(BandIterator *bandIterator) {
 }
 
 Diagonal bandIterator_getNext(BandIterator *bandIterator) {
-    Diagonal diagonal = bandIterator->band->diagonals[
-            bandIterator->index > bandIterator->band->lXalY ? bandIterator->band->lXalY : bandIterator->index];
+    Diagonal diagonal = band_getDiagonalP(bandIterator->band,
+            bandIterator->index > bandIterator->band->lXalY ? bandIterator->band->lXalY : bandIterator->index,
+            &bandIterator->segment);
     if (bandIterator->index <= bandIterator->band->lXalY) {
         bandIterator->index++;
     }
@@ -223,7 +262,7 @@ Diagonal bandIterator_getPrevious(BandIterator *bandIterator) {
     if (bandIterator->index > 0) {
         bandIterator->index--;
     }
-    return bandIterator->band->diagonals[bandIterator->index];
+    return band_getDiagonalP(bandIterator->band, bandIterator->index, &bandIterator->segment);
 }
 
 
@@ -232,7 +271,7 @@ Diagonal bandIterator_getPrevious(BandIterator *bandIterator) {
 //Interpolation function for doing log add
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-#define logUnderflowThreshold 7.5
+#define logUnderflowThreshold LOG_ADD_UNDERFLOW_THRESHOLD
 #define posteriorMatchThreshold 0.01
 
 static inline double lookup(double x) {
@@ -260,6 +299,8 @@ double logAdd(double x, double y) {
 
 static double _NULLEVENT[] = {LOG_ZERO, 0};
 static double *NULLEVENT = _NULLEVENT;
+static int32_t _NULLKMERINDEX[] = {NUM_OF_KMERS + 1};
+static int32_t *NULLKMERINDEX = _NULLKMERINDEX;
 
 Sequence *sequence_construct(int64_t length, void *elements, void *(*getFcn)(void *, int64_t)) {
     Sequence *self = malloc(sizeof(Sequence));
@@ -316,11 +357,31 @@ Sequence *sequence_sliceEventSequence2(Sequence *inputSequence, int64_t start, i
     return newSequence;
 }
 
+Sequence *sequence_constructKmerIndexSequence(int64_t length, const char *sequence,
+                                              void *(*getFcn)(void *, int64_t)) {
+    // one more index than kmers, sequence_getKmerIndex2 reads the index after the one it points at
+    int32_t *kmerIndices = st_malloc((length + 1) * sizeof(int32_t));
+    emissions_discrete_getKmerIndices(sequence, kmerIndices, length + 1);
+    return sequence_construct2(length, kmerIndices, getFcn, sequence_sliceKmerIndexSequence2);
+}
+
+Sequence *sequence_sliceKmerIndexSequence2(Sequence *inputSequence, int64_t start, int64_t sliceLength) {
+    void *elementSlice = (int32_t *)inputSequence->elements + start;
+    Sequence *newSequence = sequence_construct2(sliceLength, elementSlice,
+                                                inputSequence->get, inputSequence->sliceFcn);
+    return newSequence;
+}
+
 void sequence_sequenceDestroy(Sequence *seq) {
     //assert(seq != NULL);
     free(seq);
 }
 
+void sequence_destructKmerIndexSequence(Sequence *seq) {
+    free(seq->elements);
+    free(seq);
+}
+
 void *sequence_getBase(void *elements, int64_t index) {
     char* n;
     n = "n";
@@ -346,6 +407,14 @@ void *sequence_getKmer3(void *elements, int64_t index) {
     return index >= 0 ? &(((char *) elements)[index]) : &(((char *) elements)[0]);
 }
 
+void *sequence_getKmerIndex(void *elements, int64_t index) {
+    return index >= 0 ? &(((int32_t *) elements)[index]) : NULLKMERINDEX;
+}
+
+void *sequence_getKmerIndex2(void *elements, int64_t index) {
+    return index > 0 ? &(((int32_t *) elements)[index - 1]) : &(((int32_t *) elements)[0]);
+}
+
 void *sequence_getEvent(void *elements, int64_t index) {
     index = index * NB_EVENT_PARAMS;
     //return index >= 0 ? &(((double *)elements)[index]) : NULL;
@@ -378,7 +447,7 @@ int64_t sequence_correctSeqLength(int64_t length, SequenceType type) {
 //alignment model.
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static inline void doTransitionForward(double *fromCells, double *toCells,
+static inline void doTransitionForward(DpCell *fromCells, DpCell *toCells,
                                        int64_t from, int64_t to,
                                        double eP, double tP,
                                        void *extraArgs) {
@@ -386,12 +455,12 @@ static inline void doTransitionForward(double *fromCells, double *toCells,
 }
 
 void cell_calculateForward(StateMachine *sM,
-                           double *current, double *lower, double *middle, double *upper,
+                           DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper,
                            void* cX, void* cY, void *extraArgs) {
     sM->cellCalculate(sM, current, lower, middle, upper, cX, cY, doTransitionForward, extraArgs);
 }
 
-static inline void doTransitionBackward(double *fromCells, double *toCells,
+static inline void doTransitionBackward(DpCell *fromCells, DpCell *toCells,
                                         int64_t from, int64_t to,
                                         double eP, double tP,
                                         void *extraArgs) {
@@ -399,20 +468,46 @@ static inline void doTransitionBackward(double *fromCells, double *toCells,
 }
 
 void cell_calculateBackward(StateMachine *sM,
-                            double *current, double *lower, double *middle, double *upper,
+                            DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper,
                             void* cX, void* cY, void *extraArgs) {
     sM->cellCalculate(sM, current, lower, middle, upper, cX, cY, doTransitionBackward, extraArgs);
 }
 
-double cell_dotProduct(double *cell1, double *cell2, int64_t stateNumber) {
-    double totalProb = cell1[0] + cell2[0];
-    for (int64_t i = 1; i < stateNumber; i++) {
-        totalProb = logAdd(totalProb, cell1[i] + cell2[i]);
+//Dot products of runs of cells. The vectorMath functions work on doubles, so float cells are widened first, and
+//their log terms then summed by vectorMath too: logAdd isn't associative, and adding the terms in another order than
+//for double cells moves the total probability by up to ~1e-4, thousands of PAIR_ALIGNMENT_PROB_1 units.
+
+static double cells_logDotProduct(DpCell *cells1, DpCell *cells2, int64_t length) {
+#ifdef DP_FLOAT_CELLS
+    double *terms = st_malloc(sizeof(double) * (length > 0 ? length : 1));
+    for (int64_t i = 0; i < length; i++) {
+        terms[i] = (double) cells1[i] + cells2[i];
+    }
+    double totalProb = vectorMath_logSumExp(terms, length);
+    free(terms);
+    return totalProb;
+#else
+    return vectorMath_logDotProduct(cells1, cells2, length);
+#endif
+}
+
+static double cells_dotProduct(DpCell *cells1, DpCell *cells2, int64_t length) {
+#ifdef DP_FLOAT_CELLS
+    double totalProb = 0.0;
+    for (int64_t i = 0; i < length; i++) {
+        totalProb += (double) cells1[i] * cells2[i];
     }
     return totalProb;
+#else
+    return vectorMath_dotProduct(cells1, cells2, length);
+#endif
+}
+
+double cell_dotProduct(DpCell *cell1, DpCell *cell2, int64_t stateNumber) {
+    return cells_logDotProduct(cell1, cell2, stateNumber);
 }
 
-double cell_dotProduct2(double *cell, StateMachine *sM, double (*getStateValue)(StateMachine *, int64_t)) {
+double cell_dotProduct2(DpCell *cell, StateMachine *sM, double (*getStateValue)(StateMachine *, int64_t)) {
     double totalProb = cell[0] + getStateValue(sM, 0);
     for (int64_t i = 1; i < sM->stateNumber; i++) {
         totalProb = logAdd(totalProb, cell[i] + getStateValue(sM, i));
@@ -420,7 +515,7 @@ double cell_dotProduct2(double *cell, StateMachine *sM, double (*getStateValue)(
     return totalProb;
 }
 
-void cell_updateExpectations(double *fromCells, double *toCells, int64_t from, int64_t to, double eP, double tP,
+void cell_updateExpectations(DpCell *fromCells, DpCell *toCells, int64_t from, int64_t to, double eP, double tP,
                              void *extraArgs) {
 
     //void *extraArgs2[2] = { &totalProbability, hmmExpectations };
@@ -439,7 +534,7 @@ void cell_updateExpectations(double *fromCells, double *toCells, int64_t from, i
     }
 }
 
-void cell_signal_updateTransAndKmerSkipExpectations(double *fromCells, double *toCells, int64_t from, int64_t to,
+void cell_signal_updateTransAndKmerSkipExpectations(DpCell *fromCells, DpCell *toCells, int64_t from, int64_t to,
                                                     double eP, double tP, void *extraArgs) {
     //void *extraArgs2[2] = { &totalProbability, hmmExpectations };
     double totalProbability = *((double *) ((void **) extraArgs)[0]);
@@ -458,7 +553,7 @@ void cell_signal_updateTransAndKmerSkipExpectations(double *fromCells, double *t
     }
 }
 
-void cell_signal_updateTransAndKmerSkipExpectations2(double *fromCells, double *toCells, int64_t from, int64_t to,
+void cell_signal_updateTransAndKmerSkipExpectations2(DpCell *fromCells, DpCell *toCells, int64_t from, int64_t to,
                                                     double eP, double tP, void *extraArgs) {
     //void *extraArgs2[2] = { &totalProbability, hmmExpectations };
     double totalProbability = *((double *) ((void **) extraArgs)[0]);
@@ -490,7 +585,7 @@ void cell_signal_updateTransAndKmerSkipExpectations2(double *fromCells, double *
     }
 }
 
-void cell_signal_updateBetaAndAlphaProb(double *fromCells, double *toCells, int64_t from, int64_t to, double eP,
+void cell_signal_updateBetaAndAlphaProb(DpCell *fromCells, DpCell *toCells, int64_t from, int64_t to, double eP,
                                         double tP, void *extraArgs) {
     //void *extraArgs2[2] = { &totalProbability, hmmExpectations };
     double totalProbability = *((double *) ((void **) extraArgs)[0]);
@@ -514,7 +609,7 @@ void cell_signal_updateBetaAndAlphaProb(double *fromCells, double *toCells, int6
 
 // todo might be removeable
 static void cell_calculateExpectation(StateMachine *sM,
-                                      double *current, double *lower, double *middle, double *upper,
+                                      DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper,
                                       void* cX, void* cY,
                                       void *extraArgs) {
     void *extraArgs2[4] = { ((void **)extraArgs)[0], // &totalProbabability
@@ -525,7 +620,7 @@ static void cell_calculateExpectation(StateMachine *sM,
 }
 
 static void cell_signal_calculateUpdateExpectation(StateMachine *sM,
-                                                   double *current, double *lower, double *middle, double *upper,
+                                                   DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper,
                                                    void *cX, void *cY,
                                                    void *extraArgs) {
     void *extraArgs2[4] = { ((void **)extraArgs)[0], // &totalProbabability
@@ -545,27 +640,357 @@ static void cell_signal_calculateUpdateExpectation(StateMachine *sM,
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
+typedef struct _dpDiagonalPool DpDiagonalPool;
+
 struct _dpDiagonal {
     Diagonal diagonal;
     int64_t stateNumber;
-    double *cells;
+    DpCell *cells;
+    int64_t cellCapacity; //number of cells allocated, at least the width of the diagonal times stateNumber
+    DpDiagonalPool *pool; //pool the diagonal goes back to when destructed, NULL if it isn't from one
+    bool scaled; //cells are linear-space probabilities divided by exp(logScale), rather than log probabilities
+    double logScale; //of log probabilities, the log frame of float cells (see dpDiagonal_enterLogFrame), otherwise 0
+    bool scalable; //of a scaled matrix, so the kernels can leave scaled cells in it, or fall back to log ones
 };
 
-DpDiagonal *dpDiagonal_construct(Diagonal diagonal, int64_t stateNumber) {
-    DpDiagonal *dpDiagonal = st_malloc(sizeof(DpDiagonal));
+//Diagonals and scratch space recycled by a DpMatrix, so that once its band has been at its widest the matrix
+//makes no more heap allocations. Cell arrays grow geometrically when reused for a wider diagonal.
+struct _dpDiagonalPool {
+    stList *freeDiagonals;
+    double *scratch[2]; //for the diagonal kernels, one for the emissions and one for the recursion
+    int64_t scratchLength[2];
+    int64_t allocations;
+    ThreadGroup *threadGroup; //not owned, splits the cells of diagonals at least minThreadedWidth wide
+    int64_t minThreadedWidth;
+    EmissionCache *emissionCache; //not owned
+};
+
+static DpDiagonalPool *dpDiagonalPool_construct(void) {
+    DpDiagonalPool *pool = st_calloc(1, sizeof(DpDiagonalPool));
+    pool->freeDiagonals = stList_construct();
+    return pool;
+}
+
+static void dpDiagonalPool_destruct(DpDiagonalPool *pool) {
+    for (int64_t i = 0; i < stList_length(pool->freeDiagonals); i++) {
+        DpDiagonal *dpDiagonal = stList_get(pool->freeDiagonals, i);
+        free(dpDiagonal->cells);
+        free(dpDiagonal);
+    }
+    stList_destruct(pool->freeDiagonals);
+    free(pool->scratch[0]);
+    free(pool->scratch[1]);
+    free(pool);
+}
+
+//Gets a diagonal with uninitialised cells from the pool, or a newly allocated one if pool is NULL
+static DpDiagonal *dpDiagonalPool_getDiagonal(DpDiagonalPool *pool, Diagonal diagonal, int64_t stateNumber) {
+    assert(diagonal_getWidth(diagonal) >= 0);
+    int64_t cellNumber = stateNumber * (int64_t) diagonal_getWidth(diagonal);
+    DpDiagonal *dpDiagonal;
+    if (pool != NULL && stList_length(pool->freeDiagonals) > 0) {
+        dpDiagonal = stList_pop(pool->freeDiagonals);
+        if (dpDiagonal->cellCapacity < cellNumber) {
+            free(dpDiagonal->cells);
+            dpDiagonal->cellCapacity = cellNumber > 2 * dpDiagonal->cellCapacity ? cellNumber
+                                                                                  : 2 * dpDiagonal->cellCapacity;
+            dpDiagonal->cells = st_malloc(sizeof(DpCell) * dpDiagonal->cellCapacity);
+            pool->allocations++;
+        }
+    } else {
+        dpDiagonal = st_malloc(sizeof(DpDiagonal));
+        dpDiagonal->cellCapacity = cellNumber;
+        dpDiagonal->cells = st_malloc(sizeof(DpCell) * cellNumber);
+        if (pool != NULL) {
+            pool->allocations += 2;
+        }
+    }
     dpDiagonal->diagonal = diagonal;
     dpDiagonal->stateNumber = stateNumber;
-    assert(diagonal_getWidth(diagonal) >= 0);
-    dpDiagonal->cells = st_malloc(sizeof(double) * stateNumber * (int64_t) diagonal_getWidth(diagonal));
+    dpDiagonal->pool = pool;
+    dpDiagonal->scaled = 0;
+    dpDiagonal->logScale = 0.0;
+    dpDiagonal->scalable = 0;
     return dpDiagonal;
 }
 
+//Scratch space for the diagonal kernels, slot 0 or 1. Comes from the diagonal's pool if it has one, otherwise it is
+//allocated. Either way it must be given back with dpDiagonal_releaseScratch.
+static double *dpDiagonal_getScratch(DpDiagonal *dpDiagonal, int64_t slot, int64_t length) {
+    DpDiagonalPool *pool = dpDiagonal->pool;
+    if (pool == NULL) {
+        return st_malloc(sizeof(double) * length);
+    }
+    if (pool->scratchLength[slot] < length) {
+        free(pool->scratch[slot]);
+        pool->scratchLength[slot] = length > 2 * pool->scratchLength[slot] ? length : 2 * pool->scratchLength[slot];
+        pool->scratch[slot] = st_malloc(sizeof(double) * pool->scratchLength[slot]);
+        pool->allocations++;
+    }
+    return pool->scratch[slot];
+}
+
+static void dpDiagonal_releaseScratch(DpDiagonal *dpDiagonal, double *scratch) {
+    if (dpDiagonal->pool == NULL) {
+        free(scratch);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Emission cache
+//
+//Emissions are kept per diagonal, as arrays of one value per cell laid out as the machine's vector kernel has them.
+//A kernel only leaves out the emissions of cells without the neighbour they go with, so a diagonal computed with
+//both its predecessors present has every emission any later pass over it could use. Only those are cached; the
+//extra emissions are harmless to a pass with fewer neighbours, as they are added to LOG_ZERO.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct _emissionCache {
+    double **emissions; //indexed by xay, NULL where not cached
+    int64_t *sizes; //bytes cached for each diagonal
+    int64_t diagonalNumber;
+    int64_t size; //bytes cached, in all
+    int64_t maxSize;
+    int64_t hits;
+};
+
+EmissionCache *emissionCache_construct(int64_t diagonalNumber, int64_t maxSize) {
+    EmissionCache *emissionCache = st_malloc(sizeof(EmissionCache));
+    emissionCache->emissions = st_calloc(diagonalNumber + 1, sizeof(double *));
+    emissionCache->sizes = st_calloc(diagonalNumber + 1, sizeof(int64_t));
+    emissionCache->diagonalNumber = diagonalNumber;
+    emissionCache->size = 0;
+    emissionCache->maxSize = maxSize;
+    emissionCache->hits = 0;
+    return emissionCache;
+}
+
+void emissionCache_destruct(EmissionCache *emissionCache) {
+    for (int64_t i = 0; i <= emissionCache->diagonalNumber; i++) {
+        free(emissionCache->emissions[i]);
+    }
+    free(emissionCache->emissions);
+    free(emissionCache->sizes);
+    free(emissionCache);
+}
+
+void emissionCache_deleteDiagonal(EmissionCache *emissionCache, int64_t xay) {
+    assert(xay >= 0 && xay <= emissionCache->diagonalNumber);
+    if (emissionCache->emissions[xay] != NULL) {
+        free(emissionCache->emissions[xay]);
+        emissionCache->emissions[xay] = NULL;
+        emissionCache->size -= emissionCache->sizes[xay];
+        emissionCache->sizes[xay] = 0;
+    }
+}
+
+int64_t emissionCache_getHitNumber(EmissionCache *emissionCache) {
+    return emissionCache->hits;
+}
+
+int64_t emissionCache_getSize(EmissionCache *emissionCache) {
+    return emissionCache->size;
+}
+
+//Copies the length cached emissions of the diagonal into e, returning false if there are none
+static bool emissionCache_get(DpDiagonal *dpDiagonal, double *e, int64_t length) {
+    EmissionCache *emissionCache = dpDiagonal->pool == NULL ? NULL : dpDiagonal->pool->emissionCache;
+    int64_t xay = diagonal_getXay(dpDiagonal->diagonal);
+    if (emissionCache == NULL || emissionCache->emissions[xay] == NULL) {
+        return 0;
+    }
+    assert(emissionCache->sizes[xay] == sizeof(double) * length);
+    emissionCache->hits++;
+    memcpy(e, emissionCache->emissions[xay], sizeof(double) * length);
+    return 1;
+}
+
+static void emissionCache_put(DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                              const double *e, int64_t length) {
+    EmissionCache *emissionCache = dpDiagonal->pool == NULL ? NULL : dpDiagonal->pool->emissionCache;
+    int64_t size = sizeof(double) * length;
+    if (emissionCache == NULL || dpDiagonalM1 == NULL || dpDiagonalM2 == NULL
+        || emissionCache->size + size > emissionCache->maxSize) {
+        return;
+    }
+    int64_t xay = diagonal_getXay(dpDiagonal->diagonal);
+    assert(emissionCache->emissions[xay] == NULL);
+    emissionCache->emissions[xay] = st_malloc(size);
+    memcpy(emissionCache->emissions[xay], e, size);
+    emissionCache->sizes[xay] = size;
+    emissionCache->size += size;
+}
+
+DpDiagonal *dpDiagonal_construct(Diagonal diagonal, int64_t stateNumber) {
+    return dpDiagonalPool_getDiagonal(NULL, diagonal, stateNumber);
+}
+
 DpDiagonal *dpDiagonal_clone(DpDiagonal *diagonal) {
-    DpDiagonal *diagonal2 = dpDiagonal_construct(diagonal->diagonal, diagonal->stateNumber);
-    memcpy(diagonal2->cells, diagonal->cells, sizeof(double) * diagonal_getWidth(diagonal->diagonal) * diagonal->stateNumber);
+    DpDiagonal *diagonal2 = dpDiagonalPool_getDiagonal(diagonal->pool, diagonal->diagonal, diagonal->stateNumber);
+    memcpy(diagonal2->cells, diagonal->cells, sizeof(DpCell) * diagonal_getWidth(diagonal->diagonal) * diagonal->stateNumber);
+    diagonal2->scaled = diagonal->scaled;
+    diagonal2->logScale = diagonal->logScale;
+    diagonal2->scalable = diagonal->scalable;
+    return diagonal2;
+}
+
+bool dpDiagonal_isScaled(DpDiagonal *diagonal) {
+    return diagonal->scaled;
+}
+
+double dpDiagonal_getLogScale(DpDiagonal *diagonal) {
+    return diagonal->logScale;
+}
+
+Diagonal dpDiagonal_getDiagonal(DpDiagonal *diagonal) {
+    return diagonal->diagonal;
+}
+
+void dpDiagonal_normalise(DpDiagonal *diagonal) {
+    assert(diagonal->scaled);
+    int64_t cellNumber = diagonal_getWidth(diagonal->diagonal) * diagonal->stateNumber;
+    double maxProb = 0.0;
+    for (int64_t i = 0; i < cellNumber; i++) {
+        if (diagonal->cells[i] > maxProb) {
+            maxProb = diagonal->cells[i];
+        }
+    }
+    if (maxProb <= 0.0) { //All zero, so no scale
+        diagonal->logScale = LOG_ZERO;
+        return;
+    }
+    double inverseMaxProb = 1.0 / maxProb;
+    for (int64_t i = 0; i < cellNumber; i++) {
+        diagonal->cells[i] *= inverseMaxProb;
+    }
+    diagonal->logScale += log(maxProb);
+}
+
+//Returns the diagonal if it holds log probabilities, otherwise a copy converted to log probabilities, which
+//the caller must destruct
+static DpDiagonal *dpDiagonal_getLogProbabilities(DpDiagonal *diagonal) {
+    if (diagonal == NULL || (!diagonal->scaled && diagonal->logScale == 0.0)) {
+        return diagonal;
+    }
+    DpDiagonal *diagonal2 = dpDiagonal_clone(diagonal);
+    for (int64_t i = 0; i < diagonal_getWidth(diagonal->diagonal) * diagonal->stateNumber; i++) {
+        diagonal2->cells[i] = (diagonal->scaled ? log(diagonal->cells[i]) : diagonal->cells[i]) + diagonal->logScale;
+    }
+    diagonal2->scaled = 0;
+    diagonal2->logScale = 0.0;
     return diagonal2;
 }
 
+static void dpDiagonal_destructLogProbabilities(DpDiagonal *logDiagonal, DpDiagonal *diagonal) {
+    if (logDiagonal != diagonal) {
+        dpDiagonal_destruct(logDiagonal);
+    }
+}
+
+//The diagonals of a scaled matrix the kernels fall back to log probabilities for sit alongside scaled ones, so a
+//diagonal to be combined cell by cell with another is taken as log probabilities unless both are scaled. Returns
+//the diagonal or a log copy of it, to be given back with dpDiagonal_destructLogProbabilities.
+static DpDiagonal *dpDiagonal_getMatchingProbabilities(DpDiagonal *diagonal, DpDiagonal *otherDiagonal) {
+    return otherDiagonal->scaled || !diagonal->scaled ? diagonal : dpDiagonal_getLogProbabilities(diagonal);
+}
+
+/*
+ * Float cells only have the precision for log probabilities close to 0: held as absolute values, around -1e3 for
+ * long alignments, they are rounded by ~1e-4. So in float builds the log cells of a diagonal are held less its
+ * logScale, its log frame, which the calculations of diagonals move around (see dpDiagonal_enterLogFrame), and the
+ * kernels add cells as they are. In double builds, and for the diagonals of scaled matrices, the frame of log
+ * diagonals stays 0.
+ */
+
+#ifdef DP_FLOAT_CELLS
+static void dpDiagonal_moveToLogFrame(DpDiagonal *dpDiagonal, double logFrame) {
+    if (dpDiagonal == NULL || dpDiagonal->logScale == logFrame) {
+        return;
+    }
+    double offset = dpDiagonal->logScale - logFrame;
+    for (int64_t i = 0; i < diagonal_getWidth(dpDiagonal->diagonal) * dpDiagonal->stateNumber; i++) {
+        dpDiagonal->cells[i] += offset; //LOG_ZERO, -INFINITY, stays as it is
+    }
+    dpDiagonal->logScale = logFrame;
+}
+
+//The log frame of the largest cell of the diagonal, its own if all its cells are zero
+static double dpDiagonal_getMaxLogFrame(DpDiagonal *dpDiagonal) {
+    double maxCell = LOG_ZERO;
+    for (int64_t i = 0; i < diagonal_getWidth(dpDiagonal->diagonal) * dpDiagonal->stateNumber; i++) {
+        if (dpDiagonal->cells[i] > maxCell) {
+            maxCell = dpDiagonal->cells[i];
+        }
+    }
+    return maxCell == LOG_ZERO ? dpDiagonal->logScale : dpDiagonal->logScale + maxCell;
+}
+
+static bool dpDiagonal_hasLogFrame(DpDiagonal *dpDiagonal) {
+    return dpDiagonal == NULL || !dpDiagonal->scalable;
+}
+#endif
+
+//Puts the diagonals of a forward or backward calculation in one log frame, returning the diagonal to calculate
+//with in place of dpDiagonalM2, which must be given back with dpDiagonal_leaveLogFrame once the calculation is done.
+//That moves each diagonal, once it is complete, into the frame of its largest cell, and the frame is then that of the
+//diagonal the calculation reads: dpDiagonalM1 going forward (or dpDiagonalM2 if it is NULL), and dpDiagonal going
+//backward. The diagonals written to are moved into it, and going forward a copy of dpDiagonalM2 is too. So once a
+//diagonal is complete its cells don't change, and recalculating it from its predecessors, as the checkpointed
+//alignment does, gives exactly the same cells.
+static DpDiagonal *dpDiagonal_enterLogFrame(DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                            DpDiagonal *dpDiagonalM2, bool forward) {
+#ifdef DP_FLOAT_CELLS
+    if (!dpDiagonal_hasLogFrame(dpDiagonal) || !dpDiagonal_hasLogFrame(dpDiagonalM1)
+        || !dpDiagonal_hasLogFrame(dpDiagonalM2)) {
+        return dpDiagonalM2;
+    }
+    if (!forward) {
+        dpDiagonal_moveToLogFrame(dpDiagonalM1, dpDiagonal->logScale);
+        dpDiagonal_moveToLogFrame(dpDiagonalM2, dpDiagonal->logScale);
+        return dpDiagonalM2;
+    }
+    if (dpDiagonalM1 == NULL) {
+        if (dpDiagonalM2 != NULL) {
+            dpDiagonal_moveToLogFrame(dpDiagonal, dpDiagonalM2->logScale);
+        }
+        return dpDiagonalM2;
+    }
+    dpDiagonal_moveToLogFrame(dpDiagonal, dpDiagonalM1->logScale);
+    if (dpDiagonalM2 == NULL || dpDiagonalM2->logScale == dpDiagonalM1->logScale) {
+        return dpDiagonalM2;
+    }
+    DpDiagonal *framedDiagonalM2 = dpDiagonal_clone(dpDiagonalM2);
+    dpDiagonal_moveToLogFrame(framedDiagonalM2, dpDiagonalM1->logScale);
+    return framedDiagonalM2;
+#else
+    (void) dpDiagonal;
+    (void) dpDiagonalM1;
+    (void) forward;
+    return dpDiagonalM2;
+#endif
+}
+
+//Ends a calculation begun with dpDiagonal_enterLogFrame, moving the diagonal it completed, dpDiagonal going forward
+//and dpDiagonalM1 going backward, into the frame of its largest cell
+static void dpDiagonal_leaveLogFrame(DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                     DpDiagonal *framedDiagonalM2, bool forward) {
+#ifdef DP_FLOAT_CELLS
+    if (framedDiagonalM2 != dpDiagonalM2) {
+        dpDiagonal_destruct(framedDiagonalM2);
+    }
+    DpDiagonal *completeDiagonal = forward ? dpDiagonal : dpDiagonalM1;
+    if (completeDiagonal != NULL && dpDiagonal_hasLogFrame(completeDiagonal)) {
+        dpDiagonal_moveToLogFrame(completeDiagonal, dpDiagonal_getMaxLogFrame(completeDiagonal));
+    }
+#else
+    (void) dpDiagonal;
+    (void) dpDiagonalM1;
+    (void) dpDiagonalM2;
+    (void) framedDiagonalM2;
+    (void) forward;
+#endif
+}
+
 bool dpDiagonal_equals(DpDiagonal *diagonal1, DpDiagonal *diagonal2) {
     if (!diagonal_equals(diagonal1->diagonal, diagonal2->diagonal)) {
         return 0;
@@ -573,6 +998,9 @@ bool dpDiagonal_equals(DpDiagonal *diagonal1, DpDiagonal *diagonal2) {
     if(diagonal1->stateNumber != diagonal2->stateNumber) {
         return 0;
     }
+    if (diagonal1->scaled != diagonal2->scaled || diagonal1->logScale != diagonal2->logScale) {
+        return 0;
+    }
     for (int64_t i = 0; i < diagonal_getWidth(diagonal1->diagonal) * diagonal1->stateNumber; i++) {
         if (diagonal1->cells[i] != diagonal2->cells[i]) {
             return 0;
@@ -582,11 +1010,15 @@ bool dpDiagonal_equals(DpDiagonal *diagonal1, DpDiagonal *diagonal2) {
 }
 
 void dpDiagonal_destruct(DpDiagonal *dpDiagonal) {
+    if (dpDiagonal->pool != NULL) {
+        stList_append(dpDiagonal->pool->freeDiagonals, dpDiagonal);
+        return;
+    }
     free(dpDiagonal->cells);
     free(dpDiagonal);
 }
 
-double *dpDiagonal_getCell(DpDiagonal *dpDiagonal, int64_t xmy) {
+DpCell *dpDiagonal_getCell(DpDiagonal *dpDiagonal, int64_t xmy) {
     if (xmy < dpDiagonal->diagonal.xmyL || xmy > dpDiagonal->diagonal.xmyR) {
         return NULL;
     }
@@ -595,32 +1027,46 @@ double *dpDiagonal_getCell(DpDiagonal *dpDiagonal, int64_t xmy) {
 }
 
 void dpDiagonal_zeroValues(DpDiagonal *diagonal) {
+    double zero = diagonal->scaled ? 0.0 : LOG_ZERO;
     for (int64_t i = 0; i < diagonal_getWidth(diagonal->diagonal) * diagonal->stateNumber; i++) {
-        diagonal->cells[i] = LOG_ZERO;
+        diagonal->cells[i] = zero;
+    }
+    if (diagonal->scaled) {
+        diagonal->logScale = LOG_ZERO;
     }
 }
 
 void dpDiagonal_initialiseValues(DpDiagonal *diagonal, StateMachine *sM,
                                  double (*getStateValue)(StateMachine *, int64_t)) {
     for (int64_t i = diagonal_getMinXmy(diagonal->diagonal); i <= diagonal_getMaxXmy(diagonal->diagonal); i += 2) {
-        double *cell = dpDiagonal_getCell(diagonal, i);
+        DpCell *cell = dpDiagonal_getCell(diagonal, i);
         assert(cell != NULL);
         for (int64_t j = 0; j < diagonal->stateNumber; j++) {
-            cell[j] = getStateValue(sM, j);
+            cell[j] = diagonal->scaled ? exp(getStateValue(sM, j)) : getStateValue(sM, j);
         }
     }
+    diagonal->logScale = 0.0;
 }
 
 double dpDiagonal_dotProduct(DpDiagonal *diagonal1, DpDiagonal *diagonal2) {
-    double totalProbability = LOG_ZERO;
-    Diagonal diagonal = diagonal1->diagonal;
-    int64_t xmy = diagonal_getMinXmy(diagonal);
-    while (xmy <= diagonal_getMaxXmy(diagonal)) {
-        totalProbability = logAdd(totalProbability,
-                cell_dotProduct(dpDiagonal_getCell(diagonal1, xmy), dpDiagonal_getCell(diagonal2, xmy), diagonal1->stateNumber));
-        xmy += 2;
+    //The cells of both diagonals are laid out the same way, so this is one dot product over all the states
+    assert(diagonal1->stateNumber == diagonal2->stateNumber);
+    assert(diagonal_equals(diagonal1->diagonal, diagonal2->diagonal));
+    if (diagonal1->scaled != diagonal2->scaled) { //one has fallen back to log probabilities
+        DpDiagonal *logDiagonal1 = dpDiagonal_getLogProbabilities(diagonal1);
+        DpDiagonal *logDiagonal2 = dpDiagonal_getLogProbabilities(diagonal2);
+        double totalProbability = dpDiagonal_dotProduct(logDiagonal1, logDiagonal2);
+        dpDiagonal_destructLogProbabilities(logDiagonal1, diagonal1);
+        dpDiagonal_destructLogProbabilities(logDiagonal2, diagonal2);
+        return totalProbability;
     }
-    return totalProbability;
+    int64_t cellNumber = diagonal1->stateNumber * diagonal_getWidth(diagonal1->diagonal);
+    if (diagonal1->scaled) {
+        double totalProbability = cells_dotProduct(diagonal1->cells, diagonal2->cells, cellNumber);
+        return totalProbability > 0.0 ? log(totalProbability) + diagonal1->logScale + diagonal2->logScale : LOG_ZERO;
+    }
+    return cells_logDotProduct(diagonal1->cells, diagonal2->cells, cellNumber) + diagonal1->logScale
+           + diagonal2->logScale;
 }
 
 
@@ -630,25 +1076,50 @@ double dpDiagonal_dotProduct(DpDiagonal *diagonal1, DpDiagonal *diagonal2) {
 //Structure for storing dp-matrix
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/*
+ * Diagonal xay is kept in diagonals[xay % diagonalCapacity]. A bounded matrix has a slot for each of its diagonals,
+ * an unbounded one (see dpMatrix_constructUnbounded) only as many as it has had active at once, growing the array
+ * when two active diagonals would share a slot.
+ */
 struct _dpMatrix {
     DpDiagonal **diagonals;
     int64_t diagonalNumber;
+    int64_t diagonalCapacity;
     int64_t activeDiagonals;
     int64_t stateNumber;
+    bool scaled;
+    DpDiagonalPool *pool;
 };
 
-DpMatrix *dpMatrix_construct(int64_t diagonalNumber, int64_t stateNumber) {
+static DpMatrix *dpMatrix_construct3(int64_t diagonalNumber, int64_t diagonalCapacity, int64_t stateNumber,
+                                     bool scaled) {
     assert(diagonalNumber >= 0);
     DpMatrix *dpMatrix = st_malloc(sizeof(DpMatrix));
     dpMatrix->diagonalNumber = diagonalNumber;
-    dpMatrix->diagonals = st_calloc(dpMatrix->diagonalNumber + 1, sizeof(DpDiagonal *));
+    dpMatrix->diagonalCapacity = diagonalCapacity;
+    dpMatrix->diagonals = st_calloc(dpMatrix->diagonalCapacity, sizeof(DpDiagonal *));
     dpMatrix->activeDiagonals = 0;
     dpMatrix->stateNumber = stateNumber;
+    dpMatrix->scaled = scaled;
+    dpMatrix->pool = dpDiagonalPool_construct();
     return dpMatrix;
 }
 
+DpMatrix *dpMatrix_construct2(int64_t diagonalNumber, int64_t stateNumber, bool scaled) {
+    return dpMatrix_construct3(diagonalNumber, diagonalNumber + 1, stateNumber, scaled);
+}
+
+DpMatrix *dpMatrix_construct(int64_t diagonalNumber, int64_t stateNumber) {
+    return dpMatrix_construct2(diagonalNumber, stateNumber, 0);
+}
+
+DpMatrix *dpMatrix_constructUnbounded(int64_t stateNumber, bool scaled) {
+    return dpMatrix_construct3(INT64_MAX, 16, stateNumber, scaled);
+}
+
 void dpMatrix_destruct(DpMatrix *dpMatrix) {
     assert(dpMatrix->activeDiagonals == 0);
+    dpDiagonalPool_destruct(dpMatrix->pool);
     free(dpMatrix->diagonals);
     free(dpMatrix);
 }
@@ -657,19 +1128,49 @@ DpDiagonal *dpMatrix_getDiagonal(DpMatrix *dpMatrix, int64_t xay) {
     if (xay < 0 || xay > dpMatrix->diagonalNumber) {
         return NULL;
     }
-    return dpMatrix->diagonals[xay];
+    DpDiagonal *dpDiagonal = dpMatrix->diagonals[xay % dpMatrix->diagonalCapacity];
+    return dpDiagonal != NULL && diagonal_getXay(dpDiagonal->diagonal) == xay ? dpDiagonal : NULL;
 }
 
 int64_t dpMatrix_getActiveDiagonalNumber(DpMatrix *dpMatrix) {
     return dpMatrix->activeDiagonals;
 }
 
+int64_t dpMatrix_getAllocationNumber(DpMatrix *dpMatrix) {
+    return dpMatrix->pool->allocations;
+}
+
+void dpMatrix_setThreadGroup(DpMatrix *dpMatrix, ThreadGroup *threadGroup, int64_t minThreadedWidth) {
+    dpMatrix->pool->threadGroup = threadGroup;
+    dpMatrix->pool->minThreadedWidth = minThreadedWidth;
+}
+
+void dpMatrix_setEmissionCache(DpMatrix *dpMatrix, EmissionCache *emissionCache) {
+    assert(emissionCache == NULL || emissionCache->diagonalNumber == dpMatrix->diagonalNumber);
+    dpMatrix->pool->emissionCache = emissionCache;
+}
+
 DpDiagonal *dpMatrix_createDiagonal(DpMatrix *dpMatrix, Diagonal diagonal) {
     assert(diagonal.xay >= 0);
     assert(diagonal.xay <= dpMatrix->diagonalNumber);
     assert(dpMatrix_getDiagonal(dpMatrix, diagonal.xay) == NULL);
-    DpDiagonal *dpDiagonal = dpDiagonal_construct(diagonal, dpMatrix->stateNumber);
-    dpMatrix->diagonals[diagonal_getXay(diagonal)] = dpDiagonal;
+    //Grow an unbounded matrix until the diagonal's slot is free
+    while (dpMatrix->diagonals[diagonal.xay % dpMatrix->diagonalCapacity] != NULL) {
+        DpDiagonal **diagonals = dpMatrix->diagonals;
+        int64_t diagonalCapacity = dpMatrix->diagonalCapacity;
+        dpMatrix->diagonalCapacity *= 2;
+        dpMatrix->diagonals = st_calloc(dpMatrix->diagonalCapacity, sizeof(DpDiagonal *));
+        for (int64_t i = 0; i < diagonalCapacity; i++) {
+            if (diagonals[i] != NULL) {
+                int64_t j = diagonal_getXay(diagonals[i]->diagonal) % dpMatrix->diagonalCapacity;
+                dpMatrix->diagonals[j] = diagonals[i];
+            }
+        }
+        free(diagonals);
+    }
+    DpDiagonal *dpDiagonal = dpDiagonalPool_getDiagonal(dpMatrix->pool, diagonal, dpMatrix->stateNumber);
+    dpDiagonal->scaled = dpDiagonal->scalable = dpMatrix->scaled;
+    dpMatrix->diagonals[diagonal.xay % dpMatrix->diagonalCapacity] = dpDiagonal;
     dpMatrix->activeDiagonals++;
     return dpDiagonal;
 }
@@ -677,14 +1178,202 @@ DpDiagonal *dpMatrix_createDiagonal(DpMatrix *dpMatrix, Diagonal diagonal) {
 void dpMatrix_deleteDiagonal(DpMatrix *dpMatrix, int64_t xay) {
     assert(xay >= 0);
     assert(xay <= dpMatrix->diagonalNumber);
-    if (dpMatrix->diagonals[xay] != NULL) {
+    DpDiagonal *dpDiagonal = dpMatrix_getDiagonal(dpMatrix, xay);
+    if (dpDiagonal != NULL) {
         dpMatrix->activeDiagonals--;
         assert(dpMatrix->activeDiagonals >= 0);
-        dpDiagonal_destruct(dpMatrix->diagonals[xay]);
-        dpMatrix->diagonals[xay] = NULL;
+        dpDiagonal_destruct(dpDiagonal);
+        dpMatrix->diagonals[xay % dpMatrix->diagonalCapacity] = NULL;
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//AlignedPairBuffer
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+AlignedPairBuffer *alignedPairBuffer_construct(bool withStates) {
+    AlignedPairBuffer *buffer = st_malloc(sizeof(AlignedPairBuffer));
+    buffer->length = 0;
+    buffer->maxLength = 64;
+    buffer->probs = st_malloc(buffer->maxLength * sizeof(int64_t));
+    buffer->xs = st_malloc(buffer->maxLength * sizeof(int64_t));
+    buffer->ys = st_malloc(buffer->maxLength * sizeof(int64_t));
+    buffer->states = withStates ? st_malloc(buffer->maxLength * sizeof(int64_t)) : NULL;
+    return buffer;
+}
+
+void alignedPairBuffer_destruct(AlignedPairBuffer *buffer) {
+    free(buffer->probs);
+    free(buffer->xs);
+    free(buffer->ys);
+    free(buffer->states);
+    free(buffer);
+}
+
+void alignedPairBuffer_clear(AlignedPairBuffer *buffer) {
+    buffer->length = 0;
+}
+
+static int64_t *alignedPairBuffer_resizeArray(int64_t *array, int64_t length, int64_t maxLength) {
+    int64_t *array2 = st_malloc(maxLength * sizeof(int64_t));
+    memcpy(array2, array, length * sizeof(int64_t));
+    free(array);
+    return array2;
+}
+
+static void alignedPairBuffer_reserve(AlignedPairBuffer *buffer, int64_t length) {
+    if (length <= buffer->maxLength) {
+        return;
+    }
+    int64_t maxLength = buffer->maxLength * 2 > length ? buffer->maxLength * 2 : length;
+    buffer->probs = alignedPairBuffer_resizeArray(buffer->probs, buffer->length, maxLength);
+    buffer->xs = alignedPairBuffer_resizeArray(buffer->xs, buffer->length, maxLength);
+    buffer->ys = alignedPairBuffer_resizeArray(buffer->ys, buffer->length, maxLength);
+    if (buffer->states != NULL) {
+        buffer->states = alignedPairBuffer_resizeArray(buffer->states, buffer->length, maxLength);
+    }
+    buffer->maxLength = maxLength;
+}
+
+void alignedPairBuffer_append(AlignedPairBuffer *buffer, int64_t prob, int64_t x, int64_t y, int64_t state) {
+    alignedPairBuffer_reserve(buffer, buffer->length + 1);
+    buffer->probs[buffer->length] = prob;
+    buffer->xs[buffer->length] = x;
+    buffer->ys[buffer->length] = y;
+    if (buffer->states != NULL) {
+        buffer->states[buffer->length] = state;
+    }
+    buffer->length++;
+}
+
+void alignedPairBuffer_appendBuffer(AlignedPairBuffer *buffer, AlignedPairBuffer *buffer2,
+                                    int64_t offsetX, int64_t offsetY) {
+    alignedPairBuffer_reserve(buffer, buffer->length + buffer2->length);
+    for (int64_t i = 0; i < buffer2->length; i++) {
+        buffer->probs[buffer->length + i] = buffer2->probs[i];
+        buffer->xs[buffer->length + i] = buffer2->xs[i] + offsetX;
+        buffer->ys[buffer->length + i] = buffer2->ys[i] + offsetY;
+    }
+    if (buffer->states != NULL) {
+        for (int64_t i = 0; i < buffer2->length; i++) {
+            buffer->states[buffer->length + i] = buffer2->states != NULL ? buffer2->states[i] : 0;
+        }
     }
+    buffer->length += buffer2->length;
 }
 
+static void alignedPairBuffer_permuteArray(int64_t **array, int64_t *order, int64_t length, int64_t maxLength) {
+    int64_t *array2 = st_malloc(maxLength * sizeof(int64_t));
+    for (int64_t i = 0; i < length; i++) {
+        array2[order[i]] = (*array)[i];
+    }
+    free(*array);
+    *array = array2;
+}
+
+void alignedPairBuffer_sortByXPlusY(AlignedPairBuffer *buffer) {
+    if (buffer->length == 0) {
+        return;
+    }
+    int64_t minKey = buffer->xs[0] + buffer->ys[0], maxKey = minKey;
+    bool sorted = 1;
+    for (int64_t i = 1; i < buffer->length; i++) {
+        int64_t key = buffer->xs[i] + buffer->ys[i];
+        sorted = sorted && key >= buffer->xs[i - 1] + buffer->ys[i - 1];
+        minKey = key < minKey ? key : minKey;
+        maxKey = key > maxKey ? key : maxKey;
+    }
+    if (sorted) {
+        return;
+    }
+    //Counting sort, order[i] being where the ith pair goes
+    int64_t *starts = st_calloc(maxKey - minKey + 1, sizeof(int64_t));
+    for (int64_t i = 0; i < buffer->length; i++) {
+        starts[buffer->xs[i] + buffer->ys[i] - minKey]++;
+    }
+    int64_t total = 0;
+    for (int64_t k = 0; k <= maxKey - minKey; k++) {
+        int64_t count = starts[k];
+        starts[k] = total;
+        total += count;
+    }
+    int64_t *order = st_malloc(buffer->length * sizeof(int64_t));
+    for (int64_t i = 0; i < buffer->length; i++) {
+        order[i] = starts[buffer->xs[i] + buffer->ys[i] - minKey]++;
+    }
+    alignedPairBuffer_permuteArray(&buffer->probs, order, buffer->length, buffer->maxLength);
+    alignedPairBuffer_permuteArray(&buffer->xs, order, buffer->length, buffer->maxLength);
+    alignedPairBuffer_permuteArray(&buffer->ys, order, buffer->length, buffer->maxLength);
+    if (buffer->states != NULL) {
+        alignedPairBuffer_permuteArray(&buffer->states, order, buffer->length, buffer->maxLength);
+    }
+    free(order);
+    free(starts);
+}
+
+int64_t *alignedPairBuffer_getIndelProbabilities(AlignedPairBuffer *buffer, int64_t seqLength, bool xIfTrueElseY) {
+    int64_t *indelProbs = st_malloc(seqLength * sizeof(int64_t));
+    int64_t *coordinates = xIfTrueElseY ? buffer->xs : buffer->ys;
+    for (int64_t i = 0; i < seqLength; i++) {
+        indelProbs[i] = PAIR_ALIGNMENT_PROB_1;
+    }
+    for (int64_t i = 0; i < buffer->length; i++) {
+        indelProbs[coordinates[i]] -= buffer->probs[i];
+    }
+    for (int64_t i = 0; i < seqLength; i++) {
+        if (indelProbs[i] < 0) {
+            indelProbs[i] = 0;
+        }
+    }
+    return indelProbs;
+}
+
+void alignedPairBuffer_reweight(AlignedPairBuffer *buffer, int64_t seqLengthX, int64_t seqLengthY, double gapGamma) {
+    if (gapGamma <= 0.0) {
+        return;
+    }
+    int64_t *indelProbsX = alignedPairBuffer_getIndelProbabilities(buffer, seqLengthX, 1);
+    int64_t *indelProbsY = alignedPairBuffer_getIndelProbabilities(buffer, seqLengthY, 0);
+    for (int64_t i = 0; i < buffer->length; i++) {
+        buffer->probs[i] = buffer->probs[i] - gapGamma * (indelProbsX[buffer->xs[i]] + indelProbsY[buffer->ys[i]]);
+    }
+    free(indelProbsX);
+    free(indelProbsY);
+}
+
+void alignedPairBuffer_filter(AlignedPairBuffer *buffer, int64_t minProb) {
+    int64_t j = 0;
+    for (int64_t i = 0; i < buffer->length; i++) {
+        if (buffer->probs[i] >= minProb) {
+            buffer->probs[j] = buffer->probs[i];
+            buffer->xs[j] = buffer->xs[i];
+            buffer->ys[j] = buffer->ys[i];
+            if (buffer->states != NULL) {
+                buffer->states[j] = buffer->states[i];
+            }
+            j++;
+        }
+    }
+    buffer->length = j;
+}
+
+stList *alignedPairBuffer_toList(AlignedPairBuffer *buffer) {
+    stList *alignedPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+    for (int64_t i = 0; i < buffer->length; i++) {
+        stList_append(alignedPairs, stIntTuple_construct3(buffer->probs[i], buffer->xs[i], buffer->ys[i]));
+    }
+    return alignedPairs;
+}
+
+void alignedPairBuffer_appendList(AlignedPairBuffer *buffer, stList *alignedPairs) {
+    alignedPairBuffer_reserve(buffer, buffer->length + stList_length(alignedPairs));
+    for (int64_t i = 0; i < stList_length(alignedPairs); i++) {
+        stIntTuple *aPair = stList_get(alignedPairs, i);
+        alignedPairBuffer_append(buffer, stIntTuple_get(aPair, 0), stIntTuple_get(aPair, 1),
+                                 stIntTuple_get(aPair, 2), 0);
+    }
+}
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 //Diagonal DP Calculations
@@ -708,7 +1397,7 @@ static int64_t getYposition(Sequence *sY, int64_t xay, int64_t xmy) {
 static void diagonalCalculation(StateMachine *sM,
                                 DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
                                 Sequence* sX, Sequence* sY,
-                                void (*cellCalculation)(StateMachine *, double *, double *, double *, double *,
+                                void (*cellCalculation)(StateMachine *, DpCell *, DpCell *, DpCell *, DpCell *,
                                                         void *, void *, void *),
                                 void *extraArgs) {
     Diagonal diagonal = dpDiagonal->diagonal;
@@ -728,10 +1417,10 @@ static void diagonalCalculation(StateMachine *sM,
         void* y = sY->get(sY->elements, indexY);
 
         // do the calculations
-        double *current = dpDiagonal_getCell(dpDiagonal, xmy);
-        double *lower = dpDiagonalM1 == NULL ? NULL : dpDiagonal_getCell(dpDiagonalM1, xmy - 1);
-        double *middle = dpDiagonalM2 == NULL ? NULL : dpDiagonal_getCell(dpDiagonalM2, xmy);
-        double *upper = dpDiagonalM1 == NULL ? NULL : dpDiagonal_getCell(dpDiagonalM1, xmy + 1);
+        DpCell *current = dpDiagonal_getCell(dpDiagonal, xmy);
+        DpCell *lower = dpDiagonalM1 == NULL ? NULL : dpDiagonal_getCell(dpDiagonalM1, xmy - 1);
+        DpCell *middle = dpDiagonalM2 == NULL ? NULL : dpDiagonal_getCell(dpDiagonalM2, xmy);
+        DpCell *upper = dpDiagonalM1 == NULL ? NULL : dpDiagonal_getCell(dpDiagonalM1, xmy + 1);
         cellCalculation(sM, current, lower, middle, upper, x, y, extraArgs);
         xmy += 2;
 
@@ -740,24 +1429,22 @@ static void diagonalCalculation(StateMachine *sM,
 
 void diagonalCalculationForward(StateMachine *sM, int64_t xay, DpMatrix *dpMatrix,
                                 Sequence* sX, Sequence* sY) {
-    diagonalCalculation(sM,
-                        dpMatrix_getDiagonal(dpMatrix, xay),
-                        dpMatrix_getDiagonal(dpMatrix, xay - 1),
-                        dpMatrix_getDiagonal(dpMatrix, xay - 2),
-                        sX, sY,
-                        cell_calculateForward,
-                        NULL);
+    DpDiagonal *dpDiagonal = dpMatrix_getDiagonal(dpMatrix, xay);
+    DpDiagonal *dpDiagonalM1 = dpMatrix_getDiagonal(dpMatrix, xay - 1);
+    DpDiagonal *dpDiagonalM2 = dpMatrix_getDiagonal(dpMatrix, xay - 2);
+    DpDiagonal *framedDiagonalM2 = dpDiagonal_enterLogFrame(dpDiagonal, dpDiagonalM1, dpDiagonalM2, 1);
+    diagonalCalculation(sM, dpDiagonal, dpDiagonalM1, framedDiagonalM2, sX, sY, cell_calculateForward, NULL);
+    dpDiagonal_leaveLogFrame(dpDiagonal, dpDiagonalM1, dpDiagonalM2, framedDiagonalM2, 1);
 }
 
 void diagonalCalculationBackward(StateMachine *sM, int64_t xay, DpMatrix *dpMatrix,
                                  Sequence* sX, Sequence* sY) {
-    diagonalCalculation(sM,
-                        dpMatrix_getDiagonal(dpMatrix, xay),
-                        dpMatrix_getDiagonal(dpMatrix, xay - 1),
-                        dpMatrix_getDiagonal(dpMatrix, xay - 2),
-                        sX, sY,
-                        cell_calculateBackward,
-                        NULL);
+    DpDiagonal *dpDiagonal = dpMatrix_getDiagonal(dpMatrix, xay);
+    DpDiagonal *dpDiagonalM1 = dpMatrix_getDiagonal(dpMatrix, xay - 1);
+    DpDiagonal *dpDiagonalM2 = dpMatrix_getDiagonal(dpMatrix, xay - 2);
+    DpDiagonal *framedDiagonalM2 = dpDiagonal_enterLogFrame(dpDiagonal, dpDiagonalM1, dpDiagonalM2, 0);
+    diagonalCalculation(sM, dpDiagonal, dpDiagonalM1, framedDiagonalM2, sX, sY, cell_calculateBackward, NULL);
+    dpDiagonal_leaveLogFrame(dpDiagonal, dpDiagonalM1, dpDiagonalM2, framedDiagonalM2, 0);
 }
 
 double diagonalCalculationTotalProbability(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
@@ -773,35 +1460,56 @@ double diagonalCalculationTotalProbability(StateMachine *sM, int64_t xay, DpMatr
     if (backDiagonal != NULL && forwardDiagonal != NULL) {
         DpDiagonal *matchDiagonal = dpDiagonal_clone(backDiagonal);
         dpDiagonal_zeroValues(matchDiagonal);
-        diagonalCalculation(sM, matchDiagonal, NULL, forwardDiagonal, sX, sY, cell_calculateForward, NULL);
+        DpDiagonal *framedDiagonal = dpDiagonal_enterLogFrame(matchDiagonal, NULL, forwardDiagonal, 1);
+        if (sM->diagonalCalculate != NULL) { //the kernel can use the emissions cached for the diagonal
+            sM->diagonalCalculate(sM, matchDiagonal, NULL, framedDiagonal, sX, sY, 1);
+        } else {
+            diagonalCalculation(sM, matchDiagonal, NULL, framedDiagonal, sX, sY, cell_calculateForward, NULL);
+        }
+        dpDiagonal_leaveLogFrame(matchDiagonal, NULL, forwardDiagonal, framedDiagonal, 1);
         totalProbability = logAdd(totalProbability, dpDiagonal_dotProduct(matchDiagonal, backDiagonal));
         dpDiagonal_destruct(matchDiagonal);
     }
     return totalProbability;
 }
 
-void diagonalCalculationPosteriorMatchProbs(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
-                                            DpMatrix *backwardDpMatrix, Sequence* sX, Sequence* sY,
-                                            double totalProbability, PairwiseAlignmentParameters *p, void *extraArgs) {
+//Adds the pair to the list or buffer that is the first element of extraArgs
+static inline void posteriorMatchProbs_addPair(void *extraArgs, bool toBuffer,
+                                               int64_t prob, int64_t x, int64_t y, int64_t state) {
+    if (toBuffer) {
+        alignedPairBuffer_append(((void **) extraArgs)[0], prob, x, y, state);
+    } else {
+        stList_append(((void **) extraArgs)[0], stIntTuple_construct3(prob, x, y));
+    }
+}
+
+static void posteriorMatchProbs(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
+                                DpMatrix *backwardDpMatrix, double totalProbability, PairwiseAlignmentParameters *p,
+                                void *extraArgs, bool toBuffer) {
     assert(p->threshold >= 0.0);
     assert(p->threshold <= 1.0);
-    stList *alignedPairs = ((void **) extraArgs)[0];
-    DpDiagonal *forwardDiagonal = dpMatrix_getDiagonal(forwardDpMatrix, xay);
-    DpDiagonal *backDiagonal = dpMatrix_getDiagonal(backwardDpMatrix, xay);
+    DpDiagonal *matrixForwardDiagonal = dpMatrix_getDiagonal(forwardDpMatrix, xay);
+    DpDiagonal *matrixBackDiagonal = dpMatrix_getDiagonal(backwardDpMatrix, xay);
+    DpDiagonal *forwardDiagonal = dpDiagonal_getMatchingProbabilities(matrixForwardDiagonal, matrixBackDiagonal);
+    DpDiagonal *backDiagonal = dpDiagonal_getMatchingProbabilities(matrixBackDiagonal, matrixForwardDiagonal);
     Diagonal diagonal = forwardDiagonal->diagonal;
     int64_t xmy = diagonal_getMinXmy(diagonal);
+    //Factor to turn products of scaled cells into posteriors, or its log for log cells
+    double logScaleFactor = forwardDiagonal->logScale + backDiagonal->logScale - totalProbability;
+    double scaleFactor = forwardDiagonal->scaled ? exp(logScaleFactor) : 0.0;
 
     //Walk over the cells computing the posteriors
     while (xmy <= diagonal_getMaxXmy(diagonal)) {
         int64_t x = diagonal_getXCoordinate(diagonal_getXay(diagonal), xmy);
         int64_t y = diagonal_getYCoordinate(diagonal_getXay(diagonal), xmy);
         if (x > 0 && y > 0) {
-            double *cellForward = dpDiagonal_getCell(forwardDiagonal, xmy);
+            DpCell *cellForward = dpDiagonal_getCell(forwardDiagonal, xmy);
             //st_uglyf("X: %lld Y: %lld cellForward->MatchState: %f ", x, y, cellForward[sM->matchState]);
-            double *cellBackward = dpDiagonal_getCell(backDiagonal, xmy);
+            DpCell *cellBackward = dpDiagonal_getCell(backDiagonal, xmy);
             //st_uglyf("cellBackward->MatchState: %f ", cellBackward[sM->matchState]);
-            double posteriorProbability = exp(
-                    (cellForward[sM->matchState] + cellBackward[sM->matchState]) - totalProbability);
+            double posteriorProbability = forwardDiagonal->scaled ?
+                    cellForward[sM->matchState] * cellBackward[sM->matchState] * scaleFactor :
+                    exp((cellForward[sM->matchState] + cellBackward[sM->matchState]) + logScaleFactor);
             //st_uglyf("posteriorProb: %f\n", posteriorProbability);
             if (posteriorProbability >= p->threshold) {
                 if (posteriorProbability > 1.0) {
@@ -810,7 +1518,8 @@ void diagonalCalculationPosteriorMatchProbs(StateMachine *sM, int64_t xay, DpMat
                 //st_uglyf("Adding to alignedPairs! posteriorProb: %f, X: %lld (%s), Y: %lld (%f)\n", posteriorProbability, x - 1, sX->get(sX->elements, x-1), y - 1, *(double *)sY->get(sY->elements, y-1));
                 //st_uglyf("Adding to alignedPairs! posteriorProb: %f, X: %lld, Y: %lld (%f)\n", posteriorProbability, x - 1, y - 1, *(double *)sY->get(sY->elements, y-1));
                 posteriorProbability = floor(posteriorProbability * PAIR_ALIGNMENT_PROB_1);
-                stList_append(alignedPairs, stIntTuple_construct3((int64_t) posteriorProbability, x - 1, y - 1));
+                posteriorMatchProbs_addPair(extraArgs, toBuffer, (int64_t) posteriorProbability, x - 1, y - 1,
+                                            sM->matchState);
             }
             //if (posteriorProbability <= p->threshold) { // todo remove this!?
             //    //st_uglyf("NOT Adding to alignedPairs! posteriorProb: %f, X: %lld, Y: %lld (%f)\n", posteriorProbability, x - 1, y - 1, *(double *)sY->get(sY->elements, y-1));
@@ -818,33 +1527,39 @@ void diagonalCalculationPosteriorMatchProbs(StateMachine *sM, int64_t xay, DpMat
         }
         xmy += 2;
     }
+    dpDiagonal_destructLogProbabilities(forwardDiagonal, matrixForwardDiagonal);
+    dpDiagonal_destructLogProbabilities(backDiagonal, matrixBackDiagonal);
     //st_uglyf("final length for alignedPairs: %lld\n", stList_length(alignedPairs));
 }
 
-void diagonalCalculationMultiPosteriorMatchProbs(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
-                                                 DpMatrix *backwardDpMatrix, Sequence* sX, Sequence* sY,
-                                                 double totalProbability, PairwiseAlignmentParameters *p,
-                                                 void *extraArgs) {
+static void multiPosteriorMatchProbs(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
+                                     DpMatrix *backwardDpMatrix, double totalProbability,
+                                     PairwiseAlignmentParameters *p, void *extraArgs, bool toBuffer) {
     assert(p->threshold >= 0.0);
     assert(p->threshold <= 1.0);
-    stList *alignedPairs = ((void **) extraArgs)[0];
-    DpDiagonal *forwardDiagonal = dpMatrix_getDiagonal(forwardDpMatrix, xay);
-    DpDiagonal *backDiagonal = dpMatrix_getDiagonal(backwardDpMatrix, xay);
+    DpDiagonal *matrixForwardDiagonal = dpMatrix_getDiagonal(forwardDpMatrix, xay);
+    DpDiagonal *matrixBackDiagonal = dpMatrix_getDiagonal(backwardDpMatrix, xay);
+    DpDiagonal *forwardDiagonal = dpDiagonal_getMatchingProbabilities(matrixForwardDiagonal, matrixBackDiagonal);
+    DpDiagonal *backDiagonal = dpDiagonal_getMatchingProbabilities(matrixBackDiagonal, matrixForwardDiagonal);
     Diagonal diagonal = forwardDiagonal->diagonal;
     int64_t xmy = diagonal_getMinXmy(diagonal);
+    //Factor to turn products of scaled cells into posteriors, or its log for log cells
+    double logScaleFactor = forwardDiagonal->logScale + backDiagonal->logScale - totalProbability;
+    double scaleFactor = forwardDiagonal->scaled ? exp(logScaleFactor) : 0.0;
 
     //Walk over the cells computing the posteriors
     while (xmy <= diagonal_getMaxXmy(diagonal)) {
         int64_t x = diagonal_getXCoordinate(diagonal_getXay(diagonal), xmy);
         int64_t y = diagonal_getYCoordinate(diagonal_getXay(diagonal), xmy);
         if (x > 0 && y > 0) {
-            double *cellForward = dpDiagonal_getCell(forwardDiagonal, xmy);
+            DpCell *cellForward = dpDiagonal_getCell(forwardDiagonal, xmy);
             //st_uglyf("X: %lld Y: %lld cellForward->MatchState: %f ", x, y, cellForward[sM->matchState]);
-            double *cellBackward = dpDiagonal_getCell(backDiagonal, xmy);
+            DpCell *cellBackward = dpDiagonal_getCell(backDiagonal, xmy);
             //st_uglyf("cellBackward->MatchState: %f ", cellBackward[sM->matchState]);
             for (int64_t s = sM->matchState; s < 6; s++) {
-                double posteriorProbability = exp(
-                        (cellForward[s] + cellBackward[s]) - totalProbability);
+                double posteriorProbability = forwardDiagonal->scaled ?
+                        cellForward[s] * cellBackward[s] * scaleFactor :
+                        exp((cellForward[s] + cellBackward[s]) + logScaleFactor);
                 if (posteriorProbability >= p->threshold) {
                     if (posteriorProbability > 1.0) {
                         posteriorProbability = 1.0;
@@ -852,7 +1567,8 @@ void diagonalCalculationMultiPosteriorMatchProbs(StateMachine *sM, int64_t xay,
                     posteriorProbability = floor(posteriorProbability * PAIR_ALIGNMENT_PROB_1);
                     for (int64_t n = 0; n < s; n++) {
                         //st_uglyf("Adding to alignedPairs! posteriorProb: %f, X: %lld, Y: %lld (%f), state:%lld \n", posteriorProbability/PAIR_ALIGNMENT_PROB_1, (x + n) - 1, y - 1, *(double *)sY->get(sY->elements, y-1), s);
-                        stList_append(alignedPairs, stIntTuple_construct3((int64_t) posteriorProbability, (x + n) - 1, y - 1));
+                        posteriorMatchProbs_addPair(extraArgs, toBuffer, (int64_t) posteriorProbability,
+                                                    (x + n) - 1, y - 1, s);
                     }
                 }
                 //if (posteriorProbability <= p->threshold) { // todo remove this?!
@@ -862,11 +1578,47 @@ void diagonalCalculationMultiPosteriorMatchProbs(StateMachine *sM, int64_t xay,
         }
         xmy += 2;
     }
+    dpDiagonal_destructLogProbabilities(forwardDiagonal, matrixForwardDiagonal);
+    dpDiagonal_destructLogProbabilities(backDiagonal, matrixBackDiagonal);
     //st_uglyf("final length for alignedPairs: %lld\n", stList_length(alignedPairs));
 }
 
-void diagonalCalculationExpectations(StateMachine *sM, int64_t xay,
-                                     DpMatrix *forwardDpMatrix, DpMatrix *backwardDpMatrix, Sequence* sX, Sequence* sY,
+void diagonalCalculationPosteriorMatchProbs(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
+                                            DpMatrix *backwardDpMatrix, Sequence* sX, Sequence* sY,
+                                            double totalProbability, PairwiseAlignmentParameters *p, void *extraArgs) {
+    posteriorMatchProbs(sM, xay, forwardDpMatrix, backwardDpMatrix, totalProbability, p, extraArgs, 0);
+}
+
+void diagonalCalculationMultiPosteriorMatchProbs(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
+                                                 DpMatrix *backwardDpMatrix, Sequence* sX, Sequence* sY,
+                                                 double totalProbability, PairwiseAlignmentParameters *p,
+                                                 void *extraArgs) {
+    multiPosteriorMatchProbs(sM, xay, forwardDpMatrix, backwardDpMatrix, totalProbability, p, extraArgs, 0);
+}
+
+void diagonalCalculationPosteriorMatchProbsToBuffer(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
+                                                    DpMatrix *backwardDpMatrix, Sequence* sX, Sequence* sY,
+                                                    double totalProbability, PairwiseAlignmentParameters *p,
+                                                    void *extraArgs) {
+    posteriorMatchProbs(sM, xay, forwardDpMatrix, backwardDpMatrix, totalProbability, p, extraArgs, 1);
+}
+
+void diagonalCalculationMultiPosteriorMatchProbsToBuffer(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
+                                                         DpMatrix *backwardDpMatrix, Sequence* sX, Sequence* sY,
+                                                         double totalProbability, PairwiseAlignmentParameters *p,
+                                                         void *extraArgs) {
+    multiPosteriorMatchProbs(sM, xay, forwardDpMatrix, backwardDpMatrix, totalProbability, p, extraArgs, 1);
+}
+
+static bool diagonalKernel_updateExpectations(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                              DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                              Sequence *sX, Sequence *sY,
+                                              void (*doTransition)(DpCell *, DpCell *, int64_t, int64_t,
+                                                                   double, double, void *),
+                                              void *extraArgs);
+
+void diagonalCalculationExpectations(StateMachine *sM, int64_t xay,
+                                     DpMatrix *forwardDpMatrix, DpMatrix *backwardDpMatrix, Sequence* sX, Sequence* sY,
                                      double totalProbability, PairwiseAlignmentParameters *p, void *extraArgs) {
     /*
      * Updates the expectations of the transitions/emissions for the given diagonal.
@@ -880,11 +1632,18 @@ void diagonalCalculationExpectations(StateMachine *sM, int64_t xay,
     // We do this once per diagonal, which is a hack, rather than for the
     // whole matrix. The correction factor is approximately 1/number of
     // diagonals.
-    diagonalCalculation(sM,
-                        dpMatrix_getDiagonal(backwardDpMatrix, xay),
-                        dpMatrix_getDiagonal(forwardDpMatrix, xay - 1),
-                        dpMatrix_getDiagonal(forwardDpMatrix, xay - 2),
-                        sX, sY, cell_calculateExpectation, extraArgs2);
+    //The expectation updates work on log probabilities
+    DpDiagonal *backDiagonal = dpDiagonal_getLogProbabilities(dpMatrix_getDiagonal(backwardDpMatrix, xay));
+    DpDiagonal *forwardDiagonalM1 = dpDiagonal_getLogProbabilities(dpMatrix_getDiagonal(forwardDpMatrix, xay - 1));
+    DpDiagonal *forwardDiagonalM2 = dpDiagonal_getLogProbabilities(dpMatrix_getDiagonal(forwardDpMatrix, xay - 2));
+    if (!diagonalKernel_updateExpectations(sM, backDiagonal, forwardDiagonalM1, forwardDiagonalM2, sX, sY,
+                                           cell_updateExpectations, extraArgs2)) {
+        diagonalCalculation(sM, backDiagonal, forwardDiagonalM1, forwardDiagonalM2,
+                            sX, sY, cell_calculateExpectation, extraArgs2);
+    }
+    dpDiagonal_destructLogProbabilities(backDiagonal, dpMatrix_getDiagonal(backwardDpMatrix, xay));
+    dpDiagonal_destructLogProbabilities(forwardDiagonalM1, dpMatrix_getDiagonal(forwardDpMatrix, xay - 1));
+    dpDiagonal_destructLogProbabilities(forwardDiagonalM2, dpMatrix_getDiagonal(forwardDpMatrix, xay - 2));
 }
 
 void diagonalCalculation_signal_Expectations(StateMachine *sM, int64_t xay,
@@ -904,18 +1663,1665 @@ void diagonalCalculation_signal_Expectations(StateMachine *sM, int64_t xay,
     // We do this once per diagonal, which is a hack, rather than for the
     // whole matrix. The correction factor is approximately 1/number of
     // diagonals.
-    diagonalCalculation(sM,
-                        dpMatrix_getDiagonal(backwardDpMatrix, xay),
-                        dpMatrix_getDiagonal(forwardDpMatrix, xay - 1),
-                        dpMatrix_getDiagonal(forwardDpMatrix, xay - 2),
-                        sX, sY, cell_signal_calculateUpdateExpectation, extraArgs2);
+    //The expectation updates work on log probabilities
+    DpDiagonal *backDiagonal = dpDiagonal_getLogProbabilities(dpMatrix_getDiagonal(backwardDpMatrix, xay));
+    DpDiagonal *forwardDiagonalM1 = dpDiagonal_getLogProbabilities(dpMatrix_getDiagonal(forwardDpMatrix, xay - 1));
+    DpDiagonal *forwardDiagonalM2 = dpDiagonal_getLogProbabilities(dpMatrix_getDiagonal(forwardDpMatrix, xay - 2));
+    if (!diagonalKernel_updateExpectations(sM, backDiagonal, forwardDiagonalM1, forwardDiagonalM2, sX, sY,
+                                           sM->cellCalculateUpdateExpectations, extraArgs2)) {
+        diagonalCalculation(sM, backDiagonal, forwardDiagonalM1, forwardDiagonalM2,
+                            sX, sY, cell_signal_calculateUpdateExpectation, extraArgs2);
+    }
+    dpDiagonal_destructLogProbabilities(backDiagonal, dpMatrix_getDiagonal(backwardDpMatrix, xay));
+    dpDiagonal_destructLogProbabilities(forwardDiagonalM1, dpMatrix_getDiagonal(forwardDpMatrix, xay - 1));
+    dpDiagonal_destructLogProbabilities(forwardDiagonalM2, dpMatrix_getDiagonal(forwardDpMatrix, xay - 2));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Vectorised diagonal kernels
+//
+//The transitions of a diagonal can be done several cells at a time. A machine's kernel first lays out the
+//emissions of each cell, and the transition probabilities of those transitions whose probability depends on
+//the cell, in arrays of one value per cell. The current diagonal and its two predecessors are then copied into
+//state-major scratch buffers, so each transition becomes one vectorMath_logAddAccumulate over contiguous runs
+//of cells. Neighbouring cells that are outside the band map onto LOG_ZERO padding, which logAdd leaves
+//unchanged, so no masking is needed. Every cell sees its transitions in the same order as in the scalar
+//kernels, so the results are identical to them.
+//
+//The diagonals of scaled matrices hold linear-space cells instead, each transition being a
+//vectorMath_multiplyAccumulate, bar those whose cells span too wide a range, which are done with log probabilities.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define VECTOR_KERNEL_MAX_TRANSITIONS 35
+#define VECTOR_KERNEL_MIN_WIDTH 8
+
+//Transitions done for every cell of a diagonal, cell i adding in eP[i] and tP, or cellTP[i] for transitions whose
+//probability depends on the cell. eP is NULL for transitions without an emission.
+typedef struct _vectorKernelTransitions {
+    int64_t transitionNumber;
+    int64_t from[VECTOR_KERNEL_MAX_TRANSITIONS];
+    int64_t to[VECTOR_KERNEL_MAX_TRANSITIONS];
+    const double *eP[VECTOR_KERNEL_MAX_TRANSITIONS];
+    double tP[VECTOR_KERNEL_MAX_TRANSITIONS];
+    const double *cellTP[VECTOR_KERNEL_MAX_TRANSITIONS];
+    double logMinWeight[VECTOR_KERNEL_MAX_TRANSITIONS]; //scaled only, log of a bound on the least eP[i] * cellTP[i]
+} VectorKernelTransitions;
+
+static void vectorKernelTransitions_add(VectorKernelTransitions *transitions, int64_t from, int64_t to,
+                                        const double *eP, double tP) {
+    assert(transitions->transitionNumber < VECTOR_KERNEL_MAX_TRANSITIONS);
+    assert(eP != NULL);
+    transitions->from[transitions->transitionNumber] = from;
+    transitions->to[transitions->transitionNumber] = to;
+    transitions->eP[transitions->transitionNumber] = eP;
+    transitions->tP[transitions->transitionNumber] = tP;
+    transitions->cellTP[transitions->transitionNumber++] = NULL;
+}
+
+static void vectorKernelTransitions_addPerCell(VectorKernelTransitions *transitions, int64_t from, int64_t to,
+                                               const double *eP, const double *cellTP) {
+    assert(transitions->transitionNumber < VECTOR_KERNEL_MAX_TRANSITIONS);
+    transitions->from[transitions->transitionNumber] = from;
+    transitions->to[transitions->transitionNumber] = to;
+    transitions->eP[transitions->transitionNumber] = eP;
+    transitions->tP[transitions->transitionNumber] = 0.0;
+    transitions->cellTP[transitions->transitionNumber++] = cellTP;
+}
+
+//Lays out the per cell values of the transitions of a diagonal, returning the scratch (slot 0 of the diagonal)
+//holding them and setting *cellValueNumber to the number of arrays of one value per cell in it
+typedef double *(*VectorKernelSetup)(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                     DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                     Sequence *sX, Sequence *sY, VectorKernelTransitions *lowerTransitions,
+                                     VectorKernelTransitions *middleTransitions,
+                                     VectorKernelTransitions *upperTransitions, int64_t *cellValueNumber);
+
+//Diagonals of scaled matrices always go through the vector kernels, as the scalar ones only do log probabilities
+static bool vectorKernel_use(DpDiagonal *dpDiagonal) {
+    return dpDiagonal->scalable || (vectorMath_getSimdLevel() != simdLevel_none &&
+                                    diagonal_getWidth(dpDiagonal->diagonal) >= VECTOR_KERNEL_MIN_WIDTH);
+}
+
+//Going forward the cells of the current diagonal accumulate from their neighbours, going backward the
+//neighbours accumulate from the current cells. With scaled diagonals the per cell values are linear-space and
+//logScaleDifference is the log scale of the cells being added in less that of the cells being added to.
+//weights is scratch for width values.
+static void vectorKernel_doTransitions(double *current, int64_t currentStride,
+                                       double *neighbour, int64_t neighbourStride, int64_t neighbourOffset,
+                                       int64_t width, VectorKernelTransitions *transitions, bool forward,
+                                       bool scaled, double logScaleDifference, double *weights) {
+    const double *foldedEP = NULL, *foldedCellTP = NULL;
+    for (int64_t t = 0; t < transitions->transitionNumber; t++) {
+        double *toCells = current + transitions->to[t] * currentStride;
+        double *fromCells = neighbour + transitions->from[t] * neighbourStride + neighbourOffset;
+        const double *eP = transitions->eP[t], *cellTP = transitions->cellTP[t];
+        double tP = transitions->tP[t];
+        if (cellTP != NULL && eP == NULL) { //cell i adds in cellTP[i] + 0.0, the same as 0 + cellTP[i]
+            eP = cellTP;
+        } else if (cellTP != NULL) {
+            //Fold the transition probabilities into the emissions, once for the transitions sharing them
+            if (eP != foldedEP || cellTP != foldedCellTP) {
+                for (int64_t i = 0; i < width; i++) {
+                    weights[i] = scaled ? eP[i] * cellTP[i] : eP[i] + cellTP[i];
+                }
+                foldedEP = eP;
+                foldedCellTP = cellTP;
+            }
+            eP = weights;
+        }
+        if (scaled) {
+            double c = exp(tP + logScaleDifference);
+            if (forward) {
+                vectorMath_multiplyAccumulate(toCells, fromCells, eP, c, width);
+            } else {
+                vectorMath_multiplyAccumulate(fromCells, toCells, eP, c, width);
+            }
+        } else if (forward) {
+            vectorMath_logAddAccumulate(toCells, fromCells, eP, tP, width);
+        } else {
+            vectorMath_logAddAccumulate(fromCells, toCells, eP, tP, width);
+        }
+#ifdef DP_FLOAT_CELLS
+        //Round the totals as storing them in the cells would, so the results match the cell by cell recursion
+        double *totals = forward ? toCells : fromCells;
+        for (int64_t i = 0; i < width; i++) {
+            totals[i] = (DpCell) totals[i];
+        }
+#endif
+    }
+}
+
+//Exponentiates the cellValueNumber arrays of width per cell values in cellValues into values, each array divided by
+//exp of its largest value, which goes in logOffsets, so emissions far below 0 don't underflow. The log of the
+//smallest non-zero value of each array goes in logMins (0 if it has none).
+static void vectorKernel_exponentiateCellValues(const double *cellValues, double *values, double *logOffsets,
+                                                double *logMins, int64_t cellValueNumber, int64_t width) {
+    for (int64_t j = 0; j < cellValueNumber; j++) {
+        const double *array = cellValues + j * width;
+        double maxValue = LOG_ZERO, minValue = -LOG_ZERO;
+        for (int64_t i = 0; i < width; i++) {
+            if (array[i] > maxValue) {
+                maxValue = array[i];
+            }
+            if (array[i] < minValue && array[i] > LOG_ZERO) {
+                minValue = array[i];
+            }
+        }
+        logOffsets[j] = maxValue == LOG_ZERO ? 0.0 : maxValue;
+        logMins[j] = maxValue == LOG_ZERO ? 0.0 : minValue - maxValue;
+        for (int64_t i = 0; i < width; i++) {
+            values[j * width + i] = exp(array[i] - logOffsets[j]);
+        }
+    }
+}
+
+//The transitions with their per cell values pointing into the exponentiated values instead, and the log offsets of
+//those values added to their transition probabilities (see vectorKernel_exponentiateCellValues)
+static void vectorKernelTransitions_exponentiate(VectorKernelTransitions *transitions,
+                                                 VectorKernelTransitions *scaledTransitions,
+                                                 const double *cellValues, const double *values,
+                                                 const double *logOffsets, const double *logMins, int64_t width) {
+    *scaledTransitions = *transitions;
+    for (int64_t t = 0; t < transitions->transitionNumber; t++) {
+        scaledTransitions->logMinWeight[t] = 0.0;
+        if (transitions->eP[t] != NULL) {
+            int64_t i = transitions->eP[t] - cellValues;
+            assert(i >= 0 && i % width == 0);
+            scaledTransitions->eP[t] = values + i;
+            scaledTransitions->tP[t] += logOffsets[i / width];
+            scaledTransitions->logMinWeight[t] += logMins[i / width];
+        }
+        if (transitions->cellTP[t] != NULL) {
+            int64_t i = transitions->cellTP[t] - cellValues;
+            assert(i >= 0 && i % width == 0);
+            scaledTransitions->cellTP[t] = values + i;
+            scaledTransitions->tP[t] += logOffsets[i / width];
+            scaledTransitions->logMinWeight[t] += logMins[i / width];
+        }
+    }
+}
+
+//The log scale for cells holding logScale to take in transitions from cells with the given log scale, the largest
+//of the terms that can go into them given every value is at most 1 (transitions2 may be NULL)
+static double vectorKernel_getLogScale(double logScale, double sourceLogScale,
+                                       VectorKernelTransitions *transitions, VectorKernelTransitions *transitions2) {
+    for (int64_t t = 0; t < transitions->transitionNumber; t++) {
+        if (sourceLogScale + transitions->tP[t] > logScale) {
+            logScale = sourceLogScale + transitions->tP[t];
+        }
+    }
+    return transitions2 == NULL ? logScale : vectorKernel_getLogScale(logScale, sourceLogScale, transitions2, NULL);
+}
+
+static double vectorKernel_getLogScaleDifference(double sourceLogScale, double targetLogScale) {
+    //A target with no scale gets nothing but zeros, as the transitions into it all have probability zero
+    return targetLogScale == LOG_ZERO ? 0.0 : sourceLogScale - targetLogScale;
+}
+
+//Rescales cells gathered with one log scale to another, at least as large
+static void vectorKernel_rescale(double *cells, int64_t cellNumber, double logScale, double newLogScale) {
+    if (logScale == newLogScale || logScale == LOG_ZERO) {
+        return;
+    }
+    double c = exp(logScale - newLogScale);
+    for (int64_t i = 0; i < cellNumber; i++) {
+        cells[i] *= c;
+    }
+}
+
+//Scaled, a diagonal is only done if every non-zero term going into it is at least exp(-VECTOR_KERNEL_MAX_SCALED_RANGE)
+//of the log scale of its cells, so none underflows and the scaled cells keep everything the log ones would. Where
+//the cells of a diagonal span too wide a range for that, typically far from the alignment, it is done with log
+//probabilities instead.
+#define VECTOR_KERNEL_MAX_SCALED_RANGE 700.0
+
+//Whether a term of the transitions could underflow, the cells they come from being at least exp of logMinCells
+//(indexed by state) and logScaleDifference as for vectorKernel_doTransitions
+static bool vectorKernel_underflows(VectorKernelTransitions *transitions, const double *logMinCells, bool forward,
+                                    double logScaleDifference) {
+    for (int64_t t = 0; t < transitions->transitionNumber; t++) {
+        double logMinCell = logMinCells[forward ? transitions->from[t] : transitions->to[t]];
+        if (transitions->tP[t] != LOG_ZERO && logMinCell + transitions->logMinWeight[t] + transitions->tP[t]
+                                              + logScaleDifference < -VECTOR_KERNEL_MAX_SCALED_RANGE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//Whether rescaling cells at least exp of logMinCells from one log scale to another would underflow
+static bool vectorKernel_rescaleUnderflows(const double *logMinCells, int64_t stateNumber, double logScale,
+                                           double newLogScale) {
+    if (logScale == LOG_ZERO) {
+        return 0;
+    }
+    for (int64_t s = 0; s < stateNumber; s++) {
+        if (logMinCells[s] + logScale - newLogScale < -VECTOR_KERNEL_MAX_SCALED_RANGE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//A previous diagonal only contributes going forward if it exists and, when scaled, isn't all zero
+static bool vectorKernel_hasCells(DpDiagonal *dpDiagonal) {
+    return dpDiagonal != NULL && !(dpDiagonal->scaled && dpDiagonal->logScale == LOG_ZERO);
+}
+
+//Copies the cells of a diagonal into a state-major buffer, the cell at index i (counting from the diagonal's
+//minimum xmy) going to buffer[state * stride + i - start], the rest of the buffer being zero. If scaled the cells
+//go in as probabilities divided by exp of the log scale returned, with the log of the smallest non-zero one of each
+//state in logMinCells (0 if it has none), otherwise as log probabilities, being converted if the diagonal holds the
+//other.
+static double vectorKernel_gather(DpDiagonal *dpDiagonal, double *buffer, int64_t start, int64_t stride,
+                                  bool scaled, double *logMinCells) {
+    int64_t stateNumber = dpDiagonal->stateNumber, width = diagonal_getWidth(dpDiagonal->diagonal);
+    double zero = scaled ? 0.0 : LOG_ZERO;
+    //Only the entries either side of the cells need clearing, the cells going to buffer[state * stride + i]
+    for (int64_t s = 0; s < stateNumber; s++) {
+        for (int64_t i = 0; i < -start; i++) {
+            buffer[s * stride + i] = zero;
+        }
+        for (int64_t i = width - start; i < stride; i++) {
+            buffer[s * stride + i] = zero;
+        }
+    }
+    buffer -= start;
+    const DpCell *cells = dpDiagonal->cells;
+    if (!scaled) {
+        for (int64_t s = 0; s < stateNumber; s++) {
+            double *row = buffer + s * stride;
+            const DpCell *stateCells = cells + s;
+            if (dpDiagonal->scaled) {
+                for (int64_t i = 0; i < width; i++) {
+                    row[i] = log(stateCells[i * stateNumber]) + dpDiagonal->logScale;
+                }
+            } else {
+                for (int64_t i = 0; i < width; i++) {
+                    row[i] = stateCells[i * stateNumber];
+                }
+            }
+        }
+        return 0.0;
+    }
+    //The log scale of a diagonal of log probabilities is its largest cell
+    double logScale = dpDiagonal->logScale;
+    if (!dpDiagonal->scaled) {
+        logScale = LOG_ZERO;
+        for (int64_t i = 0; i < width * stateNumber; i++) {
+            if (cells[i] > logScale) {
+                logScale = cells[i];
+            }
+        }
+    }
+    for (int64_t s = 0; s < stateNumber; s++) {
+        logMinCells[s] = 0.0;
+    }
+    if (logScale == LOG_ZERO) {
+        for (int64_t s = 0; s < stateNumber; s++) {
+            for (int64_t i = 0; i < width; i++) {
+                buffer[s * stride + i] = 0.0;
+            }
+        }
+        return logScale;
+    }
+    for (int64_t s = 0; s < stateNumber; s++) {
+        double *row = buffer + s * stride, minCell = 1.0;
+        const DpCell *stateCells = cells + s;
+        if (dpDiagonal->scaled) {
+            for (int64_t i = 0; i < width; i++) {
+                row[i] = stateCells[i * stateNumber];
+                if (row[i] < minCell && row[i] > 0.0) {
+                    minCell = row[i];
+                }
+            }
+        } else {
+            for (int64_t i = 0; i < width; i++) {
+                row[i] = exp(stateCells[i * stateNumber] - logScale);
+                if (row[i] < minCell && stateCells[i * stateNumber] > LOG_ZERO) { //exp may underflow to 0
+                    minCell = row[i];
+                }
+            }
+        }
+        logMinCells[s] = log(minCell);
+    }
+    return logScale;
+}
+
+//Copies a state-major buffer back into the cells of a diagonal, which are then normalised if scaled
+static void vectorKernel_scatter(DpDiagonal *dpDiagonal, double *buffer, int64_t start, int64_t stride,
+                                 bool scaled, double logScale) {
+    int64_t stateNumber = dpDiagonal->stateNumber, width = diagonal_getWidth(dpDiagonal->diagonal);
+    for (int64_t s = 0; s < stateNumber; s++) {
+        const double *row = buffer + s * stride - start;
+        DpCell *stateCells = dpDiagonal->cells + s;
+        for (int64_t i = 0; i < width; i++) {
+            stateCells[i * stateNumber] = row[i];
+        }
+    }
+    //Log cells stay in the log frame of the kernel call, 0 if the diagonal was scaled (see dpDiagonal_enterLogFrame)
+    dpDiagonal->logScale = scaled ? logScale : dpDiagonal->scaled ? 0.0 : dpDiagonal->logScale;
+    dpDiagonal->scaled = scaled;
+    if (scaled) {
+        dpDiagonal_normalise(dpDiagonal);
+    }
+}
+
+//The diagonals of a kernel call and the state-major buffers they are copied into, with, when scaled, the log of the
+//smallest non-zero cell of each state of each
+typedef struct _vectorKernelBuffers {
+    DpDiagonal *dpDiagonal, *dpDiagonalM1, *dpDiagonalM2;
+    double *current, *m1, *m2, *weights;
+    double *logMinCells, *m1LogMinCells, *m2LogMinCells;
+    int64_t width, m1Start, m1Stride, m2Start, m2Stride;
+    // index of cell 0's lower neighbour in the previous diagonal and middle neighbour in the one before
+    int64_t lowerIndex, middleIndex;
+} VectorKernelBuffers;
+
+//Does the transitions with the cells either scaled or as log probabilities. Scaled, the cells being added to
+//take the log scale of the largest term that can go into them, so no value overflows, and if a term could
+//underflow (see vectorKernel_underflows) false is returned, the diagonals being left as they were.
+static bool vectorKernel_recurse(VectorKernelBuffers *b, VectorKernelTransitions *lowerTransitions,
+                                 VectorKernelTransitions *middleTransitions,
+                                 VectorKernelTransitions *upperTransitions, bool forward, bool scaled) {
+    int64_t stateNumber = b->dpDiagonal->stateNumber, width = b->width;
+    double logScale = vectorKernel_gather(b->dpDiagonal, b->current, 0, width, scaled, b->logMinCells);
+    double m1LogScale = b->dpDiagonalM1 == NULL ? LOG_ZERO :
+                        vectorKernel_gather(b->dpDiagonalM1, b->m1, b->m1Start, b->m1Stride, scaled, b->m1LogMinCells);
+    double m2LogScale = b->dpDiagonalM2 == NULL ? LOG_ZERO :
+                        vectorKernel_gather(b->dpDiagonalM2, b->m2, b->m2Start, b->m2Stride, scaled, b->m2LogMinCells);
+
+    // Going forward each cell only writes to itself, so doing lower, middle then upper keeps the order of
+    // the scalar kernels. Going backward a cell of the previous diagonal is the upper neighbour of the cell
+    // before it and then the lower neighbour of the cell after it, so the upper transitions go first.
+    if (forward) {
+        double currentLogScale = logScale;
+        if (scaled) {
+            logScale = vectorKernel_getLogScale(logScale, m1LogScale, lowerTransitions, upperTransitions);
+            logScale = vectorKernel_getLogScale(logScale, m2LogScale, middleTransitions, NULL);
+        }
+        double m1LogScaleDifference = vectorKernel_getLogScaleDifference(m1LogScale, logScale);
+        double m2LogScaleDifference = vectorKernel_getLogScaleDifference(m2LogScale, logScale);
+        if (scaled && (vectorKernel_rescaleUnderflows(b->logMinCells, stateNumber, currentLogScale, logScale)
+                       || (b->dpDiagonalM1 != NULL && (vectorKernel_underflows(lowerTransitions, b->m1LogMinCells,
+                                                                               forward, m1LogScaleDifference)
+                                                       || vectorKernel_underflows(upperTransitions, b->m1LogMinCells,
+                                                                                  forward, m1LogScaleDifference)))
+                       || (b->dpDiagonalM2 != NULL && vectorKernel_underflows(middleTransitions, b->m2LogMinCells,
+                                                                              forward, m2LogScaleDifference)))) {
+            return 0;
+        }
+        if (scaled) {
+            vectorKernel_rescale(b->current, stateNumber * width, currentLogScale, logScale);
+        }
+        if (b->dpDiagonalM1 != NULL) {
+            vectorKernel_doTransitions(b->current, width, b->m1, b->m1Stride, b->lowerIndex - b->m1Start, width,
+                                       lowerTransitions, forward, scaled, m1LogScaleDifference, b->weights);
+        }
+        if (b->dpDiagonalM2 != NULL) {
+            vectorKernel_doTransitions(b->current, width, b->m2, b->m2Stride, b->middleIndex - b->m2Start, width,
+                                       middleTransitions, forward, scaled, m2LogScaleDifference, b->weights);
+        }
+        if (b->dpDiagonalM1 != NULL) {
+            vectorKernel_doTransitions(b->current, width, b->m1, b->m1Stride, b->lowerIndex + 1 - b->m1Start,
+                                       width, upperTransitions, forward, scaled, m1LogScaleDifference, b->weights);
+        }
+        vectorKernel_scatter(b->dpDiagonal, b->current, 0, width, scaled, logScale);
+        return 1;
+    }
+    double currentM1LogScale = m1LogScale, currentM2LogScale = m2LogScale;
+    if (scaled) {
+        m1LogScale = vectorKernel_getLogScale(m1LogScale, logScale, upperTransitions, lowerTransitions);
+        m2LogScale = vectorKernel_getLogScale(m2LogScale, logScale, middleTransitions, NULL);
+    }
+    double m1LogScaleDifference = vectorKernel_getLogScaleDifference(logScale, m1LogScale);
+    double m2LogScaleDifference = vectorKernel_getLogScaleDifference(logScale, m2LogScale);
+    if (scaled && ((b->dpDiagonalM1 != NULL
+                    && (vectorKernel_rescaleUnderflows(b->m1LogMinCells, stateNumber, currentM1LogScale, m1LogScale)
+                        || vectorKernel_underflows(upperTransitions, b->logMinCells, forward, m1LogScaleDifference)
+                        || vectorKernel_underflows(lowerTransitions, b->logMinCells, forward, m1LogScaleDifference)))
+                   || (b->dpDiagonalM2 != NULL
+                       && (vectorKernel_rescaleUnderflows(b->m2LogMinCells, stateNumber, currentM2LogScale, m2LogScale)
+                           || vectorKernel_underflows(middleTransitions, b->logMinCells, forward,
+                                                      m2LogScaleDifference))))) {
+        return 0;
+    }
+    if (b->dpDiagonalM1 != NULL) {
+        if (scaled) {
+            vectorKernel_rescale(b->m1, stateNumber * b->m1Stride, currentM1LogScale, m1LogScale);
+        }
+        vectorKernel_doTransitions(b->current, width, b->m1, b->m1Stride, b->lowerIndex + 1 - b->m1Start, width,
+                                   upperTransitions, forward, scaled, m1LogScaleDifference, b->weights);
+        vectorKernel_doTransitions(b->current, width, b->m1, b->m1Stride, b->lowerIndex - b->m1Start, width,
+                                   lowerTransitions, forward, scaled, m1LogScaleDifference, b->weights);
+        vectorKernel_scatter(b->dpDiagonalM1, b->m1, b->m1Start, b->m1Stride, scaled, m1LogScale);
+    }
+    if (b->dpDiagonalM2 != NULL) {
+        if (scaled) {
+            vectorKernel_rescale(b->m2, stateNumber * b->m2Stride, currentM2LogScale, m2LogScale);
+        }
+        vectorKernel_doTransitions(b->current, width, b->m2, b->m2Stride, b->middleIndex - b->m2Start, width,
+                                   middleTransitions, forward, scaled, m2LogScaleDifference, b->weights);
+        vectorKernel_scatter(b->dpDiagonalM2, b->m2, b->m2Start, b->m2Stride, scaled, m2LogScale);
+    }
+    return 1;
+}
+
+//Does the transitions with scaled cells, the per cell values being exponentiated into the scratch after the buffers,
+//returning false if that could underflow
+static bool vectorKernel_recurseScaled(VectorKernelBuffers *b, VectorKernelTransitions *lowerTransitions,
+                                       VectorKernelTransitions *middleTransitions,
+                                       VectorKernelTransitions *upperTransitions, const double *cellValues,
+                                       int64_t cellValueNumber, int64_t bufferLength, bool forward) {
+    int64_t stateNumber = b->dpDiagonal->stateNumber, width = b->width;
+    b->logMinCells = b->current + bufferLength;
+    b->m1LogMinCells = b->logMinCells + stateNumber;
+    b->m2LogMinCells = b->m1LogMinCells + stateNumber;
+    double *values = b->m2LogMinCells + stateNumber, *logOffsets = values + cellValueNumber * width;
+    double *logMins = logOffsets + cellValueNumber;
+    vectorKernel_exponentiateCellValues(cellValues, values, logOffsets, logMins, cellValueNumber, width);
+    VectorKernelTransitions scaledLowerTransitions, scaledMiddleTransitions, scaledUpperTransitions;
+    vectorKernelTransitions_exponentiate(lowerTransitions, &scaledLowerTransitions, cellValues, values,
+                                         logOffsets, logMins, width);
+    vectorKernelTransitions_exponentiate(middleTransitions, &scaledMiddleTransitions, cellValues, values,
+                                         logOffsets, logMins, width);
+    vectorKernelTransitions_exponentiate(upperTransitions, &scaledUpperTransitions, cellValues, values,
+                                         logOffsets, logMins, width);
+    return vectorKernel_recurse(b, &scaledLowerTransitions, &scaledMiddleTransitions, &scaledUpperTransitions,
+                                forward, 1);
+}
+
+//Does the transitions of a diagonal given the cellValueNumber arrays of per cell values in cellValues, which the
+//transitions point into. The entries of cells without the respective neighbour just need to be finite.
+//
+//The diagonals of a scaled matrix are done with scaled cells when that loses little enough to underflow, and
+//otherwise with log probabilities, the diagonals written to then holding them instead.
+static void vectorKernel_calculate(DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                   VectorKernelTransitions *lowerTransitions,
+                                   VectorKernelTransitions *middleTransitions,
+                                   VectorKernelTransitions *upperTransitions,
+                                   double *cellValues, int64_t cellValueNumber, bool forward) {
+    if (!forward && !vectorKernel_hasCells(dpDiagonal)) { //Nothing to add to the previous diagonals
+        return;
+    }
+    if (forward && !vectorKernel_hasCells(dpDiagonalM1)) {
+        dpDiagonalM1 = NULL;
+    }
+    if (forward && !vectorKernel_hasCells(dpDiagonalM2)) {
+        dpDiagonalM2 = NULL;
+    }
+    int64_t stateNumber = dpDiagonal->stateNumber;
+    int64_t xmyL = diagonal_getMinXmy(dpDiagonal->diagonal);
+    int64_t width = diagonal_getWidth(dpDiagonal->diagonal);
+    VectorKernelBuffers b = { .dpDiagonal = dpDiagonal, .dpDiagonalM1 = dpDiagonalM1,
+                              .dpDiagonalM2 = dpDiagonalM2, .width = width };
+    b.lowerIndex = dpDiagonalM1 == NULL ? 0 : (xmyL - 1 - diagonal_getMinXmy(dpDiagonalM1->diagonal)) / 2;
+    b.middleIndex = dpDiagonalM2 == NULL ? 0 : (xmyL - diagonal_getMinXmy(dpDiagonalM2->diagonal)) / 2;
+    // the buffers for the neighbouring diagonals have to cover every neighbour of the current diagonal
+    if (dpDiagonalM1 != NULL) {
+        b.m1Start = b.lowerIndex < 0 ? b.lowerIndex : 0;
+        int64_t end = b.lowerIndex + 1 + width;
+        b.m1Stride = (end > diagonal_getWidth(dpDiagonalM1->diagonal) ? end
+                      : diagonal_getWidth(dpDiagonalM1->diagonal)) - b.m1Start;
+    }
+    if (dpDiagonalM2 != NULL) {
+        b.m2Start = b.middleIndex < 0 ? b.middleIndex : 0;
+        int64_t end = b.middleIndex + width;
+        b.m2Stride = (end > diagonal_getWidth(dpDiagonalM2->diagonal) ? end
+                      : diagonal_getWidth(dpDiagonalM2->diagonal)) - b.m2Start;
+    }
+
+    // the buffers, then for scaled diagonals the logs of their smallest cells, and the exponentiated per cell
+    // values with the log offsets and smallest values of their arrays
+    int64_t bufferLength = stateNumber * (width + b.m1Stride + b.m2Stride) + width;
+    b.current = dpDiagonal_getScratch(dpDiagonal, 1, bufferLength + (dpDiagonal->scalable ?
+                                                                     3 * stateNumber + cellValueNumber * (width + 2)
+                                                                     : 0));
+    b.m1 = b.current + stateNumber * width;
+    b.m2 = b.m1 + stateNumber * b.m1Stride;
+    b.weights = b.m2 + stateNumber * b.m2Stride;
+    if (!dpDiagonal->scalable || !vectorKernel_recurseScaled(&b, lowerTransitions, middleTransitions,
+                                                             upperTransitions, cellValues, cellValueNumber,
+                                                             bufferLength, forward)) {
+        vectorKernel_recurse(&b, lowerTransitions, middleTransitions, upperTransitions, forward, 0);
+    }
+    dpDiagonal_releaseScratch(dpDiagonal, b.current);
+}
+
+static void vectorKernel_run(VectorKernelSetup setup, StateMachine *sM, DpDiagonal *dpDiagonal,
+                             DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2, Sequence *sX, Sequence *sY,
+                             bool forward) {
+    VectorKernelTransitions lowerTransitions = { 0 }, middleTransitions = { 0 }, upperTransitions = { 0 };
+    int64_t cellValueNumber;
+    double *cellValues = setup(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY,
+                               &lowerTransitions, &middleTransitions, &upperTransitions, &cellValueNumber);
+    vectorKernel_calculate(dpDiagonal, dpDiagonalM1, dpDiagonalM2, &lowerTransitions, &middleTransitions,
+                           &upperTransitions, cellValues, cellValueNumber, forward);
+    dpDiagonal_releaseScratch(dpDiagonal, cellValues);
+}
+
+static void vectorKernel_doCellTransitions(VectorKernelTransitions *transitions, int64_t i,
+                                           DpCell *fromCells, DpCell *toCells,
+                                           void (*doTransition)(DpCell *, DpCell *, int64_t, int64_t,
+                                                                double, double, void *),
+                                           void *extraArgs) {
+    for (int64_t t = 0; t < transitions->transitionNumber; t++) {
+        doTransition(fromCells, toCells, transitions->from[t], transitions->to[t],
+                     transitions->eP[t] == NULL ? 0.0 : transitions->eP[t][i],
+                     transitions->cellTP[t] == NULL ? transitions->tP[t] : transitions->cellTP[t][i], extraArgs);
+    }
+}
+
+//Calls doTransition for the transitions of each cell, with the emissions the vector kernel lays out, in the order
+//the machine's cellCalculate would. extraArgs are as for cell_calculateExpectation.
+static void vectorKernel_updateExpectations(VectorKernelSetup setup, StateMachine *sM, DpDiagonal *dpDiagonal,
+                                            DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                            Sequence *sX, Sequence *sY,
+                                            void (*doTransition)(DpCell *, DpCell *, int64_t, int64_t,
+                                                                 double, double, void *),
+                                            void *extraArgs) {
+    VectorKernelTransitions lowerTransitions = { 0 }, middleTransitions = { 0 }, upperTransitions = { 0 };
+    int64_t cellValueNumber;
+    double *cellValues = setup(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY,
+                               &lowerTransitions, &middleTransitions, &upperTransitions, &cellValueNumber);
+    Diagonal diagonal = dpDiagonal->diagonal;
+    int64_t xay = diagonal_getXay(diagonal);
+    int64_t i = 0;
+    for (int64_t xmy = diagonal_getMinXmy(diagonal); xmy <= diagonal_getMaxXmy(diagonal); xmy += 2, i++) {
+        void *cX = sX->get(sX->elements, getXposition(sX, xay, xmy) - 1);
+        void *cY = sY->get(sY->elements, getYposition(sY, xay, xmy) - 1);
+        void *extraArgs2[4] = { ((void **) extraArgs)[0], ((void **) extraArgs)[1], cX, cY };
+        DpCell *current = dpDiagonal_getCell(dpDiagonal, xmy);
+        DpCell *lower = dpDiagonalM1 == NULL ? NULL : dpDiagonal_getCell(dpDiagonalM1, xmy - 1);
+        DpCell *middle = dpDiagonalM2 == NULL ? NULL : dpDiagonal_getCell(dpDiagonalM2, xmy);
+        DpCell *upper = dpDiagonalM1 == NULL ? NULL : dpDiagonal_getCell(dpDiagonalM1, xmy + 1);
+        if (lower != NULL) {
+            vectorKernel_doCellTransitions(&lowerTransitions, i, lower, current, doTransition, extraArgs2);
+        }
+        if (middle != NULL) {
+            vectorKernel_doCellTransitions(&middleTransitions, i, middle, current, doTransition, extraArgs2);
+        }
+        if (upper != NULL) {
+            vectorKernel_doCellTransitions(&upperTransitions, i, upper, current, doTransition, extraArgs2);
+        }
+    }
+    dpDiagonal_releaseScratch(dpDiagonal, cellValues);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Specialised diagonal kernels
+//
+//Each kernel does the same recursion as running the machine's cellCalculate over the diagonal with
+//cell_calculateForward/cell_calculateBackward, but with the transitions written out in place and the emission
+//functions and transition probabilities looked up once per diagonal instead of once per transition. The
+//arithmetic is done in the same order as the generic path, so the resulting matrices are identical.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static inline void kernel_doTransition(DpCell *fromCells, DpCell *toCells, int64_t from, int64_t to,
+                                       double eP, double tP, bool forward) {
+    if (forward) {
+        toCells[to] = logAdd(toCells[to], fromCells[from] + (eP + tP));
+    } else {
+        fromCells[from] = logAdd(fromCells[from], toCells[to] + (eP + tP));
+    }
+}
+
+static inline void kernel_getCells(DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                   int64_t xmy, DpCell **current, DpCell **lower, DpCell **middle, DpCell **upper) {
+    *current = dpDiagonal_getCell(dpDiagonal, xmy);
+    *lower = dpDiagonalM1 == NULL ? NULL : dpDiagonal_getCell(dpDiagonalM1, xmy - 1);
+    *middle = dpDiagonalM2 == NULL ? NULL : dpDiagonal_getCell(dpDiagonalM2, xmy);
+    *upper = dpDiagonalM1 == NULL ? NULL : dpDiagonal_getCell(dpDiagonalM1, xmy + 1);
+}
+
+//Kernel over the cells minXmy, minXmy + 2, .., maxXmy of a diagonal. firstCellLower says whether to do the
+//transitions between the first cell and the lower diagonal, otherTransitions whether to do all the rest.
+typedef void (*CellRangeKernel)(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                Sequence *sX, Sequence *sY, int64_t minXmy, int64_t maxXmy,
+                                bool firstCellLower, bool otherTransitions);
+
+typedef struct _threadedDiagonal {
+    StateMachine *sM;
+    DpDiagonal *dpDiagonal, *dpDiagonalM1, *dpDiagonalM2;
+    Sequence *sX, *sY;
+    bool forward;
+    CellRangeKernel kernel;
+} ThreadedDiagonal;
+
+//First cell, as an offset from the diagonal's min xmy in steps of 2, of the given thread's share of the diagonal
+static int64_t threadedDiagonal_getChunkStart(ThreadedDiagonal *threadedDiagonal, int64_t thread,
+                                              int64_t threadNumber) {
+    return diagonal_getWidth(threadedDiagonal->dpDiagonal->diagonal) * thread / threadNumber;
+}
+
+static void threadedDiagonal_calculateChunk(void *arg, int64_t thread, int64_t threadNumber) {
+    ThreadedDiagonal *t = arg;
+    int64_t start = threadedDiagonal_getChunkStart(t, thread, threadNumber);
+    int64_t end = threadedDiagonal_getChunkStart(t, thread + 1, threadNumber);
+    if (start == end) {
+        return;
+    }
+    int64_t minXmy = diagonal_getMinXmy(t->dpDiagonal->diagonal);
+    // going backward neighbouring cells both add to the cell of the lower diagonal between them, so the first
+    // cell of each chunk leaves it to the calling thread
+    t->kernel(t->sM, t->dpDiagonal, t->dpDiagonalM1, t->dpDiagonalM2, t->sX, t->sY,
+              minXmy + 2 * start, minXmy + 2 * (end - 1), t->forward || thread == 0, 1);
+}
+
+//Splits the cells of the diagonal across the thread group of its pool, if it has one and the diagonal is wide
+//enough, returning false otherwise. Going forward each cell only writes to itself. Going backward the only cells
+//written by two chunks are the ones of the lower diagonal at chunk boundaries, which are finished off here once the
+//chunks are done, in the order the serial kernel would have used, so the result is the same either way.
+static bool threadedDiagonal_calculate(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                       DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                       Sequence *sX, Sequence *sY, bool forward, CellRangeKernel kernel) {
+    DpDiagonalPool *pool = dpDiagonal->pool;
+    if (pool == NULL || pool->threadGroup == NULL
+        || diagonal_getWidth(dpDiagonal->diagonal) < pool->minThreadedWidth) {
+        return 0;
+    }
+    ThreadedDiagonal threadedDiagonal = { sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, forward, kernel };
+    threadGroup_run(pool->threadGroup, threadedDiagonal_calculateChunk, &threadedDiagonal);
+    if (!forward) {
+        int64_t threadNumber = threadGroup_getThreadNumber(pool->threadGroup);
+        int64_t minXmy = diagonal_getMinXmy(dpDiagonal->diagonal);
+        for (int64_t thread = 1; thread < threadNumber; thread++) {
+            int64_t start = threadedDiagonal_getChunkStart(&threadedDiagonal, thread, threadNumber);
+            if (start < threadedDiagonal_getChunkStart(&threadedDiagonal, thread + 1, threadNumber)) {
+                kernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY,
+                       minXmy + 2 * start, minXmy + 2 * start, 1, 0);
+            }
+        }
+    }
+    return 1;
+}
+
+static inline void stateMachine5_diagonalKernel(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                                DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                                Sequence *sX, Sequence *sY, bool forward) {
+    StateMachine5 *sM5 = (StateMachine5 *) sM;
+    double (*getXGapProb)(const double *, void *) = sM5->getXGapProbFcn;
+    double (*getYGapProb)(const double *, void *) = sM5->getYGapProbFcn;
+    double (*getMatchProb)(const double *, void *, void *) = sM5->getMatchProbFcn;
+    const double *gapXProbs = sM5->model.EMISSION_GAP_X_PROBS;
+    const double *gapYProbs = sM5->model.EMISSION_GAP_Y_PROBS;
+    const double *matchProbs = sM5->model.EMISSION_MATCH_PROBS;
+    // to gapX
+    double tShortOpenX = sM5->TRANSITION_GAP_SHORT_OPEN_X, tShortExtendX = sM5->TRANSITION_GAP_SHORT_EXTEND_X;
+    double tLongOpenX = sM5->TRANSITION_GAP_LONG_OPEN_X, tLongExtendX = sM5->TRANSITION_GAP_LONG_EXTEND_X;
+    // to match
+    double tMatchContinue = sM5->TRANSITION_MATCH_CONTINUE;
+    double tMatchFromShortX = sM5->TRANSITION_MATCH_FROM_SHORT_GAP_X;
+    double tMatchFromShortY = sM5->TRANSITION_MATCH_FROM_SHORT_GAP_Y;
+    double tMatchFromLongX = sM5->TRANSITION_MATCH_FROM_LONG_GAP_X;
+    double tMatchFromLongY = sM5->TRANSITION_MATCH_FROM_LONG_GAP_Y;
+    // to gapY
+    double tShortOpenY = sM5->TRANSITION_GAP_SHORT_OPEN_Y, tShortExtendY = sM5->TRANSITION_GAP_SHORT_EXTEND_Y;
+    double tLongOpenY = sM5->TRANSITION_GAP_LONG_OPEN_Y, tLongExtendY = sM5->TRANSITION_GAP_LONG_EXTEND_Y;
+
+    Diagonal diagonal = dpDiagonal->diagonal;
+    int64_t xay = diagonal_getXay(diagonal);
+    for (int64_t xmy = diagonal_getMinXmy(diagonal); xmy <= diagonal_getMaxXmy(diagonal); xmy += 2) {
+        void *cX = sX->get(sX->elements, getXposition(sX, xay, xmy) - 1);
+        void *cY = sY->get(sY->elements, getYposition(sY, xay, xmy) - 1);
+        DpCell *current, *lower, *middle, *upper;
+        kernel_getCells(dpDiagonal, dpDiagonalM1, dpDiagonalM2, xmy, &current, &lower, &middle, &upper);
+        if (lower != NULL) {
+            double eP = getXGapProb(gapXProbs, cX);
+            kernel_doTransition(lower, current, match, shortGapX, eP, tShortOpenX, forward);
+            kernel_doTransition(lower, current, shortGapX, shortGapX, eP, tShortExtendX, forward);
+            kernel_doTransition(lower, current, match, longGapX, eP, tLongOpenX, forward);
+            kernel_doTransition(lower, current, longGapX, longGapX, eP, tLongExtendX, forward);
+        }
+        if (middle != NULL) {
+            double eP = getMatchProb(matchProbs, cX, cY);
+            kernel_doTransition(middle, current, match, match, eP, tMatchContinue, forward);
+            kernel_doTransition(middle, current, shortGapX, match, eP, tMatchFromShortX, forward);
+            kernel_doTransition(middle, current, shortGapY, match, eP, tMatchFromShortY, forward);
+            kernel_doTransition(middle, current, longGapX, match, eP, tMatchFromLongX, forward);
+            kernel_doTransition(middle, current, longGapY, match, eP, tMatchFromLongY, forward);
+        }
+        if (upper != NULL) {
+            double eP = getYGapProb(gapYProbs, cY);
+            kernel_doTransition(upper, current, match, shortGapY, eP, tShortOpenY, forward);
+            kernel_doTransition(upper, current, shortGapY, shortGapY, eP, tShortExtendY, forward);
+            kernel_doTransition(upper, current, match, longGapY, eP, tLongOpenY, forward);
+            kernel_doTransition(upper, current, longGapY, longGapY, eP, tLongExtendY, forward);
+        }
+    }
+}
+
+static double *stateMachine5_vectorKernelSetup(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                               DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                               Sequence *sX, Sequence *sY, VectorKernelTransitions *lowerTransitions,
+                                               VectorKernelTransitions *middleTransitions,
+                                               VectorKernelTransitions *upperTransitions, int64_t *cellValueNumber) {
+    StateMachine5 *sM5 = (StateMachine5 *) sM;
+    int64_t width = diagonal_getWidth(dpDiagonal->diagonal);
+    double *eX = dpDiagonal_getScratch(dpDiagonal, 0, 3 * width);
+    double *eM = eX + width, *eY = eM + width;
+    vectorKernelTransitions_add(lowerTransitions, match, shortGapX, eX, sM5->TRANSITION_GAP_SHORT_OPEN_X);
+    vectorKernelTransitions_add(lowerTransitions, shortGapX, shortGapX, eX, sM5->TRANSITION_GAP_SHORT_EXTEND_X);
+    vectorKernelTransitions_add(lowerTransitions, match, longGapX, eX, sM5->TRANSITION_GAP_LONG_OPEN_X);
+    vectorKernelTransitions_add(lowerTransitions, longGapX, longGapX, eX, sM5->TRANSITION_GAP_LONG_EXTEND_X);
+    vectorKernelTransitions_add(middleTransitions, match, match, eM, sM5->TRANSITION_MATCH_CONTINUE);
+    vectorKernelTransitions_add(middleTransitions, shortGapX, match, eM, sM5->TRANSITION_MATCH_FROM_SHORT_GAP_X);
+    vectorKernelTransitions_add(middleTransitions, shortGapY, match, eM, sM5->TRANSITION_MATCH_FROM_SHORT_GAP_Y);
+    vectorKernelTransitions_add(middleTransitions, longGapX, match, eM, sM5->TRANSITION_MATCH_FROM_LONG_GAP_X);
+    vectorKernelTransitions_add(middleTransitions, longGapY, match, eM, sM5->TRANSITION_MATCH_FROM_LONG_GAP_Y);
+    vectorKernelTransitions_add(upperTransitions, match, shortGapY, eY, sM5->TRANSITION_GAP_SHORT_OPEN_Y);
+    vectorKernelTransitions_add(upperTransitions, shortGapY, shortGapY, eY, sM5->TRANSITION_GAP_SHORT_EXTEND_Y);
+    vectorKernelTransitions_add(upperTransitions, match, longGapY, eY, sM5->TRANSITION_GAP_LONG_OPEN_Y);
+    vectorKernelTransitions_add(upperTransitions, longGapY, longGapY, eY, sM5->TRANSITION_GAP_LONG_EXTEND_Y);
+
+    if (!emissionCache_get(dpDiagonal, eX, 3 * width)) {
+        memset(eX, 0, sizeof(double) * 3 * width);
+        Diagonal diagonal = dpDiagonal->diagonal;
+        int64_t xay = diagonal_getXay(diagonal);
+        int64_t i = 0;
+        for (int64_t xmy = diagonal_getMinXmy(diagonal); xmy <= diagonal_getMaxXmy(diagonal); xmy += 2, i++) {
+            void *cX = sX->get(sX->elements, getXposition(sX, xay, xmy) - 1);
+            void *cY = sY->get(sY->elements, getYposition(sY, xay, xmy) - 1);
+            DpCell *current, *lower, *middle, *upper;
+            kernel_getCells(dpDiagonal, dpDiagonalM1, dpDiagonalM2, xmy, &current, &lower, &middle, &upper);
+            if (lower != NULL) {
+                eX[i] = sM5->getXGapProbFcn(sM5->model.EMISSION_GAP_X_PROBS, cX);
+            }
+            if (middle != NULL) {
+                eM[i] = sM5->getMatchProbFcn(sM5->model.EMISSION_MATCH_PROBS, cX, cY);
+            }
+            if (upper != NULL) {
+                eY[i] = sM5->getYGapProbFcn(sM5->model.EMISSION_GAP_Y_PROBS, cY);
+            }
+        }
+        emissionCache_put(dpDiagonal, dpDiagonalM1, dpDiagonalM2, eX, 3 * width);
+    }
+    *cellValueNumber = 3;
+    return eX;
+}
+
+void diagonalKernel_stateMachine5(StateMachine *sM, DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                  DpDiagonal *dpDiagonalM2, Sequence *sX, Sequence *sY, bool forward) {
+    if (vectorKernel_use(dpDiagonal)) {
+        vectorKernel_run(stateMachine5_vectorKernelSetup, sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2,
+                         sX, sY, forward);
+    } else if (forward) {
+        stateMachine5_diagonalKernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, 1);
+    } else {
+        stateMachine5_diagonalKernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, 0);
+    }
+}
+
+static inline void stateMachine4_diagonalKernel(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                                DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                                Sequence *sX, Sequence *sY, bool forward) {
+    StateMachine4 *sM4 = (StateMachine4 *) sM;
+    double (*getXGapProb)(const double *, void *) = sM4->getXGapProbFcn;
+    double (*getYGapProb)(const double *, void *, void *) = sM4->getYGapProbFcn;
+    double (*getMatchProb)(const double *, void *, void *) = sM4->getMatchProbFcn;
+    const double *gapXProbs = sM4->model.EMISSION_GAP_X_PROBS;
+    const double *gapYProbs = sM4->model.EMISSION_GAP_Y_PROBS;
+    const double *matchProbs = sM4->model.EMISSION_MATCH_PROBS;
+    // to gapX
+    double tShortOpenX = sM4->TRANSITION_GAP_SHORT_OPEN_X, tShortExtendX = sM4->TRANSITION_GAP_SHORT_EXTEND_X;
+    double tLongOpenX = sM4->TRANSITION_GAP_LONG_OPEN_X, tLongExtendX = sM4->TRANSITION_GAP_LONG_EXTEND_X;
+    double tLongSwitchToX = sM4->TRANSITION_GAP_LONG_SWITCH_TO_X;
+    // to match
+    double tMatchContinue = sM4->TRANSITION_MATCH_CONTINUE;
+    double tMatchFromShortX = sM4->TRANSITION_MATCH_FROM_SHORT_GAP_X;
+    double tMatchFromShortY = sM4->TRANSITION_MATCH_FROM_SHORT_GAP_Y;
+    double tMatchFromLongX = sM4->TRANSITION_MATCH_FROM_LONG_GAP_X;
+    // to gapY
+    double tShortOpenY = sM4->TRANSITION_GAP_SHORT_OPEN_Y, tShortExtendY = sM4->TRANSITION_GAP_SHORT_EXTEND_Y;
+
+    Diagonal diagonal = dpDiagonal->diagonal;
+    int64_t xay = diagonal_getXay(diagonal);
+    for (int64_t xmy = diagonal_getMinXmy(diagonal); xmy <= diagonal_getMaxXmy(diagonal); xmy += 2) {
+        void *cX = sX->get(sX->elements, getXposition(sX, xay, xmy) - 1);
+        void *cY = sY->get(sY->elements, getYposition(sY, xay, xmy) - 1);
+        DpCell *current, *lower, *middle, *upper;
+        kernel_getCells(dpDiagonal, dpDiagonalM1, dpDiagonalM2, xmy, &current, &lower, &middle, &upper);
+        if (lower != NULL) {
+            double eP = getXGapProb(gapXProbs, cX);
+            kernel_doTransition(lower, current, match, shortGapX, eP, tShortOpenX, forward);
+            kernel_doTransition(lower, current, shortGapX, shortGapX, eP, tShortExtendX, forward);
+            kernel_doTransition(lower, current, match, longGapX, eP, tLongOpenX, forward);
+            kernel_doTransition(lower, current, longGapX, longGapX, eP, tLongExtendX, forward);
+            kernel_doTransition(lower, current, shortGapY, longGapX, eP, tLongSwitchToX, forward);
+        }
+        if (middle != NULL) {
+            double eP = getMatchProb(matchProbs, cX, cY);
+            kernel_doTransition(middle, current, match, match, eP, tMatchContinue, forward);
+            kernel_doTransition(middle, current, shortGapX, match, eP, tMatchFromShortX, forward);
+            kernel_doTransition(middle, current, shortGapY, match, eP, tMatchFromShortY, forward);
+            kernel_doTransition(middle, current, longGapX, match, eP, tMatchFromLongX, forward);
+        }
+        if (upper != NULL) {
+            double eP = getYGapProb(gapYProbs, cX, cY);
+            kernel_doTransition(upper, current, match, shortGapY, eP, tShortOpenY, forward);
+            kernel_doTransition(upper, current, shortGapY, shortGapY, eP, tShortExtendY, forward);
+        }
+    }
+}
+
+static double *stateMachine4_vectorKernelSetup(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                               DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                               Sequence *sX, Sequence *sY, VectorKernelTransitions *lowerTransitions,
+                                               VectorKernelTransitions *middleTransitions,
+                                               VectorKernelTransitions *upperTransitions, int64_t *cellValueNumber) {
+    StateMachine4 *sM4 = (StateMachine4 *) sM;
+    int64_t width = diagonal_getWidth(dpDiagonal->diagonal);
+    double *eX = dpDiagonal_getScratch(dpDiagonal, 0, 3 * width);
+    double *eM = eX + width, *eY = eM + width;
+    vectorKernelTransitions_add(lowerTransitions, match, shortGapX, eX, sM4->TRANSITION_GAP_SHORT_OPEN_X);
+    vectorKernelTransitions_add(lowerTransitions, shortGapX, shortGapX, eX, sM4->TRANSITION_GAP_SHORT_EXTEND_X);
+    vectorKernelTransitions_add(lowerTransitions, match, longGapX, eX, sM4->TRANSITION_GAP_LONG_OPEN_X);
+    vectorKernelTransitions_add(lowerTransitions, longGapX, longGapX, eX, sM4->TRANSITION_GAP_LONG_EXTEND_X);
+    vectorKernelTransitions_add(lowerTransitions, shortGapY, longGapX, eX, sM4->TRANSITION_GAP_LONG_SWITCH_TO_X);
+    vectorKernelTransitions_add(middleTransitions, match, match, eM, sM4->TRANSITION_MATCH_CONTINUE);
+    vectorKernelTransitions_add(middleTransitions, shortGapX, match, eM, sM4->TRANSITION_MATCH_FROM_SHORT_GAP_X);
+    vectorKernelTransitions_add(middleTransitions, shortGapY, match, eM, sM4->TRANSITION_MATCH_FROM_SHORT_GAP_Y);
+    vectorKernelTransitions_add(middleTransitions, longGapX, match, eM, sM4->TRANSITION_MATCH_FROM_LONG_GAP_X);
+    vectorKernelTransitions_add(upperTransitions, match, shortGapY, eY, sM4->TRANSITION_GAP_SHORT_OPEN_Y);
+    vectorKernelTransitions_add(upperTransitions, shortGapY, shortGapY, eY, sM4->TRANSITION_GAP_SHORT_EXTEND_Y);
+
+    if (!emissionCache_get(dpDiagonal, eX, 3 * width)) {
+        memset(eX, 0, sizeof(double) * 3 * width);
+        Diagonal diagonal = dpDiagonal->diagonal;
+        int64_t xay = diagonal_getXay(diagonal);
+        int64_t i = 0;
+        for (int64_t xmy = diagonal_getMinXmy(diagonal); xmy <= diagonal_getMaxXmy(diagonal); xmy += 2, i++) {
+            void *cX = sX->get(sX->elements, getXposition(sX, xay, xmy) - 1);
+            void *cY = sY->get(sY->elements, getYposition(sY, xay, xmy) - 1);
+            DpCell *current, *lower, *middle, *upper;
+            kernel_getCells(dpDiagonal, dpDiagonalM1, dpDiagonalM2, xmy, &current, &lower, &middle, &upper);
+            if (lower != NULL) {
+                eX[i] = sM4->getXGapProbFcn(sM4->model.EMISSION_GAP_X_PROBS, cX);
+            }
+            if (middle != NULL) {
+                eM[i] = sM4->getMatchProbFcn(sM4->model.EMISSION_MATCH_PROBS, cX, cY);
+            }
+            if (upper != NULL) {
+                eY[i] = sM4->getYGapProbFcn(sM4->model.EMISSION_GAP_Y_PROBS, cX, cY);
+            }
+        }
+        emissionCache_put(dpDiagonal, dpDiagonalM1, dpDiagonalM2, eX, 3 * width);
+    }
+    *cellValueNumber = 3;
+    return eX;
+}
+
+void diagonalKernel_stateMachine4(StateMachine *sM, DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                  DpDiagonal *dpDiagonalM2, Sequence *sX, Sequence *sY, bool forward) {
+    if (vectorKernel_use(dpDiagonal)) {
+        vectorKernel_run(stateMachine4_vectorKernelSetup, sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2,
+                         sX, sY, forward);
+    } else if (forward) {
+        stateMachine4_diagonalKernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, 1);
+    } else {
+        stateMachine4_diagonalKernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, 0);
+    }
+}
+
+static inline void stateMachine3_diagonalKernel(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                                DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                                Sequence *sX, Sequence *sY, bool forward) {
+    StateMachine3 *sM3 = (StateMachine3 *) sM;
+    double (*getXGapProb)(const double *, void *) = sM3->getXGapProbFcn;
+    double (*getYGapProb)(const double *, void *, void *) = sM3->getYGapProbFcn;
+    double (*getMatchProb)(const double *, void *, void *) = sM3->getMatchProbFcn;
+    const double *gapXProbs = sM3->model.EMISSION_GAP_X_PROBS;
+    const double *gapYProbs = sM3->model.EMISSION_GAP_Y_PROBS;
+    const double *matchProbs = sM3->model.EMISSION_MATCH_PROBS;
+    double tOpenX = sM3->TRANSITION_GAP_OPEN_X, tExtendX = sM3->TRANSITION_GAP_EXTEND_X;
+    double tSwitchToX = sM3->TRANSITION_GAP_SWITCH_TO_X;
+    double tMatchContinue = sM3->TRANSITION_MATCH_CONTINUE;
+    double tMatchFromX = sM3->TRANSITION_MATCH_FROM_GAP_X, tMatchFromY = sM3->TRANSITION_MATCH_FROM_GAP_Y;
+    double tOpenY = sM3->TRANSITION_GAP_OPEN_Y, tExtendY = sM3->TRANSITION_GAP_EXTEND_Y;
+
+    Diagonal diagonal = dpDiagonal->diagonal;
+    int64_t xay = diagonal_getXay(diagonal);
+    for (int64_t xmy = diagonal_getMinXmy(diagonal); xmy <= diagonal_getMaxXmy(diagonal); xmy += 2) {
+        void *cX = sX->get(sX->elements, getXposition(sX, xay, xmy) - 1);
+        void *cY = sY->get(sY->elements, getYposition(sY, xay, xmy) - 1);
+        DpCell *current, *lower, *middle, *upper;
+        kernel_getCells(dpDiagonal, dpDiagonalM1, dpDiagonalM2, xmy, &current, &lower, &middle, &upper);
+        if (lower != NULL) {
+            double eP = getXGapProb(gapXProbs, cX);
+            kernel_doTransition(lower, current, match, shortGapX, eP, tOpenX, forward);
+            kernel_doTransition(lower, current, shortGapX, shortGapX, eP, tExtendX, forward);
+            kernel_doTransition(lower, current, shortGapY, shortGapX, eP, tSwitchToX, forward);
+        }
+        if (middle != NULL) {
+            double eP = getMatchProb(matchProbs, cX, cY);
+            kernel_doTransition(middle, current, match, match, eP, tMatchContinue, forward);
+            kernel_doTransition(middle, current, shortGapX, match, eP, tMatchFromX, forward);
+            kernel_doTransition(middle, current, shortGapY, match, eP, tMatchFromY, forward);
+        }
+        if (upper != NULL) {
+            double eP = getYGapProb(gapYProbs, cX, cY);
+            kernel_doTransition(upper, current, match, shortGapY, eP, tOpenY, forward);
+            kernel_doTransition(upper, current, shortGapY, shortGapY, eP, tExtendY, forward);
+        }
+    }
+}
+
+static double *stateMachine3_vectorKernelSetup(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                               DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                               Sequence *sX, Sequence *sY, VectorKernelTransitions *lowerTransitions,
+                                               VectorKernelTransitions *middleTransitions,
+                                               VectorKernelTransitions *upperTransitions, int64_t *cellValueNumber) {
+    StateMachine3 *sM3 = (StateMachine3 *) sM;
+    int64_t width = diagonal_getWidth(dpDiagonal->diagonal);
+    double *eX = dpDiagonal_getScratch(dpDiagonal, 0, 3 * width);
+    double *eM = eX + width, *eY = eM + width;
+    vectorKernelTransitions_add(lowerTransitions, match, shortGapX, eX, sM3->TRANSITION_GAP_OPEN_X);
+    vectorKernelTransitions_add(lowerTransitions, shortGapX, shortGapX, eX, sM3->TRANSITION_GAP_EXTEND_X);
+    vectorKernelTransitions_add(lowerTransitions, shortGapY, shortGapX, eX, sM3->TRANSITION_GAP_SWITCH_TO_X);
+    vectorKernelTransitions_add(middleTransitions, match, match, eM, sM3->TRANSITION_MATCH_CONTINUE);
+    vectorKernelTransitions_add(middleTransitions, shortGapX, match, eM, sM3->TRANSITION_MATCH_FROM_GAP_X);
+    vectorKernelTransitions_add(middleTransitions, shortGapY, match, eM, sM3->TRANSITION_MATCH_FROM_GAP_Y);
+    vectorKernelTransitions_add(upperTransitions, match, shortGapY, eY, sM3->TRANSITION_GAP_OPEN_Y);
+    vectorKernelTransitions_add(upperTransitions, shortGapY, shortGapY, eY, sM3->TRANSITION_GAP_EXTEND_Y);
+
+    if (!emissionCache_get(dpDiagonal, eX, 3 * width)) {
+        memset(eX, 0, sizeof(double) * 3 * width);
+        Diagonal diagonal = dpDiagonal->diagonal;
+        int64_t xay = diagonal_getXay(diagonal);
+        int64_t i = 0;
+        for (int64_t xmy = diagonal_getMinXmy(diagonal); xmy <= diagonal_getMaxXmy(diagonal); xmy += 2, i++) {
+            void *cX = sX->get(sX->elements, getXposition(sX, xay, xmy) - 1);
+            void *cY = sY->get(sY->elements, getYposition(sY, xay, xmy) - 1);
+            DpCell *current, *lower, *middle, *upper;
+            kernel_getCells(dpDiagonal, dpDiagonalM1, dpDiagonalM2, xmy, &current, &lower, &middle, &upper);
+            if (lower != NULL) {
+                eX[i] = sM3->getXGapProbFcn(sM3->model.EMISSION_GAP_X_PROBS, cX);
+            }
+            if (middle != NULL) {
+                eM[i] = sM3->getMatchProbFcn(sM3->model.EMISSION_MATCH_PROBS, cX, cY);
+            }
+            if (upper != NULL) {
+                eY[i] = sM3->getYGapProbFcn(sM3->model.EMISSION_GAP_Y_PROBS, cX, cY);
+            }
+        }
+        emissionCache_put(dpDiagonal, dpDiagonalM1, dpDiagonalM2, eX, 3 * width);
+    }
+    *cellValueNumber = 3;
+    return eX;
+}
+
+void diagonalKernel_stateMachine3(StateMachine *sM, DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                  DpDiagonal *dpDiagonalM2, Sequence *sX, Sequence *sY, bool forward) {
+    if (vectorKernel_use(dpDiagonal)) {
+        vectorKernel_run(stateMachine3_vectorKernelSetup, sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2,
+                         sX, sY, forward);
+    } else if (forward) {
+        stateMachine3_diagonalKernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, 1);
+    } else {
+        stateMachine3_diagonalKernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, 0);
+    }
+}
+
+static inline void stateMachine3Hdp_diagonalKernel(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                                   DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                                   Sequence *sX, Sequence *sY, bool forward) {
+    StateMachine3_HDP *sM3 = (StateMachine3_HDP *) sM;
+    double (*getXGapProb)(const double *, void *) = sM3->getXGapProbFcn;
+    double (*getYGapProb)(NanoporeHDP *, void *, void *) = sM3->getYGapProbFcn;
+    double (*getMatchProb)(NanoporeHDP *, void *, void *) = sM3->getMatchProbFcn;
+    const double *gapXProbs = sM3->model.EMISSION_GAP_X_PROBS;
+    NanoporeHDP *hdp = sM3->hdpModel;
+    double tOpenX = sM3->TRANSITION_GAP_OPEN_X, tExtendX = sM3->TRANSITION_GAP_EXTEND_X;
+    double tSwitchToX = sM3->TRANSITION_GAP_SWITCH_TO_X;
+    double tMatchContinue = sM3->TRANSITION_MATCH_CONTINUE;
+    double tMatchFromX = sM3->TRANSITION_MATCH_FROM_GAP_X, tMatchFromY = sM3->TRANSITION_MATCH_FROM_GAP_Y;
+    double tOpenY = sM3->TRANSITION_GAP_OPEN_Y, tExtendY = sM3->TRANSITION_GAP_EXTEND_Y;
+
+    Diagonal diagonal = dpDiagonal->diagonal;
+    int64_t xay = diagonal_getXay(diagonal);
+    for (int64_t xmy = diagonal_getMinXmy(diagonal); xmy <= diagonal_getMaxXmy(diagonal); xmy += 2) {
+        void *cX = sX->get(sX->elements, getXposition(sX, xay, xmy) - 1);
+        void *cY = sY->get(sY->elements, getYposition(sY, xay, xmy) - 1);
+        DpCell *current, *lower, *middle, *upper;
+        kernel_getCells(dpDiagonal, dpDiagonalM1, dpDiagonalM2, xmy, &current, &lower, &middle, &upper);
+        if (lower != NULL) {
+            double eP = getXGapProb(gapXProbs, cX);
+            kernel_doTransition(lower, current, match, shortGapX, eP, tOpenX, forward);
+            kernel_doTransition(lower, current, shortGapX, shortGapX, eP, tExtendX, forward);
+            kernel_doTransition(lower, current, shortGapY, shortGapX, eP, tSwitchToX, forward);
+        }
+        if (middle != NULL) {
+            double eP = getMatchProb(hdp, cX, cY);
+            kernel_doTransition(middle, current, match, match, eP, tMatchContinue, forward);
+            kernel_doTransition(middle, current, shortGapX, match, eP, tMatchFromX, forward);
+            kernel_doTransition(middle, current, shortGapY, match, eP, tMatchFromY, forward);
+        }
+        if (upper != NULL) {
+            double eP = getYGapProb(hdp, cX, cY);
+            kernel_doTransition(upper, current, match, shortGapY, eP, tOpenY, forward);
+            kernel_doTransition(upper, current, shortGapY, shortGapY, eP, tExtendY, forward);
+        }
+    }
+}
+
+static double *stateMachine3Hdp_vectorKernelSetup(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                                  DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                                  Sequence *sX, Sequence *sY, VectorKernelTransitions *lowerTransitions,
+                                                  VectorKernelTransitions *middleTransitions,
+                                                  VectorKernelTransitions *upperTransitions, int64_t *cellValueNumber) {
+    StateMachine3_HDP *sM3 = (StateMachine3_HDP *) sM;
+    int64_t width = diagonal_getWidth(dpDiagonal->diagonal);
+    double *eX = dpDiagonal_getScratch(dpDiagonal, 0, 3 * width);
+    double *eM = eX + width, *eY = eM + width;
+    vectorKernelTransitions_add(lowerTransitions, match, shortGapX, eX, sM3->TRANSITION_GAP_OPEN_X);
+    vectorKernelTransitions_add(lowerTransitions, shortGapX, shortGapX, eX, sM3->TRANSITION_GAP_EXTEND_X);
+    vectorKernelTransitions_add(lowerTransitions, shortGapY, shortGapX, eX, sM3->TRANSITION_GAP_SWITCH_TO_X);
+    vectorKernelTransitions_add(middleTransitions, match, match, eM, sM3->TRANSITION_MATCH_CONTINUE);
+    vectorKernelTransitions_add(middleTransitions, shortGapX, match, eM, sM3->TRANSITION_MATCH_FROM_GAP_X);
+    vectorKernelTransitions_add(middleTransitions, shortGapY, match, eM, sM3->TRANSITION_MATCH_FROM_GAP_Y);
+    vectorKernelTransitions_add(upperTransitions, match, shortGapY, eY, sM3->TRANSITION_GAP_OPEN_Y);
+    vectorKernelTransitions_add(upperTransitions, shortGapY, shortGapY, eY, sM3->TRANSITION_GAP_EXTEND_Y);
+
+    if (!emissionCache_get(dpDiagonal, eX, 3 * width)) {
+        memset(eX, 0, sizeof(double) * 3 * width);
+        Diagonal diagonal = dpDiagonal->diagonal;
+        int64_t xay = diagonal_getXay(diagonal);
+        int64_t i = 0;
+        for (int64_t xmy = diagonal_getMinXmy(diagonal); xmy <= diagonal_getMaxXmy(diagonal); xmy += 2, i++) {
+            void *cX = sX->get(sX->elements, getXposition(sX, xay, xmy) - 1);
+            void *cY = sY->get(sY->elements, getYposition(sY, xay, xmy) - 1);
+            DpCell *current, *lower, *middle, *upper;
+            kernel_getCells(dpDiagonal, dpDiagonalM1, dpDiagonalM2, xmy, &current, &lower, &middle, &upper);
+            if (lower != NULL) {
+                eX[i] = sM3->getXGapProbFcn(sM3->model.EMISSION_GAP_X_PROBS, cX);
+            }
+            if (middle != NULL) {
+                eM[i] = sM3->getMatchProbFcn(sM3->hdpModel, cX, cY);
+            }
+            if (upper != NULL) {
+                eY[i] = sM3->getYGapProbFcn(sM3->hdpModel, cX, cY);
+            }
+        }
+        emissionCache_put(dpDiagonal, dpDiagonalM1, dpDiagonalM2, eX, 3 * width);
+    }
+    *cellValueNumber = 3;
+    return eX;
+}
+
+void diagonalKernel_stateMachine3Hdp(StateMachine *sM, DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                     DpDiagonal *dpDiagonalM2, Sequence *sX, Sequence *sY, bool forward) {
+    if (vectorKernel_use(dpDiagonal)) {
+        vectorKernel_run(stateMachine3Hdp_vectorKernelSetup, sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2,
+                         sX, sY, forward);
+    } else if (forward) {
+        stateMachine3Hdp_diagonalKernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, 1);
+    } else {
+        stateMachine3Hdp_diagonalKernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, 0);
+    }
+}
+
+static inline void stateMachine3Vanilla_diagonalKernel(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                                       DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                                       Sequence *sX, Sequence *sY, bool forward) {
+    StateMachine3Vanilla *sM3v = (StateMachine3Vanilla *) sM;
+    KmerSkipTable *kmerSkipTable = sM3v->kmerSkipTable;
+    double (*getScaledMatchProb)(const double *, void *, void *) = sM3v->getScaledMatchProbFcn;
+    double (*getMatchProb)(const double *, void *, void *) = sM3v->getMatchProbFcn;
+    const double *gapYProbs = sM3v->model.EMISSION_GAP_Y_PROBS;
+    const double *matchProbs = sM3v->model.EMISSION_MATCH_PROBS;
+    // the transitions out of Y don't depend on the kmer
+    double a_yy = sM3v->TRANSITION_E_TO_E;
+    double a_ym = 1.0f - a_yy;
+    double la_yy = log(a_yy), la_ym = log(a_ym);
+    KmerSkipTransitions scratch;
+
+    Diagonal diagonal = dpDiagonal->diagonal;
+    int64_t xay = diagonal_getXay(diagonal);
+    for (int64_t xmy = diagonal_getMinXmy(diagonal); xmy <= diagonal_getMaxXmy(diagonal); xmy += 2) {
+        void *cX = sX->get(sX->elements, getXposition(sX, xay, xmy) - 1);
+        void *cY = sY->get(sY->elements, getYposition(sY, xay, xmy) - 1);
+        DpCell *current, *lower, *middle, *upper;
+        kernel_getCells(dpDiagonal, dpDiagonalM1, dpDiagonalM2, xmy, &current, &lower, &middle, &upper);
+
+        // transitions out of match and X depend on the kmer (see stateMachine3Vanilla_cellCalculate)
+        const KmerSkipTransitions *t = stateMachine_getKmerSkipTransitions(sM, kmerSkipTable, cX, &scratch);
+
+        if (lower != NULL) {
+            kernel_doTransition(lower, current, match, shortGapX, 0, t->matchToSkip, forward);
+            kernel_doTransition(lower, current, shortGapX, shortGapX, 0, t->skipToSkip, forward);
+        }
+        if (middle != NULL) {
+            double eP = getMatchProb(matchProbs, cX, cY);
+            kernel_doTransition(middle, current, match, match, eP, t->matchToMatch, forward);
+            kernel_doTransition(middle, current, shortGapX, match, eP, t->skipToMatch, forward);
+            kernel_doTransition(middle, current, shortGapY, match, eP, la_ym, forward);
+        }
+        if (upper != NULL) {
+            double eP = getScaledMatchProb(gapYProbs, cX, cY);
+            kernel_doTransition(upper, current, match, shortGapY, eP, t->matchToExtra, forward);
+            kernel_doTransition(upper, current, shortGapY, shortGapY, eP, la_yy, forward);
+        }
+    }
+}
+
+static double *stateMachine3Vanilla_vectorKernelSetup(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                                      DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                                      Sequence *sX, Sequence *sY,
+                                                      VectorKernelTransitions *lowerTransitions,
+                                                      VectorKernelTransitions *middleTransitions,
+                                                      VectorKernelTransitions *upperTransitions,
+                                                      int64_t *cellValueNumber) {
+    StateMachine3Vanilla *sM3v = (StateMachine3Vanilla *) sM;
+    int64_t width = diagonal_getWidth(dpDiagonal->diagonal);
+    // the emissions, which are cached, then the transitions out of match and X, which depend on the kmer
+    double *eM = dpDiagonal_getScratch(dpDiagonal, 0, 7 * width);
+    double *eY = eM + width;
+    double *matchToSkip = eY + width, *skipToSkip = matchToSkip + width, *matchToMatch = skipToSkip + width;
+    double *skipToMatch = matchToMatch + width, *matchToExtra = skipToMatch + width;
+    double a_yy = sM3v->TRANSITION_E_TO_E;
+    double a_ym = 1.0f - a_yy;
+    vectorKernelTransitions_addPerCell(lowerTransitions, match, shortGapX, NULL, matchToSkip);
+    vectorKernelTransitions_addPerCell(lowerTransitions, shortGapX, shortGapX, NULL, skipToSkip);
+    vectorKernelTransitions_addPerCell(middleTransitions, match, match, eM, matchToMatch);
+    vectorKernelTransitions_addPerCell(middleTransitions, shortGapX, match, eM, skipToMatch);
+    vectorKernelTransitions_add(middleTransitions, shortGapY, match, eM, log(a_ym));
+    vectorKernelTransitions_addPerCell(upperTransitions, match, shortGapY, eY, matchToExtra);
+    vectorKernelTransitions_add(upperTransitions, shortGapY, shortGapY, eY, log(a_yy));
+
+    bool cached = emissionCache_get(dpDiagonal, eM, 2 * width);
+    if (!cached) {
+        memset(eM, 0, sizeof(double) * 2 * width);
+    }
+    KmerSkipTransitions scratch;
+    Diagonal diagonal = dpDiagonal->diagonal;
+    int64_t xay = diagonal_getXay(diagonal);
+    int64_t i = 0;
+    for (int64_t xmy = diagonal_getMinXmy(diagonal); xmy <= diagonal_getMaxXmy(diagonal); xmy += 2, i++) {
+        void *cX = sX->get(sX->elements, getXposition(sX, xay, xmy) - 1);
+        void *cY = sY->get(sY->elements, getYposition(sY, xay, xmy) - 1);
+        const KmerSkipTransitions *t = stateMachine_getKmerSkipTransitions(sM, sM3v->kmerSkipTable, cX, &scratch);
+        matchToSkip[i] = t->matchToSkip;
+        skipToSkip[i] = t->skipToSkip;
+        matchToMatch[i] = t->matchToMatch;
+        skipToMatch[i] = t->skipToMatch;
+        matchToExtra[i] = t->matchToExtra;
+        if (cached) {
+            continue;
+        }
+        DpCell *current, *lower, *middle, *upper;
+        kernel_getCells(dpDiagonal, dpDiagonalM1, dpDiagonalM2, xmy, &current, &lower, &middle, &upper);
+        if (middle != NULL) {
+            eM[i] = sM3v->getMatchProbFcn(sM3v->model.EMISSION_MATCH_PROBS, cX, cY);
+        }
+        if (upper != NULL) {
+            eY[i] = sM3v->getScaledMatchProbFcn(sM3v->model.EMISSION_GAP_Y_PROBS, cX, cY);
+        }
+    }
+    if (!cached) {
+        emissionCache_put(dpDiagonal, dpDiagonalM1, dpDiagonalM2, eM, 2 * width);
+    }
+    *cellValueNumber = 7;
+    return eM;
+}
+
+void diagonalKernel_stateMachine3Vanilla(StateMachine *sM, DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                         DpDiagonal *dpDiagonalM2, Sequence *sX, Sequence *sY, bool forward) {
+    if (vectorKernel_use(dpDiagonal)) {
+        vectorKernel_run(stateMachine3Vanilla_vectorKernelSetup, sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2,
+                         sX, sY, forward);
+    } else if (forward) {
+        stateMachine3Vanilla_diagonalKernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, 1);
+    } else {
+        stateMachine3Vanilla_diagonalKernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, 0);
+    }
+}
+
+static inline void stateMachineEchelon_diagonalKernel(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                                      DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                                      Sequence *sX, Sequence *sY, bool forward,
+                                                      int64_t minXmy, int64_t maxXmy,
+                                                      bool firstCellLower, bool otherTransitions) {
+    StateMachineEchelon *sMe = (StateMachineEchelon *) sM;
+    KmerSkipTable *kmerSkipTable = sMe->kmerSkipTable;
+    KmerSkipTransitions scratch;
+    double (*getScaledMatchProb)(const double *, void *, void *) = sMe->getScaledMatchProbFcn;
+    const double *gapYProbs = sMe->model.EMISSION_GAP_Y_PROBS;
+
+    int64_t xay = diagonal_getXay(dpDiagonal->diagonal);
+    for (int64_t xmy = minXmy; xmy <= maxXmy; xmy += 2) {
+        void *cX = sX->get(sX->elements, getXposition(sX, xay, xmy) - 1);
+        void *cY = sY->get(sY->elements, getYposition(sY, xay, xmy) - 1);
+        DpCell *current, *lower, *middle, *upper;
+        kernel_getCells(dpDiagonal, dpDiagonalM1, dpDiagonalM2, xmy, &current, &lower, &middle, &upper);
+
+        // transitions, as in stateMachineEchelon_cellCalculate
+        const KmerSkipTransitions *t = stateMachine_getKmerSkipTransitions(sM, kmerSkipTable, cX, &scratch);
+        double la_mx = t->matchToSkip; // beta
+        double la_mh = t->matchToMatch; // 1 - beta
+        double la_xx = t->skipToSkip; // alpha
+        double la_xh = t->skipToMatch; // 1 - alpha
+
+        if (lower != NULL && (xmy == minXmy ? firstCellLower : otherTransitions)) {
+            for (int64_t n = 1; n < 6; n++) {
+                kernel_doTransition(lower, current, n, gapX, 0, la_mx, forward);
+            }
+            kernel_doTransition(lower, current, gapX, gapX, 0, la_xx, forward);
+        }
+        if (!otherTransitions || (middle == NULL && upper == NULL)) {
+            continue;
+        }
+        // the match emission and duration prob for a run of n kmers are the same for every from state
+        double eP[6], durationProb[ECHELON_DURATION_PROBS];
+        stateMachineEchelon_getCellEmissions(sM, cX, cY, middle != NULL ? eP : NULL, durationProb);
+        if (middle != NULL) {
+            for (int64_t n = 1; n < 6; n++) {
+                double tP = la_mh + durationProb[n];
+                for (int64_t from = 0; from < 6; from++) {
+                    kernel_doTransition(middle, current, from, n, eP[n], tP, forward);
+                }
+            }
+            for (int64_t n = 1; n < 6; n++) {
+                kernel_doTransition(middle, current, gapX, n, eP[n], (la_xh + durationProb[n]), forward);
+            }
+        }
+        if (upper != NULL) {
+            double eP0 = getScaledMatchProb(gapYProbs, cX, cY);
+            double tP = la_mh + durationProb[0];
+            for (int64_t n = 1; n < 6; n++) {
+                kernel_doTransition(upper, current, n, match0, eP0, tP, forward);
+            }
+        }
+    }
+}
+
+static void stateMachineEchelon_forwardCells(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                             DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                             Sequence *sX, Sequence *sY, int64_t minXmy, int64_t maxXmy,
+                                             bool firstCellLower, bool otherTransitions) {
+    stateMachineEchelon_diagonalKernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, 1, minXmy, maxXmy,
+                                       firstCellLower, otherTransitions);
+}
+
+static void stateMachineEchelon_backwardCells(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                              DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                              Sequence *sX, Sequence *sY, int64_t minXmy, int64_t maxXmy,
+                                              bool firstCellLower, bool otherTransitions) {
+    stateMachineEchelon_diagonalKernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, 0, minXmy, maxXmy,
+                                       firstCellLower, otherTransitions);
+}
+
+typedef struct _echelonCellValues {
+    StateMachine *sM;
+    DpDiagonal *dpDiagonal, *dpDiagonalM1, *dpDiagonalM2;
+    Sequence *sX, *sY;
+    double *cellValues;
+    bool cached; //the emissions are there already
+} EchelonCellValues;
+
+//Fills in the per cell values of cells start to end - 1 (see stateMachineEchelon_vectorKernelSetup)
+static void stateMachineEchelon_fillCellValues(EchelonCellValues *v, int64_t start, int64_t end) {
+    StateMachineEchelon *sMe = (StateMachineEchelon *) v->sM;
+    int64_t width = diagonal_getWidth(v->dpDiagonal->diagonal);
+    double *eP0 = v->cellValues + 5 * width;
+    double *la_mx = eP0 + width, *la_xx = la_mx + width;
+    double *matchDurations = la_xx + width, *skipDurations = matchDurations + 5 * width;
+    double *extraDurations = skipDurations + 5 * width;
+    KmerSkipTransitions scratch;
+    int64_t xay = diagonal_getXay(v->dpDiagonal->diagonal);
+    for (int64_t i = start; i < end; i++) {
+        int64_t xmy = diagonal_getMinXmy(v->dpDiagonal->diagonal) + 2 * i;
+        void *cX = v->sX->get(v->sX->elements, getXposition(v->sX, xay, xmy) - 1);
+        void *cY = v->sY->get(v->sY->elements, getYposition(v->sY, xay, xmy) - 1);
+        DpCell *current, *lower, *middle, *upper;
+        kernel_getCells(v->dpDiagonal, v->dpDiagonalM1, v->dpDiagonalM2, xmy, &current, &lower, &middle, &upper);
+        const KmerSkipTransitions *t = stateMachine_getKmerSkipTransitions(v->sM, sMe->kmerSkipTable, cX, &scratch);
+        la_mx[i] = t->matchToSkip;
+        la_xx[i] = t->skipToSkip;
+        double eP[6], durationProb[ECHELON_DURATION_PROBS] = { 0 };
+        if (middle != NULL || upper != NULL) {
+            stateMachineEchelon_getCellEmissions(v->sM, cX, cY, middle != NULL && !v->cached ? eP : NULL,
+                                                 durationProb);
+        }
+        for (int64_t n = 1; n < 6; n++) {
+            matchDurations[(n - 1) * width + i] = t->matchToMatch + durationProb[n];
+            skipDurations[(n - 1) * width + i] = t->skipToMatch + durationProb[n];
+            if (!v->cached) {
+                v->cellValues[(n - 1) * width + i] = middle != NULL ? eP[n] : 0.0;
+            }
+        }
+        extraDurations[i] = t->matchToMatch + durationProb[0];
+        if (!v->cached) {
+            eP0[i] = upper != NULL ? sMe->getScaledMatchProbFcn(sMe->model.EMISSION_GAP_Y_PROBS, cX, cY) : 0.0;
+        }
+    }
+}
+
+static void stateMachineEchelon_fillCellValuesChunk(void *arg, int64_t thread, int64_t threadNumber) {
+    EchelonCellValues *v = arg;
+    int64_t width = diagonal_getWidth(v->dpDiagonal->diagonal);
+    stateMachineEchelon_fillCellValues(v, width * thread / threadNumber, width * (thread + 1) / threadNumber);
+}
+
+//The per cell values are the match emissions of runs of 1 to 5 kmers and the extra event emission, which are
+//cached, then the transitions to X and the transitions to the match states with their duration probs, all of
+//which depend on the cell. Wide diagonals have their cells filled in by the threads of the pool's thread group.
+static double *stateMachineEchelon_vectorKernelSetup(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                                     DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                                     Sequence *sX, Sequence *sY,
+                                                     VectorKernelTransitions *lowerTransitions,
+                                                     VectorKernelTransitions *middleTransitions,
+                                                     VectorKernelTransitions *upperTransitions,
+                                                     int64_t *cellValueNumber) {
+    int64_t width = diagonal_getWidth(dpDiagonal->diagonal);
+    double *cellValues = dpDiagonal_getScratch(dpDiagonal, 0, 19 * width);
+    double *eP0 = cellValues + 5 * width;
+    double *la_mx = eP0 + width, *la_xx = la_mx + width;
+    double *matchDurations = la_xx + width, *skipDurations = matchDurations + 5 * width;
+    double *extraDurations = skipDurations + 5 * width;
+    for (int64_t n = 1; n < 6; n++) {
+        vectorKernelTransitions_addPerCell(lowerTransitions, n, gapX, NULL, la_mx);
+    }
+    vectorKernelTransitions_addPerCell(lowerTransitions, gapX, gapX, NULL, la_xx);
+    for (int64_t n = 1; n < 6; n++) {
+        for (int64_t from = 0; from < 6; from++) {
+            vectorKernelTransitions_addPerCell(middleTransitions, from, n, cellValues + (n - 1) * width,
+                                               matchDurations + (n - 1) * width);
+        }
+    }
+    for (int64_t n = 1; n < 6; n++) {
+        vectorKernelTransitions_addPerCell(middleTransitions, gapX, n, cellValues + (n - 1) * width,
+                                           skipDurations + (n - 1) * width);
+    }
+    for (int64_t n = 1; n < 6; n++) {
+        vectorKernelTransitions_addPerCell(upperTransitions, n, match0, eP0, extraDurations);
+    }
+
+    EchelonCellValues v = { sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, cellValues,
+                            emissionCache_get(dpDiagonal, cellValues, 6 * width) };
+    DpDiagonalPool *pool = dpDiagonal->pool;
+    if (pool != NULL && pool->threadGroup != NULL && width >= pool->minThreadedWidth) {
+        threadGroup_run(pool->threadGroup, stateMachineEchelon_fillCellValuesChunk, &v);
+    } else {
+        stateMachineEchelon_fillCellValues(&v, 0, width);
+    }
+    if (!v.cached) {
+        emissionCache_put(dpDiagonal, dpDiagonalM1, dpDiagonalM2, cellValues, 6 * width);
+    }
+    *cellValueNumber = 19;
+    return cellValues;
+}
+
+//Log diagonals wide enough to split have their cells split between the pool's threads, which beats the vector
+//kernel on one thread. Scaled diagonals always take the vector kernel, which only fills in the emissions with the
+//threads.
+void diagonalKernel_stateMachineEchelon(StateMachine *sM, DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                        DpDiagonal *dpDiagonalM2, Sequence *sX, Sequence *sY, bool forward) {
+    CellRangeKernel kernel = forward ? stateMachineEchelon_forwardCells : stateMachineEchelon_backwardCells;
+    if (!dpDiagonal->scalable
+        && threadedDiagonal_calculate(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, forward, kernel)) {
+        return;
+    }
+    if (vectorKernel_use(dpDiagonal)) {
+        vectorKernel_run(stateMachineEchelon_vectorKernelSetup, sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2,
+                         sX, sY, forward);
+        return;
+    }
+    kernel(sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY,
+           diagonal_getMinXmy(dpDiagonal->diagonal), diagonal_getMaxXmy(dpDiagonal->diagonal), 1, 1);
+}
+
+//The setup of the vector kernel of the machine's diagonal kernel, NULL if it doesn't have one
+static VectorKernelSetup vectorKernel_getSetup(StateMachine *sM) {
+    if (sM->diagonalCalculate == diagonalKernel_stateMachine5) {
+        return stateMachine5_vectorKernelSetup;
+    }
+    if (sM->diagonalCalculate == diagonalKernel_stateMachine4) {
+        return stateMachine4_vectorKernelSetup;
+    }
+    if (sM->diagonalCalculate == diagonalKernel_stateMachine3) {
+        return stateMachine3_vectorKernelSetup;
+    }
+    if (sM->diagonalCalculate == diagonalKernel_stateMachine3Hdp) {
+        return stateMachine3Hdp_vectorKernelSetup;
+    }
+    if (sM->diagonalCalculate == diagonalKernel_stateMachine3Vanilla) {
+        return stateMachine3Vanilla_vectorKernelSetup;
+    }
+    if (sM->diagonalCalculate == diagonalKernel_stateMachineEchelon) {
+        return stateMachineEchelon_vectorKernelSetup;
+    }
+    return NULL;
+}
+
+//Does the expectation updates of the cells of a diagonal with the emissions its kernel lays out, which come from the
+//emission cache when it has them, returning false if the machine has no vector kernel
+static bool diagonalKernel_updateExpectations(StateMachine *sM, DpDiagonal *dpDiagonal,
+                                              DpDiagonal *dpDiagonalM1, DpDiagonal *dpDiagonalM2,
+                                              Sequence *sX, Sequence *sY,
+                                              void (*doTransition)(DpCell *, DpCell *, int64_t, int64_t,
+                                                                   double, double, void *),
+                                              void *extraArgs) {
+    VectorKernelSetup setup = vectorKernel_getSetup(sM);
+    if (setup == NULL) {
+        return 0;
+    }
+    vectorKernel_updateExpectations(setup, sM, dpDiagonal, dpDiagonalM1, dpDiagonalM2, sX, sY, doTransition,
+                                    extraArgs);
+    return 1;
+}
+
+bool diagonalCalculation_supportsScaling(StateMachine *sM) {
+    //The emissions of the signal machines can have the cells of a diagonal span far more than the range of a
+    //double, but their vector kernels fall back to log probabilities for those diagonals. Float cells have too
+    //little range for any of them.
+#ifdef DP_FLOAT_CELLS
+    return 0;
+#else
+    return sM->diagonalCalculate == diagonalKernel_stateMachine5
+           || sM->diagonalCalculate == diagonalKernel_stateMachine3Vanilla
+           || sM->diagonalCalculate == diagonalKernel_stateMachineEchelon;
+#endif
+}
+
+static void diagonalCalculationForwardWithKernel(StateMachine *sM, int64_t xay, DpMatrix *dpMatrix,
+                                                 Sequence* sX, Sequence* sY) {
+    DpDiagonal *dpDiagonal = dpMatrix_getDiagonal(dpMatrix, xay);
+    DpDiagonal *dpDiagonalM1 = dpMatrix_getDiagonal(dpMatrix, xay - 1);
+    DpDiagonal *dpDiagonalM2 = dpMatrix_getDiagonal(dpMatrix, xay - 2);
+    DpDiagonal *framedDiagonalM2 = dpDiagonal_enterLogFrame(dpDiagonal, dpDiagonalM1, dpDiagonalM2, 1);
+    sM->diagonalCalculate(sM, dpDiagonal, dpDiagonalM1, framedDiagonalM2, sX, sY, 1);
+    dpDiagonal_leaveLogFrame(dpDiagonal, dpDiagonalM1, dpDiagonalM2, framedDiagonalM2, 1);
+}
+
+static void diagonalCalculationBackwardWithKernel(StateMachine *sM, int64_t xay, DpMatrix *dpMatrix,
+                                                  Sequence* sX, Sequence* sY) {
+    DpDiagonal *dpDiagonal = dpMatrix_getDiagonal(dpMatrix, xay);
+    DpDiagonal *dpDiagonalM1 = dpMatrix_getDiagonal(dpMatrix, xay - 1);
+    DpDiagonal *dpDiagonalM2 = dpMatrix_getDiagonal(dpMatrix, xay - 2);
+    DpDiagonal *framedDiagonalM2 = dpDiagonal_enterLogFrame(dpDiagonal, dpDiagonalM1, dpDiagonalM2, 0);
+    sM->diagonalCalculate(sM, dpDiagonal, dpDiagonalM1, framedDiagonalM2, sX, sY, 0);
+    dpDiagonal_leaveLogFrame(dpDiagonal, dpDiagonalM1, dpDiagonalM2, framedDiagonalM2, 0);
+}
+
+DiagonalCalculationFn diagonalCalculation_getForwardFn(StateMachine *sM) {
+    return sM->diagonalCalculate != NULL ? diagonalCalculationForwardWithKernel : diagonalCalculationForward;
+}
+
+DiagonalCalculationFn diagonalCalculation_getBackwardFn(StateMachine *sM) {
+    return sM->diagonalCalculate != NULL ? diagonalCalculationBackwardWithKernel : diagonalCalculationBackward;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Banded alignment routine to calculate posterior match probs
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Thread group for the kernels to split wide diagonals of the forward and backward matrices across, or NULL if
+//p asks for one thread
+static ThreadGroup *getDiagonalThreadGroup(PairwiseAlignmentParameters *p,
+                                           DpMatrix *forwardDpMatrix, DpMatrix *backwardDpMatrix) {
+    if (p->diagonalThreadNumber <= 1) {
+        return NULL;
+    }
+    ThreadGroup *threadGroup = threadGroup_construct(p->diagonalThreadNumber);
+    dpMatrix_setThreadGroup(forwardDpMatrix, threadGroup, p->minThreadedDiagonalWidth);
+    dpMatrix_setThreadGroup(backwardDpMatrix, threadGroup, p->minThreadedDiagonalWidth);
+    return threadGroup;
+}
+
+//Emission cache shared by the forward and backward matrices, or NULL if p doesn't ask for one
+static EmissionCache *getEmissionCache(PairwiseAlignmentParameters *p, int64_t diagonalNumber,
+                                       DpMatrix *forwardDpMatrix, DpMatrix *backwardDpMatrix) {
+    if (p->emissionCacheMaxSize <= 0) {
+        return NULL;
+    }
+    EmissionCache *emissionCache = emissionCache_construct(diagonalNumber, p->emissionCacheMaxSize);
+    dpMatrix_setEmissionCache(forwardDpMatrix, emissionCache);
+    dpMatrix_setEmissionCache(backwardDpMatrix, emissionCache);
+    return emissionCache;
+}
+
+//The span, from *xmyL to *xmyR, of the cells of dpDiagonal whose most probable state is within xDrop log units of
+//the most probable state of the diagonal. The whole diagonal if it is all zero.
+static void dpDiagonal_getProbableCells(DpDiagonal *dpDiagonal, double xDrop, int64_t *xmyL, int64_t *xmyR) {
+    int64_t width = diagonal_getWidth(dpDiagonal->diagonal);
+    int64_t cellNumber = width * dpDiagonal->stateNumber;
+    double zero = dpDiagonal->scaled ? 0.0 : LOG_ZERO;
+    double maxProb = zero;
+    for (int64_t i = 0; i < cellNumber; i++) {
+        if (dpDiagonal->cells[i] > maxProb) {
+            maxProb = dpDiagonal->cells[i];
+        }
+    }
+    *xmyL = diagonal_getMinXmy(dpDiagonal->diagonal);
+    *xmyR = diagonal_getMaxXmy(dpDiagonal->diagonal);
+    if (maxProb <= zero) {
+        return;
+    }
+    double minProb = dpDiagonal->scaled ? maxProb * exp(-xDrop) : maxProb - xDrop;
+    int64_t i = 0, j = cellNumber - 1;
+    while (dpDiagonal->cells[i] < minProb) {
+        i++;
+    }
+    while (dpDiagonal->cells[j] < minProb) {
+        j--;
+    }
+    *xmyL += 2 * (i / dpDiagonal->stateNumber);
+    *xmyR -= 2 * (width - 1 - j / dpDiagonal->stateNumber);
+}
+
+/*
+ * The diagonal of an adaptive band following dpDiagonal, the last diagonal of the forward matrix: the probable
+ * cells of dpDiagonal (see dpDiagonal_getProbableCells) one step on, expanded by expansion either side and kept
+ * within bound, the next diagonal of the band the adaptive band is kept in. If the probable cells have left it, bound.
+ */
+static Diagonal getAdaptiveBandDiagonal(Diagonal bound, DpDiagonal *dpDiagonal, double xDrop, int64_t expansion) {
+    assert(expansion % 2 == 0);
+    assert(diagonal_getXay(bound) == diagonal_getXay(dpDiagonal->diagonal) + 1);
+    int64_t xmyL, xmyR;
+    dpDiagonal_getProbableCells(dpDiagonal, xDrop, &xmyL, &xmyR);
+    xmyL -= expansion + 1;
+    xmyR += expansion + 1;
+    if (xmyL < diagonal_getMinXmy(bound)) {
+        xmyL = diagonal_getMinXmy(bound);
+    }
+    if (xmyR > diagonal_getMaxXmy(bound)) {
+        xmyR = diagonal_getMaxXmy(bound);
+    }
+    return xmyL <= xmyR ? diagonal_construct(diagonal_getXay(bound), xmyL, xmyR) : bound;
+}
+
+/*
+ * Does the backward pass from diagonal, the last diagonal of the forward matrix, back to tracedBackTo, passing
+ * each diagonal from tracedBackTo + 1 to the one returned to diagonalPosteriorProbFn. If atEnd diagonal is the end of
+ * the matrix and is the one returned, otherwise the one returned is traceBackDiagonals + 1 before it, and the
+ * forward diagonals from it on are kept for the next traceback.
+ */
+static int64_t traceBackBand(StateMachine *sM, Diagonal diagonal, int64_t tracedBackTo,
+                             bool atEnd, bool raggedEnd,
+                             DpMatrix *forwardDpMatrix, DpMatrix *backwardDpMatrix,
+                             Sequence *sX, Sequence *sY, PairwiseAlignmentParameters *p,
+                             DiagonalCalculationFn diagonalCalculationBackwardFn, EmissionCache *emissionCache,
+                             void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *, DpMatrix *,
+                                                             Sequence*, Sequence*,
+                                                             double, PairwiseAlignmentParameters *, void *),
+                             void *extraArgs) {
+    //Initialise the last row (until now) of the backward matrix to represent an end point
+    dpDiagonal_initialiseValues(dpMatrix_createDiagonal(backwardDpMatrix, diagonal), sM,
+                                raggedEnd ? sM->raggedEndStateProb : sM->endStateProb);
+    //This is a diagonal between the place we trace back to and where we trace back from
+    if (diagonal_getXay(diagonal) > tracedBackTo + 1) {
+        DpDiagonal *j = dpMatrix_getDiagonal(forwardDpMatrix, diagonal_getXay(diagonal) - 1);
+        assert(j != NULL);
+        dpDiagonal_zeroValues(dpMatrix_createDiagonal(backwardDpMatrix, j->diagonal));
+    }
+
+    //Do walk back
+    int64_t xay2 = diagonal_getXay(diagonal);
+    int64_t tracedBackFrom = diagonal_getXay(diagonal) - (atEnd ? 0 : p->traceBackDiagonals + 1);
+    double totalProbability = LOG_ZERO;
+    int64_t totalPosteriorCalculationsThisTraceback = 0;
+    while (xay2 > tracedBackTo) {
+        //Create the earlier diagonal
+        if (xay2 > tracedBackTo + 2) {
+            DpDiagonal *j = dpMatrix_getDiagonal(forwardDpMatrix, xay2 - 2);
+            assert(j != NULL);
+            dpDiagonal_zeroValues(dpMatrix_createDiagonal(backwardDpMatrix, j->diagonal));
+        }
+        if (xay2 > tracedBackTo + 1) {
+            diagonalCalculationBackwardFn(sM, xay2, backwardDpMatrix, sX, sY);
+        }
+        if (xay2 <= tracedBackFrom) {
+            assert(dpMatrix_getDiagonal(forwardDpMatrix, xay2) != NULL);
+            assert(dpMatrix_getDiagonal(forwardDpMatrix, xay2-1) != NULL);
+            assert(dpMatrix_getDiagonal(backwardDpMatrix, xay2) != NULL);
+            if (xay2 != diagonal_getXay(diagonal)) {
+                assert(dpMatrix_getDiagonal(backwardDpMatrix, xay2+1) != NULL);
+            }
+            if (totalPosteriorCalculationsThisTraceback++ % 10 == 0) {
+                double newTotalProbability = diagonalCalculationTotalProbability(
+                        sM, xay2,
+                        forwardDpMatrix, backwardDpMatrix, sX, sY
+                        );
+                if (totalPosteriorCalculationsThisTraceback != 1) {
+                    assert(totalProbability + 1.0 > newTotalProbability);
+                    assert(newTotalProbability + 1.0 > newTotalProbability);
+                }
+                totalProbability = newTotalProbability;
+            }
+            diagonalPosteriorProbFn(sM, xay2,
+                                    forwardDpMatrix, backwardDpMatrix,
+                                    sX, sY,
+                                    totalProbability, p, extraArgs);
+            //Delete forward diagonal after last access in posterior calculation
+            if (xay2 < tracedBackFrom || atEnd) {
+                dpMatrix_deleteDiagonal(forwardDpMatrix, xay2);
+            }
+        }
+        //Delete backward diagonal after last access in backward calculation
+        if (xay2 < diagonal_getXay(diagonal)) {
+            dpMatrix_deleteDiagonal(backwardDpMatrix, xay2 + 1);
+        }
+        xay2--;
+    }
+    assert(totalPosteriorCalculationsThisTraceback == tracedBackFrom - tracedBackTo);
+    //Diagonals up to tracedBackFrom won't be calculated again
+    if (emissionCache != NULL) {
+        for (int64_t i = tracedBackTo + 1; i <= tracedBackFrom; i++) {
+            emissionCache_deleteDiagonal(emissionCache, i);
+        }
+    }
+    dpMatrix_deleteDiagonal(backwardDpMatrix, xay2 + 1);
+    dpMatrix_deleteDiagonal(forwardDpMatrix, xay2);
+    //Check memory state.
+    assert(dpMatrix_getActiveDiagonalNumber(backwardDpMatrix) == 0);
+    if (!atEnd) {
+        assert(dpMatrix_getActiveDiagonalNumber(forwardDpMatrix) == p->traceBackDiagonals + 2);
+    }
+    return tracedBackFrom;
 }
 
-
-/////////////////////////////////////////////////////////////////////////////////////////////////////////
-//Banded alignment routine to calculate posterior match probs
-/////////////////////////////////////////////////////////////////////////////////////////////////////////
-
 void getPosteriorProbsWithBanding(StateMachine *sM,
                                   stList *anchorPairs,
                                   Sequence *sX, Sequence *sY,
@@ -937,28 +3343,55 @@ void getPosteriorProbsWithBanding(StateMachine *sM,
         return;
     }
 
-    //Primitives for the forward matrix recursion
-    Band *band = band_construct(anchorPairs, sX->length, sY->length, p->diagonalExpansion);
+    //Use the state machine's specialised diagonal kernels, if it has them
+    DiagonalCalculationFn diagonalCalculationForwardFn = diagonalCalculation_getForwardFn(sM);
+    DiagonalCalculationFn diagonalCalculationBackwardFn = diagonalCalculation_getBackwardFn(sM);
+    bool scaled = p->scaledProbabilities && diagonalCalculation_supportsScaling(sM);
+
+    //Primitives for the forward matrix recursion, an adaptive band being kept within a band around the anchors
+    //with its own expansion, or the whole matrix
+    bool adaptive = p->adaptiveBandXDrop > 0.0;
+    Band *band;
+    if (!adaptive) {
+        band = band_construct(anchorPairs, sX->length, sY->length, p->diagonalExpansion);
+    } else if (p->adaptiveBandMaxExpansion >= 0) {
+        assert(p->adaptiveBandMaxExpansion % 2 == 0);
+        band = band_construct(anchorPairs, sX->length, sY->length, p->adaptiveBandMaxExpansion);
+    } else {
+        stList *noAnchorPairs = stList_construct();
+        band = band_construct(noAnchorPairs, sX->length, sY->length, 2 * diagonalNumber);
+        stList_destruct(noAnchorPairs);
+    }
 
     BandIterator *forwardBandIterator = bandIterator_construct(band);
-    DpMatrix *forwardDpMatrix = dpMatrix_construct(diagonalNumber, sM->stateNumber);
+    DpMatrix *forwardDpMatrix = dpMatrix_construct2(diagonalNumber, sM->stateNumber, scaled);
     //Initialise forward matrix.
-    dpDiagonal_initialiseValues(dpMatrix_createDiagonal(forwardDpMatrix, bandIterator_getNext(forwardBandIterator)),
-                                sM, alignmentHasRaggedLeftEnd ? sM->raggedStartStateProb : sM->startStateProb);
+    DpDiagonal *forwardDiagonal = dpMatrix_createDiagonal(forwardDpMatrix, bandIterator_getNext(forwardBandIterator));
+    dpDiagonal_initialiseValues(forwardDiagonal, sM,
+                                alignmentHasRaggedLeftEnd ? sM->raggedStartStateProb : sM->startStateProb);
 
     //Backward matrix.
-    DpMatrix *backwardDpMatrix = dpMatrix_construct(diagonalNumber, sM->stateNumber);
+    DpMatrix *backwardDpMatrix = dpMatrix_construct2(diagonalNumber, sM->stateNumber, scaled);
+
+    //Threads to split wide diagonals between
+    ThreadGroup *threadGroup = getDiagonalThreadGroup(p, forwardDpMatrix, backwardDpMatrix);
+
+    //Emissions computed by the forward pass, for reuse by the backward pass
+    EmissionCache *emissionCache = getEmissionCache(p, diagonalNumber, forwardDpMatrix, backwardDpMatrix);
 
     int64_t tracedBackTo = 0;
-    int64_t totalPosteriorCalculations = 0;
 
     while (1) { //Loop that moves through the matrix forward
 
-        Diagonal diagonal = bandIterator_getNext(forwardBandIterator);
+        Diagonal diagonal = adaptive ?
+                getAdaptiveBandDiagonal(band_getDiagonal(band, diagonal_getXay(forwardDiagonal->diagonal) + 1),
+                                        forwardDiagonal, p->adaptiveBandXDrop, p->diagonalExpansion) :
+                bandIterator_getNext(forwardBandIterator);
 
         //Forward calculation
-        dpDiagonal_zeroValues(dpMatrix_createDiagonal(forwardDpMatrix, diagonal));
-        diagonalCalculationForward(sM, diagonal_getXay(diagonal), forwardDpMatrix, sX, sY);
+        forwardDiagonal = dpMatrix_createDiagonal(forwardDpMatrix, diagonal);
+        dpDiagonal_zeroValues(forwardDiagonal);
+        diagonalCalculationForwardFn(sM, diagonal_getXay(diagonal), forwardDpMatrix, sX, sY);
 
         //Condition true at the end of the matrix
         bool atEnd = diagonal_getXay(diagonal) == diagonalNumber;
@@ -968,95 +3401,281 @@ void getPosteriorProbsWithBanding(StateMachine *sM,
 
         //Traceback
         if (atEnd || tracebackPoint) {
-            //Initialise the last row (until now) of the backward matrix to represent an end point
-            dpDiagonal_initialiseValues(dpMatrix_createDiagonal(backwardDpMatrix, diagonal), sM,
-                    (atEnd && alignmentHasRaggedRightEnd) ? sM->raggedEndStateProb : sM->endStateProb);
-            //This is a diagonal between the place we trace back to and where we trace back from
-            if (diagonal_getXay(diagonal) > tracedBackTo + 1) {
-                DpDiagonal *j = dpMatrix_getDiagonal(forwardDpMatrix, diagonal_getXay(diagonal) - 1);
-                assert(j != NULL);
-                dpDiagonal_zeroValues(dpMatrix_createDiagonal(backwardDpMatrix, j->diagonal));
-            }
-
-            //Do walk back
-            BandIterator *backwardBandIterator = bandIterator_clone(forwardBandIterator);
-            Diagonal diagonal2 = bandIterator_getPrevious(backwardBandIterator);
-            assert(diagonal_getXay(diagonal2) == diagonal_getXay(diagonal));
-            int64_t tracedBackFrom = diagonal_getXay(diagonal) - (atEnd ? 0 : p->traceBackDiagonals + 1);
-            double totalProbability = LOG_ZERO;
-            int64_t totalPosteriorCalculationsThisTraceback = 0;
-            while (diagonal_getXay(diagonal2) > tracedBackTo) {
-                //Create the earlier diagonal
-                if (diagonal_getXay(diagonal2) > tracedBackTo + 2) {
-                    DpDiagonal *j = dpMatrix_getDiagonal(forwardDpMatrix, diagonal_getXay(diagonal2) - 2);
-                    assert(j != NULL);
-                    dpDiagonal_zeroValues(dpMatrix_createDiagonal(backwardDpMatrix, j->diagonal));
-                }
-                if (diagonal_getXay(diagonal2) > tracedBackTo + 1) {
-                    diagonalCalculationBackward(sM, diagonal_getXay(diagonal2), backwardDpMatrix, sX, sY);
-                }
-                if (diagonal_getXay(diagonal2) <= tracedBackFrom) {
-                    assert(dpMatrix_getDiagonal(forwardDpMatrix, diagonal_getXay(diagonal2)) != NULL);
-                    assert(dpMatrix_getDiagonal(forwardDpMatrix, diagonal_getXay(diagonal2)-1) != NULL);
-                    assert(dpMatrix_getDiagonal(backwardDpMatrix, diagonal_getXay(diagonal2)) != NULL);
-                    if (diagonal_getXay(diagonal2) != diagonalNumber) {
-                        assert(dpMatrix_getDiagonal(backwardDpMatrix, diagonal_getXay(diagonal2)+1) != NULL);
-                    }
-                    if (totalPosteriorCalculationsThisTraceback++ % 10 == 0) {
-                        double newTotalProbability = diagonalCalculationTotalProbability(
-                                sM, diagonal_getXay(diagonal2),
-                                forwardDpMatrix, backwardDpMatrix, sX, sY
-                                );
-                        if (totalPosteriorCalculationsThisTraceback != 1) {
-                            assert(totalProbability + 1.0 > newTotalProbability);
-                            assert(newTotalProbability + 1.0 > newTotalProbability);
-                        }
-                        totalProbability = newTotalProbability;
-                    }
-                    diagonalPosteriorProbFn(sM, diagonal_getXay(diagonal2),
-                                            forwardDpMatrix, backwardDpMatrix,
-                                            sX, sY,
-                                            totalProbability, p, extraArgs);
-                    //Delete forward diagonal after last access in posterior calculation
-                    if (diagonal_getXay(diagonal2) < tracedBackFrom || atEnd) {
-                        dpMatrix_deleteDiagonal(forwardDpMatrix, diagonal_getXay(diagonal2));
-                    }
-                }
-                //Delete backward diagonal after last access in backward calculation
-                if (diagonal_getXay(diagonal2) + 1 <= diagonalNumber) {
-                    dpMatrix_deleteDiagonal(backwardDpMatrix, diagonal_getXay(diagonal2) + 1);
-                }
-                diagonal2 = bandIterator_getPrevious(backwardBandIterator);
-            }
-            tracedBackTo = tracedBackFrom;
-            bandIterator_destruct(backwardBandIterator);
-            dpMatrix_deleteDiagonal(backwardDpMatrix, diagonal_getXay(diagonal2) + 1);
-            dpMatrix_deleteDiagonal(forwardDpMatrix, diagonal_getXay(diagonal2));
-            //Check memory state.
-            assert(dpMatrix_getActiveDiagonalNumber(backwardDpMatrix) == 0);
-            totalPosteriorCalculations += totalPosteriorCalculationsThisTraceback;
-            if (!atEnd) {
-                assert(dpMatrix_getActiveDiagonalNumber(forwardDpMatrix) == p->traceBackDiagonals + 2);
-            }
+            tracedBackTo = traceBackBand(sM, diagonal, tracedBackTo, atEnd, atEnd && alignmentHasRaggedRightEnd,
+                                         forwardDpMatrix, backwardDpMatrix, sX, sY, p,
+                                         diagonalCalculationBackwardFn, emissionCache,
+                                         diagonalPosteriorProbFn, extraArgs);
         }
         if (atEnd) {
             break;
         }
     }
-    assert(totalPosteriorCalculations == diagonalNumber);
     assert(tracedBackTo == diagonalNumber);
     assert(dpMatrix_getActiveDiagonalNumber(backwardDpMatrix) == 0);
     assert(dpMatrix_getActiveDiagonalNumber(forwardDpMatrix) == 0);
     //Cleanup
+    if (threadGroup != NULL) {
+        threadGroup_destruct(threadGroup);
+    }
+    if (emissionCache != NULL) {
+        emissionCache_destruct(emissionCache);
+    }
     dpMatrix_destruct(forwardDpMatrix);
     dpMatrix_destruct(backwardDpMatrix);
     bandIterator_destruct(forwardBandIterator);
     band_destruct(band);
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Streaming banded alignment
+//Banded alignment of a sequence against one given a chunk at a time, emitting posteriors as it goes
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * sY is a view of the chunks the aligner holds, chunks[i] starting at element chunkStarts[i] of sY. Chunks are
+ * released from the front once the band has passed them, the cells of diagonals still to be calculated having y
+ * coordinates no less than minY.
+ */
+struct _streamingAligner {
+    StateMachine *sM;
+    Sequence *sX;
+    Sequence *sY;
+    PairwiseAlignmentParameters p;
+    bool alignmentHasRaggedRightEnd;
+    void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *, DpMatrix *, Sequence*, Sequence*,
+                                    double, PairwiseAlignmentParameters *, void *);
+    void *extraArgs;
+    void (*chunkDestructFn)(Sequence *);
+    Sequence **chunks;
+    int64_t *chunkStarts;
+    int64_t chunkNumber;
+    int64_t maxChunkNumber;
+    int64_t minY;
+    bool finished;
+    DiagonalCalculationFn diagonalCalculationForwardFn;
+    DiagonalCalculationFn diagonalCalculationBackwardFn;
+    DpMatrix *forwardDpMatrix;
+    DpMatrix *backwardDpMatrix;
+    ThreadGroup *threadGroup;
+    DpDiagonal *forwardDiagonal; //Last diagonal of the forward matrix, NULL once the alignment is done
+    int64_t tracedBackTo;
+};
+
+static void *streamingAligner_getElement(void *elements, int64_t index) {
+    StreamingAligner *aligner = elements;
+    assert(aligner->chunkNumber > 0);
+    if (index < 0) { //The get functions of the chunks give a placeholder for the elements before the start
+        return aligner->chunks[0]->get(aligner->chunks[0]->elements, index);
+    }
+    //Binary search for the last chunk starting at or before index
+    int64_t i = 0, j = aligner->chunkNumber - 1;
+    while (i < j) {
+        int64_t k = (i + j + 1) / 2;
+        if (aligner->chunkStarts[k] <= index) {
+            i = k;
+        } else {
+            j = k - 1;
+        }
+    }
+    Sequence *chunk = aligner->chunks[i];
+    assert(index >= aligner->chunkStarts[i] && index < aligner->chunkStarts[i] + chunk->length);
+    return chunk->get(chunk->elements, index - aligner->chunkStarts[i]);
+}
+
+StreamingAligner *streamingAligner_construct(StateMachine *sM, Sequence *sX, PairwiseAlignmentParameters *p,
+                                             bool alignmentHasRaggedLeftEnd, bool alignmentHasRaggedRightEnd,
+                                             void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *,
+                                                                             DpMatrix *, Sequence*, Sequence*,
+                                                                             double, PairwiseAlignmentParameters *,
+                                                                             void *),
+                                             void *extraArgs, void (*chunkDestructFn)(Sequence *)) {
+    if (p->adaptiveBandXDrop <= 0.0) {
+        stThrowNew(PAIRWISE_ALIGNMENT_EXCEPTION_ID, "Streaming alignment needs an adaptive band, got an X-drop of %f",
+                   p->adaptiveBandXDrop);
+    }
+    assert(p->traceBackDiagonals >= 1);
+    assert(p->diagonalExpansion >= 0);
+    assert(p->diagonalExpansion % 2 == 0);
+    assert(p->minDiagsBetweenTraceBack >= 2);
+    assert(p->traceBackDiagonals + 1 < p->minDiagsBetweenTraceBack);
+
+    StreamingAligner *aligner = st_malloc(sizeof(StreamingAligner));
+    aligner->sM = sM;
+    aligner->sX = sX;
+    aligner->sY = sequence_construct2(0, aligner, streamingAligner_getElement, NULL);
+    aligner->p = *p;
+    aligner->alignmentHasRaggedRightEnd = alignmentHasRaggedRightEnd;
+    aligner->diagonalPosteriorProbFn = diagonalPosteriorProbFn;
+    aligner->extraArgs = extraArgs;
+    aligner->chunkDestructFn = chunkDestructFn;
+    aligner->maxChunkNumber = 16;
+    aligner->chunks = st_malloc(aligner->maxChunkNumber * sizeof(Sequence *));
+    aligner->chunkStarts = st_malloc(aligner->maxChunkNumber * sizeof(int64_t));
+    aligner->chunkNumber = 0;
+    aligner->minY = 0;
+    aligner->finished = 0;
+
+    //Use the state machine's specialised diagonal kernels, if it has them
+    aligner->diagonalCalculationForwardFn = diagonalCalculation_getForwardFn(sM);
+    aligner->diagonalCalculationBackwardFn = diagonalCalculation_getBackwardFn(sM);
+    bool scaled = p->scaledProbabilities && diagonalCalculation_supportsScaling(sM);
+    aligner->forwardDpMatrix = dpMatrix_constructUnbounded(sM->stateNumber, scaled);
+    aligner->backwardDpMatrix = dpMatrix_constructUnbounded(sM->stateNumber, scaled);
+    aligner->threadGroup = getDiagonalThreadGroup(p, aligner->forwardDpMatrix, aligner->backwardDpMatrix);
+
+    //Initialise forward matrix.
+    aligner->forwardDiagonal = dpMatrix_createDiagonal(aligner->forwardDpMatrix, diagonal_construct(0, 0, 0));
+    dpDiagonal_initialiseValues(aligner->forwardDiagonal, sM,
+                                alignmentHasRaggedLeftEnd ? sM->raggedStartStateProb : sM->startStateProb);
+    aligner->tracedBackTo = 0;
+    return aligner;
+}
+
+//Sets diagonal to the next diagonal of the band, returning false if it has cells beyond the elements of sY
+//pushed so far, and so can't be calculated yet
+static bool streamingAligner_getNextDiagonal(StreamingAligner *aligner, Diagonal *diagonal) {
+    int64_t xay = diagonal_getXay(aligner->forwardDiagonal->diagonal) + 1;
+    int64_t lX = aligner->sX->length, lY = aligner->sY->length;
+    //The cells of the matrix, leaving out those before minY and, until sY is finished, not bounding y by its length
+    int64_t minXmy = aligner->finished && xay - 2 * lY > -xay ? xay - 2 * lY : -xay;
+    int64_t maxXmy = xay;
+    if (2 * lX - xay < maxXmy) {
+        maxXmy = 2 * lX - xay;
+    }
+    if (xay - 2 * aligner->minY < maxXmy) {
+        maxXmy = xay - 2 * aligner->minY;
+    }
+    if (maxXmy < minXmy) {
+        assert(!aligner->finished);
+        return 0;
+    }
+    *diagonal = getAdaptiveBandDiagonal(diagonal_construct(xay, minXmy, maxXmy), aligner->forwardDiagonal,
+                                        aligner->p.adaptiveBandXDrop, aligner->p.diagonalExpansion);
+    return aligner->finished || diagonal_getMinXmy(*diagonal) >= xay - 2 * lY;
+}
+
+//Releases the chunks before the elements the diagonals of the forward matrix still to be used need
+static void streamingAligner_releaseChunks(StreamingAligner *aligner) {
+    for (int64_t i = aligner->tracedBackTo; i <= diagonal_getXay(aligner->forwardDiagonal->diagonal); i++) {
+        Diagonal diagonal = dpMatrix_getDiagonal(aligner->forwardDpMatrix, i)->diagonal;
+        int64_t y = diagonal_getYCoordinate(i, diagonal_getMaxXmy(diagonal));
+        if (i == aligner->tracedBackTo || y < aligner->minY) {
+            aligner->minY = y;
+        }
+    }
+    //Cells with y coordinate minY use element minY - 1, the last chunk is kept for the placeholder before the start
+    int64_t i = 0;
+    while (i < aligner->chunkNumber - 1 && aligner->chunkStarts[i] + aligner->chunks[i]->length < aligner->minY) {
+        if (aligner->chunkDestructFn != NULL) {
+            aligner->chunkDestructFn(aligner->chunks[i]);
+        }
+        i++;
+    }
+    aligner->chunkNumber -= i;
+    memmove(aligner->chunks, aligner->chunks + i, aligner->chunkNumber * sizeof(Sequence *));
+    memmove(aligner->chunkStarts, aligner->chunkStarts + i, aligner->chunkNumber * sizeof(int64_t));
+}
+
+//Moves the forward band on as far as the elements of sY allow, tracing back when it gets far enough
+static void streamingAligner_advance(StreamingAligner *aligner) {
+    PairwiseAlignmentParameters *p = &aligner->p;
+    Diagonal diagonal;
+    while (aligner->forwardDiagonal != NULL && streamingAligner_getNextDiagonal(aligner, &diagonal)) {
+        //Forward calculation
+        aligner->forwardDiagonal = dpMatrix_createDiagonal(aligner->forwardDpMatrix, diagonal);
+        dpDiagonal_zeroValues(aligner->forwardDiagonal);
+        aligner->diagonalCalculationForwardFn(aligner->sM, diagonal_getXay(diagonal), aligner->forwardDpMatrix,
+                                              aligner->sX, aligner->sY);
+
+        bool atEnd = aligner->finished && diagonal_getXay(diagonal) == aligner->sX->length + aligner->sY->length;
+        bool tracebackPoint = diagonal_getXay(diagonal) >= aligner->tracedBackTo + p->minDiagsBetweenTraceBack;
+        if (atEnd || tracebackPoint) {
+            aligner->tracedBackTo = traceBackBand(aligner->sM, diagonal, aligner->tracedBackTo, atEnd,
+                                                  atEnd && aligner->alignmentHasRaggedRightEnd,
+                                                  aligner->forwardDpMatrix, aligner->backwardDpMatrix,
+                                                  aligner->sX, aligner->sY, p,
+                                                  aligner->diagonalCalculationBackwardFn, NULL,
+                                                  aligner->diagonalPosteriorProbFn, aligner->extraArgs);
+            if (atEnd) {
+                aligner->forwardDiagonal = NULL;
+            } else {
+                streamingAligner_releaseChunks(aligner);
+            }
+        }
+    }
+}
+
+void streamingAligner_push(StreamingAligner *aligner, Sequence *chunk) {
+    assert(!aligner->finished);
+    if (chunk->length == 0) {
+        if (aligner->chunkDestructFn != NULL) {
+            aligner->chunkDestructFn(chunk);
+        }
+        return;
+    }
+    if (aligner->chunkNumber == aligner->maxChunkNumber) {
+        aligner->maxChunkNumber *= 2;
+        Sequence **chunks = st_malloc(aligner->maxChunkNumber * sizeof(Sequence *));
+        int64_t *chunkStarts = st_malloc(aligner->maxChunkNumber * sizeof(int64_t));
+        memcpy(chunks, aligner->chunks, aligner->chunkNumber * sizeof(Sequence *));
+        memcpy(chunkStarts, aligner->chunkStarts, aligner->chunkNumber * sizeof(int64_t));
+        free(aligner->chunks);
+        free(aligner->chunkStarts);
+        aligner->chunks = chunks;
+        aligner->chunkStarts = chunkStarts;
+    }
+    aligner->chunks[aligner->chunkNumber] = chunk;
+    aligner->chunkStarts[aligner->chunkNumber++] = aligner->sY->length;
+    aligner->sY->length += chunk->length;
+    streamingAligner_advance(aligner);
+}
+
+void streamingAligner_finish(StreamingAligner *aligner) {
+    assert(!aligner->finished);
+    aligner->finished = 1;
+    if (aligner->chunkNumber == 0) { //Nothing to align against
+        dpMatrix_deleteDiagonal(aligner->forwardDpMatrix, 0);
+        aligner->forwardDiagonal = NULL;
+        return;
+    }
+    streamingAligner_advance(aligner);
+    assert(aligner->forwardDiagonal == NULL);
+    assert(aligner->tracedBackTo == aligner->sX->length + aligner->sY->length);
+}
+
+int64_t streamingAligner_getBufferedLength(StreamingAligner *aligner) {
+    return aligner->chunkNumber == 0 ? 0 : aligner->sY->length - aligner->chunkStarts[0];
+}
+
+int64_t streamingAligner_getTracedBackTo(StreamingAligner *aligner) {
+    return aligner->tracedBackTo;
+}
+
+void streamingAligner_destruct(StreamingAligner *aligner) {
+    if (aligner->forwardDiagonal != NULL) { //Not finished, so clean up the diagonals still held
+        for (int64_t i = aligner->tracedBackTo; i <= diagonal_getXay(aligner->forwardDiagonal->diagonal); i++) {
+            dpMatrix_deleteDiagonal(aligner->forwardDpMatrix, i);
+        }
+    }
+    if (aligner->chunkDestructFn != NULL) {
+        for (int64_t i = 0; i < aligner->chunkNumber; i++) {
+            aligner->chunkDestructFn(aligner->chunks[i]);
+        }
+    }
+    if (aligner->threadGroup != NULL) {
+        threadGroup_destruct(aligner->threadGroup);
+    }
+    dpMatrix_destruct(aligner->forwardDpMatrix);
+    dpMatrix_destruct(aligner->backwardDpMatrix);
+    sequence_sequenceDestroy(aligner->sY);
+    free(aligner->chunks);
+    free(aligner->chunkStarts);
+    free(aligner);
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 //Blast anchoring functions
-//Use lastz to get sets of anchors
+//Use lastz, or the seeds of seedAnchors, to get sets of anchors
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 int sortByXPlusYCoordinate(const void *i, const void *j) {
@@ -1248,10 +3867,11 @@ stList *filterToRemoveOverlap(stList *sortedOverlappingPairs) {
     return nonOverlappingPairs;
 }
 
-static void getBlastPairsForPairwiseAlignmentParametersP(
+static void getAnchorPairsForPairwiseAlignmentParametersP(
                         const char *sX, const char *sY, int64_t pX, int64_t pY,
                         int64_t x, int64_t y, PairwiseAlignmentParameters *p,
-                        stList *combinedAnchorPairs) {
+                        stList *combinedAnchorPairs,
+                        stList *(*getPairsFcn)(const char *, const char *, int64_t, bool)) {
 
     int64_t lX2 = x - pX;
     assert(lX2 >= 0);
@@ -1261,7 +3881,7 @@ static void getBlastPairsForPairwiseAlignmentParametersP(
     if (matrixSize > p->repeatMaskMatrixBiggerThanThis) {
         char *sX2 = stString_getSubString(sX, pX, lX2);
         char *sY2 = stString_getSubString(sY, pY, lY2);
-        stList *unfilteredBottomLevelAnchorPairs = getBlastPairs(sX2, sY2, p->constraintDiagonalTrim, 0);
+        stList *unfilteredBottomLevelAnchorPairs = getPairsFcn(sX2, sY2, p->constraintDiagonalTrim, 0);
         stList_sort(unfilteredBottomLevelAnchorPairs, (int (*)(const void *, const void *)) stIntTuple_cmpFn);
         stList *bottomLevelAnchorPairs = filterToRemoveOverlap(unfilteredBottomLevelAnchorPairs);
         st_logDebug("Got %" PRIi64 " bottom level anchor pairs, which reduced to %" PRIi64 " after filtering \n",
@@ -1276,9 +3896,14 @@ static void getBlastPairsForPairwiseAlignmentParametersP(
     }
 }
 
-stList *getBlastPairsForPairwiseAlignmentParameters(void *sX, void *sY, PairwiseAlignmentParameters *p) {
-
-    // cast to char arrays for lastz
+static stList *getAnchorPairsForPairwiseAlignmentParameters(void *sX, void *sY, PairwiseAlignmentParameters *p,
+                                                            stList *(*getPairsFcn)(const char *, const char *,
+                                                                                   int64_t, bool)) {
+    /*
+     * Anchors from getPairsFcn, which is getBlastPairs or getSeedPairs, over the whole of the sequences with repeat
+     * masking and then again without it in the gaps between the anchors that are still too big.
+     */
+    // cast to char arrays
     char *cX = (char *) sX;
     char *cY = (char *) sY;
     int64_t lX = strlen(cX);
@@ -1289,7 +3914,7 @@ stList *getBlastPairsForPairwiseAlignmentParameters(void *sX, void *sY, Pairwise
     }
     // anchorPairs
     // Get anchors
-    stList *unfilteredTopLevelAnchorPairs = getBlastPairs(cX, cY, p->constraintDiagonalTrim, 1);
+    stList *unfilteredTopLevelAnchorPairs = getPairsFcn(cX, cY, p->constraintDiagonalTrim, 1);
     // sort them
     stList_sort(unfilteredTopLevelAnchorPairs, (int (*)(const void *, const void *)) stIntTuple_cmpFn);
     // filter
@@ -1314,7 +3939,7 @@ stList *getBlastPairsForPairwiseAlignmentParameters(void *sX, void *sY, Pairwise
         assert(x >= pX);
         assert(y >= pY);
         // see if we want to split the matrix into two
-        getBlastPairsForPairwiseAlignmentParametersP(cX, cY, pX, pY, x, y, p, combinedAnchorPairs);
+        getAnchorPairsForPairwiseAlignmentParametersP(cX, cY, pX, pY, x, y, p, combinedAnchorPairs, getPairsFcn);
         // finally append
         stList_append(combinedAnchorPairs, anchorPair);
         // increment for next iteration
@@ -1322,13 +3947,21 @@ stList *getBlastPairsForPairwiseAlignmentParameters(void *sX, void *sY, Pairwise
         pY = y + 1;
     }
     // one final check
-    getBlastPairsForPairwiseAlignmentParametersP(cX, cY, pX, pY, lX, lY, p, combinedAnchorPairs);
+    getAnchorPairsForPairwiseAlignmentParametersP(cX, cY, pX, pY, lX, lY, p, combinedAnchorPairs, getPairsFcn);
     stList_setDestructor(topLevelAnchorPairs, NULL);
     stList_destruct(topLevelAnchorPairs);
     st_logDebug("Got %" PRIi64 " combined anchor pairs\n", stList_length(combinedAnchorPairs));
     return combinedAnchorPairs;
 }
 
+stList *getBlastPairsForPairwiseAlignmentParameters(void *sX, void *sY, PairwiseAlignmentParameters *p) {
+    return getAnchorPairsForPairwiseAlignmentParameters(sX, sY, p, getBlastPairs);
+}
+
+stList *getSeedPairsForPairwiseAlignmentParameters(void *sX, void *sY, PairwiseAlignmentParameters *p) {
+    return getAnchorPairsForPairwiseAlignmentParameters(sX, sY, p, getSeedPairs);
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 //Split large gap functions
 //Functions to split up alignment around gaps in the anchors that are too large.
@@ -1402,14 +4035,34 @@ static void convertAlignedPairs(stList *alignedPairs2, int64_t offsetX, int64_t
     }
 }
 
-void getPosteriorProbsWithBandingSplittingAlignmentsByLargeGaps(
-        StateMachine *sM, stList *anchorPairs, Sequence *SsX, Sequence *SsY,
-        PairwiseAlignmentParameters *p,
-        bool alignmentHasRaggedLeftEnd, bool alignmentHasRaggedRightEnd,
-        void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *,
-                                        DpMatrix *, Sequence*, Sequence*, double,
-                                        PairwiseAlignmentParameters *, void *),
-        void (*coordinateCorrectionFn)(), void *extraArgs) {
+//One of the independent alignments between split points
+typedef struct _subAlignment {
+    int64_t x1, y1; //Offset of the sub-matrix
+    Sequence *sX, *sY;
+    stList *anchorPairs; //Anchor pairs, relative to the sub-matrix
+    bool alignmentHasRaggedLeftEnd, alignmentHasRaggedRightEnd;
+    //Used when run by the thread pool
+    StateMachine *sM;
+    PairwiseAlignmentParameters *p;
+    void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *, DpMatrix *, Sequence*, Sequence*, double,
+                                    PairwiseAlignmentParameters *, void *);
+    void *alignedPairs; //Output of the sub-alignment, a list of pairs or an AlignedPairBuffer
+    void (*alignedPairsDestructFn)(void *);
+} SubAlignment;
+
+static void subAlignment_destruct(SubAlignment *subAlignment) {
+    stList_destruct(subAlignment->anchorPairs);
+    sequence_sequenceDestroy(subAlignment->sX);
+    sequence_sequenceDestroy(subAlignment->sY);
+    if (subAlignment->alignedPairs != NULL) {
+        subAlignment->alignedPairsDestructFn(subAlignment->alignedPairs);
+    }
+    free(subAlignment);
+}
+
+static stList *getSubAlignments(stList *anchorPairs, Sequence *SsX, Sequence *SsY,
+                                PairwiseAlignmentParameters *p,
+                                bool alignmentHasRaggedLeftEnd, bool alignmentHasRaggedRightEnd) {
     // you are going to cut the sequences into subSequences anyways, so not having the correct
     // number of elements in length, ie having it reflect the number of nucleotides might be ok?
     int64_t lX = SsX->length; // so here you want the total number of elements
@@ -1419,9 +4072,9 @@ void getPosteriorProbsWithBandingSplittingAlignmentsByLargeGaps(
                                          p->splitMatrixBiggerThanThis,
                                          alignmentHasRaggedLeftEnd,
                                          alignmentHasRaggedRightEnd);
+    stList *subAlignments = stList_construct3(0, (void (*)(void *)) subAlignment_destruct);
     int64_t j = 0;
 
-    //Now to the actual alignments
     for (int64_t i = 0; i < stList_length(splitPoints); i++) {
         stIntTuple *subRegion = stList_get(splitPoints, i);
         int64_t x1 = stIntTuple_get(subRegion, 0);
@@ -1429,11 +4082,16 @@ void getPosteriorProbsWithBandingSplittingAlignmentsByLargeGaps(
         int64_t x2 = stIntTuple_get(subRegion, 2);
         int64_t y2 = stIntTuple_get(subRegion, 3);
 
-        Sequence *sX3 = SsX->sliceFcn(SsX, x1, x2 - x1);
-        Sequence *sY3 = SsY->sliceFcn(SsY, y1, y2 - y1);
+        SubAlignment *subAlignment = st_calloc(1, sizeof(SubAlignment));
+        subAlignment->x1 = x1;
+        subAlignment->y1 = y1;
+        subAlignment->sX = SsX->sliceFcn(SsX, x1, x2 - x1);
+        subAlignment->sY = SsY->sliceFcn(SsY, y1, y2 - y1);
+        subAlignment->alignmentHasRaggedLeftEnd = alignmentHasRaggedLeftEnd || i > 0;
+        subAlignment->alignmentHasRaggedRightEnd = alignmentHasRaggedRightEnd || i < stList_length(splitPoints) - 1;
 
         //List of anchor pairs
-        stList *subListOfAnchorPoints = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+        subAlignment->anchorPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
 
         while (j < stList_length(anchorPairs)) {
             stIntTuple *anchorPair = stList_get(anchorPairs, j);
@@ -1446,28 +4104,90 @@ void getPosteriorProbsWithBandingSplittingAlignmentsByLargeGaps(
             }
             assert(x >= x1 && x < x2);
             assert(y >= y1 && y < y2);
-            stList_append(subListOfAnchorPoints, stIntTuple_construct2(x - x1, y - y1));
+            stList_append(subAlignment->anchorPairs, stIntTuple_construct2(x - x1, y - y1));
             j++;
         }
+        stList_append(subAlignments, subAlignment);
+    }
+    assert(j == stList_length(anchorPairs));
+    stList_destruct(splitPoints);
+    return subAlignments;
+}
 
-        //Make the alignments
+void getPosteriorProbsWithBandingSplittingAlignmentsByLargeGaps(
+        StateMachine *sM, stList *anchorPairs, Sequence *SsX, Sequence *SsY,
+        PairwiseAlignmentParameters *p,
+        bool alignmentHasRaggedLeftEnd, bool alignmentHasRaggedRightEnd,
+        void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *,
+                                        DpMatrix *, Sequence*, Sequence*, double,
+                                        PairwiseAlignmentParameters *, void *),
+        void (*coordinateCorrectionFn)(), void *extraArgs) {
+    stList *subAlignments = getSubAlignments(anchorPairs, SsX, SsY, p,
+                                             alignmentHasRaggedLeftEnd, alignmentHasRaggedRightEnd);
+
+    //Now to the actual alignments
+    for (int64_t i = 0; i < stList_length(subAlignments); i++) {
+        SubAlignment *subAlignment = stList_get(subAlignments, i);
 
-        getPosteriorProbsWithBanding(sM, subListOfAnchorPoints, sX3, sY3, p,
-                                     (alignmentHasRaggedLeftEnd || i > 0),
-                                     (alignmentHasRaggedRightEnd || i < stList_length(splitPoints) - 1),
+        //Make the alignments
+        getPosteriorProbsWithBanding(sM, subAlignment->anchorPairs, subAlignment->sX, subAlignment->sY, p,
+                                     subAlignment->alignmentHasRaggedLeftEnd,
+                                     subAlignment->alignmentHasRaggedRightEnd,
                                      diagonalPosteriorProbFn, extraArgs);
 
         if (coordinateCorrectionFn != NULL) {
-            coordinateCorrectionFn(x1, y1, extraArgs);
+            coordinateCorrectionFn(subAlignment->x1, subAlignment->y1, extraArgs);
         }
+    }
+    stList_destruct(subAlignments);
+}
 
-        //Clean up
-        stList_destruct(subListOfAnchorPoints);
-        sequence_sequenceDestroy(sX3);
-        sequence_sequenceDestroy(sY3);
+static void subAlignment_align(SubAlignment *subAlignment) {
+    void *extraArgs[1] = { subAlignment->alignedPairs };
+    getPosteriorProbsWithBanding(subAlignment->sM, subAlignment->anchorPairs, subAlignment->sX, subAlignment->sY,
+                                 subAlignment->p,
+                                 subAlignment->alignmentHasRaggedLeftEnd, subAlignment->alignmentHasRaggedRightEnd,
+                                 subAlignment->diagonalPosteriorProbFn, extraArgs);
+}
+
+static void getPosteriorProbsWithBandingSplittingAlignmentsByLargeGapsInParallel(
+        StateMachine *sM, stList *anchorPairs, Sequence *SsX, Sequence *SsY,
+        PairwiseAlignmentParameters *p,
+        bool alignmentHasRaggedLeftEnd, bool alignmentHasRaggedRightEnd,
+        void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *,
+                                        DpMatrix *, Sequence*, Sequence*, double,
+                                        PairwiseAlignmentParameters *, void *),
+        void (*coordinateCorrectionFn)(), void *extraArgs,
+        void *(*alignedPairsConstructFn)(void *), void (*alignedPairsDestructFn)(void *)) {
+    /*
+     * As getPosteriorProbsWithBandingSplittingAlignmentsByLargeGaps, but the sub-alignments are run on
+     * p->threadNumber threads, each filling its own list (or buffer) of aligned pairs, made by passing the first
+     * element of extraArgs to alignedPairsConstructFn, so they are like it. The lists are then put in place of
+     * that element and passed to coordinateCorrectionFn in order, so the result is the same as for the serial
+     * version.
+     */
+    stList *subAlignments = getSubAlignments(anchorPairs, SsX, SsY, p,
+                                             alignmentHasRaggedLeftEnd, alignmentHasRaggedRightEnd);
+    for (int64_t i = 0; i < stList_length(subAlignments); i++) {
+        SubAlignment *subAlignment = stList_get(subAlignments, i);
+        subAlignment->sM = sM;
+        subAlignment->p = p;
+        subAlignment->diagonalPosteriorProbFn = diagonalPosteriorProbFn;
+        subAlignment->alignedPairs = alignedPairsConstructFn(((void **) extraArgs)[0]);
+        subAlignment->alignedPairsDestructFn = alignedPairsDestructFn;
     }
-    assert(j == stList_length(anchorPairs));
-    stList_destruct(splitPoints);
+
+    threadPool_runTasks(subAlignments, (void (*)(void *)) subAlignment_align, p->threadNumber);
+
+    void **extraArgs2 = extraArgs;
+    void *buffer = extraArgs2[0];
+    for (int64_t i = 0; i < stList_length(subAlignments); i++) {
+        SubAlignment *subAlignment = stList_get(subAlignments, i);
+        extraArgs2[0] = subAlignment->alignedPairs;
+        coordinateCorrectionFn(subAlignment->x1, subAlignment->y1, extraArgs);
+    }
+    extraArgs2[0] = buffer;
+    stList_destruct(subAlignments);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1486,6 +4206,14 @@ PairwiseAlignmentParameters *pairwiseAlignmentBandingParameters_construct() {
     p->splitMatrixBiggerThanThis = (int64_t) 3000 * 3000;
     p->alignAmbiguityCharacters = 0;
     p->gapGamma = 0.5;
+    p->scaledProbabilities = 0;
+    p->checkpointInterval = 0;
+    p->threadNumber = 1;
+    p->diagonalThreadNumber = 1;
+    p->minThreadedDiagonalWidth = 128;
+    p->emissionCacheMaxSize = 64 * 1024 * 1024;
+    p->adaptiveBandXDrop = 0.0;
+    p->adaptiveBandMaxExpansion = -1;
     return p;
 }
 
@@ -1502,6 +4230,12 @@ static void alignedPairCoordinateCorrectionFn(int64_t offsetX, int64_t offsetY,
     }
 }
 
+//An empty list for a thread's sub-alignments, the list it is like being ignored
+static void *alignedPairList_constructLike(void *list) {
+    (void) list;
+    return stList_construct();
+}
+
 stList *getAlignedPairsUsingAnchors(StateMachine *sM,
                                     Sequence *SsX, Sequence *SsY,
                                     stList *anchorPairs,
@@ -1517,14 +4251,27 @@ stList *getAlignedPairsUsingAnchors(StateMachine *sM,
     stList *alignedPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
     void *extraArgs[2] = { subListOfAlignedPairs, alignedPairs };
 
-    getPosteriorProbsWithBandingSplittingAlignmentsByLargeGaps(sM, anchorPairs,
-                                                               SsX, SsY,
-                                                               p,
-                                                               alignmentHasRaggedLeftEnd,
-                                                               alignmentHasRaggedRightEnd,
-                                                               diagonalPosteriorProbFn,
-                                                               alignedPairCoordinateCorrectionFn,
-                                                               extraArgs);
+    if (p->threadNumber > 1) {
+        getPosteriorProbsWithBandingSplittingAlignmentsByLargeGapsInParallel(sM, anchorPairs,
+                                                                             SsX, SsY,
+                                                                             p,
+                                                                             alignmentHasRaggedLeftEnd,
+                                                                             alignmentHasRaggedRightEnd,
+                                                                             diagonalPosteriorProbFn,
+                                                                             alignedPairCoordinateCorrectionFn,
+                                                                             extraArgs,
+                                                                             alignedPairList_constructLike,
+                                                                             (void (*)(void *)) stList_destruct);
+    } else {
+        getPosteriorProbsWithBandingSplittingAlignmentsByLargeGaps(sM, anchorPairs,
+                                                                   SsX, SsY,
+                                                                   p,
+                                                                   alignmentHasRaggedLeftEnd,
+                                                                   alignmentHasRaggedRightEnd,
+                                                                   diagonalPosteriorProbFn,
+                                                                   alignedPairCoordinateCorrectionFn,
+                                                                   extraArgs);
+    }
 
     assert(stList_length(subListOfAlignedPairs) == 0);
     stList_destruct(subListOfAlignedPairs);
@@ -1532,6 +4279,176 @@ stList *getAlignedPairsUsingAnchors(StateMachine *sM,
     return alignedPairs;
 }
 
+static void alignedPairBufferCoordinateCorrectionFn(int64_t offsetX, int64_t offsetY, void *extraArgs) {
+    AlignedPairBuffer *subBuffer = ((void **) extraArgs)[0];
+    AlignedPairBuffer *buffer = ((void **) extraArgs)[1];
+    alignedPairBuffer_appendBuffer(buffer, subBuffer, offsetX, offsetY);
+    alignedPairBuffer_clear(subBuffer);
+}
+
+//An empty buffer that records the states of its pairs if buffer does
+static void *alignedPairBuffer_constructLike(void *buffer) {
+    return alignedPairBuffer_construct(((AlignedPairBuffer *) buffer)->states != NULL);
+}
+
+AlignedPairBuffer *getAlignedPairBufferUsingAnchors(StateMachine *sM,
+                                                    Sequence *SsX, Sequence *SsY,
+                                                    stList *anchorPairs,
+                                                    PairwiseAlignmentParameters *p,
+                                                    void (*diagonalPosteriorProbFn)(StateMachine *, int64_t,
+                                                                                    DpMatrix *, DpMatrix *,
+                                                                                    Sequence *, Sequence *, double,
+                                                                                    PairwiseAlignmentParameters *,
+                                                                                    void *),
+                                                    bool withStates,
+                                                    bool alignmentHasRaggedLeftEnd,
+                                                    bool alignmentHasRaggedRightEnd) {
+    AlignedPairBuffer *subBuffer = alignedPairBuffer_construct(withStates);
+    AlignedPairBuffer *buffer = alignedPairBuffer_construct(withStates);
+    void *extraArgs[2] = { subBuffer, buffer };
+
+    if (p->threadNumber > 1) {
+        getPosteriorProbsWithBandingSplittingAlignmentsByLargeGapsInParallel(sM, anchorPairs,
+                                                                             SsX, SsY,
+                                                                             p,
+                                                                             alignmentHasRaggedLeftEnd,
+                                                                             alignmentHasRaggedRightEnd,
+                                                                             diagonalPosteriorProbFn,
+                                                                             alignedPairBufferCoordinateCorrectionFn,
+                                                                             extraArgs,
+                                                                             alignedPairBuffer_constructLike,
+                                                                             (void (*)(void *)) alignedPairBuffer_destruct);
+    } else {
+        getPosteriorProbsWithBandingSplittingAlignmentsByLargeGaps(sM, anchorPairs,
+                                                                   SsX, SsY,
+                                                                   p,
+                                                                   alignmentHasRaggedLeftEnd,
+                                                                   alignmentHasRaggedRightEnd,
+                                                                   diagonalPosteriorProbFn,
+                                                                   alignedPairBufferCoordinateCorrectionFn,
+                                                                   extraArgs);
+    }
+
+    assert(subBuffer->length == 0);
+    alignedPairBuffer_destruct(subBuffer);
+    alignedPairBuffer_sortByXPlusY(buffer);
+
+    return buffer;
+}
+
+AlignmentJob *alignmentJob_construct(StateMachine *sM, Sequence *sX, Sequence *sY, stList *anchorPairs,
+                                     void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *,
+                                                                     DpMatrix *, Sequence *, Sequence *, double,
+                                                                     PairwiseAlignmentParameters *, void *),
+                                     bool withStates, bool alignmentHasRaggedLeftEnd,
+                                     bool alignmentHasRaggedRightEnd) {
+    AlignmentJob *job = st_malloc(sizeof(AlignmentJob));
+    job->sM = sM;
+    job->sX = sX;
+    job->sY = sY;
+    job->anchorPairs = anchorPairs;
+    job->diagonalPosteriorProbFn = diagonalPosteriorProbFn;
+    job->withStates = withStates;
+    job->alignmentHasRaggedLeftEnd = alignmentHasRaggedLeftEnd;
+    job->alignmentHasRaggedRightEnd = alignmentHasRaggedRightEnd;
+    job->alignedPairs = NULL;
+    job->poreModel = NULL;
+    return job;
+}
+
+AlignmentJob *alignmentJob_constructForRead(PoreModel *poreModel, StateMachineType type, Strand strand,
+                                            NanoporeReadAdjustmentParameters readParams, Sequence *sX,
+                                            Sequence *sY, stList *anchorPairs,
+                                            void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *,
+                                                                            DpMatrix *, Sequence *, Sequence *,
+                                                                            double, PairwiseAlignmentParameters *,
+                                                                            void *),
+                                            bool withStates, bool alignmentHasRaggedLeftEnd,
+                                            bool alignmentHasRaggedRightEnd) {
+    StateMachine *sM = poreModel_getStateMachine(poreModel, type);
+    if (type == vanilla) {
+        stateMachine3Vanilla_setStrandTransitionsToDefaults(sM, strand);
+    }
+    poreModel_scaleStateMachine(poreModel, sM, readParams.scale, readParams.shift, readParams.var,
+                                readParams.scale_sd, readParams.var_sd);
+    AlignmentJob *job = alignmentJob_construct(sM, sX, sY, anchorPairs, diagonalPosteriorProbFn, withStates,
+                                               alignmentHasRaggedLeftEnd, alignmentHasRaggedRightEnd);
+    job->poreModel = poreModel;
+    job->readParams = readParams;
+    return job;
+}
+
+void alignmentJob_destruct(AlignmentJob *job) {
+    if (job->alignedPairs != NULL) {
+        alignedPairBuffer_destruct(job->alignedPairs);
+    }
+    if (job->poreModel != NULL) {
+        poreModel_destructStateMachine(job->poreModel, job->sM);
+    }
+    free(job);
+}
+
+AlignedPairBuffer *alignmentJob_takeAlignedPairs(AlignmentJob *job) {
+    AlignedPairBuffer *alignedPairs = job->alignedPairs;
+    job->alignedPairs = NULL;
+    return alignedPairs;
+}
+
+typedef struct _batchTask {
+    AlignmentJob *job;
+    PairwiseAlignmentParameters *p;
+} BatchTask;
+
+static void batchTask_align(BatchTask *task) {
+    AlignmentJob *job = task->job;
+    if (job->alignedPairs != NULL) {
+        alignedPairBuffer_destruct(job->alignedPairs);
+    }
+    job->alignedPairs = getAlignedPairBufferUsingAnchors(job->sM, job->sX, job->sY, job->anchorPairs, task->p,
+                                                         job->diagonalPosteriorProbFn, job->withStates,
+                                                         job->alignmentHasRaggedLeftEnd,
+                                                         job->alignmentHasRaggedRightEnd);
+}
+
+static int64_t batchTask_size(BatchTask *task) {
+    return task->job->sX->length * task->job->sY->length;
+}
+
+static int batchTask_cmpBySize(const void *a, const void *b) {
+    //Largest first, so a long job isn't left to run on its own at the end
+    int64_t i = batchTask_size((BatchTask *) a), j = batchTask_size((BatchTask *) b);
+    return i > j ? -1 : i < j ? 1 : 0;
+}
+
+void getAlignedPairsForBatch(stList *jobs, PairwiseAlignmentParameters *p) {
+    int64_t jobNumber = stList_length(jobs);
+    if (jobNumber == 0) {
+        return;
+    }
+    //Each job gets an equal share of the threads for its sub-alignments, and none for its diagonals if the jobs
+    //run in parallel, so the threads don't multiply
+    PairwiseAlignmentParameters jobP = *p;
+    if (p->threadNumber > 1 && jobNumber > 1) {
+        jobP.threadNumber = p->threadNumber / jobNumber > 1 ? p->threadNumber / jobNumber : 1;
+        jobP.diagonalThreadNumber = 1;
+    }
+    BatchTask *tasks = st_malloc(jobNumber * sizeof(BatchTask));
+    for (int64_t i = 0; i < jobNumber; i++) {
+        tasks[i].job = stList_get(jobs, i);
+        tasks[i].p = &jobP;
+    }
+    qsort(tasks, jobNumber, sizeof(BatchTask), batchTask_cmpBySize);
+    stList *taskList = stList_construct();
+    for (int64_t i = 0; i < jobNumber; i++) {
+        stList_append(taskList, &tasks[i]);
+    }
+
+    threadPool_runTasks(taskList, (void (*)(void *)) batchTask_align, p->threadNumber);
+
+    stList_destruct(taskList);
+    free(tasks);
+}
+
 stList *getAlignedPairs(StateMachine *sM, void *cX, void *cY, int64_t lX, int64_t lY,
                         PairwiseAlignmentParameters *p,
                         void *(*getXFcn)(void *, int64_t),
@@ -1558,14 +4475,16 @@ stList *getAlignedPairs(StateMachine *sM, void *cX, void *cY, int64_t lX, int64_
     return alignedPairs;
 }
 
-stList *getAlignedPairsWithoutBanding(StateMachine *sM, void *cX, void *cY, int64_t lX, int64_t lY,
-                                      PairwiseAlignmentParameters *p,
-                                      void *(*getXFcn)(void *, int64_t),
-                                      void *(*getYFcn)(void *, int64_t),
-                                      void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *,
-                                                                      DpMatrix *, Sequence *, Sequence *, double,
-                                                                      PairwiseAlignmentParameters *, void *),
-                                      bool alignmentHasRaggedLeftEnd, bool alignmentHasRaggedRightEnd) {
+static void getPosteriorProbsWithoutBanding(StateMachine *sM, void *cX, void *cY, int64_t lX, int64_t lY,
+                                            PairwiseAlignmentParameters *p,
+                                            void *(*getXFcn)(void *, int64_t),
+                                            void *(*getYFcn)(void *, int64_t),
+                                            void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *,
+                                                                            DpMatrix *, Sequence *, Sequence *,
+                                                                            double, PairwiseAlignmentParameters *,
+                                                                            void *),
+                                            bool alignmentHasRaggedLeftEnd, bool alignmentHasRaggedRightEnd,
+                                            void *extraArgs) {
     // make sequence objects
     Sequence *ScX = sequence_construct(lX, cX, getXFcn);
     if (sM->type == echelon) {
@@ -1580,43 +4499,134 @@ stList *getAlignedPairsWithoutBanding(StateMachine *sM, void *cX, void *cY, int6
     stList *emptyList = stList_construct(); // place holder for band_construct
     Band *band = band_construct(emptyList, ScX->length, ScY->length, 2); // why 2?
     BandIterator *bandIt = bandIterator_construct(band);
+    ThreadGroup *threadGroup = getDiagonalThreadGroup(p, forwardDpMatrix, backwardDpMatrix);
+    // the emissions of each diagonal are computed once, for the forward pass, and reused by the recomputation
+    // and the backward pass
+    EmissionCache *emissionCache = getEmissionCache(p, diagonalNumber, forwardDpMatrix, backwardDpMatrix);
+
+    // the forward diagonals are split into segments of interval diagonals, only the first and last diagonal of
+    // each segment are kept by the forward pass, the others are recomputed from the end of the previous segment
+    // when the backward pass gets to them
+    int64_t interval = p->checkpointInterval > 0 ? p->checkpointInterval :
+                       (int64_t) ceil(sqrt((double) (diagonalNumber + 1)));
+    int64_t segmentNumber = diagonalNumber / interval + 1;
 
+    // perform forward algorithm
+    DiagonalCalculationFn diagonalCalculationForwardFn = diagonalCalculation_getForwardFn(sM);
     for (int64_t i = 0; i <= diagonalNumber; i++) {
         Diagonal d = bandIterator_getNext(bandIt);
-        dpDiagonal_zeroValues(dpMatrix_createDiagonal(backwardDpMatrix, d));
-        dpDiagonal_zeroValues(dpMatrix_createDiagonal(forwardDpMatrix, d));
+        assert(diagonal_getXay(d) == i);
+        if (i == 0) {
+            dpDiagonal_initialiseValues(dpMatrix_createDiagonal(forwardDpMatrix, d), sM,
+                                        alignmentHasRaggedLeftEnd ? sM->raggedStartStateProb : sM->startStateProb);
+        } else {
+            dpDiagonal_zeroValues(dpMatrix_createDiagonal(forwardDpMatrix, d));
+            diagonalCalculationForwardFn(sM, i, forwardDpMatrix, ScX, ScY);
+        }
+        if (i >= 2 && (i - 2) % interval != 0 && (i - 2) % interval != interval - 1) {
+            dpMatrix_deleteDiagonal(forwardDpMatrix, i - 2);
+        }
     }
 
-    dpDiagonal_initialiseValues(dpMatrix_getDiagonal(forwardDpMatrix, 0), sM,
-                                alignmentHasRaggedLeftEnd ? sM->raggedStartStateProb : sM->startStateProb);
-    dpDiagonal_initialiseValues(dpMatrix_getDiagonal(backwardDpMatrix, diagonalNumber), sM,
+    // calculate total probability
+    dpDiagonal_initialiseValues(dpMatrix_createDiagonal(backwardDpMatrix, band_getDiagonal(band, diagonalNumber)),
+                                sM,
                                 alignmentHasRaggedRightEnd ? sM->raggedEndStateProb : sM->endStateProb);
-
-    // perform forward algorithm
-    for (int64_t i = 0; i <= diagonalNumber; i++) {
-        diagonalCalculationForward(sM, i, forwardDpMatrix, ScX, ScY);
-    }
-    // perform backward algorithm
-    for (int64_t i = diagonalNumber; i > 0; i--) {
-        diagonalCalculationBackward(sM, i, backwardDpMatrix, ScX, ScY);
-    }
-    // calculate total probability, make a place for the aligned pairs to go then run
-    // diagoinalCalculationPosteriorMatchProbs
     double totalProbability = diagonalCalculationTotalProbability(sM, diagonalNumber, forwardDpMatrix,
                                                                   backwardDpMatrix, ScX, ScY);
-    stList *alignedPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
-    void *extraArgs[1] = { alignedPairs };
-    for (int64_t i = 0; i <= diagonalNumber; i++) {
-        diagonalPosteriorProbFn(sM, i, forwardDpMatrix, backwardDpMatrix, ScX, ScY, totalProbability, p, extraArgs);
+
+    // perform backward algorithm a segment at a time, running diagonalPosteriorProbFn on each diagonal once the
+    // backward calculation is done with it
+    DiagonalCalculationFn diagonalCalculationBackwardFn = diagonalCalculation_getBackwardFn(sM);
+    for (int64_t segment = segmentNumber - 1; segment >= 0; segment--) {
+        int64_t segmentStart = segment * interval;
+        int64_t segmentEnd = segmentStart + interval - 1 > diagonalNumber ?
+                             diagonalNumber : segmentStart + interval - 1;
+        // recompute the forward diagonals of the segment
+        for (int64_t i = segmentStart + 1; i <= segmentEnd; i++) {
+            if (dpMatrix_getDiagonal(forwardDpMatrix, i) == NULL) {
+                dpDiagonal_zeroValues(dpMatrix_createDiagonal(forwardDpMatrix, band_getDiagonal(band, i)));
+                diagonalCalculationForwardFn(sM, i, forwardDpMatrix, ScX, ScY);
+            }
+        }
+        for (int64_t i = segmentEnd; i >= segmentStart; i--) {
+            if (i > 0) {
+                // create the earlier diagonals, the backward calculation of i pushes into i - 1 and i - 2
+                if (i == diagonalNumber) {
+                    dpDiagonal_zeroValues(dpMatrix_createDiagonal(backwardDpMatrix, band_getDiagonal(band, i - 1)));
+                }
+                if (i > 1) {
+                    dpDiagonal_zeroValues(dpMatrix_createDiagonal(backwardDpMatrix, band_getDiagonal(band, i - 2)));
+                }
+                diagonalCalculationBackwardFn(sM, i, backwardDpMatrix, ScX, ScY);
+            }
+            diagonalPosteriorProbFn(sM, i, forwardDpMatrix, backwardDpMatrix, ScX, ScY, totalProbability, p,
+                                    extraArgs);
+            // neither is needed by the diagonals still to come
+            dpMatrix_deleteDiagonal(forwardDpMatrix, i);
+            if (i < diagonalNumber) {
+                dpMatrix_deleteDiagonal(backwardDpMatrix, i + 1);
+            }
+            if (emissionCache != NULL) {
+                emissionCache_deleteDiagonal(emissionCache, i);
+            }
+        }
     }
+    dpMatrix_deleteDiagonal(backwardDpMatrix, 0);
+    assert(dpMatrix_getActiveDiagonalNumber(forwardDpMatrix) == 0);
+    assert(dpMatrix_getActiveDiagonalNumber(backwardDpMatrix) == 0);
 
     // cleanup
+    if (threadGroup != NULL) {
+        threadGroup_destruct(threadGroup);
+    }
+    if (emissionCache != NULL) {
+        emissionCache_destruct(emissionCache);
+    }
+    bandIterator_destruct(bandIt);
+    band_destruct(band);
+    stList_destruct(emptyList);
+    dpMatrix_destruct(forwardDpMatrix);
+    dpMatrix_destruct(backwardDpMatrix);
     sequence_sequenceDestroy(ScX);
     sequence_sequenceDestroy(ScY);
+}
 
+stList *getAlignedPairsWithoutBanding(StateMachine *sM, void *cX, void *cY, int64_t lX, int64_t lY,
+                                      PairwiseAlignmentParameters *p,
+                                      void *(*getXFcn)(void *, int64_t),
+                                      void *(*getYFcn)(void *, int64_t),
+                                      void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *,
+                                                                      DpMatrix *, Sequence *, Sequence *, double,
+                                                                      PairwiseAlignmentParameters *, void *),
+                                      bool alignmentHasRaggedLeftEnd, bool alignmentHasRaggedRightEnd) {
+    stList *alignedPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+    void *extraArgs[1] = { alignedPairs };
+    getPosteriorProbsWithoutBanding(sM, cX, cY, lX, lY, p, getXFcn, getYFcn, diagonalPosteriorProbFn,
+                                    alignmentHasRaggedLeftEnd, alignmentHasRaggedRightEnd, extraArgs);
     return alignedPairs;
 }
 
+AlignedPairBuffer *getAlignedPairBufferWithoutBanding(StateMachine *sM, void *cX, void *cY, int64_t lX, int64_t lY,
+                                                      PairwiseAlignmentParameters *p,
+                                                      void *(*getXFcn)(void *, int64_t),
+                                                      void *(*getYFcn)(void *, int64_t),
+                                                      void (*diagonalPosteriorProbFn)(StateMachine *, int64_t,
+                                                                                      DpMatrix *, DpMatrix *,
+                                                                                      Sequence *, Sequence *, double,
+                                                                                      PairwiseAlignmentParameters *,
+                                                                                      void *),
+                                                      bool withStates,
+                                                      bool alignmentHasRaggedLeftEnd,
+                                                      bool alignmentHasRaggedRightEnd) {
+    AlignedPairBuffer *buffer = alignedPairBuffer_construct(withStates);
+    void *extraArgs[1] = { buffer };
+    getPosteriorProbsWithoutBanding(sM, cX, cY, lX, lY, p, getXFcn, getYFcn, diagonalPosteriorProbFn,
+                                    alignmentHasRaggedLeftEnd, alignmentHasRaggedRightEnd, extraArgs);
+    alignedPairBuffer_sortByXPlusY(buffer);
+    return buffer;
+}
+
 void getExpectationsUsingAnchors(StateMachine *sM, Hmm *hmmExpectations,
                                  Sequence *SsX, Sequence *SsY,
                                  stList *anchorPairs,
@@ -0,0 +1,373 @@
+/*
+ * posteriorWriter.c
+ *
+ * Buffered output of the posteriors of signal alignments, as the tab separated table or as binary records.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include "sonLib.h"
+#include "nanopore.h"
+#include "emissionMatrix.h"
+#include "stateMachine.h"
+#include "pairwiseAligner.h"
+#include "posteriorWriter.h"
+
+#define POSTERIOR_WRITER_BUFFER_SIZE (1 << 22)
+// longest "%f" of a double: sign, 309 digits, point and 6 decimals
+#define POSTERIOR_WRITER_MAX_DOUBLE_LENGTH 320
+#define POSTERIOR_WRITER_MAX_INT_LENGTH 24
+
+struct _posteriorWriter {
+    FILE *fH;
+    bool ownsFile;
+    PosteriorsFormat format;
+    char *buffer;
+    int64_t length;
+    int64_t capacity;
+};
+
+///////////////////////////
+// Binary posteriors     //
+///////////////////////////
+
+// The binary posteriors of a strand: this header, the read label and the contig (not nul terminated) and then a
+// record per aligned pair. The descaled values and the reference kmers aren't kept, they follow from the scale and
+// shift and from the target kmers. Records are in the byte order of the machine that wrote them.
+typedef struct _posteriorsHeader {
+    char magic[8];
+    int64_t byteOrder;
+    int64_t pairNumber;
+    int64_t readLabelLength;
+    int64_t contigLength;
+    int64_t strand;
+    int64_t forward;
+    double scale;
+    double shift;
+} PosteriorsHeader;
+
+typedef struct _posteriorRecord {
+    int64_t x; // reference position
+    int64_t y; // event index
+    double eventMean;
+    double eventNoise;
+    double eventDuration;
+    double expectedLevel;
+    double expectedNoise;
+    double posterior;
+    char kmer[KMER_LENGTH]; // target kmer
+} PosteriorRecord;
+
+#define POSTERIORS_MAGIC "cPpost01"
+#define POSTERIORS_BYTE_ORDER 0x0102030405060708
+#define POSTERIORS_CONVERT_CHUNK 4096
+
+// The strands aligned to the reverse complement of the reference
+static bool posteriorWriter_isReversed(Strand strand, bool forward) {
+    return (strand == complement && forward) || (strand == template && (!forward));
+}
+
+///////////////////////////
+// Formatting            //
+///////////////////////////
+
+static char *posteriorWriter_appendUnsigned(char *p, uint64_t n) {
+    char digits[POSTERIOR_WRITER_MAX_INT_LENGTH];
+    int64_t i = 0;
+    do {
+        digits[i++] = (char) ('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+    while (i > 0) {
+        *p++ = digits[--i];
+    }
+    return p;
+}
+
+static char *posteriorWriter_appendInt(char *p, int64_t n) {
+    if (n < 0) {
+        *p++ = '-';
+        return posteriorWriter_appendUnsigned(p, -(uint64_t) n);
+    }
+    return posteriorWriter_appendUnsigned(p, (uint64_t) n);
+}
+
+// Appends x as printf's "%f" gives it. Values that are too large, not finite, or too near halfway between two
+// sixth decimals for the scaled value to round the same way as x itself would go through sprintf.
+static char *posteriorWriter_appendDouble(char *p, double x) {
+    double a = fabs(x);
+    if (a < 1.0e6) {
+        // a * 1.0e6 < 1.0e12 is within 1.0e-4 of the exact product
+        double scaled = a * 1.0e6;
+        double whole = floor(scaled);
+        double fraction = scaled - whole;
+        if (fabs(fraction - 0.5) > 1.0e-3) {
+            uint64_t n = (uint64_t) whole + (fraction > 0.5 ? 1 : 0);
+            if (signbit(x)) {
+                *p++ = '-';
+            }
+            p = posteriorWriter_appendUnsigned(p, n / 1000000);
+            *p++ = '.';
+            uint64_t decimals = n % 1000000;
+            for (int64_t i = 5; i >= 0; i--) {
+                p[i] = (char) ('0' + decimals % 10);
+                decimals /= 10;
+            }
+            return p + 6;
+        }
+    }
+    return p + sprintf(p, "%f", x);
+}
+
+static char *posteriorWriter_appendChars(char *p, const char *chars, int64_t length) {
+    memcpy(p, chars, length);
+    return p + length;
+}
+
+///////////////////////////
+// Writer                //
+///////////////////////////
+
+PosteriorWriter *posteriorWriter_constructForFileHandle(FILE *fH, PosteriorsFormat format) {
+    PosteriorWriter *posteriorWriter = st_malloc(sizeof(PosteriorWriter));
+    posteriorWriter->fH = fH;
+    posteriorWriter->ownsFile = 0;
+    posteriorWriter->format = format;
+    posteriorWriter->capacity = POSTERIOR_WRITER_BUFFER_SIZE;
+    posteriorWriter->buffer = st_malloc(posteriorWriter->capacity);
+    posteriorWriter->length = 0;
+    return posteriorWriter;
+}
+
+PosteriorWriter *posteriorWriter_construct(const char *posteriorsFile, PosteriorsFormat format) {
+    FILE *fH = fopen(posteriorsFile, format == posteriors_binary ? "ab" : "a");
+    if (fH == NULL) {
+        st_errAbort("posteriorWriter_construct: couldn't open %s\n", posteriorsFile);
+    }
+    PosteriorWriter *posteriorWriter = posteriorWriter_constructForFileHandle(fH, format);
+    posteriorWriter->ownsFile = 1;
+    return posteriorWriter;
+}
+
+void posteriorWriter_flush(PosteriorWriter *posteriorWriter) {
+    if (posteriorWriter->length > 0
+        && fwrite(posteriorWriter->buffer, 1, posteriorWriter->length, posteriorWriter->fH)
+           != (size_t) posteriorWriter->length) {
+        st_errAbort("posteriorWriter_flush: couldn't write the posteriors\n");
+    }
+    posteriorWriter->length = 0;
+}
+
+void posteriorWriter_destruct(PosteriorWriter *posteriorWriter) {
+    posteriorWriter_flush(posteriorWriter);
+    if (posteriorWriter->ownsFile) {
+        if (fclose(posteriorWriter->fH) != 0) {
+            st_errAbort("posteriorWriter_destruct: couldn't close the posteriors\n");
+        }
+    } else {
+        fflush(posteriorWriter->fH);
+    }
+    free(posteriorWriter->buffer);
+    free(posteriorWriter);
+}
+
+// Makes room for length more bytes in the buffer, returning where they go
+static char *posteriorWriter_reserve(PosteriorWriter *posteriorWriter, int64_t length) {
+    if (posteriorWriter->length + length > posteriorWriter->capacity) {
+        posteriorWriter_flush(posteriorWriter);
+        if (length > posteriorWriter->capacity) {
+            free(posteriorWriter->buffer);
+            posteriorWriter->capacity = length;
+            posteriorWriter->buffer = st_malloc(posteriorWriter->capacity);
+        }
+    }
+    return posteriorWriter->buffer + posteriorWriter->length;
+}
+
+static void posteriorWriter_appendRow(PosteriorWriter *posteriorWriter, const char *readLabel, int64_t readLabelLength,
+                                      const char *contig, int64_t contigLength, const char *strandLabel,
+                                      PosteriorRecord *record, const char *refKmer, double scale, double shift) {
+    char *p = posteriorWriter_reserve(posteriorWriter, readLabelLength + contigLength + 2 * KMER_LENGTH
+                                                       + 2 * POSTERIOR_WRITER_MAX_INT_LENGTH
+                                                       + 8 * POSTERIOR_WRITER_MAX_DOUBLE_LENGTH + 16);
+    char *start = p;
+    p = posteriorWriter_appendChars(p, contig, contigLength);
+    *p++ = '\t';
+    p = posteriorWriter_appendInt(p, record->x);
+    *p++ = '\t';
+    p = posteriorWriter_appendChars(p, refKmer, KMER_LENGTH);
+    *p++ = '\t';
+    p = posteriorWriter_appendChars(p, readLabel, readLabelLength);
+    *p++ = '\t';
+    *p++ = strandLabel[0];
+    *p++ = '\t';
+    p = posteriorWriter_appendInt(p, record->y);
+    *p++ = '\t';
+    p = posteriorWriter_appendDouble(p, record->eventMean);
+    *p++ = '\t';
+    p = posteriorWriter_appendDouble(p, record->eventNoise);
+    *p++ = '\t';
+    p = posteriorWriter_appendDouble(p, record->eventDuration);
+    *p++ = '\t';
+    p = posteriorWriter_appendChars(p, record->kmer, KMER_LENGTH);
+    *p++ = '\t';
+    p = posteriorWriter_appendDouble(p, record->expectedLevel);
+    *p++ = '\t';
+    p = posteriorWriter_appendDouble(p, record->expectedNoise);
+    *p++ = '\t';
+    p = posteriorWriter_appendDouble(p, record->posterior);
+    *p++ = '\t';
+    p = posteriorWriter_appendDouble(p, (record->eventMean - shift) / scale);
+    *p++ = '\t';
+    p = posteriorWriter_appendDouble(p, (record->expectedLevel - shift) / scale);
+    *p++ = '\n';
+    posteriorWriter->length += p - start;
+}
+
+static void posteriorWriter_appendBinary(PosteriorWriter *posteriorWriter, const void *data, int64_t length) {
+    char *p = posteriorWriter_reserve(posteriorWriter, length);
+    memcpy(p, data, length);
+    posteriorWriter->length += length;
+}
+
+void posteriorWriter_writeStrand(PosteriorWriter *posteriorWriter, const char *readLabel, const char *contig,
+                                 Strand strand, bool forward, const char *target, const double *matchModel,
+                                 double scale, double shift, const double *events, int64_t eventSequenceOffset,
+                                 int64_t referenceSequenceOffset, AlignedPairBuffer *alignedPairs) {
+    int64_t readLabelLength = strlen(readLabel);
+    int64_t contigLength = strlen(contig);
+    char *strandLabel = strand == template ? "t" : "c";
+    bool reversed = posteriorWriter_isReversed(strand, forward);
+
+    // the kmers of the target, and their reverse complements, once for all the pairs
+    int64_t targetLength = strlen(target);
+    int64_t kmerNumber = targetLength >= KMER_LENGTH ? targetLength - KMER_LENGTH + 1 : 0;
+    int32_t *kmerIndices = st_malloc((kmerNumber + 1) * sizeof(int32_t));
+    emissions_discrete_getKmerIndices(target, kmerIndices, kmerNumber);
+    char *rcTarget = reversed ? stString_reverseComplementString(target) : NULL;
+
+    if (posteriorWriter->format == posteriors_binary) {
+        PosteriorsHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, POSTERIORS_MAGIC, sizeof(header.magic));
+        header.byteOrder = POSTERIORS_BYTE_ORDER;
+        header.pairNumber = alignedPairs->length;
+        header.readLabelLength = readLabelLength;
+        header.contigLength = contigLength;
+        header.strand = strand;
+        header.forward = forward;
+        header.scale = scale;
+        header.shift = shift;
+        posteriorWriter_appendBinary(posteriorWriter, &header, sizeof(header));
+        posteriorWriter_appendBinary(posteriorWriter, readLabel, readLabelLength);
+        posteriorWriter_appendBinary(posteriorWriter, contig, contigLength);
+    }
+
+    PosteriorRecord record;
+    memset(&record, 0, sizeof(record));
+    for (int64_t i = 0; i < alignedPairs->length; i++) {
+        int64_t x_i = alignedPairs->xs[i];
+        if (x_i < 0 || x_i >= kmerNumber) {
+            st_errAbort("posteriorWriter_writeStrand: aligned pair at %" PRIi64 " is off the end of the target\n",
+                        x_i);
+        }
+        // the reference coordinate, counted back from the end of the slice on the reverse complement (the
+        // slice being targetLength - KMER_LENGTH events long)
+        record.x = reversed ? referenceSequenceOffset - KMER_LENGTH - x_i : x_i + referenceSequenceOffset;
+        record.y = alignedPairs->ys[i] + eventSequenceOffset;
+        record.eventMean = events[record.y * NB_EVENT_PARAMS];
+        record.eventNoise = events[(record.y * NB_EVENT_PARAMS) + 1];
+        record.eventDuration = events[(record.y * NB_EVENT_PARAMS) + 2];
+        // kmers with an N get no expectations
+        int64_t kmerIndex = kmerIndices[x_i];
+        record.expectedLevel = kmerIndex < NUM_OF_KMERS ? matchModel[1 + (kmerIndex * MODEL_PARAMS)] : 0.0;
+        record.expectedNoise = kmerIndex < NUM_OF_KMERS ? matchModel[1 + (kmerIndex * MODEL_PARAMS + 2)] : 0.0;
+        record.posterior = ((double) alignedPairs->probs[i]) / PAIR_ALIGNMENT_PROB_1;
+        memcpy(record.kmer, target + x_i, KMER_LENGTH);
+
+        if (posteriorWriter->format == posteriors_binary) {
+            posteriorWriter_appendBinary(posteriorWriter, &record, sizeof(record));
+        } else {
+            const char *refKmer = reversed ? rcTarget + (targetLength - x_i - KMER_LENGTH) : target + x_i;
+            posteriorWriter_appendRow(posteriorWriter, readLabel, readLabelLength, contig, contigLength, strandLabel,
+                                      &record, refKmer, scale, shift);
+        }
+    }
+    free(kmerIndices);
+    free(rcTarget);
+}
+
+///////////////////////////
+// Conversion            //
+///////////////////////////
+
+static bool posteriorWriter_convertRecords(PosteriorWriter *posteriorWriter, FILE *fH, PosteriorsHeader *header,
+                                           const char *readLabel, const char *contig) {
+    char *strandLabel = header->strand == template ? "t" : "c";
+    bool reversed = posteriorWriter_isReversed((Strand) header->strand, header->forward);
+    PosteriorRecord *records = st_malloc(POSTERIORS_CONVERT_CHUNK * sizeof(PosteriorRecord));
+    char *kmers = st_malloc(POSTERIORS_CONVERT_CHUNK * KMER_LENGTH + 1);
+    for (int64_t start = 0; start < header->pairNumber; start += POSTERIORS_CONVERT_CHUNK) {
+        int64_t n = header->pairNumber - start < POSTERIORS_CONVERT_CHUNK ? header->pairNumber - start
+                                                                          : POSTERIORS_CONVERT_CHUNK;
+        if (fread(records, sizeof(PosteriorRecord), n, fH) != (size_t) n) {
+            free(records);
+            free(kmers);
+            return 0;
+        }
+        // the reference kmers of the chunk, reverse complemented together so record i's is n - 1 - i from the start
+        char *rcKmers = NULL;
+        if (reversed) {
+            for (int64_t i = 0; i < n; i++) {
+                memcpy(kmers + i * KMER_LENGTH, records[i].kmer, KMER_LENGTH);
+            }
+            kmers[n * KMER_LENGTH] = '\0';
+            rcKmers = stString_reverseComplementString(kmers);
+        }
+        for (int64_t i = 0; i < n; i++) {
+            const char *refKmer = reversed ? rcKmers + (n - 1 - i) * KMER_LENGTH : records[i].kmer;
+            posteriorWriter_appendRow(posteriorWriter, readLabel, header->readLabelLength, contig,
+                                      header->contigLength, strandLabel, &records[i], refKmer, header->scale,
+                                      header->shift);
+        }
+        free(rcKmers);
+    }
+    free(records);
+    free(kmers);
+    return 1;
+}
+
+bool posteriorWriter_convertBinaryFile(PosteriorWriter *posteriorWriter, const char *binaryFile) {
+    FILE *fH = fopen(binaryFile, "rb");
+    if (fH == NULL) {
+        return 0;
+    }
+    bool converted = 1;
+    PosteriorsHeader header;
+    size_t headerLength;
+    while ((headerLength = fread(&header, 1, sizeof(header), fH)) > 0) {
+        if (headerLength != sizeof(header) || memcmp(header.magic, POSTERIORS_MAGIC, sizeof(header.magic)) != 0
+            || header.byteOrder != POSTERIORS_BYTE_ORDER || header.pairNumber < 0 || header.readLabelLength < 0
+            || header.contigLength < 0 || (header.strand != template && header.strand != complement)) {
+            converted = 0;
+            break;
+        }
+        char *readLabel = st_malloc(header.readLabelLength + 1);
+        char *contig = st_malloc(header.contigLength + 1);
+        converted = fread(readLabel, 1, header.readLabelLength, fH) == (size_t) header.readLabelLength
+                    && fread(contig, 1, header.contigLength, fH) == (size_t) header.contigLength
+                    && posteriorWriter_convertRecords(posteriorWriter, fH, &header, readLabel, contig);
+        free(readLabel);
+        free(contig);
+        if (!converted) {
+            break;
+        }
+    }
+    fclose(fH);
+    return converted;
+}
@@ -0,0 +1,398 @@
+/*
+ * seedAnchors.c
+ *
+ * Seed and chain anchoring: the kmers of sX are hashed, those of sY looked up to give seed hits, hits on the same
+ * diagonal merged into segments and the best chain of segments found by dynamic programming. The gaps between the
+ * segments of the chain are filled by global alignment and its ends extended without gaps, giving runs of aligned
+ * columns that are trimmed into anchor pairs.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "sonLib.h"
+#include "seedAnchors.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Seeds
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define SEED_NO_KMER UINT32_MAX
+
+static inline int64_t seed_getBaseCode(char c, bool repeatMask) {
+    switch (repeatMask ? c : toupper(c)) {
+        case 'A':
+            return 0;
+        case 'C':
+            return 1;
+        case 'G':
+            return 2;
+        case 'T':
+            return 3;
+        default:
+            return -1;
+    }
+}
+
+//Code of the kmer starting at each position of s, SEED_NO_KMER where the kmer has a base that can't be seeded from
+static uint32_t *seed_getKmerCodes(const char *s, int64_t l, bool repeatMask) {
+    uint32_t *codes = st_malloc(l * sizeof(uint32_t));
+    uint32_t mask = (((uint32_t) 1) << (2 * SEED_KMER_LENGTH)) - 1;
+    uint32_t code = 0;
+    int64_t validBases = 0;
+    for (int64_t i = 0; i < l; i++) {
+        int64_t baseCode = seed_getBaseCode(s[i], repeatMask);
+        if (baseCode < 0) {
+            validBases = 0;
+        } else {
+            code = ((code << 2) | baseCode) & mask;
+            validBases++;
+        }
+        codes[i] = SEED_NO_KMER;
+        if (i >= SEED_KMER_LENGTH - 1) {
+            codes[i - SEED_KMER_LENGTH + 1] = validBases >= SEED_KMER_LENGTH ? code : SEED_NO_KMER;
+        }
+    }
+    return codes;
+}
+
+static inline uint32_t seed_hash(uint32_t code, int64_t bits) {
+    return (uint32_t) (code * UINT32_C(2654435761)) >> (32 - bits);
+}
+
+typedef struct _seedHit {
+    int64_t x, y;
+} SeedHit;
+
+static int seedHit_cmpByDiagonal(const void *a, const void *b) {
+    const SeedHit *i = a, *j = b;
+    int64_t k = i->y - i->x, l = j->y - j->x;
+    if (k != l) {
+        return k < l ? -1 : 1;
+    }
+    return i->x < j->x ? -1 : (i->x > j->x ? 1 : 0);
+}
+
+//The pairs of positions with the same kmer in sX and sY, skipping kmers occurring more than SEED_MAX_OCCURRENCES
+//times in sX
+static SeedHit *seed_getHits(uint32_t *codesX, int64_t lX, uint32_t *codesY, int64_t lY, int64_t *hitNumber) {
+    //Hash the kmers of sX into buckets, stored contiguously
+    int64_t bits = 1;
+    while ((((int64_t) 1) << bits) < lX && bits < 30) {
+        bits++;
+    }
+    int64_t bucketNumber = ((int64_t) 1) << bits;
+    int64_t *bucketStarts = st_calloc(bucketNumber + 1, sizeof(int64_t));
+    for (int64_t x = 0; x < lX; x++) {
+        if (codesX[x] != SEED_NO_KMER) {
+            bucketStarts[seed_hash(codesX[x], bits) + 1]++;
+        }
+    }
+    for (int64_t i = 0; i < bucketNumber; i++) {
+        bucketStarts[i + 1] += bucketStarts[i];
+    }
+    int64_t *positions = st_malloc((bucketStarts[bucketNumber] + 1) * sizeof(int64_t));
+    int64_t *bucketEnds = st_malloc(bucketNumber * sizeof(int64_t));
+    memcpy(bucketEnds, bucketStarts, bucketNumber * sizeof(int64_t));
+    for (int64_t x = 0; x < lX; x++) {
+        if (codesX[x] != SEED_NO_KMER) {
+            positions[bucketEnds[seed_hash(codesX[x], bits)]++] = x;
+        }
+    }
+    free(bucketEnds);
+
+    //Look up the kmers of sY
+    int64_t maxHitNumber = 64;
+    SeedHit *hits = st_malloc(maxHitNumber * sizeof(SeedHit));
+    *hitNumber = 0;
+    for (int64_t y = 0; y < lY; y++) {
+        uint32_t code = codesY[y];
+        if (code == SEED_NO_KMER) {
+            continue;
+        }
+        uint32_t bucket = seed_hash(code, bits);
+        int64_t occurrences = 0;
+        for (int64_t i = bucketStarts[bucket]; i < bucketStarts[bucket + 1]; i++) {
+            occurrences += codesX[positions[i]] == code;
+        }
+        if (occurrences == 0 || occurrences > SEED_MAX_OCCURRENCES) {
+            continue;
+        }
+        if (*hitNumber + occurrences > maxHitNumber) {
+            maxHitNumber = 2 * (*hitNumber + occurrences);
+            SeedHit *hits2 = st_malloc(maxHitNumber * sizeof(SeedHit));
+            memcpy(hits2, hits, *hitNumber * sizeof(SeedHit));
+            free(hits);
+            hits = hits2;
+        }
+        for (int64_t i = bucketStarts[bucket]; i < bucketStarts[bucket + 1]; i++) {
+            if (codesX[positions[i]] == code) {
+                hits[*hitNumber].x = positions[i];
+                hits[*hitNumber].y = y;
+                (*hitNumber)++;
+            }
+        }
+    }
+    free(positions);
+    free(bucketStarts);
+    return hits;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Chaining
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Ungapped run of overlapping seed hits on one diagonal
+typedef struct _seedSegment {
+    int64_t x, y, length;
+} SeedSegment;
+
+static int seedSegment_cmpByX(const void *a, const void *b) {
+    const SeedSegment *i = a, *j = b;
+    if (i->x != j->x) {
+        return i->x < j->x ? -1 : 1;
+    }
+    return i->y < j->y ? -1 : (i->y > j->y ? 1 : 0);
+}
+
+//Merges the hits, sorted by diagonal, into segments, sorted by x
+static SeedSegment *seed_getSegments(SeedHit *hits, int64_t hitNumber, int64_t *segmentNumber) {
+    SeedSegment *segments = st_malloc((hitNumber + 1) * sizeof(SeedSegment));
+    *segmentNumber = 0;
+    for (int64_t i = 0; i < hitNumber; i++) {
+        if (*segmentNumber > 0) {
+            SeedSegment *segment = &segments[*segmentNumber - 1];
+            if (segment->y - segment->x == hits[i].y - hits[i].x && hits[i].x <= segment->x + segment->length) {
+                segment->length = hits[i].x + SEED_KMER_LENGTH - segment->x;
+                continue;
+            }
+        }
+        segments[*segmentNumber].x = hits[i].x;
+        segments[*segmentNumber].y = hits[i].y;
+        segments[*segmentNumber].length = SEED_KMER_LENGTH;
+        (*segmentNumber)++;
+    }
+    qsort(segments, *segmentNumber, sizeof(SeedSegment), seedSegment_cmpByX);
+    return segments;
+}
+
+/*
+ * Best scoring chain of segments, each strictly after the one before in both sequences, scored by the number of
+ * bases the segments add less SEED_GAP_PENALTY per diagonal moved between them. Returns the segments of the
+ * chain, in order, or an empty list if no chain scores SEED_MIN_CHAIN_SCORE.
+ */
+static stList *seed_getBestChain(SeedSegment *segments, int64_t segmentNumber) {
+    int64_t *scores = st_malloc((segmentNumber + 1) * sizeof(int64_t));
+    int64_t *predecessors = st_malloc((segmentNumber + 1) * sizeof(int64_t));
+    int64_t best = -1;
+    for (int64_t j = 0; j < segmentNumber; j++) {
+        SeedSegment *s2 = &segments[j];
+        scores[j] = s2->length;
+        predecessors[j] = -1;
+        for (int64_t i = j - 1; i >= 0 && i >= j - SEED_CHAIN_LOOKBACK; i--) {
+            SeedSegment *s1 = &segments[i];
+            int64_t addedX = s2->x + s2->length - (s1->x + s1->length);
+            int64_t addedY = s2->y + s2->length - (s1->y + s1->length);
+            if (s1->x >= s2->x || s1->y >= s2->y || addedX <= 0 || addedY <= 0) {
+                continue;
+            }
+            int64_t added = s2->length < addedX ? s2->length : addedX;
+            added = added < addedY ? added : addedY;
+            int64_t diagonalChange = (s2->y - s2->x) - (s1->y - s1->x);
+            int64_t score = scores[i] + added - SEED_GAP_PENALTY * (diagonalChange < 0 ? -diagonalChange
+                                                                                      : diagonalChange);
+            if (score > scores[j]) {
+                scores[j] = score;
+                predecessors[j] = i;
+            }
+        }
+        if (best == -1 || scores[j] > scores[best]) {
+            best = j;
+        }
+    }
+    stList *chain = stList_construct();
+    if (best != -1 && scores[best] >= SEED_MIN_CHAIN_SCORE) {
+        for (int64_t i = best; i != -1; i = predecessors[i]) {
+            stList_append(chain, &segments[i]);
+        }
+        stList_reverse(chain);
+    }
+    free(scores);
+    free(predecessors);
+    return chain;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Extension into anchor pairs
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Collects aligned columns into runs, and the trimmed runs into anchor pairs
+typedef struct _seedRuns {
+    int64_t x, y, length; //The current run
+    int64_t trim;
+    stList *anchorPairs;
+} SeedRuns;
+
+static void seedRuns_flush(SeedRuns *runs) {
+    for (int64_t l = runs->trim; l < runs->length - runs->trim; l++) {
+        stList_append(runs->anchorPairs, stIntTuple_construct2(runs->x + l, runs->y + l));
+    }
+    runs->length = 0;
+}
+
+static void seedRuns_addColumns(SeedRuns *runs, int64_t x, int64_t y, int64_t length) {
+    if (length <= 0) {
+        return;
+    }
+    if (runs->length == 0 || x != runs->x + runs->length || y != runs->y + runs->length) {
+        seedRuns_flush(runs);
+        runs->x = x;
+        runs->y = y;
+    }
+    runs->length += length;
+}
+
+static inline int64_t seed_columnScore(char c1, char c2) {
+    return toupper(c1) == toupper(c2) && seed_getBaseCode(c1, 0) >= 0 ? 1 : -1;
+}
+
+//Number of columns an ungapped extension from (x, y), in direction step, should take
+static int64_t seed_extend(const char *sX, int64_t lX, const char *sY, int64_t lY, int64_t x, int64_t y,
+                           int64_t step) {
+    int64_t score = 0, bestScore = 0, bestLength = 0;
+    for (int64_t i = 0; x >= 0 && x < lX && y >= 0 && y < lY; i++) {
+        score += seed_columnScore(sX[x], sY[y]);
+        if (score > bestScore) {
+            bestScore = score;
+            bestLength = i + 1;
+        } else if (score < bestScore - SEED_X_DROP) {
+            break;
+        }
+        x += step;
+        y += step;
+    }
+    return bestLength;
+}
+
+/*
+ * Global alignment of sX[x1, x2) with sY[y1, y2), scoring +1 for a match, -1 for a mismatch and
+ * SEED_FILL_GAP_PENALTY for each gap, adding the aligned columns to runs. Left unaligned if bigger than
+ * SEED_MAX_FILL_CELLS.
+ */
+static void seed_fillGap(const char *sX, const char *sY, int64_t x1, int64_t x2, int64_t y1, int64_t y2,
+                         SeedRuns *runs) {
+    int64_t gX = x2 - x1, gY = y2 - y1;
+    if (gX <= 0 || gY <= 0 || gX * gY > SEED_MAX_FILL_CELLS) {
+        return;
+    }
+    int64_t width = gY + 1;
+    int32_t *m = st_malloc((gX + 1) * width * sizeof(int32_t));
+    for (int64_t i = 0; i <= gX; i++) {
+        m[i * width] = -i * SEED_FILL_GAP_PENALTY;
+    }
+    for (int64_t j = 0; j <= gY; j++) {
+        m[j] = -j * SEED_FILL_GAP_PENALTY;
+    }
+    for (int64_t i = 1; i <= gX; i++) {
+        for (int64_t j = 1; j <= gY; j++) {
+            int32_t diagonal = m[(i - 1) * width + j - 1] + seed_columnScore(sX[x1 + i - 1], sY[y1 + j - 1]);
+            int32_t up = m[(i - 1) * width + j] - SEED_FILL_GAP_PENALTY;
+            int32_t left = m[i * width + j - 1] - SEED_FILL_GAP_PENALTY;
+            int32_t score = diagonal >= up ? diagonal : up;
+            m[i * width + j] = score >= left ? score : left;
+        }
+    }
+    //Trace back, collecting the aligned columns in reverse
+    int64_t *columns = st_malloc((gX < gY ? gX : gY) * sizeof(int64_t));
+    int64_t columnNumber = 0;
+    int64_t i = gX, j = gY;
+    while (i > 0 && j > 0) {
+        if (m[i * width + j] == m[(i - 1) * width + j - 1] + seed_columnScore(sX[x1 + i - 1], sY[y1 + j - 1])) {
+            columns[columnNumber++] = (i - 1) * width + j - 1;
+            i--;
+            j--;
+        } else if (m[i * width + j] == m[(i - 1) * width + j] - SEED_FILL_GAP_PENALTY) {
+            i--;
+        } else {
+            j--;
+        }
+    }
+    for (int64_t k = columnNumber - 1; k >= 0; k--) {
+        seedRuns_addColumns(runs, x1 + columns[k] / width, y1 + columns[k] % width, 1);
+    }
+    free(columns);
+    free(m);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Anchors
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+stList *getSeedPairs(const char *sX, const char *sY, int64_t trim, bool repeatMask) {
+    /*
+     * Uses seeds to compute a bunch of monotonically increasing pairs such that for any pair of consecutive
+     * pairs in the list (x1, y1) (x2, y2) in the set of aligned pairs x1 appears before x2 in X and y1
+     * appears before y2 in Y.
+     */
+    stList *anchorPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+    int64_t lX = strlen(sX);
+    int64_t lY = strlen(sY);
+    if (lX < SEED_KMER_LENGTH || lY < SEED_KMER_LENGTH) {
+        return anchorPairs;
+    }
+
+    uint32_t *codesX = seed_getKmerCodes(sX, lX, repeatMask);
+    uint32_t *codesY = seed_getKmerCodes(sY, lY, repeatMask);
+    int64_t hitNumber;
+    SeedHit *hits = seed_getHits(codesX, lX, codesY, lY, &hitNumber);
+    qsort(hits, hitNumber, sizeof(SeedHit), seedHit_cmpByDiagonal);
+    int64_t segmentNumber;
+    SeedSegment *segments = seed_getSegments(hits, hitNumber, &segmentNumber);
+    stList *chain = seed_getBestChain(segments, segmentNumber);
+    st_logDebug("Got %" PRIi64 " seed hits, %" PRIi64 " segments and a chain of %" PRIi64 "\n", hitNumber,
+                segmentNumber, stList_length(chain));
+
+    SeedRuns runs = { 0, 0, 0, trim, anchorPairs };
+    int64_t pX = 0, pY = 0; //End of the chain so far
+    for (int64_t i = 0; i < stList_length(chain); i++) {
+        SeedSegment segment = *(SeedSegment *) stList_get(chain, i);
+        if (i == 0) {
+            int64_t extension = seed_extend(sX, lX, sY, lY, segment.x - 1, segment.y - 1, -1);
+            segment.x -= extension;
+            segment.y -= extension;
+            segment.length += extension;
+        } else {
+            //Clip any overlap with the previous segment
+            int64_t overlap = pX - segment.x > pY - segment.y ? pX - segment.x : pY - segment.y;
+            if (overlap > 0) {
+                segment.x += overlap;
+                segment.y += overlap;
+                segment.length -= overlap;
+            }
+            if (segment.length <= 0) {
+                continue;
+            }
+            seed_fillGap(sX, sY, pX, segment.x, pY, segment.y, &runs);
+        }
+        seedRuns_addColumns(&runs, segment.x, segment.y, segment.length);
+        pX = segment.x + segment.length;
+        pY = segment.y + segment.length;
+    }
+    //Extend the end of the last segment kept, which needn't be the last of the chain if that was clipped away
+    if (stList_length(chain) > 0) {
+        seedRuns_addColumns(&runs, pX, pY, seed_extend(sX, lX, sY, lY, pX, pY, 1));
+    }
+    seedRuns_flush(&runs);
+
+    stList_destruct(chain);
+    free(segments);
+    free(hits);
+    free(codesX);
+    free(codesY);
+    return anchorPairs;
+}
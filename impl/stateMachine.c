@@ -11,6 +11,12 @@
 #include <ctype.h>
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stateMachine.h>
 #include "nanopore.h"
 #include "nanopore_hdp.h"
@@ -19,6 +25,7 @@
 #include "pairwiseAligner.h"
 #include "stateMachine.h"
 #include "emissionMatrix.h"
+#include "vectorMath.h"
 #include "discreteHmm.h"
 
 //////////////////////////////////////////////////////////////////////////////
@@ -39,18 +46,6 @@ static void index_check(int64_t c) {
     assert(c >= 0 && c < NUM_OF_KMERS);
 }
 
-// from SO: http://stackoverflow.com/questions/213042/how-do-you-do-exponentiation-in-c
-static int64_t intPow(int64_t base, int64_t exp) {
-    if (exp == 0) {
-        return 1;
-    } else if (exp % 2) {
-        return base * intPow(base, exp - 1);
-    } else {
-        int64_t tmp = intPow(base, exp / 2);
-        return tmp * tmp;
-    }
-}
-
 static inline void emissions_discrete_initializeEmissionsMatrices(StateMachine *sM) {
     sM->EMISSION_GAP_X_PROBS = st_malloc(sM->parameterSetSize*sizeof(double));
     sM->EMISSION_GAP_Y_PROBS = st_malloc(sM->parameterSetSize*sizeof(double));
@@ -122,9 +117,7 @@ int64_t emissions_discrete_getKmerIndex(void *kmer) {
     if (kmerLen == 0) {
         return NUM_OF_KMERS + 1;
     }
-    // TODO hardwire this for speed?
-    int64_t axisLength = intPow(SYMBOL_NUMBER_NO_N, KMER_LENGTH);
-    int64_t l = axisLength / SYMBOL_NUMBER_NO_N;
+    int64_t l = NUM_OF_KMERS / SYMBOL_NUMBER_NO_N;
     int64_t i = 0;
     int64_t x = 0;
     while(l > 1) {
@@ -132,24 +125,56 @@ int64_t emissions_discrete_getKmerIndex(void *kmer) {
         i += 1;
         l = l / SYMBOL_NUMBER_NO_N;
     }
-    int64_t last = strlen(kmer) - 1;
+    int64_t last = kmerLen - 1;
     x += emissions_discrete_getBaseIndex((char *)kmer + last);
 
     return x;
 }
 
-int64_t emissions_discrete_getKmerIndexFromKmer(void *kmer) {
-    // make temp kmer meant to work with getKmer
-    char *kmer_i = malloc((KMER_LENGTH) * sizeof(char));
+void emissions_discrete_getKmerIndices(const char *sequence, int32_t *kmerIndices, int64_t kmerNumber) {
+    // rolling 2-bit encoding of the kmers made only of A, C, G and T, the same as emissions_discrete_getKmerIndex
+    // gives them, the others (and those cut short by the end of the sequence) go through
+    // emissions_discrete_getKmerIndex
+    assert(SYMBOL_NUMBER_NO_N == 4);
+    assert(NUM_OF_KMERS == (1 << (2 * KMER_LENGTH)));
+    int64_t kmerIndex = 0;
+    int64_t validBases = 0; // number of A, C, G or T in a row ending at the last base read
+    int64_t end = 0; // bases read
+    for (int64_t i = 0; i < kmerNumber; i++) {
+        while (end < i + KMER_LENGTH && sequence[end] != '\0') {
+            int64_t b = emissions_discrete_getBaseIndex((char *) sequence + end);
+            if (b < SYMBOL_NUMBER_NO_N) {
+                kmerIndex = ((kmerIndex << 2) | b) & (NUM_OF_KMERS - 1);
+                validBases++;
+            } else {
+                validBases = 0;
+            }
+            end++;
+        }
+        if (end == i + KMER_LENGTH && validBases >= KMER_LENGTH) {
+            kmerIndices[i] = (int32_t) kmerIndex;
+        } else {
+            char kmer_i[KMER_LENGTH + 1];
+            strncpy(kmer_i, sequence + i, KMER_LENGTH);
+            kmer_i[KMER_LENGTH] = '\0';
+            kmerIndices[i] = (int32_t) emissions_discrete_getKmerIndex(kmer_i);
+        }
+    }
+}
+
+// Index of the kmer starting offset characters into kmer, cut short if it runs into the end of the string
+static int64_t emissions_discrete_getKmerIndexAt(void *kmer, int64_t offset) {
+    char kmer_i[KMER_LENGTH + 1];
     for (int64_t x = 0; x < KMER_LENGTH; x++) {
-        kmer_i[x] = *((char *)kmer+x);
+        kmer_i[x] = *((char *)kmer+(x+offset));
     }
     kmer_i[KMER_LENGTH] = '\0';
+    return emissions_discrete_getKmerIndex(kmer_i);
+}
 
-    int64_t i = emissions_discrete_getKmerIndex(kmer_i);
-    //index_check(i);
-    free(kmer_i);
-    return i;
+int64_t emissions_discrete_getKmerIndexFromKmer(void *kmer) {
+    // meant to work with getKmer
+    return emissions_discrete_getKmerIndexAt(kmer, 0);
 }
 
 double emissions_symbol_getGapProb(const double *emissionGapProbs, void *base) {
@@ -172,19 +197,18 @@ double emissions_symbol_getMatchProb(const double *emissionMatchProbs, void *x,
     return emissionMatchProbs[iX * SYMBOL_NUMBER_NO_N + iY];
 }
 
+static inline double emissions_kmer_getGapProbP(const double *emissionGapProbs, int64_t i) {
+    return i > NUM_OF_KMERS ? LOG_ZERO : emissionGapProbs[i];
+}
+
 double emissions_kmer_getGapProb(const double *emissionGapProbs, void *kmer) {
-    // make temp kmer meant to work with getKmer
-    char *kmer_i = malloc((KMER_LENGTH) * sizeof(char));
-    for (int64_t x = 0; x < KMER_LENGTH; x++) {
-        kmer_i[x] = *((char *)kmer+x);
-    }
-    kmer_i[KMER_LENGTH] = '\0';
+    // meant to work with getKmer
+    return emissions_kmer_getGapProbP(emissionGapProbs, emissions_discrete_getKmerIndexAt(kmer, 0));
+}
 
-    int64_t i = emissions_discrete_getKmerIndex(kmer_i);
-    //index_check(i);
-    free(kmer_i);
-    double p = i > NUM_OF_KMERS ? LOG_ZERO : emissionGapProbs[i];
-    return p;
+double emissions_kmer_getGapProbFromIndex(const double *emissionGapProbs, void *kmerIndex) {
+    // meant to work with sequence_getKmerIndex
+    return emissions_kmer_getGapProbP(emissionGapProbs, *(int32_t *) kmerIndex);
 }
 
 double emissions_kmer_getMatchProb(const double *emissionMatchProbs, void *x, void *y) {
@@ -199,6 +223,24 @@ double emissions_kmer_getMatchProb(const double *emissionMatchProbs, void *x, vo
 
 /////////////////////////////////////////// STATIC FUNCTIONS ////////////////////////////////////////////////////////
 
+// the model values take the first 1 + NUM_OF_KMERS * MODEL_PARAMS doubles, the derived params start at the
+// next 64 byte boundary after them
+#define SIGNAL_MODEL_LENGTH (1 + (NUM_OF_KMERS * MODEL_PARAMS))
+// number of kmer skip bins on the second line of a model file
+#define SIGNAL_SKIP_BINS 30
+
+static inline const SignalKmerParams *emissions_signal_getKmerParams(const double *eventModel) {
+    return (const SignalKmerParams *) (((uintptr_t) (eventModel + SIGNAL_MODEL_LENGTH) + 63) & ~((uintptr_t) 63));
+}
+
+static double *emissions_signal_constructModel(int64_t parameterSetSize) {
+    if (parameterSetSize != NUM_OF_KMERS) {
+        st_errAbort("emissions_signal_constructModel: signal models have %i kmers, got %lld\n", NUM_OF_KMERS,
+                    parameterSetSize);
+    }
+    return st_malloc(SIGNAL_MODEL_LENGTH * sizeof(double) + 64 + NUM_OF_KMERS * sizeof(SignalKmerParams));
+}
+
 static inline void emissions_vanilla_initializeEmissionsMatrices(StateMachine *sM, int64_t nbSkipParams) {
     // changed to 30 for skip prob bins
     // the kmer/gap and skip (f(|ui-1 - ui|)) probs have smaller tables, either 30 for the skip or parameterSetSize
@@ -207,8 +249,8 @@ static inline void emissions_vanilla_initializeEmissionsMatrices(StateMachine *s
     sM->EMISSION_GAP_X_PROBS = st_malloc(nbSkipParams * sizeof(double));
 
     // both the Iy and M - type states use the event/kmer match model so the matrices need to be the same size
-    sM->EMISSION_GAP_Y_PROBS = st_malloc(1 + (sM->parameterSetSize * MODEL_PARAMS) * sizeof(double));
-    sM->EMISSION_MATCH_PROBS = st_malloc(1 + (sM->parameterSetSize * MODEL_PARAMS) * sizeof(double));
+    sM->EMISSION_GAP_Y_PROBS = emissions_signal_constructModel(sM->parameterSetSize);
+    sM->EMISSION_MATCH_PROBS = emissions_signal_constructModel(sM->parameterSetSize);
 }
 
 static inline void emissions_signal_initMatchMatrixToZero(double *matchModel, int64_t parameterSetSize) {
@@ -240,7 +282,8 @@ static inline double emissions_signal_getModelFluctuationLambda(const double *ev
     return kmerIndex > NUM_OF_KMERS ? 0.0 : eventModel[1 + (kmerIndex * MODEL_PARAMS + 4)];
 }
 
-static void emissions_signal_loadPoreModel(StateMachine *sM, const char *modelFile, StateMachineType type) {
+static void emissions_signal_parsePoreModel(const char *modelFile, double *matchModel, double *skipBins,
+                                           double *gapYModel) {
     /*
      *  the model file has the format:
      *  line 1: [correlation coefficient] [level_mean] [level_sd] [noise_mean]
@@ -251,17 +294,20 @@ static void emissions_signal_loadPoreModel(StateMachine *sM, const char *modelFi
      */
 
     FILE *fH = fopen(modelFile, "r");
+    if (fH == NULL) {
+        st_errAbort("emissions_signal_loadPoreModel: couldn't open pore model %s\n", modelFile);
+    }
 
     // Line 1: parse the match emissions line
     char *string = stFile_getLineFromFile(fH);
     stList *tokens = stString_split(string);
     // check to make sure that the model will fit in the stateMachine
-    if (stList_length(tokens) != 1 + (sM->parameterSetSize * MODEL_PARAMS)) {
+    if (stList_length(tokens) != SIGNAL_MODEL_LENGTH) {
         st_errAbort("This stateMachine is not correct for signal model (match emissions)\n");
     }
     // load the model into the state machine emissions
-    for (int64_t i = 0; i < 1 + (sM->parameterSetSize * MODEL_PARAMS); i++) {
-        int64_t j = sscanf(stList_get(tokens, i), "%lf", &(sM->EMISSION_MATCH_PROBS[i]));
+    for (int64_t i = 0; i < SIGNAL_MODEL_LENGTH; i++) {
+        int64_t j = sscanf(stList_get(tokens, i), "%lf", &(matchModel[i]));
         if (j != 1) {
             st_errAbort("emissions_signal_loadPoreModel: error loading pore model (match emissions)\n");
         }
@@ -274,23 +320,14 @@ static void emissions_signal_loadPoreModel(StateMachine *sM, const char *modelFi
     string = stFile_getLineFromFile(fH);
     tokens = stString_split(string);
     // check for correctness
-    if (stList_length(tokens) != 30) {
+    if (stList_length(tokens) != SIGNAL_SKIP_BINS) {
         st_errAbort("Did not get expected number of kmer skip bins, expected 30, got %lld\n",
                     stList_length(tokens));
     }
-
-    // load in the kmer skip 'bins' for the vanilla and echelon models
-    if (type == vanilla || type == echelon) {
-        // load X Gap emissions into stateMachine
-        for (int64_t i = 0; i < 30; i++) {
-            int64_t j = sscanf(stList_get(tokens, i), "%lf", &(sM->EMISSION_GAP_X_PROBS[i]));
-            int64_t a = sscanf(stList_get(tokens, i), "%lf", &(sM->EMISSION_GAP_X_PROBS[i+30]));
-            if (j != 1) {
-                st_errAbort("emissions_signal_loadPoreModel: error loading vanilla alpha kmer skip bins\n");
-            }
-            if (a != 1) {
-                st_errAbort("emissions_signal_loadPoreModel: error loading vanilla kmer beta skip bins\n");
-            }
+    for (int64_t i = 0; i < SIGNAL_SKIP_BINS; i++) {
+        int64_t j = sscanf(stList_get(tokens, i), "%lf", &(skipBins[i]));
+        if (j != 1) {
+            st_errAbort("emissions_signal_loadPoreModel: error loading vanilla kmer skip bins\n");
         }
     }
 
@@ -302,12 +339,12 @@ static void emissions_signal_loadPoreModel(StateMachine *sM, const char *modelFi
     string = stFile_getLineFromFile(fH);
     tokens = stString_split(string);
     // check to make sure that the model will fit in the stateMachine
-    if (stList_length(tokens) != 1 + (sM->parameterSetSize * MODEL_PARAMS)) {
+    if (stList_length(tokens) != SIGNAL_MODEL_LENGTH) {
         st_errAbort("This stateMachine is not correct for signal model (dupeEvent - Y emissions)\n");
     }
     // load the model into the state machine emissions
-    for (int64_t i = 0; i < 1 + (sM->parameterSetSize * MODEL_PARAMS); i++) {
-        int64_t j = sscanf(stList_get(tokens, i), "%lf", &(sM->EMISSION_GAP_Y_PROBS[i]));
+    for (int64_t i = 0; i < SIGNAL_MODEL_LENGTH; i++) {
+        int64_t j = sscanf(stList_get(tokens, i), "%lf", &(gapYModel[i]));
         if (j != 1) {
             st_errAbort("emissions_signal_loadPoreModel: error loading pore model (dupeEvent - Y emissions)\n");
         }
@@ -318,6 +355,29 @@ static void emissions_signal_loadPoreModel(StateMachine *sM, const char *modelFi
 
     // close file
     fclose(fH);
+
+    emissions_signal_deriveKmerParams(matchModel);
+    emissions_signal_deriveKmerParams(gapYModel);
+}
+
+static void emissions_signal_setSkipBins(StateMachine *sM, const double *skipBins) {
+    // the vanilla and echelon models take the kmer skip 'bins' as both their alpha and beta skip probs, the others
+    // don't use them
+    if (sM->type == vanilla || sM->type == echelon) {
+        for (int64_t i = 0; i < SIGNAL_SKIP_BINS; i++) {
+            sM->EMISSION_GAP_X_PROBS[i] = skipBins[i];
+            sM->EMISSION_GAP_X_PROBS[i + SIGNAL_SKIP_BINS] = skipBins[i];
+        }
+    }
+}
+
+static void emissions_signal_loadPoreModel(StateMachine *sM, const char *modelFile) {
+    if (sM->parameterSetSize != NUM_OF_KMERS) {
+        st_errAbort("This stateMachine is not correct for signal model (match emissions)\n");
+    }
+    double skipBins[SIGNAL_SKIP_BINS];
+    emissions_signal_parsePoreModel(modelFile, sM->EMISSION_MATCH_PROBS, skipBins, sM->EMISSION_GAP_Y_PROBS);
+    emissions_signal_setSkipBins(sM, skipBins);
 }
 
 static inline double emissions_signal_logInvGaussPdf(double eventNoise, double modelNoiseMean,
@@ -343,6 +403,16 @@ static inline double emissions_signal_logGaussPdf(double x, double mu, double si
     return log_inv_sqrt_2pi - l_sigma + (-0.5 * a * a);
 }
 
+// emissions_signal_logGaussPdf with the terms of the model taken from a SignalKmerParams, multiplying by the
+// reciprocal of sigma, so it agrees with it to within rounding
+static inline double emissions_signal_logGaussPdfFromParams(double x, double mu, double invSigma, double logNorm) {
+    if (isinf(invSigma)) {
+        return LOG_ZERO;
+    }
+    double a = (x - mu) * invSigma;
+    return logNorm + (-0.5 * a * a);
+}
+
 static double emissions_signal_poissonPosteriorProb(int64_t n, double duration) {
     assert(n <= 5);
 
@@ -384,26 +454,12 @@ void emissions_signal_initEmissionsToZero(StateMachine *sM, int64_t nbSkipParams
 
     // set match matrix to zeros
     emissions_signal_initMatchMatrixToZero(sM->EMISSION_MATCH_PROBS, sM->parameterSetSize);
-}
-
-int64_t emissions_signal_getKmerSkipBin(double *matchModel, void *kmers) {
-    char *kmer_im1 = malloc((KMER_LENGTH) * sizeof(char));
-    for (int64_t x = 0; x < KMER_LENGTH; x++) {
-        kmer_im1[x] = *((char *)kmers+x);
-    }
-    kmer_im1[KMER_LENGTH] = '\0';
 
-    // make kmer_i
-    char *kmer_i = malloc((KMER_LENGTH) * sizeof(char));
-    for (int64_t x = 0; x < KMER_LENGTH; x++) {
-        kmer_i[x] = *((char *)kmers+(x+1));
-    }
-    kmer_i[KMER_LENGTH] = '\0';
-
-    // get indices
-    int64_t k_i= emissions_discrete_getKmerIndex(kmer_i);
-    int64_t k_im1 = emissions_discrete_getKmerIndex(kmer_im1);
+    emissions_signal_deriveKmerParams(sM->EMISSION_GAP_Y_PROBS);
+    emissions_signal_deriveKmerParams(sM->EMISSION_MATCH_PROBS);
+}
 
+static int64_t emissions_signal_getKmerSkipBinP(const double *matchModel, int64_t k_i, int64_t k_im1) {
     // get the expected mean current for each one
     double u_ki = emissions_signal_getModelLevelMean(matchModel, k_i);
     double u_kim1 = emissions_signal_getModelLevelMean(matchModel, k_im1);
@@ -414,11 +470,21 @@ int64_t emissions_signal_getKmerSkipBin(double *matchModel, void *kmers) {
     // get the 'bin' for skip prob, clamp to the last bin
     int64_t bin = (int64_t)(d / 0.5); // 0.5 pA bins right now
     bin = bin >= 30 ? 29 : bin;
-    free(kmer_im1);
-    free(kmer_i);
     return bin;
 }
 
+int64_t emissions_signal_getKmerSkipBin(double *matchModel, void *kmers) {
+    // kmers points at kmer_i-1, kmer_i starts one base on
+    int64_t k_i = emissions_discrete_getKmerIndexAt(kmers, 1);
+    int64_t k_im1 = emissions_discrete_getKmerIndexAt(kmers, 0);
+    return emissions_signal_getKmerSkipBinP(matchModel, k_i, k_im1);
+}
+
+int64_t emissions_signal_getKmerSkipBinFromIndex(double *matchModel, void *kmerIndices) {
+    // kmerIndices points at the index of kmer_i-1, followed by that of kmer_i
+    return emissions_signal_getKmerSkipBinP(matchModel, ((int32_t *) kmerIndices)[1], ((int32_t *) kmerIndices)[0]);
+}
+
 double emissions_signal_getBetaOrAlphaSkipProb(StateMachine *sM, void *kmers, bool getAlpha) {
     // downcast
     StateMachine3Vanilla *sM3v = (StateMachine3Vanilla *) sM;
@@ -427,69 +493,29 @@ double emissions_signal_getBetaOrAlphaSkipProb(StateMachine *sM, void *kmers, bo
     return getAlpha ? sM3v->model.EMISSION_GAP_X_PROBS[bin+30] : sM3v->model.EMISSION_GAP_X_PROBS[bin];
 }
 
+double emissions_signal_getBetaOrAlphaSkipProbFromIndex(StateMachine *sM, void *kmerIndices, bool getAlpha) {
+    StateMachine3Vanilla *sM3v = (StateMachine3Vanilla *) sM;
+    int64_t bin = emissions_signal_getKmerSkipBinFromIndex(sM3v->model.EMISSION_MATCH_PROBS, kmerIndices);
+    return getAlpha ? sM3v->model.EMISSION_GAP_X_PROBS[bin+30] : sM3v->model.EMISSION_GAP_X_PROBS[bin];
+}
+
 double emissions_signal_getKmerSkipProb(StateMachine *sM, void *kmers) {
     //TODO this is still being used by echelon, migrate to alpha/beta function
     StateMachine3Vanilla *sM3v = (StateMachine3Vanilla *) sM;
-    // make kmer_i-1
-    char *kmer_im1 = malloc((KMER_LENGTH) * sizeof(char));
-    for (int64_t x = 0; x < KMER_LENGTH; x++) {
-        kmer_im1[x] = *((char *)kmers+x);
-    }
-    kmer_im1[KMER_LENGTH] = '\0';
-
-    // make kmer_i
-    char *kmer_i = malloc((KMER_LENGTH) * sizeof(char));
-    for (int64_t x = 0; x < KMER_LENGTH; x++) {
-        kmer_i[x] = *((char *)kmers+(x+1));
-    }
-    kmer_i[KMER_LENGTH] = '\0';
-
-    // get indices
-    int64_t k_i= emissions_discrete_getKmerIndex(kmer_i);
-    int64_t k_im1 = emissions_discrete_getKmerIndex(kmer_im1);
-
-    // get the expected mean current for each one
-    double u_ki = emissions_signal_getModelLevelMean(sM3v->model.EMISSION_MATCH_PROBS, k_i);
-    double u_kim1 = emissions_signal_getModelLevelMean(sM3v->model.EMISSION_MATCH_PROBS, k_im1);
-
-    // find the difference
-    double d = fabs(u_ki - u_kim1);
-
-    // get the 'bin' for skip prob, clamp to the last bin
-    int64_t bin = (int64_t)(d / 0.5); // 0.5 pA bins right now
-    bin = bin >= 30 ? 29 : bin;
-
-    // for debugging
-    //double pSkip = sM3v->model.EMISSION_GAP_X_PROBS[bin];
-    //st_uglyf("SENTINAL - getKmerSkipProb; kmer_i: %s (index: %lld, model u=%f), kmer_im1: %s (index: %lld, model u=%f), d: %f, bin: %lld, pSkip: %f\n",
-    //         kmer_i, k_i, u_ki, kmer_im1, k_im1, u_kim1, d, bin, pSkip);
-
-    // clean up
-    free(kmer_im1);
-    free(kmer_i);
+    int64_t bin = emissions_signal_getKmerSkipBin(sM3v->model.EMISSION_MATCH_PROBS, kmers);
     // NOT log space
     return sM3v->model.EMISSION_GAP_X_PROBS[bin];
 }
 
-double emissions_signal_logGaussMatchProb(const double *eventModel, void *kmer, void *event) {
-    // make temp kmer meant to work with getKmer2
-    char *kmer_i = malloc((KMER_LENGTH) * sizeof(char));
-    for (int64_t x = 0; x < KMER_LENGTH; x++) {
-        kmer_i[x] = *((char *)kmer+(x+1));
-    }
-    kmer_i[KMER_LENGTH] = '\0';
-
-    // get event mean, and kmer index
+static double emissions_signal_logGaussMatchProbP(const double *eventModel, int64_t kmerIndex, void *event) {
+    // get event mean
     double eventMean = *(double *) event;
-    int64_t kmerIndex = emissions_discrete_getKmerIndex(kmer_i);
     double l_inv_sqrt_2pi = log(0.3989422804014327); // constant
     double modelMean = emissions_signal_getModelLevelMean(eventModel, kmerIndex);
     double modelStdDev = emissions_signal_getModelLevelSd(eventModel, kmerIndex);
     double l_modelSD = log(modelStdDev);
     double a = (eventMean - modelMean) / modelStdDev;
 
-    // clean up
-    free(kmer_i);
     /// / debugging
     //double prob = l_inv_sqrt_2pi - l_modelSD + (-0.5f * a * a);
     //st_uglyf("MATCHING--kmer:%s (index: %lld), event mean: %f, levelMean: %f, prob: %f\n", kmer_i, kmerIndex, eventMean, modelMean, prob);
@@ -497,21 +523,22 @@ double emissions_signal_logGaussMatchProb(const double *eventModel, void *kmer,
     return l_inv_sqrt_2pi - l_modelSD + (-0.5f * a * a);
 }
 
-double emissions_signal_getEventMatchProbWithTwoDists(const double *eventModel, void *kmer, void *event) {
-    // make temp kmer meant to work with getKmer2
-    char *kmer_i = malloc((KMER_LENGTH) * sizeof(char));
-    for (int64_t x = 0; x < KMER_LENGTH; x++) {
-        kmer_i[x] = *((char *)kmer+(x+1));
-    }
-    kmer_i[KMER_LENGTH] = '\0';
+double emissions_signal_logGaussMatchProb(const double *eventModel, void *kmer, void *event) {
+    // meant to work with getKmer2
+    return emissions_signal_logGaussMatchProbP(eventModel, emissions_discrete_getKmerIndexAt(kmer, 1), event);
+}
 
+double emissions_signal_logGaussMatchProbFromIndex(const double *eventModel, void *kmerIndex, void *event) {
+    // meant to work with sequence_getKmerIndex2
+    return emissions_signal_logGaussMatchProbP(eventModel, ((int32_t *) kmerIndex)[1], event);
+}
+
+static double emissions_signal_getEventMatchProbWithTwoDistsP(const double *eventModel, int64_t kmerIndex,
+                                                               void *event) {
     // get event mean, and noise
     double eventMean = *(double *) event;
     double eventNoise = *(double *) ((char *)event + sizeof(double));
 
-    // get the kmer index
-    int64_t kmerIndex = emissions_discrete_getKmerIndex(kmer_i);
-
     // first calculate the prob of the level mean
     double expectedLevelMean = emissions_signal_getModelLevelMean(eventModel, kmerIndex);
     double expectedLevelSd = emissions_signal_getModelLevelSd(eventModel, kmerIndex);
@@ -522,40 +549,133 @@ double emissions_signal_getEventMatchProbWithTwoDists(const double *eventModel,
     double modelNoiseLambda = emissions_signal_getModelFluctuationLambda(eventModel, kmerIndex);
     double noiseProb = emissions_signal_logInvGaussPdf(eventNoise, expectedNoiseMean, modelNoiseLambda);
 
-    // clean up
-    free(kmer_i);
-
     return levelProb + noiseProb;
 }
 
+double emissions_signal_getEventMatchProbWithTwoDists(const double *eventModel, void *kmer, void *event) {
+    // meant to work with getKmer2, goes through the kmer params like the FromIndex version so the two agree
+    int32_t kmerIndex = (int32_t) emissions_discrete_getKmerIndexAt(kmer, 1);
+    double matchProb;
+    emissions_signal_getEventMatchProbsWithTwoDists(eventModel, &kmerIndex, 1, event, &matchProb);
+    return matchProb;
+}
+
+// number of kmers whose params are gathered into columns for each call to vectorMath_logGaussianPair
+#define SIGNAL_KMER_PARAMS_CHUNK 32
+
+void emissions_signal_getEventMatchProbsWithTwoDists(const double *eventModel, const int32_t *kmerIndices,
+                                                     int64_t kmerNumber, void *event, double *matchProbs) {
+    const SignalKmerParams *kmerParams = emissions_signal_getKmerParams(eventModel);
+    // the event terms are shared by all the kmers: the inverse Gaussian's -3/2 log(eventNoise) and the 1 /
+    // eventNoise its squared deviation is weighted by
+    double eventMean = *(double *) event;
+    double eventNoise = *(double *) ((char *)event + sizeof(double));
+    double eventLogNorm = -1.5 * log(eventNoise);
+    double eventWeight = 1.0 / eventNoise;
+
+    double logNorm[SIGNAL_KMER_PARAMS_CHUNK], levelMean[SIGNAL_KMER_PARAMS_CHUNK];
+    double levelInvSd[SIGNAL_KMER_PARAMS_CHUNK], noiseMean[SIGNAL_KMER_PARAMS_CHUNK];
+    double noiseScale[SIGNAL_KMER_PARAMS_CHUNK], probs[SIGNAL_KMER_PARAMS_CHUNK];
+    int64_t positions[SIGNAL_KMER_PARAMS_CHUNK];
+    for (int64_t start = 0; start < kmerNumber; start += SIGNAL_KMER_PARAMS_CHUNK) {
+        int64_t end = start + SIGNAL_KMER_PARAMS_CHUNK < kmerNumber ? start + SIGNAL_KMER_PARAMS_CHUNK : kmerNumber;
+        int64_t n = 0;
+        for (int64_t i = start; i < end; i++) {
+            int64_t kmerIndex = kmerIndices[i];
+            if (kmerIndex < 0 || kmerIndex >= NUM_OF_KMERS) {
+                // kmers with Ns get the zeroed model of emissions_signal_getModelLevelMean and friends
+                matchProbs[i] = emissions_signal_getEventMatchProbWithTwoDistsP(eventModel, kmerIndex, event);
+                continue;
+            }
+            const SignalKmerParams *k = &kmerParams[kmerIndex];
+            logNorm[n] = k->logNorm;
+            levelMean[n] = k->levelMean;
+            levelInvSd[n] = k->levelInvSd;
+            noiseMean[n] = k->noiseMean;
+            noiseScale[n] = k->noiseScale;
+            positions[n++] = i;
+        }
+        vectorMath_logGaussianPair(probs, logNorm, eventLogNorm, eventMean, levelMean, levelInvSd, eventNoise,
+                                   noiseMean, noiseScale, eventWeight, n);
+        for (int64_t i = 0; i < n; i++) {
+            matchProbs[positions[i]] = probs[i];
+        }
+    }
+}
+
+double emissions_signal_getEventMatchProbWithTwoDistsFromIndex(const double *eventModel, void *kmerIndex,
+                                                               void *event) {
+    // meant to work with sequence_getKmerIndex2
+    double matchProb;
+    emissions_signal_getEventMatchProbsWithTwoDists(eventModel, (int32_t *) kmerIndex + 1, 1, event, &matchProb);
+    return matchProb;
+}
+
 double emissions_signal_multipleKmerMatchProb(const double *eventModel, void *kmers, void *event, int64_t n) {
     // this is meant to work with getKmer2
     double p = 0.0;
-    for (int64_t i = 0; i < n; i++) {
-        // check if we're going to run off the end of the sequence
+    if (n > 0) {
+        // check if we're going to run off the end of the sequence, if so return zero prob of emitting this many
+        // kmers from this event
         int64_t l = (KMER_LENGTH * n);
-        //char lastBase = *(char *) (kmers + l);
-        char lastBase = *((char *)kmers + l); // new way
-        // if we're not, logAdd up all the probs for the next n kmers
-        if (isupper(lastBase)) {
-            //char *x_i = &kmers[i];
-            char *x_i = ((char *)kmers + i); // new way
-            p = logAdd(p, emissions_signal_getEventMatchProbWithTwoDists(eventModel, x_i, event));
-        } else { // otherwise return zero prob of emitting this many kmers from this event
+        char lastBase = *((char *)kmers + l);
+        if (!isupper(lastBase)) {
             return LOG_ZERO;
         }
+        // if we're not, logAdd up all the probs for the next n kmers, all matched to this event
+        int32_t kmerIndices[n];
+        double matchProbs[n];
+        for (int64_t i = 0; i < n; i++) {
+            kmerIndices[i] = (int32_t) emissions_discrete_getKmerIndexAt(kmers, i + 1);
+        }
+        emissions_signal_getEventMatchProbsWithTwoDists(eventModel, kmerIndices, n, event, matchProbs);
+        for (int64_t i = 0; i < n; i++) {
+            p = logAdd(p, matchProbs[i]);
+        }
     }
     // todo make this a pre-calculated thing
     return p - log(n);
 }
 
+void emissions_signal_multipleKmerMatchProbs(const double *eventModel, void *kmers, void *event, int64_t maxN,
+                                             double *matchProbs) {
+    // this is meant to work with getKmer2, see emissions_signal_multipleKmerMatchProb
+    if (maxN < 1) {
+        return;
+    }
+    // runs that would go off the end of the sequence get zero prob, only the kmers of the longest run that doesn't
+    // are read
+    bool inSequence[maxN + 1];
+    int64_t kmerNumber = 0;
+    for (int64_t n = 1; n <= maxN; n++) {
+        inSequence[n] = isupper(*((char *)kmers + (KMER_LENGTH * n))) != 0;
+        if (inSequence[n]) {
+            kmerNumber = n;
+        }
+    }
+    int32_t kmerIndices[maxN];
+    double kmerMatchProbs[maxN];
+    for (int64_t i = 0; i < kmerNumber; i++) {
+        kmerIndices[i] = (int32_t) emissions_discrete_getKmerIndexAt(kmers, i + 1);
+    }
+    emissions_signal_getEventMatchProbsWithTwoDists(eventModel, kmerIndices, kmerNumber, event, kmerMatchProbs);
+    // the sum for a run of n kmers is the sum for n - 1 plus its last kmer
+    double p = 0.0;
+    for (int64_t n = 1; n <= maxN; n++) {
+        if (n <= kmerNumber) {
+            p = logAdd(p, kmerMatchProbs[n - 1]);
+        }
+        matchProbs[n] = inSequence[n] ? p - log(n) : LOG_ZERO;
+    }
+}
+
 double emissions_signal_getDurationProb(void *event, int64_t n) {
     double duration = *(double *) ((char *)event + (2 * sizeof(double)));
     return emissions_signal_poissonPosteriorProb(n, duration);
 }
 
-double emissions_signal_getBivariateGaussPdfMatchProb(const double *eventModel, void *kmer, void *event) {
-    // this is meant to work with getKmer2
+static double emissions_signal_getBivariateGaussPdfMatchProbP(const double *eventModel, int64_t kmerIndex,
+                                                               void *event) {
     // wrangle event data
     double eventMean = *(double *) event;
     double eventNoise = *(double *) ((char*)event + sizeof(double)); // aaah pointers
@@ -564,15 +684,6 @@ double emissions_signal_getBivariateGaussPdfMatchProb(const double *eventModel,
     double p = eventModel[0];
     double pSq = p * p;
 
-    // make temp kmer
-    char *kmer_i = malloc((KMER_LENGTH) * sizeof(char));
-    for (int64_t x = 0; x < KMER_LENGTH; x++) {
-        kmer_i[x] = *((char *)kmer+(x+1));
-    }
-    kmer_i[KMER_LENGTH] = '\0';
-
-    int64_t kmerIndex = emissions_discrete_getKmerIndex(kmer_i);
-
     // get the µ and σ for the level and noise for the model
     double levelMean = emissions_signal_getModelLevelMean(eventModel, kmerIndex);
     double levelStdDev = emissions_signal_getModelLevelSd(eventModel, kmerIndex);
@@ -587,28 +698,27 @@ double emissions_signal_getBivariateGaussPdfMatchProb(const double *eventModel,
     double a = expC * ((xu * xu) + (yu * yu) - (2 * p * xu * yu));
     double c = log_inv_2pi - log(levelStdDev * noiseStdDev * sqrt(1 - pSq));
 
-    // clean
-    free(kmer_i);
-
     return c + a;
 }
 
-double emissions_signal_strawManGetKmerEventMatchProb(const double *eventModel, void *kmer, void *event) {
-    // this is meant to work with getKmer (NOT getKmer2)
+double emissions_signal_getBivariateGaussPdfMatchProb(const double *eventModel, void *kmer, void *event) {
+    // this is meant to work with getKmer2
+    return emissions_signal_getBivariateGaussPdfMatchProbP(eventModel, emissions_discrete_getKmerIndexAt(kmer, 1),
+                                                           event);
+}
+
+double emissions_signal_getBivariateGaussPdfMatchProbFromIndex(const double *eventModel, void *kmerIndex,
+                                                               void *event) {
+    // meant to work with sequence_getKmerIndex2
+    return emissions_signal_getBivariateGaussPdfMatchProbP(eventModel, ((int32_t *) kmerIndex)[1], event);
+}
+
+static double emissions_signal_strawManGetKmerEventMatchProbP(const double *eventModel, int64_t kmerIndex,
+                                                               void *event) {
     // wrangle event data
     double eventMean = *(double *) event;
     double eventNoise = *(double *) ((char *)event + sizeof(double)); // aaah pointers
 
-    // make temp kmer
-    char *kmer_i = malloc((KMER_LENGTH) * sizeof(char));
-    for (int64_t x = 0; x < KMER_LENGTH; x++) {
-        kmer_i[x] = *((char *)kmer+x);
-    }
-    kmer_i[KMER_LENGTH] = '\0';
-
-    // get index
-    int64_t kmerIndex = emissions_discrete_getKmerIndex(kmer_i);
-
     // get the µ and σ for the level and noise for the model
     double levelMean = emissions_signal_getModelLevelMean(eventModel, kmerIndex);
     double levelStdDev = emissions_signal_getModelLevelSd(eventModel, kmerIndex);
@@ -618,9 +728,6 @@ double emissions_signal_strawManGetKmerEventMatchProb(const double *eventModel,
     double l_probEventMean = emissions_signal_logGaussPdf(eventMean, levelMean, levelStdDev);
     double l_probEventNoise = emissions_signal_logGaussPdf(eventNoise, noiseMean, noiseStdDev);
 
-    // clean
-    free(kmer_i);
-
     // debugging
     //double prob = l_probEventMean + l_probEventNoise;
     //st_uglyf("MATCHING--kmer:%s (index: %lld), event mean: %f, \n modelMean: %f, modelLsd: %f probEvent: %f probNoise: %f, combined: %f\n",
@@ -629,26 +736,80 @@ double emissions_signal_strawManGetKmerEventMatchProb(const double *eventModel,
     return l_probEventMean + l_probEventNoise;
 }
 
-void emissions_signal_scaleModel(StateMachine *sM,
-                                 double scale, double shift, double var,
-                                 double scale_sd, double var_sd) {
+static double emissions_signal_strawManGetKmerEventMatchProbFromParams(const double *eventModel, int64_t i,
+                                                                       void *event) {
+    if (i < 0 || i >= NUM_OF_KMERS) {
+        return emissions_signal_strawManGetKmerEventMatchProbP(eventModel, i, event);
+    }
+    const SignalKmerParams *k = &emissions_signal_getKmerParams(eventModel)[i];
+    double eventMean = *(double *) event;
+    double eventNoise = *(double *) ((char *)event + sizeof(double));
+    return emissions_signal_logGaussPdfFromParams(eventMean, k->levelMean, k->levelInvSd, k->levelLogNorm)
+           + emissions_signal_logGaussPdfFromParams(eventNoise, k->noiseMean, k->noiseInvSd, k->noiseLogNorm);
+}
+
+double emissions_signal_strawManGetKmerEventMatchProb(const double *eventModel, void *kmer, void *event) {
+    // this is meant to work with getKmer (NOT getKmer2)
+    return emissions_signal_strawManGetKmerEventMatchProbFromParams(eventModel,
+                                                                    emissions_discrete_getKmerIndexAt(kmer, 0), event);
+}
+
+double emissions_signal_strawManGetKmerEventMatchProbFromIndex(const double *eventModel, void *kmerIndex,
+                                                               void *event) {
+    // meant to work with sequence_getKmerIndex
+    return emissions_signal_strawManGetKmerEventMatchProbFromParams(eventModel, *(int32_t *) kmerIndex, event);
+}
+
+void emissions_signal_deriveKmerParams(double *eventModel) {
+    SignalKmerParams *kmerParams = (SignalKmerParams *) emissions_signal_getKmerParams(eventModel);
+    double log_inv_sqrt_2pi = -0.91893853320467267; // as in emissions_signal_logGaussPdf
+    double l_twoPi = 1.8378770664093453; // as in emissions_signal_logInvGaussPdf
+    for (int64_t i = 0; i < NUM_OF_KMERS; i++) {
+        SignalKmerParams *k = &kmerParams[i];
+        k->levelMean = emissions_signal_getModelLevelMean(eventModel, i);
+        double levelSd = emissions_signal_getModelLevelSd(eventModel, i);
+        k->levelInvSd = 1.0 / levelSd;
+        k->levelLogNorm = log_inv_sqrt_2pi - log(levelSd);
+        k->noiseMean = emissions_signal_getModelFluctuationMean(eventModel, i);
+        double noiseSd = emissions_signal_getModelFluctuationSd(eventModel, i);
+        k->noiseInvSd = 1.0 / noiseSd;
+        k->noiseLogNorm = log_inv_sqrt_2pi - log(noiseSd);
+        double noiseLambda = emissions_signal_getModelFluctuationLambda(eventModel, i);
+        k->noiseScale = sqrt(noiseLambda) / k->noiseMean;
+        k->logNorm = k->levelLogNorm + (log(noiseLambda) - l_twoPi) / 2;
+    }
+}
+
+static void emissions_signal_scaleModelValues(const double *model, double *scaledModel,
+                                             double scale, double shift, double var,
+                                             double scale_sd, double var_sd) {
     // model is arranged: level_mean, level_stdev, sd_mean, sd_stdev, sd_lambda per kmer
     // already been adjusted for correlation coeff.
-    for (int64_t i = 1; i < (sM->parameterSetSize * MODEL_PARAMS) + 1; i += MODEL_PARAMS) {
+    // model and scaledModel can be the same
+    scaledModel[0] = model[0];
+    for (int64_t i = 1; i < SIGNAL_MODEL_LENGTH; i += MODEL_PARAMS) {
         // Level adjustments
         // level_mean = mean * scale + shift
-        sM->EMISSION_MATCH_PROBS[i] = sM->EMISSION_MATCH_PROBS[i] * scale + shift;
+        scaledModel[i] = model[i] * scale + shift;
         // level_stdev = stdev * var
-        sM->EMISSION_MATCH_PROBS[i+1] = sM->EMISSION_MATCH_PROBS[i+1] * var;
+        scaledModel[i+1] = model[i+1] * var;
 
         // Fluctuation (noise) adjustments
         // noise_mean *= scale_sd
-        sM->EMISSION_MATCH_PROBS[i+2] = sM->EMISSION_MATCH_PROBS[i+2] * scale_sd;
+        scaledModel[i+2] = model[i+2] * scale_sd;
         // noise_lambda *= var_sd
-        sM->EMISSION_MATCH_PROBS[i+4] = sM->EMISSION_MATCH_PROBS[i+4] * var_sd;
+        scaledModel[i+4] = model[i+4] * var_sd;
         // noise_sd = sqrt(adjusted_noise_mean**3 / adjusted_noise_lambda);
-        sM->EMISSION_MATCH_PROBS[i+3] = sqrt(pow(sM->EMISSION_MATCH_PROBS[i+2], 3.0) / sM->EMISSION_MATCH_PROBS[i+4]);
+        scaledModel[i+3] = sqrt(pow(scaledModel[i+2], 3.0) / scaledModel[i+4]);
     }
+    emissions_signal_deriveKmerParams(scaledModel);
+}
+
+void emissions_signal_scaleModel(StateMachine *sM,
+                                 double scale, double shift, double var,
+                                 double scale_sd, double var_sd) {
+    emissions_signal_scaleModelValues(sM->EMISSION_MATCH_PROBS, sM->EMISSION_MATCH_PROBS,
+                                      scale, shift, var, scale_sd, var_sd);
 }
 
 void emissions_signal_scaleModelNoiseOnly(StateMachine *sM,
@@ -671,6 +832,7 @@ void emissions_signal_scaleModelNoiseOnly(StateMachine *sM,
         // noise_sd = sqrt(adjusted_noise_mean**3 / adjusted_noise_lambda);
         sM->EMISSION_MATCH_PROBS[i+3] = sqrt(pow(sM->EMISSION_MATCH_PROBS[i+2], 3.0) / sM->EMISSION_MATCH_PROBS[i+4]);
     }
+    emissions_signal_deriveKmerParams(sM->EMISSION_MATCH_PROBS);
 }
 
 ////////////////////////////
@@ -828,9 +990,9 @@ static double stateMachine4_raggedEndStateProb(StateMachine *sM, int64_t state)
 
 
 static void stateMachine5_cellCalculate(StateMachine *sM,
-                                        double *current, double *lower, double *middle, double *upper,
+                                        DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper,
                                         void *cX, void *cY,
-                                        void (*doTransition)(double *, double *, // fromCells, toCells
+                                        void (*doTransition)(DpCell *, DpCell *, // fromCells, toCells
                                                              int64_t, int64_t,   // from, to
                                                              double, double,     // emissionProb, transitionProb
                                                              void *),            // extraArgs
@@ -866,9 +1028,9 @@ static void stateMachine5_cellCalculate(StateMachine *sM,
 }
 
 static void stateMachine4_cellCalculate(StateMachine *sM,
-                                              double *current, double *lower, double *middle, double *upper,
+                                              DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper,
                                             void *cX, void *cY,
-                                            void (*doTransition)(double *, double *, // fromCells, toCells
+                                            void (*doTransition)(DpCell *, DpCell *, // fromCells, toCells
                                                                  int64_t, int64_t,   // from, to
                                                                  double, double,     // emissionProb, transitionProb
                                                                  void *),            // extraArgs
@@ -904,7 +1066,7 @@ StateMachine *stateMachine5_construct(StateMachineType type, int64_t parameterSe
                                       double (*gapXProbFcn)(const double *, void *),
                                       double (*gapYProbFcn)(const double *, void *),
                                       double (*matchProbFcn)(const double *, void *, void *),
-                                      void (*cellCalcUpdateExpFcn)(double *fromCells, double *toCells,
+                                      void (*cellCalcUpdateExpFcn)(DpCell *fromCells, DpCell *toCells,
                                                                    int64_t from, int64_t to,
                                                                    double eP, double tP, void *extraArgs)) {
     /*
@@ -946,6 +1108,7 @@ StateMachine *stateMachine5_construct(StateMachineType type, int64_t parameterSe
     sM5->model.raggedStartStateProb = stateMachine5_raggedStartStateProb;
     sM5->model.raggedEndStateProb = stateMachine5_raggedEndStateProb;
     sM5->model.cellCalculate = stateMachine5_cellCalculate;
+    sM5->model.diagonalCalculate = diagonalKernel_stateMachine5;
     sM5->model.cellCalculateUpdateExpectations = cellCalcUpdateExpFcn;
 
     sM5->getXGapProbFcn = gapXProbFcn;
@@ -963,7 +1126,7 @@ StateMachine *stateMachine4_construct(StateMachineType type, int64_t parameterSe
                                       double (*gapXProbFcn)(const double *, void *),
                                       double (*gapYProbFcn)(const double *, void *, void *),
                                       double (*matchProbFcn)(const double *, void *, void *),
-                                      void (*cellCalcUpdateFcn)(double *, double *, int64_t from, int64_t to,
+                                      void (*cellCalcUpdateFcn)(DpCell *, DpCell *, int64_t from, int64_t to,
                                                                 double eP, double tP, void *)) {
     StateMachine4 *sM4 = st_malloc(sizeof(StateMachine4));
     if (type != fourState) {
@@ -982,6 +1145,7 @@ StateMachine *stateMachine4_construct(StateMachineType type, int64_t parameterSe
     sM4->model.endStateProb = stateMachine4_endStateProb;
     sM4->model.raggedEndStateProb = stateMachine4_raggedEndStateProb;
     sM4->model.cellCalculate = stateMachine4_cellCalculate;
+    sM4->model.diagonalCalculate = diagonalKernel_stateMachine4;
     // cell calculate
     sM4->model.cellCalculateUpdateExpectations = cellCalcUpdateFcn;
 
@@ -1162,9 +1326,7 @@ static void stateMachine5_loadSymmetric(StateMachine5 *sM5, Hmm *hmm) {
 /////////////////////////////////////////// STATIC FUNCTIONS ////////////////////////////////////////////////////////
 
 // Transitions //
-typedef enum {
-    match0 = 0, match1 = 1, match2 = 2, match3 = 3, match4 = 4, match5 = 5, gapX = 6
-} SignalState;
+// SignalState moved to stateMachine.h
 
 static double stateMachine3_startStateProb(StateMachine *sM, int64_t state) {
     //Match state is like going to a match.
@@ -1304,9 +1466,9 @@ void stateMachine3Vanilla_setStrandTransitionsToDefaults(StateMachine *sM, Stran
 }
 
 static void stateMachine3_cellCalculate(StateMachine *sM,
-                                        double *current, double *lower, double *middle, double *upper,
+                                        DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper,
                                         void *cX, void *cY,
-                                        void (*doTransition)(double *, double *,
+                                        void (*doTransition)(DpCell *, DpCell *,
                                                              int64_t, int64_t,
                                                              double, double,
                                                              void *),
@@ -1335,9 +1497,9 @@ static void stateMachine3_cellCalculate(StateMachine *sM,
 }
 
 static void stateMachine3HDP_cellCalculate(StateMachine *sM,
-                                           double *current, double *lower, double *middle, double *upper,
+                                           DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper,
                                            void *cX, void *cY,
-                                           void (*doTransition)(double *, double *,
+                                           void (*doTransition)(DpCell *, DpCell *,
                                                                 int64_t, int64_t,
                                                                 double, double,
                                                                 void *),
@@ -1365,43 +1527,183 @@ static void stateMachine3HDP_cellCalculate(StateMachine *sM,
     }
 }
 
+static void stateMachine3Vanilla_kmerSkipTransitions(StateMachine3Vanilla *sM3v, void *cX,
+                                                      KmerSkipTransitions *transitions) {
+    // from match
+    double a_mx = sM3v->getKmerSkipProb((StateMachine *) sM3v, cX, 0); // get beta prob
+    double a_my = (1 - a_mx) * sM3v->TRANSITION_M_TO_Y_NOT_X; // trans M to Y not X fudge factor
+    double a_mm = 1.0f - a_my - a_mx;
+    // from X [Skipped event state]
+    double a_xx = sM3v->getKmerSkipProb((StateMachine *) sM3v, cX, 1); // get alpha prob
+    double a_xm = 1.0f - a_xx;
+
+    transitions->matchToSkip = log(a_mx);
+    transitions->matchToExtra = log(a_my);
+    transitions->matchToMatch = log(a_mm);
+    transitions->skipToSkip = log(a_xx);
+    transitions->skipToMatch = log(a_xm);
+}
+
+static void stateMachineEchelon_kmerSkipTransitions(StateMachineEchelon *sMe, void *cX,
+                                                    KmerSkipTransitions *transitions) {
+    // from M
+    double a_mx = sMe->getKmerSkipProb((StateMachine *) sMe, cX); // beta
+    double a_mh = 1 - a_mx; // 1 - beta
+    // from X (kmer skip)
+    double a_xx = a_mx; // alpha, to seperate alpha, need to change here
+    double a_xh = 1 - a_xx; // 1 - alpha
+
+    transitions->matchToSkip = log(a_mx);
+    transitions->matchToExtra = log(a_mh);
+    transitions->matchToMatch = log(a_mh);
+    transitions->skipToSkip = log(a_xx);
+    transitions->skipToMatch = log(a_xh);
+}
+
+void stateMachine_calculateKmerSkipTransitions(StateMachine *sM, void *cX, KmerSkipTransitions *transitions) {
+    switch (sM->type) {
+        case vanilla:
+            stateMachine3Vanilla_kmerSkipTransitions((StateMachine3Vanilla *) sM, cX, transitions);
+            return;
+        case echelon:
+            stateMachineEchelon_kmerSkipTransitions((StateMachineEchelon *) sM, cX, transitions);
+            return;
+        default:
+            st_errAbort("stateMachine_calculateKmerSkipTransitions: unsupported stateMachine type %i\n", sM->type);
+    }
+}
+
+static KmerSkipTable **stateMachine_getKmerSkipTableField(StateMachine *sM) {
+    switch (sM->type) {
+        case vanilla:
+            return &((StateMachine3Vanilla *) sM)->kmerSkipTable;
+        case echelon:
+            return &((StateMachineEchelon *) sM)->kmerSkipTable;
+        default:
+            return NULL;
+    }
+}
+
+static void kmerSkipTable_destruct(KmerSkipTable *kmerSkipTable) {
+    if (kmerSkipTable == NULL) {
+        return;
+    }
+    free(kmerSkipTable->transitions);
+    free(kmerSkipTable);
+}
+
+void stateMachine_setKmerSkipTable(StateMachine *sM, void *elements, int64_t length, int64_t elementSize) {
+    KmerSkipTable **field = stateMachine_getKmerSkipTableField(sM);
+    if (field == NULL) {
+        st_errAbort("stateMachine_setKmerSkipTable: unsupported stateMachine type %i\n", sM->type);
+    }
+    kmerSkipTable_destruct(*field);
+    *field = NULL;
+    if (elements == NULL || length <= 0) {
+        return;
+    }
+    KmerSkipTable *kmerSkipTable = st_malloc(sizeof(KmerSkipTable));
+    kmerSkipTable->elements = elements;
+    kmerSkipTable->elementSize = elementSize;
+    kmerSkipTable->length = length;
+    kmerSkipTable->transitions = st_malloc(length * sizeof(KmerSkipTransitions));
+    for (int64_t i = 0; i < length; i++) {
+        stateMachine_calculateKmerSkipTransitions(sM, (char *) elements + i * elementSize,
+                                                  &kmerSkipTable->transitions[i]);
+    }
+    *field = kmerSkipTable;
+}
+
+static void eventDurationTable_destruct(EventDurationTable *durationTable) {
+    if (durationTable == NULL) {
+        return;
+    }
+    free(durationTable->durationProbs);
+    free(durationTable);
+}
+
+void stateMachineEchelon_setDurationTable(StateMachine *sM, void *events, int64_t length) {
+    if (sM->type != echelon) {
+        st_errAbort("stateMachineEchelon_setDurationTable: unsupported stateMachine type %i\n", sM->type);
+    }
+    StateMachineEchelon *sMe = (StateMachineEchelon *) sM;
+    eventDurationTable_destruct(sMe->durationTable);
+    sMe->durationTable = NULL;
+    if (events == NULL || length <= 0) {
+        return;
+    }
+    EventDurationTable *durationTable = st_malloc(sizeof(EventDurationTable));
+    durationTable->events = events;
+    durationTable->eventSize = NB_EVENT_PARAMS * sizeof(double);
+    durationTable->length = length;
+    durationTable->durationProbs = st_malloc(length * ECHELON_DURATION_PROBS * sizeof(double));
+    for (int64_t i = 0; i < length; i++) {
+        void *event = (char *) events + i * durationTable->eventSize;
+        for (int64_t n = 0; n < ECHELON_DURATION_PROBS; n++) {
+            durationTable->durationProbs[i * ECHELON_DURATION_PROBS + n] = sMe->getDurationProb(event, n);
+        }
+    }
+    sMe->durationTable = durationTable;
+}
+
+void stateMachineEchelon_getCellEmissions(StateMachine *sM, void *cX, void *cY, double *matchProbs,
+                                          double *durationProbs) {
+    StateMachineEchelon *sMe = (StateMachineEchelon *) sM;
+    // duration probs depend only on the event
+    EventDurationTable *durationTable = sMe->durationTable;
+    uintptr_t offset = durationTable == NULL ? 0 : (uintptr_t) cY - (uintptr_t) durationTable->events;
+    if (durationTable != NULL && offset < (uintptr_t) (durationTable->length * durationTable->eventSize)) {
+        memcpy(durationProbs, &durationTable->durationProbs[offset / durationTable->eventSize * ECHELON_DURATION_PROBS],
+               ECHELON_DURATION_PROBS * sizeof(double));
+    } else {
+        for (int64_t n = 0; n < ECHELON_DURATION_PROBS; n++) {
+            durationProbs[n] = sMe->getDurationProb(cY, n);
+        }
+    }
+    if (matchProbs == NULL) {
+        return;
+    }
+    if (sMe->getMatchProbFcn == emissions_signal_multipleKmerMatchProb) {
+        emissions_signal_multipleKmerMatchProbs(sMe->model.EMISSION_MATCH_PROBS, cX, cY, match5, matchProbs);
+    } else {
+        for (int64_t n = match1; n <= match5; n++) {
+            matchProbs[n] = sMe->getMatchProbFcn(sMe->model.EMISSION_MATCH_PROBS, cX, cY, n);
+        }
+    }
+}
+
 static void stateMachine3Vanilla_cellCalculate(StateMachine *sM,
-                                               double *current, double *lower, double *middle, double *upper,
+                                               DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper,
                                                void *cX, void *cY,
-                                               void (*doTransition)(double *, double *, int64_t, int64_t,
+                                               void (*doTransition)(DpCell *, DpCell *, int64_t, int64_t,
                                                                     double, double, void *),
                                                void *extraArgs) {
 
     StateMachine3Vanilla *sM3v = (StateMachine3Vanilla *) sM;
     // Establish transition probs (all adopted from Nanopolish by JTS)
-    // from match
-    double a_mx = sM3v->getKmerSkipProb((StateMachine *) sM3v, cX, 0); // get beta prob
-    double a_my = (1 - a_mx) * sM3v->TRANSITION_M_TO_Y_NOT_X; // trans M to Y not X fudge factor
-    double a_mm = 1.0f - a_my - a_mx;
+    // from match and from X [Skipped event state], see stateMachine3Vanilla_kmerSkipTransitions
+    KmerSkipTransitions scratch;
+    const KmerSkipTransitions *t = stateMachine_getKmerSkipTransitions(sM, sM3v->kmerSkipTable, cX, &scratch);
 
     // from Y [Extra event state]
     double a_yy = sM3v->TRANSITION_E_TO_E;
     double a_ym = 1.0f - a_yy;
 
-    // from X [Skipped event state]
-    double a_xx = sM3v->getKmerSkipProb((StateMachine *)sM3v, cX, 1); // get alpha prob
-    double a_xm = 1.0f - a_xx;
-
     if (lower != NULL) {
-        doTransition(lower, current, match, shortGapX, 0, log(a_mx), extraArgs);
-        doTransition(lower, current, shortGapX, shortGapX, 0, log(a_xx), extraArgs);
+        doTransition(lower, current, match, shortGapX, 0, t->matchToSkip, extraArgs);
+        doTransition(lower, current, shortGapX, shortGapX, 0, t->skipToSkip, extraArgs);
         // X to Y not allowed
         //doTransition(lower, current, shortGapY, shortGapX, eP, sM3->TRANSITION_GAP_SWITCH_TO_X, extraArgs);
     }
     if (middle != NULL) {
         double eP = sM3v->getMatchProbFcn(sM3v->model.EMISSION_MATCH_PROBS, cX, cY);
-        doTransition(middle, current, match, match, eP, log(a_mm), extraArgs);
-        doTransition(middle, current, shortGapX, match, eP, log(a_xm), extraArgs);
+        doTransition(middle, current, match, match, eP, t->matchToMatch, extraArgs);
+        doTransition(middle, current, shortGapX, match, eP, t->skipToMatch, extraArgs);
         doTransition(middle, current, shortGapY, match, eP, log(a_ym), extraArgs);
     }
     if (upper != NULL) {
         double eP = sM3v->getScaledMatchProbFcn(sM3v->model.EMISSION_GAP_Y_PROBS, cX, cY);
-        doTransition(upper, current, match, shortGapY, eP, log(a_my), extraArgs);
+        doTransition(upper, current, match, shortGapY, eP, t->matchToExtra, extraArgs);
         doTransition(upper, current, shortGapY, shortGapY, eP, log(a_yy), extraArgs);
         // Y to X not allowed
         //doTransition(upper, current, shortGapX, shortGapY, eP, sM3->TRANSITION_GAP_SWITCH_TO_Y, extraArgs);
@@ -1409,20 +1711,19 @@ static void stateMachine3Vanilla_cellCalculate(StateMachine *sM,
 }
 
 static void stateMachineEchelon_cellCalculate(StateMachine *sM,
-                                              double *current, double *lower, double *middle, double *upper,
+                                              DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper,
                                               void *cX, void *cY,
-                                              void (*doTransition)(double *, double *, int64_t, int64_t,
+                                              void (*doTransition)(DpCell *, DpCell *, int64_t, int64_t,
                                                                    double, double, void *),
                                               void *extraArgs) {
     StateMachineEchelon *sMe = (StateMachineEchelon *) sM;
-    // transitions
-    // from M
-    double a_mx = sMe->getKmerSkipProb((StateMachine *) sMe, cX), la_mx = log(a_mx); // beta
-    double a_mh = 1 - a_mx, la_mh = log(a_mh); // 1 - beta
-
-    // from X (kmer skip)
-    double a_xx = a_mx, la_xx = log(a_xx); // alpha, to seperate alpha, need to change here
-    double a_xh = 1 - a_xx, la_xh = log(a_xh); // 1 - alpha
+    // transitions from M and from X (kmer skip), see stateMachineEchelon_kmerSkipTransitions
+    KmerSkipTransitions scratch;
+    const KmerSkipTransitions *t = stateMachine_getKmerSkipTransitions(sM, sMe->kmerSkipTable, cX, &scratch);
+    double la_mx = t->matchToSkip; // beta
+    double la_mh = t->matchToMatch; // 1 - beta
+    double la_xx = t->skipToSkip; // alpha
+    double la_xh = t->skipToMatch; // 1 - alpha
 
     if (lower != NULL) {
         // go from all of the match states to gapX
@@ -1432,36 +1733,39 @@ static void stateMachineEchelon_cellCalculate(StateMachine *sM,
         // gapX --> gapX
         doTransition(lower, current, gapX, gapX, 0, la_xx, extraArgs);
     }
+    if (middle == NULL && upper == NULL) {
+        return;
+    }
+    // the emissions are the same for every from state
+    double eP[6], durationProb[ECHELON_DURATION_PROBS];
+    stateMachineEchelon_getCellEmissions(sM, cX, cY, middle != NULL ? eP : NULL, durationProb);
     if (middle != NULL) {
         // first we handle going from all of the match states to match1 through match5
         for (int64_t n = 1; n < 6; n++) {
             for (int64_t from = 0; from < 6; from++) {
-                doTransition(middle, current, from, n,
-                             sMe->getMatchProbFcn(sMe->model.EMISSION_MATCH_PROBS, cX, cY, n),
-                             (la_mh + sMe->getDurationProb(cY, n)), extraArgs);
+                doTransition(middle, current, from, n, eP[n], (la_mh + durationProb[n]), extraArgs);
             }
         }
         // now do from gapX to the match states
         for (int64_t n = 1; n < 6; n++) {
-            doTransition(middle, current, gapX, n, sMe->getMatchProbFcn(sMe->model.EMISSION_MATCH_PROBS, cX, cY, n),
-                         (la_xh + sMe->getDurationProb(cY, n)), extraArgs);
+            doTransition(middle, current, gapX, n, eP[n], (la_xh + durationProb[n]), extraArgs);
         }
     }
     if (upper != NULL) {
         // only allowed to go from match states to match0 (extra event state)
+        double eP0 = sMe->getScaledMatchProbFcn(sMe->model.EMISSION_GAP_Y_PROBS, cX, cY);
         for (int64_t n = 1; n < 6; n++) {
-            doTransition(upper, current, n, match0,
-                         sMe->getScaledMatchProbFcn(sMe->model.EMISSION_GAP_Y_PROBS, cX, cY),
+            doTransition(upper, current, n, match0, eP0,
                          //sMe->getDurationProb(cY, 0), extraArgs);
-                         (la_mh + sMe->getDurationProb(cY, 0)), extraArgs);
+                         (la_mh + durationProb[0]), extraArgs);
         }
     }
 }
 
 static void stateMachineEchelonB_cellCalculate(StateMachine *sM,
-                                              double *current, double *lower, double *middle, double *upper,
+                                              DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper,
                                               void *cX, void *cY,
-                                              void (*doTransition)(double *, double *, int64_t, int64_t,
+                                              void (*doTransition)(DpCell *, DpCell *, int64_t, int64_t,
                                                                    double, double, void *),
                                               void *extraArgs) {
     StateMachineEchelonB *sMe = (StateMachineEchelonB *) sM;
@@ -1484,27 +1788,29 @@ static void stateMachineEchelonB_cellCalculate(StateMachine *sM,
         doTransition(lower, current, gapX, gapX, 0, la_xx, extraArgs);
     }
     if (middle != NULL) {
+        // the emissions are the same for every from state
+        double eP[6], durationProb[6];
+        for (int64_t n = 1; n < 6; n++) {
+            eP[n] = sMe->getMatchProbFcn(sMe->model.EMISSION_MATCH_PROBS, cX, cY, n);
+            durationProb[n] = sMe->getDurationProb(cY, n);
+        }
         // first we handle going from all of the match states to match1 through match5
         for (int64_t n = 1; n < 6; n++) {
             for (int64_t from = 0; from < 6; from++) {
-                doTransition(middle, current, from, n,
-                             sMe->getMatchProbFcn(sMe->model.EMISSION_MATCH_PROBS, cX, cY, n), // eP
-                             (la_mh + sMe->getDurationProb(cY, n)), extraArgs);
+                doTransition(middle, current, from, n, eP[n], (la_mh + durationProb[n]), extraArgs);
             }
         }
         // now do from gapX to the match states
         for (int64_t n = 1; n < 6; n++) {
-            doTransition(middle, current, gapX, n, sMe->getMatchProbFcn(sMe->model.EMISSION_MATCH_PROBS, cX, cY, n),
-                         (la_xh + sMe->getDurationProb(cY, n)), extraArgs);
+            doTransition(middle, current, gapX, n, eP[n], (la_xh + durationProb[n]), extraArgs);
         }
     }
     if (upper != NULL) {
         // only allowed to go from match states to match0 (extra event state)
+        double eP0 = sMe->getScaledMatchProbFcn(sMe->model.EMISSION_GAP_Y_PROBS, cX, cY);
+        double tP = la_mh + sMe->getDurationProb(cY, 0);
         for (int64_t n = 1; n < 6; n++) {
-            doTransition(upper, current, n, match0,
-                         sMe->getScaledMatchProbFcn(sMe->model.EMISSION_GAP_Y_PROBS, cX, cY),
-                         //sMe->getDurationProb(cY, 0), extraArgs);
-                         (la_mh + sMe->getDurationProb(cY, 0)), extraArgs);
+            doTransition(upper, current, n, match0, eP0, tP, extraArgs);
         }
     }
 }
@@ -1516,7 +1822,7 @@ StateMachine *stateMachine3_construct(StateMachineType type, int64_t parameterSe
                                       double (*gapXProbFcn)(const double *, void *),
                                       double (*gapYProbFcn)(const double *, void *, void *),
                                       double (*matchProbFcn)(const double *, void *, void *),
-                                      void (*cellCalcUpdateExpFcn)(double *fromCells, double *toCells,
+                                      void (*cellCalcUpdateExpFcn)(DpCell *fromCells, DpCell *toCells,
                                                                    int64_t from, int64_t to,
                                                                    double eP, double tP, void *extraArgs)) {
     /*
@@ -1539,6 +1845,7 @@ StateMachine *stateMachine3_construct(StateMachineType type, int64_t parameterSe
     sM3->model.raggedStartStateProb = stateMachine3_raggedStartStateProb;
     sM3->model.raggedEndStateProb = stateMachine3_raggedEndStateProb;
     sM3->model.cellCalculate = stateMachine3_cellCalculate;
+    sM3->model.diagonalCalculate = diagonalKernel_stateMachine3;
     sM3->model.cellCalculateUpdateExpectations = cellCalcUpdateExpFcn;
 
     // setup functions
@@ -1567,7 +1874,7 @@ StateMachine *stateMachine3Hdp_construct(StateMachineType type, int64_t paramete
                                          double (*gapXProbFcn)(const double *, void *),
                                          double (*gapYProbFcn)(NanoporeHDP *, void *, void *),
                                          double (*matchProbFcn)(NanoporeHDP *, void *, void *),
-                                         void (*cellCalcUpdateExpFcn)(double *fromCells, double *toCells,
+                                         void (*cellCalcUpdateExpFcn)(DpCell *fromCells, DpCell *toCells,
                                                                       int64_t from, int64_t to,
                                                                       double eP, double tP, void *extraArgs)) {
     StateMachine3_HDP *sM3 = st_malloc(sizeof(StateMachine3_HDP));
@@ -1585,6 +1892,7 @@ StateMachine *stateMachine3Hdp_construct(StateMachineType type, int64_t paramete
     sM3->model.raggedStartStateProb = stateMachine3_raggedStartStateProb;
     sM3->model.raggedEndStateProb = stateMachine3_raggedEndStateProb;
     sM3->model.cellCalculate = stateMachine3HDP_cellCalculate;
+    sM3->model.diagonalCalculate = diagonalKernel_stateMachine3Hdp;
     sM3->model.cellCalculateUpdateExpectations = cellCalcUpdateExpFcn;
 
     // setup functions
@@ -1612,7 +1920,7 @@ StateMachine *stateMachine3Vanilla_construct(StateMachineType type, int64_t para
                                              double (*xSkipProbFcn)(StateMachine *, void *, bool),
                                              double (*scaledMatchProbFcn)(const double *, void *, void *),
                                              double (*matchProbFcn)(const double *, void *, void *),
-                                             void (*cellCalcUpdateExpFcn)(double *fromCells, double *toCells,
+                                             void (*cellCalcUpdateExpFcn)(DpCell *fromCells, DpCell *toCells,
                                                                           int64_t from, int64_t to,
                                                                           double eP, double tP, void *extraArgs)) {
     StateMachine3Vanilla *sM3v = st_malloc(sizeof(StateMachine3Vanilla));
@@ -1637,12 +1945,14 @@ StateMachine *stateMachine3Vanilla_construct(StateMachineType type, int64_t para
     sM3v->model.endStateProb = stateMachine3Vanilla_endStateProb;
     sM3v->model.raggedEndStateProb = stateMachine3Vanilla_raggedEndStateProb;
     sM3v->model.cellCalculate = stateMachine3Vanilla_cellCalculate;
+    sM3v->model.diagonalCalculate = diagonalKernel_stateMachine3Vanilla;
     sM3v->model.cellCalculateUpdateExpectations = cellCalcUpdateExpFcn;
 
     // stateMachine3Vanilla-specific functions
     sM3v->getKmerSkipProb = xSkipProbFcn;
     sM3v->getScaledMatchProbFcn = scaledMatchProbFcn;
     sM3v->getMatchProbFcn = matchProbFcn;
+    sM3v->kmerSkipTable = NULL;
 
     // set emissions to defaults or zeros
     setEmissionsDefaults((StateMachine *) sM3v, 60);
@@ -1655,7 +1965,7 @@ StateMachine *stateMachineEchelon_construct(StateMachineType type, int64_t param
                                             double (*skipProbFcn)(StateMachine *sM, void *kmerList),
                                             double (*matchProbFcn)(const double *, void *, void *, int64_t n),
                                             double (*scaledMatchProbFcn)(const double *, void *, void *),
-                                            void (*cellCalcUpdateExpFcn)(double *fromCells, double *toCells,
+                                            void (*cellCalcUpdateExpFcn)(DpCell *fromCells, DpCell *toCells,
                                                                          int64_t from, int64_t to,
                                                                          double eP, double tP, void *extraArgs)) {
     StateMachineEchelon *sMe = st_malloc(sizeof(StateMachineEchelon));
@@ -1679,6 +1989,7 @@ StateMachine *stateMachineEchelon_construct(StateMachineType type, int64_t param
     sMe->model.endStateProb = stateMachineEchelon_endStateProb;
     sMe->model.raggedEndStateProb = stateMachineEchelon_endStateProb;
     sMe->model.cellCalculate = stateMachineEchelon_cellCalculate;
+    sMe->model.diagonalCalculate = diagonalKernel_stateMachineEchelon;
     sMe->model.cellCalculateUpdateExpectations = cellCalcUpdateExpFcn;
 
     // class functions
@@ -1686,6 +1997,8 @@ StateMachine *stateMachineEchelon_construct(StateMachineType type, int64_t param
     sMe->getDurationProb = durationProbFcn;
     sMe->getMatchProbFcn = matchProbFcn;
     sMe->getScaledMatchProbFcn = scaledMatchProbFcn;
+    sMe->kmerSkipTable = NULL;
+    sMe->durationTable = NULL;
 
     setEmissionsToDefaults((StateMachine *) sMe, 60);
     return (StateMachine *) sMe;
@@ -1772,15 +2085,48 @@ StateMachine *getStateMachine5(Hmm *hmmD, StateMachineFunctions *sMfs) {
     }
 }
 
+// A signal stateMachine of one of the types made from a pore model, with its model zeroed
+static StateMachine *stateMachine_constructSignal(StateMachineType type) {
+    switch (type) {
+        case threeState:
+            return stateMachine3_construct(threeState, NUM_OF_KMERS,
+                                           stateMachine3_setTransitionsToNanoporeDefaults,
+                                           emissions_signal_initEmissionsToZero,
+                                           emissions_kmer_getGapProb,
+                                           emissions_signal_strawManGetKmerEventMatchProb,
+                                           emissions_signal_strawManGetKmerEventMatchProb,
+                                           cell_signal_updateTransAndKmerSkipExpectations);
+        case fourState:
+            return stateMachine4_construct(fourState, NUM_OF_KMERS,
+                                           emissions_signal_initEmissionsToZero,
+                                           emissions_kmer_getGapProb,
+                                           emissions_signal_strawManGetKmerEventMatchProb,
+                                           emissions_signal_strawManGetKmerEventMatchProb,
+                                           cell_signal_updateTransAndKmerSkipExpectations);
+        case vanilla:
+            return stateMachine3Vanilla_construct(vanilla, NUM_OF_KMERS,
+                                                  emissions_signal_initEmissionsToZero,
+                                                  emissions_signal_getBetaOrAlphaSkipProb,
+                                                  emissions_signal_getEventMatchProbWithTwoDists,
+                                                  emissions_signal_getEventMatchProbWithTwoDists,
+                                                  cell_signal_updateBetaAndAlphaProb);
+        case echelon:
+            return stateMachineEchelon_construct(echelon, NUM_OF_KMERS,
+                                                 emissions_signal_initEmissionsToZero,
+                                                 emissions_signal_getDurationProb,
+                                                 emissions_signal_getKmerSkipProb,
+                                                 emissions_signal_multipleKmerMatchProb,
+                                                 emissions_signal_getEventMatchProbWithTwoDists,
+                                                 NULL); // cell update expectation, to be implemented
+        default:
+            st_errAbort("stateMachine_constructSignal: no signal stateMachine of type %i\n", type);
+            return NULL;
+    }
+}
+
 StateMachine *getStrawManStateMachine3(const char *modelFile) {
-    StateMachine *sM3 = stateMachine3_construct(threeState, NUM_OF_KMERS,
-                                                stateMachine3_setTransitionsToNanoporeDefaults,
-                                                emissions_signal_initEmissionsToZero,
-                                                emissions_kmer_getGapProb,
-                                                emissions_signal_strawManGetKmerEventMatchProb,
-                                                emissions_signal_strawManGetKmerEventMatchProb,
-                                                cell_signal_updateTransAndKmerSkipExpectations);
-    emissions_signal_loadPoreModel(sM3, modelFile, sM3->type);
+    StateMachine *sM3 = stateMachine_constructSignal(threeState);
+    emissions_signal_loadPoreModel(sM3, modelFile);
     return sM3;
 }
 
@@ -1798,41 +2144,297 @@ StateMachine *getHdpStateMachine3(NanoporeHDP *hdp) {
 }
 
 StateMachine *getStateMachine4(const char *modelFile) {
-    StateMachine *sM4 = stateMachine4_construct(fourState, NUM_OF_KMERS,
-                                                emissions_signal_initEmissionsToZero,
-                                                emissions_kmer_getGapProb,
-                                                emissions_signal_strawManGetKmerEventMatchProb,
-                                                emissions_signal_strawManGetKmerEventMatchProb,
-                                                cell_signal_updateTransAndKmerSkipExpectations);
-    emissions_signal_loadPoreModel(sM4, modelFile, sM4->type);
+    StateMachine *sM4 = stateMachine_constructSignal(fourState);
+    emissions_signal_loadPoreModel(sM4, modelFile);
     return sM4;
 }
 
 StateMachine *getSignalStateMachine3Vanilla(const char *modelFile) {
     // construct a stateMachine3Vanilla then load the model
-    StateMachine *sM3v = stateMachine3Vanilla_construct(vanilla, NUM_OF_KMERS,
-                                                        emissions_signal_initEmissionsToZero,
-                                                        emissions_signal_getBetaOrAlphaSkipProb,
-                                                        emissions_signal_getEventMatchProbWithTwoDists,
-                                                        emissions_signal_getEventMatchProbWithTwoDists,
-                                                        cell_signal_updateBetaAndAlphaProb);
-    emissions_signal_loadPoreModel(sM3v, modelFile, sM3v->type);
+    StateMachine *sM3v = stateMachine_constructSignal(vanilla);
+    emissions_signal_loadPoreModel(sM3v, modelFile);
     return sM3v;
 }
 
 StateMachine *getStateMachineEchelon(const char *modelFile) {
-    StateMachine *sMe = stateMachineEchelon_construct(echelon, NUM_OF_KMERS,
-                                                      emissions_signal_initEmissionsToZero,
-                                                      emissions_signal_getDurationProb,
-                                                      emissions_signal_getKmerSkipProb,
-                                                      emissions_signal_multipleKmerMatchProb,
-                                                      emissions_signal_getEventMatchProbWithTwoDists,
-                                                      NULL); // cell update expectation, to be implemented
-    emissions_signal_loadPoreModel(sMe, modelFile, sMe->type);
+    StateMachine *sMe = stateMachine_constructSignal(echelon);
+    emissions_signal_loadPoreModel(sMe, modelFile);
     return sMe;
 }
 
+/////////////////
+// Pore models //
+/////////////////
+
+struct _poreModel {
+    double *matchModel; // as EMISSION_MATCH_PROBS, the model values followed by their derived kmer params
+    double *gapYModel;  // as EMISSION_GAP_Y_PROBS
+    double *skipBins;   // the SIGNAL_SKIP_BINS kmer skip bins
+    void *mapping;      // the binary model file the three point into, NULL if they are allocated
+    size_t mappingLength;
+};
+
+// The binary model file starts with this header, followed by the skip bins and then the match and Y gap models,
+// each at a 64 byte aligned offset and laid out as in memory, their derived kmer params included, so that they can
+// be used where the file is mapped.
+typedef struct _poreModelFileHeader {
+    char magic[8];
+    int64_t byteOrder;
+    int64_t kmerNumber;
+    int64_t modelParams;
+    int64_t kmerParamsSize;
+    int64_t skipBinNumber;
+    int64_t sourceSize;  // size and modification time of the model file it was made from
+    int64_t sourceMTime;
+} PoreModelFileHeader;
+
+#define PORE_MODEL_FILE_MAGIC "cPpmdl02"
+#define PORE_MODEL_FILE_BYTE_ORDER 0x0102030405060708
+#define PORE_MODEL_ALIGN(n) (((n) + 63) & ~((size_t) 63))
+#define PORE_MODEL_BLOCK_LENGTH (PORE_MODEL_ALIGN(SIGNAL_MODEL_LENGTH * sizeof(double)) + \
+                                 NUM_OF_KMERS * sizeof(SignalKmerParams))
+#define PORE_MODEL_SKIP_BINS_OFFSET PORE_MODEL_ALIGN(sizeof(PoreModelFileHeader))
+#define PORE_MODEL_MATCH_OFFSET (PORE_MODEL_SKIP_BINS_OFFSET + PORE_MODEL_ALIGN(SIGNAL_SKIP_BINS * sizeof(double)))
+#define PORE_MODEL_GAP_Y_OFFSET (PORE_MODEL_MATCH_OFFSET + PORE_MODEL_BLOCK_LENGTH)
+#define PORE_MODEL_FILE_LENGTH (PORE_MODEL_GAP_Y_OFFSET + PORE_MODEL_BLOCK_LENGTH)
+
+// Copies a signal model and its derived kmer params, which sit at different offsets from the model values if the two
+// aren't aligned alike
+static void emissions_signal_copyModel(const double *model, double *copy) {
+    memcpy(copy, model, SIGNAL_MODEL_LENGTH * sizeof(double));
+    memcpy((SignalKmerParams *) emissions_signal_getKmerParams(copy), emissions_signal_getKmerParams(model),
+           NUM_OF_KMERS * sizeof(SignalKmerParams));
+}
+
+static void poreModel_getSourceStats(const char *modelFile, int64_t *size, int64_t *mTime) {
+    struct stat st;
+    if (modelFile == NULL || stat(modelFile, &st) != 0) {
+        *size = -1;
+        *mTime = -1;
+        return;
+    }
+    *size = (int64_t) st.st_size;
+    *mTime = (int64_t) st.st_mtime;
+}
+
+PoreModel *poreModel_loadFromFile(const char *modelFile) {
+    PoreModel *poreModel = st_calloc(1, sizeof(PoreModel));
+    poreModel->matchModel = emissions_signal_constructModel(NUM_OF_KMERS);
+    poreModel->gapYModel = emissions_signal_constructModel(NUM_OF_KMERS);
+    poreModel->skipBins = st_malloc(SIGNAL_SKIP_BINS * sizeof(double));
+    emissions_signal_parsePoreModel(modelFile, poreModel->matchModel, poreModel->skipBins, poreModel->gapYModel);
+    return poreModel;
+}
+
+PoreModel *poreModel_loadBinary(const char *binaryFile, const char *modelFile) {
+    int fd = open(binaryFile, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size != PORE_MODEL_FILE_LENGTH) {
+        close(fd);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, PORE_MODEL_FILE_LENGTH, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    const PoreModelFileHeader *header = mapping;
+    int64_t sourceSize, sourceMTime;
+    poreModel_getSourceStats(modelFile, &sourceSize, &sourceMTime);
+    if (memcmp(header->magic, PORE_MODEL_FILE_MAGIC, sizeof(header->magic)) != 0
+        || header->byteOrder != PORE_MODEL_FILE_BYTE_ORDER || header->kmerNumber != NUM_OF_KMERS
+        || header->modelParams != MODEL_PARAMS || header->kmerParamsSize != (int64_t) sizeof(SignalKmerParams)
+        || header->skipBinNumber != SIGNAL_SKIP_BINS
+        || (modelFile != NULL && (header->sourceSize != sourceSize || header->sourceMTime != sourceMTime))) {
+        munmap(mapping, PORE_MODEL_FILE_LENGTH);
+        return NULL;
+    }
+    PoreModel *poreModel = st_malloc(sizeof(PoreModel));
+    poreModel->mapping = mapping;
+    poreModel->mappingLength = PORE_MODEL_FILE_LENGTH;
+    poreModel->skipBins = (double *) ((char *) mapping + PORE_MODEL_SKIP_BINS_OFFSET);
+    poreModel->matchModel = (double *) ((char *) mapping + PORE_MODEL_MATCH_OFFSET);
+    poreModel->gapYModel = (double *) ((char *) mapping + PORE_MODEL_GAP_Y_OFFSET);
+    return poreModel;
+}
+
+bool poreModel_writeBinary(PoreModel *poreModel, const char *binaryFile, const char *modelFile) {
+    char *buffer = st_calloc(PORE_MODEL_FILE_LENGTH, 1);
+    PoreModelFileHeader *header = (PoreModelFileHeader *) buffer;
+    memcpy(header->magic, PORE_MODEL_FILE_MAGIC, sizeof(header->magic));
+    header->byteOrder = PORE_MODEL_FILE_BYTE_ORDER;
+    header->kmerNumber = NUM_OF_KMERS;
+    header->modelParams = MODEL_PARAMS;
+    header->kmerParamsSize = sizeof(SignalKmerParams);
+    header->skipBinNumber = SIGNAL_SKIP_BINS;
+    poreModel_getSourceStats(modelFile, &header->sourceSize, &header->sourceMTime);
+    memcpy(buffer + PORE_MODEL_SKIP_BINS_OFFSET, poreModel->skipBins, SIGNAL_SKIP_BINS * sizeof(double));
+    // the buffer is only 16 byte aligned, so the kmer params are copied to where they'll be in the file
+    memcpy(buffer + PORE_MODEL_MATCH_OFFSET, poreModel->matchModel, SIGNAL_MODEL_LENGTH * sizeof(double));
+    memcpy(buffer + PORE_MODEL_MATCH_OFFSET + PORE_MODEL_ALIGN(SIGNAL_MODEL_LENGTH * sizeof(double)),
+           emissions_signal_getKmerParams(poreModel->matchModel), NUM_OF_KMERS * sizeof(SignalKmerParams));
+    memcpy(buffer + PORE_MODEL_GAP_Y_OFFSET, poreModel->gapYModel, SIGNAL_MODEL_LENGTH * sizeof(double));
+    memcpy(buffer + PORE_MODEL_GAP_Y_OFFSET + PORE_MODEL_ALIGN(SIGNAL_MODEL_LENGTH * sizeof(double)),
+           emissions_signal_getKmerParams(poreModel->gapYModel), NUM_OF_KMERS * sizeof(SignalKmerParams));
+
+    // written to a temporary file and renamed into place, so that a concurrent reader never maps half a model
+    char *tempFile = stString_print("%s.%lld.tmp", binaryFile, (long long) getpid());
+    FILE *fH = fopen(tempFile, "wb");
+    bool written = fH != NULL && fwrite(buffer, 1, PORE_MODEL_FILE_LENGTH, fH) == PORE_MODEL_FILE_LENGTH;
+    if (fH != NULL) {
+        written = (fclose(fH) == 0) && written;
+    }
+    written = written && rename(tempFile, binaryFile) == 0;
+    if (!written) {
+        remove(tempFile);
+    }
+    free(tempFile);
+    free(buffer);
+    return written;
+}
+
+PoreModel *poreModel_load(const char *modelFile, bool binarySidecar) {
+    if (!binarySidecar) {
+        return poreModel_loadFromFile(modelFile);
+    }
+    char *binaryFile = stString_print("%s.bin", modelFile);
+    PoreModel *poreModel = poreModel_loadBinary(binaryFile, modelFile);
+    if (poreModel == NULL) {
+        poreModel = poreModel_loadFromFile(modelFile);
+        if (!poreModel_writeBinary(poreModel, binaryFile, modelFile)) {
+            st_logInfo("poreModel_load: couldn't write binary model %s, carrying on without it\n", binaryFile);
+        }
+    }
+    free(binaryFile);
+    return poreModel;
+}
+
+void poreModel_destruct(PoreModel *poreModel) {
+    if (poreModel->mapping != NULL) {
+        munmap(poreModel->mapping, poreModel->mappingLength);
+    } else {
+        free(poreModel->matchModel);
+        free(poreModel->gapYModel);
+        free(poreModel->skipBins);
+    }
+    free(poreModel);
+}
+
+StateMachine *poreModel_getStateMachine(PoreModel *poreModel, StateMachineType type) {
+    StateMachine *sM = stateMachine_constructSignal(type);
+    emissions_signal_copyModel(poreModel->matchModel, sM->EMISSION_MATCH_PROBS);
+    emissions_signal_setSkipBins(sM, poreModel->skipBins);
+    // nothing changes the Y gap model once it's loaded, so it is shared rather than copied
+    free(sM->EMISSION_GAP_Y_PROBS);
+    sM->EMISSION_GAP_Y_PROBS = poreModel->gapYModel;
+    return sM;
+}
+
+void poreModel_scaleStateMachine(PoreModel *poreModel, StateMachine *sM, double scale, double shift, double var,
+                                 double scale_sd, double var_sd) {
+    emissions_signal_scaleModelValues(poreModel->matchModel, sM->EMISSION_MATCH_PROBS,
+                                      scale, shift, var, scale_sd, var_sd);
+}
+
+void poreModel_destructStateMachine(PoreModel *poreModel, StateMachine *sM) {
+    if (sM->EMISSION_GAP_Y_PROBS == poreModel->gapYModel) {
+        sM->EMISSION_GAP_Y_PROBS = NULL;
+    }
+    stateMachine_destructSignal(sM);
+}
+
+struct _poreModelCache {
+    stHash *poreModels; // model file to PoreModel
+    bool binarySidecars;
+    pthread_mutex_t mutex;
+};
+
+PoreModelCache *poreModelCache_construct(bool binarySidecars) {
+    PoreModelCache *cache = st_malloc(sizeof(PoreModelCache));
+    cache->poreModels = stHash_construct3(stHash_stringKey, stHash_stringEqualKey, free,
+                                          (void (*)(void *)) poreModel_destruct);
+    cache->binarySidecars = binarySidecars;
+    pthread_mutex_init(&cache->mutex, NULL);
+    return cache;
+}
+
+void poreModelCache_destruct(PoreModelCache *cache) {
+    stHash_destruct(cache->poreModels);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache);
+}
+
+PoreModel *poreModelCache_get(PoreModelCache *cache, const char *modelFile) {
+    // loading under the lock, two threads wanting the same model load it once
+    pthread_mutex_lock(&cache->mutex);
+    PoreModel *poreModel = stHash_search(cache->poreModels, (void *) modelFile);
+    if (poreModel == NULL) {
+        poreModel = poreModel_load(modelFile, cache->binarySidecars);
+        stHash_insert(cache->poreModels, stString_copy(modelFile), poreModel);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return poreModel;
+}
+
+void stateMachine_setKmerIndexEmissions(StateMachine *sM) {
+    // machines that have already been switched are left as they are, so one can be reused for many alignments
+    if (sM->type == threeState
+        && ((StateMachine3 *) sM)->getMatchProbFcn == emissions_signal_strawManGetKmerEventMatchProbFromIndex) {
+        return;
+    }
+    if (sM->type == fourState
+        && ((StateMachine4 *) sM)->getMatchProbFcn == emissions_signal_strawManGetKmerEventMatchProbFromIndex) {
+        return;
+    }
+    if (sM->type == vanilla && ((StateMachine3Vanilla *) sM)->getMatchProbFcn
+                               == emissions_signal_getEventMatchProbWithTwoDistsFromIndex) {
+        return;
+    }
+    if (sM->type == threeState
+        && ((StateMachine3 *) sM)->getMatchProbFcn == emissions_signal_strawManGetKmerEventMatchProb) {
+        StateMachine3 *sM3 = (StateMachine3 *) sM;
+        sM3->getXGapProbFcn = emissions_kmer_getGapProbFromIndex;
+        sM3->getYGapProbFcn = emissions_signal_strawManGetKmerEventMatchProbFromIndex;
+        sM3->getMatchProbFcn = emissions_signal_strawManGetKmerEventMatchProbFromIndex;
+        return;
+    }
+    if (sM->type == fourState
+        && ((StateMachine4 *) sM)->getMatchProbFcn == emissions_signal_strawManGetKmerEventMatchProb) {
+        StateMachine4 *sM4 = (StateMachine4 *) sM;
+        sM4->getXGapProbFcn = emissions_kmer_getGapProbFromIndex;
+        sM4->getYGapProbFcn = emissions_signal_strawManGetKmerEventMatchProbFromIndex;
+        sM4->getMatchProbFcn = emissions_signal_strawManGetKmerEventMatchProbFromIndex;
+        return;
+    }
+    if (sM->type == vanilla
+        && ((StateMachine3Vanilla *) sM)->getMatchProbFcn == emissions_signal_getEventMatchProbWithTwoDists) {
+        StateMachine3Vanilla *sM3v = (StateMachine3Vanilla *) sM;
+        sM3v->getKmerSkipProb = emissions_signal_getBetaOrAlphaSkipProbFromIndex;
+        sM3v->getScaledMatchProbFcn = emissions_signal_getEventMatchProbWithTwoDistsFromIndex;
+        sM3v->getMatchProbFcn = emissions_signal_getEventMatchProbWithTwoDistsFromIndex;
+        return;
+    }
+    st_errAbort("stateMachine_setKmerIndexEmissions: no kmer index emissions for this stateMachine\n");
+}
+
 void stateMachine_destruct(StateMachine *stateMachine) {
+    KmerSkipTable **kmerSkipTable = stateMachine_getKmerSkipTableField(stateMachine);
+    if (kmerSkipTable != NULL) {
+        kmerSkipTable_destruct(*kmerSkipTable);
+    }
+    if (stateMachine->type == echelon) {
+        eventDurationTable_destruct(((StateMachineEchelon *) stateMachine)->durationTable);
+    }
     free(stateMachine);
 }
 
+void stateMachine_destructSignal(StateMachine *sM) {
+    free(sM->EMISSION_MATCH_PROBS);
+    free(sM->EMISSION_GAP_X_PROBS);
+    free(sM->EMISSION_GAP_Y_PROBS);
+    stateMachine_destruct(sM);
+}
+
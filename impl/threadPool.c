@@ -0,0 +1,193 @@
+/*
+ * threadPool.c
+ *
+ * Thread pools for the aligner: one running lists of independent tasks, one keeping a group of threads
+ * waiting to be handed fine grained work.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "sonLib.h"
+#include "vectorMath.h"
+#include "threadPool.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Task lists
+//
+//Workers take the next task from a shared index under a mutex, so long and short tasks balance out without
+//any up front partitioning.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct _taskQueue {
+    stList *tasks;
+    void (*taskFn)(void *);
+    int64_t nextTask;
+    pthread_mutex_t mutex;
+} TaskQueue;
+
+static void *threadPool_worker(void *arg) {
+    TaskQueue *queue = arg;
+    while (1) {
+        pthread_mutex_lock(&queue->mutex);
+        int64_t i = queue->nextTask++;
+        pthread_mutex_unlock(&queue->mutex);
+        if (i >= stList_length(queue->tasks)) {
+            return NULL;
+        }
+        queue->taskFn(stList_get(queue->tasks, i));
+    }
+}
+
+void threadPool_runTasks(stList *tasks, void (*taskFn)(void *), int64_t threadNumber) {
+    if (threadNumber > stList_length(tasks)) {
+        threadNumber = stList_length(tasks);
+    }
+    if (threadNumber <= 1) {
+        for (int64_t i = 0; i < stList_length(tasks); i++) {
+            taskFn(stList_get(tasks, i));
+        }
+        return;
+    }
+    //Settle the instruction set before the workers race to pick it
+    vectorMath_getSimdLevel();
+
+    TaskQueue queue;
+    queue.tasks = tasks;
+    queue.taskFn = taskFn;
+    queue.nextTask = 0;
+    pthread_mutex_init(&queue.mutex, NULL);
+    pthread_t *threads = st_malloc(threadNumber * sizeof(pthread_t));
+    for (int64_t i = 0; i < threadNumber; i++) {
+        if (pthread_create(&threads[i], NULL, threadPool_worker, &queue) != 0) {
+            st_errAbort("threadPool: failed to start thread %" PRIi64 "\n", i);
+        }
+    }
+    for (int64_t i = 0; i < threadNumber; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&queue.mutex);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Thread group
+//
+//The workers sleep on a condition variable between calls to threadGroup_run, which bumps a generation
+//counter to wake them. A mutex and two condition variables rather than a pthread_barrier_t, which not every
+//platform has.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct _threadGroupMember {
+    ThreadGroup *threadGroup;
+    int64_t thread;
+} ThreadGroupMember;
+
+struct _threadGroup {
+    int64_t threadNumber;
+    pthread_t *threads;
+    ThreadGroupMember *members;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int64_t generation; //Incremented by each call to threadGroup_run
+    int64_t running; //Workers still running the current call
+    bool stop;
+    void (*fn)(void *, int64_t, int64_t);
+    void *arg;
+};
+
+static void *threadGroup_worker(void *arg) {
+    ThreadGroupMember *member = arg;
+    ThreadGroup *threadGroup = member->threadGroup;
+    int64_t generation = 0;
+    while (1) {
+        pthread_mutex_lock(&threadGroup->mutex);
+        while (threadGroup->generation == generation && !threadGroup->stop) {
+            pthread_cond_wait(&threadGroup->start, &threadGroup->mutex);
+        }
+        if (threadGroup->stop) {
+            pthread_mutex_unlock(&threadGroup->mutex);
+            return NULL;
+        }
+        generation = threadGroup->generation;
+        void (*fn)(void *, int64_t, int64_t) = threadGroup->fn;
+        void *fnArg = threadGroup->arg;
+        pthread_mutex_unlock(&threadGroup->mutex);
+
+        fn(fnArg, member->thread, threadGroup->threadNumber);
+
+        pthread_mutex_lock(&threadGroup->mutex);
+        if (--threadGroup->running == 0) {
+            pthread_cond_signal(&threadGroup->done);
+        }
+        pthread_mutex_unlock(&threadGroup->mutex);
+    }
+}
+
+ThreadGroup *threadGroup_construct(int64_t threadNumber) {
+    assert(threadNumber >= 1);
+    ThreadGroup *threadGroup = st_calloc(1, sizeof(ThreadGroup));
+    threadGroup->threadNumber = threadNumber;
+    pthread_mutex_init(&threadGroup->mutex, NULL);
+    pthread_cond_init(&threadGroup->start, NULL);
+    pthread_cond_init(&threadGroup->done, NULL);
+    vectorMath_getSimdLevel();
+    threadGroup->threads = st_malloc(threadNumber * sizeof(pthread_t));
+    threadGroup->members = st_malloc(threadNumber * sizeof(ThreadGroupMember));
+    for (int64_t i = 1; i < threadNumber; i++) {
+        threadGroup->members[i].threadGroup = threadGroup;
+        threadGroup->members[i].thread = i;
+        if (pthread_create(&threadGroup->threads[i], NULL, threadGroup_worker, &threadGroup->members[i]) != 0) {
+            st_errAbort("threadGroup: failed to start thread %" PRIi64 "\n", i);
+        }
+    }
+    return threadGroup;
+}
+
+void threadGroup_destruct(ThreadGroup *threadGroup) {
+    pthread_mutex_lock(&threadGroup->mutex);
+    threadGroup->stop = 1;
+    pthread_cond_broadcast(&threadGroup->start);
+    pthread_mutex_unlock(&threadGroup->mutex);
+    for (int64_t i = 1; i < threadGroup->threadNumber; i++) {
+        pthread_join(threadGroup->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&threadGroup->mutex);
+    pthread_cond_destroy(&threadGroup->start);
+    pthread_cond_destroy(&threadGroup->done);
+    free(threadGroup->threads);
+    free(threadGroup->members);
+    free(threadGroup);
+}
+
+int64_t threadGroup_getThreadNumber(ThreadGroup *threadGroup) {
+    return threadGroup->threadNumber;
+}
+
+void threadGroup_run(ThreadGroup *threadGroup, void (*fn)(void *arg, int64_t thread, int64_t threadNumber),
+                     void *arg) {
+    if (threadGroup->threadNumber == 1) {
+        fn(arg, 0, 1);
+        return;
+    }
+    pthread_mutex_lock(&threadGroup->mutex);
+    assert(threadGroup->running == 0);
+    threadGroup->fn = fn;
+    threadGroup->arg = arg;
+    threadGroup->running = threadGroup->threadNumber - 1;
+    threadGroup->generation++;
+    pthread_cond_broadcast(&threadGroup->start);
+    pthread_mutex_unlock(&threadGroup->mutex);
+
+    fn(arg, 0, threadGroup->threadNumber);
+
+    pthread_mutex_lock(&threadGroup->mutex);
+    while (threadGroup->running > 0) {
+        pthread_cond_wait(&threadGroup->done, &threadGroup->mutex);
+    }
+    pthread_mutex_unlock(&threadGroup->mutex);
+}
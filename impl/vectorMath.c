@@ -0,0 +1,360 @@
+/*
+ * vectorMath.c
+ *
+ * Batched versions of logAdd. The vector logAdd is branch free: all four cubics of the interpolation in
+ * pairwiseAligner.c's lookup() are evaluated and the right one is blended in, with the same coefficients and
+ * the same order of operations, so each lane gives exactly what logAdd gives. AVX2 is picked at runtime
+ * when the CPU has it, otherwise SSE2 is used where the build has it, otherwise the scalar logAdd. The
+ * Gaussian log densities of the signal emissions are batched the same way.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include "sonLib.h"
+#include "pairwiseAligner.h"
+#include "vectorMath.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define VECTOR_MATH_SSE2 1
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define VECTOR_MATH_AVX2 1
+#endif
+
+//Coefficients of the cubics in lookup(), kept as floats so they round the same way
+static const double logAddCoefficients[4][4] = {
+        { -0.009350833524763f, 0.130659527668286f, 0.498799810682272f, 0.693203116424741f },
+        { -0.014532321752540f, 0.139942324101744f, 0.495635523139337f, 0.692140569840976f },
+        { -0.004605031767994f, 0.063427417320019f, 0.695956496475118f, 0.514272634594009f },
+        { -0.000458661602210f, 0.009695946122598f, 0.930734667215156f, 0.168037164329057f } };
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Instruction set selection
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int64_t simdLevel = -1;
+
+SimdLevel vectorMath_getSupportedSimdLevel(void) {
+#if defined(VECTOR_MATH_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        return simdLevel_avx2;
+    }
+#endif
+#if defined(VECTOR_MATH_SSE2)
+    return simdLevel_sse2;
+#else
+    return simdLevel_none;
+#endif
+}
+
+SimdLevel vectorMath_getSimdLevel(void) {
+    if (simdLevel == -1) {
+        simdLevel = vectorMath_getSupportedSimdLevel();
+    }
+    return (SimdLevel) simdLevel;
+}
+
+void vectorMath_setSimdLevel(SimdLevel level) {
+    SimdLevel supportedLevel = vectorMath_getSupportedSimdLevel();
+    simdLevel = level > supportedLevel ? supportedLevel : level;
+}
+
+int64_t vectorMath_getVectorWidth(void) {
+    switch (vectorMath_getSimdLevel()) {
+        case simdLevel_avx2:
+            return 4;
+        case simdLevel_sse2:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//AVX2
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if defined(VECTOR_MATH_AVX2)
+__attribute__((target("avx2")))
+static inline __m256d logAddCubic_avx2(__m256d x, const double *c) {
+    __m256d r = _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(c[0]), x), _mm256_set1_pd(c[1]));
+    r = _mm256_add_pd(_mm256_mul_pd(r, x), _mm256_set1_pd(c[2]));
+    return _mm256_add_pd(_mm256_mul_pd(r, x), _mm256_set1_pd(c[3]));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d logAdd_avx2(__m256d x, __m256d y) {
+    __m256d hi = _mm256_max_pd(x, y);
+    __m256d lo = _mm256_min_pd(x, y);
+    __m256d d = _mm256_sub_pd(hi, lo);
+    __m256d l = logAddCubic_avx2(d, logAddCoefficients[3]);
+    l = _mm256_blendv_pd(l, logAddCubic_avx2(d, logAddCoefficients[2]),
+                         _mm256_cmp_pd(d, _mm256_set1_pd(4.50f), _CMP_LE_OQ));
+    l = _mm256_blendv_pd(l, logAddCubic_avx2(d, logAddCoefficients[1]),
+                         _mm256_cmp_pd(d, _mm256_set1_pd(2.50f), _CMP_LE_OQ));
+    l = _mm256_blendv_pd(l, logAddCubic_avx2(d, logAddCoefficients[0]),
+                         _mm256_cmp_pd(d, _mm256_set1_pd(1.00f), _CMP_LE_OQ));
+    __m256d underflow = _mm256_or_pd(_mm256_cmp_pd(lo, _mm256_set1_pd(LOG_ZERO), _CMP_EQ_OQ),
+                                     _mm256_cmp_pd(d, _mm256_set1_pd(LOG_ADD_UNDERFLOW_THRESHOLD), _CMP_GE_OQ));
+    return _mm256_blendv_pd(_mm256_add_pd(l, lo), hi, underflow);
+}
+
+__attribute__((target("avx2")))
+static int64_t logAdd_batch_avx2(const double *x, const double *y, double *result, int64_t length) {
+    int64_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        _mm256_storeu_pd(result + i, logAdd_avx2(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int64_t logAddAccumulate_avx2(double *total, const double *x, const double *eP, double tP, int64_t length) {
+    __m256d t = _mm256_set1_pd(tP);
+    int64_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        __m256d p = _mm256_add_pd(_mm256_loadu_pd(x + i), _mm256_add_pd(_mm256_loadu_pd(eP + i), t));
+        _mm256_storeu_pd(total + i, logAdd_avx2(_mm256_loadu_pd(total + i), p));
+    }
+    return i;
+}
+
+//Sums into four running totals, which are returned in lanes
+__attribute__((target("avx2")))
+static int64_t logDotProduct_avx2(const double *x, const double *y, int64_t length, double *lanes) {
+    __m256d total = _mm256_set1_pd(LOG_ZERO);
+    int64_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        __m256d p = y == NULL ? _mm256_loadu_pd(x + i) : _mm256_add_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i));
+        total = logAdd_avx2(total, p);
+    }
+    _mm256_storeu_pd(lanes, total);
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int64_t logGaussianPair_avx2(double *result, const double *c, double d, double x, const double *xMean,
+                                    const double *xScale, double y, const double *yMean, const double *yScale,
+                                    double w, int64_t length) {
+    __m256d dV = _mm256_set1_pd(d), xV = _mm256_set1_pd(x), yV = _mm256_set1_pd(y), wV = _mm256_set1_pd(w);
+    __m256d half = _mm256_set1_pd(0.5);
+    int64_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        __m256d a = _mm256_mul_pd(_mm256_sub_pd(xV, _mm256_loadu_pd(xMean + i)), _mm256_loadu_pd(xScale + i));
+        __m256d b = _mm256_mul_pd(_mm256_sub_pd(yV, _mm256_loadu_pd(yMean + i)), _mm256_loadu_pd(yScale + i));
+        __m256d deviation = _mm256_add_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(_mm256_mul_pd(b, b), wV));
+        _mm256_storeu_pd(result + i, _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(c + i), dV),
+                                                   _mm256_mul_pd(deviation, half)));
+    }
+    return i;
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//SSE2
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if defined(VECTOR_MATH_SSE2)
+static inline __m128d select_sse2(__m128d mask, __m128d a, __m128d b) {
+    return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+static inline __m128d logAddCubic_sse2(__m128d x, const double *c) {
+    __m128d r = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(c[0]), x), _mm_set1_pd(c[1]));
+    r = _mm_add_pd(_mm_mul_pd(r, x), _mm_set1_pd(c[2]));
+    return _mm_add_pd(_mm_mul_pd(r, x), _mm_set1_pd(c[3]));
+}
+
+static inline __m128d logAdd_sse2(__m128d x, __m128d y) {
+    __m128d hi = _mm_max_pd(x, y);
+    __m128d lo = _mm_min_pd(x, y);
+    __m128d d = _mm_sub_pd(hi, lo);
+    __m128d l = logAddCubic_sse2(d, logAddCoefficients[3]);
+    l = select_sse2(_mm_cmple_pd(d, _mm_set1_pd(4.50f)), logAddCubic_sse2(d, logAddCoefficients[2]), l);
+    l = select_sse2(_mm_cmple_pd(d, _mm_set1_pd(2.50f)), logAddCubic_sse2(d, logAddCoefficients[1]), l);
+    l = select_sse2(_mm_cmple_pd(d, _mm_set1_pd(1.00f)), logAddCubic_sse2(d, logAddCoefficients[0]), l);
+    __m128d underflow = _mm_or_pd(_mm_cmpeq_pd(lo, _mm_set1_pd(LOG_ZERO)),
+                                  _mm_cmpge_pd(d, _mm_set1_pd(LOG_ADD_UNDERFLOW_THRESHOLD)));
+    return select_sse2(underflow, hi, _mm_add_pd(l, lo));
+}
+
+static int64_t logAdd_batch_sse2(const double *x, const double *y, double *result, int64_t length) {
+    int64_t i = 0;
+    for (; i + 2 <= length; i += 2) {
+        _mm_storeu_pd(result + i, logAdd_sse2(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+    }
+    return i;
+}
+
+static int64_t logAddAccumulate_sse2(double *total, const double *x, const double *eP, double tP, int64_t length) {
+    __m128d t = _mm_set1_pd(tP);
+    int64_t i = 0;
+    for (; i + 2 <= length; i += 2) {
+        __m128d p = _mm_add_pd(_mm_loadu_pd(x + i), _mm_add_pd(_mm_loadu_pd(eP + i), t));
+        _mm_storeu_pd(total + i, logAdd_sse2(_mm_loadu_pd(total + i), p));
+    }
+    return i;
+}
+
+static int64_t logDotProduct_sse2(const double *x, const double *y, int64_t length, double *lanes) {
+    __m128d total = _mm_set1_pd(LOG_ZERO);
+    int64_t i = 0;
+    for (; i + 2 <= length; i += 2) {
+        __m128d p = y == NULL ? _mm_loadu_pd(x + i) : _mm_add_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i));
+        total = logAdd_sse2(total, p);
+    }
+    _mm_storeu_pd(lanes, total);
+    return i;
+}
+
+static int64_t logGaussianPair_sse2(double *result, const double *c, double d, double x, const double *xMean,
+                                    const double *xScale, double y, const double *yMean, const double *yScale,
+                                    double w, int64_t length) {
+    __m128d dV = _mm_set1_pd(d), xV = _mm_set1_pd(x), yV = _mm_set1_pd(y), wV = _mm_set1_pd(w);
+    __m128d half = _mm_set1_pd(0.5);
+    int64_t i = 0;
+    for (; i + 2 <= length; i += 2) {
+        __m128d a = _mm_mul_pd(_mm_sub_pd(xV, _mm_loadu_pd(xMean + i)), _mm_loadu_pd(xScale + i));
+        __m128d b = _mm_mul_pd(_mm_sub_pd(yV, _mm_loadu_pd(yMean + i)), _mm_loadu_pd(yScale + i));
+        __m128d deviation = _mm_add_pd(_mm_mul_pd(a, a), _mm_mul_pd(_mm_mul_pd(b, b), wV));
+        _mm_storeu_pd(result + i, _mm_sub_pd(_mm_add_pd(_mm_loadu_pd(c + i), dV), _mm_mul_pd(deviation, half)));
+    }
+    return i;
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Batched functions
+//
+//The vector routines do as many whole vectors as fit and return how far they got, the rest is done with
+//the scalar logAdd.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void vectorMath_logAdd(const double *x, const double *y, double *result, int64_t length) {
+    int64_t i = 0;
+    switch (vectorMath_getSimdLevel()) {
+#if defined(VECTOR_MATH_AVX2)
+        case simdLevel_avx2:
+            i = logAdd_batch_avx2(x, y, result, length);
+            break;
+#endif
+#if defined(VECTOR_MATH_SSE2)
+        case simdLevel_sse2:
+            i = logAdd_batch_sse2(x, y, result, length);
+            break;
+#endif
+        default:
+            break;
+    }
+    for (; i < length; i++) {
+        result[i] = logAdd(x[i], y[i]);
+    }
+}
+
+void vectorMath_logAddAccumulate(double *total, const double *x, const double *eP, double tP, int64_t length) {
+    int64_t i = 0;
+    switch (vectorMath_getSimdLevel()) {
+#if defined(VECTOR_MATH_AVX2)
+        case simdLevel_avx2:
+            i = logAddAccumulate_avx2(total, x, eP, tP, length);
+            break;
+#endif
+#if defined(VECTOR_MATH_SSE2)
+        case simdLevel_sse2:
+            i = logAddAccumulate_sse2(total, x, eP, tP, length);
+            break;
+#endif
+        default:
+            break;
+    }
+    for (; i < length; i++) {
+        total[i] = logAdd(total[i], x[i] + (eP[i] + tP));
+    }
+}
+
+//y may be NULL, in which case the terms are just x
+static double logDotProduct(const double *x, const double *y, int64_t length) {
+    double lanes[4];
+    int64_t laneNumber = 0, i = 0;
+    switch (vectorMath_getSimdLevel()) {
+#if defined(VECTOR_MATH_AVX2)
+        case simdLevel_avx2:
+            i = logDotProduct_avx2(x, y, length, lanes);
+            laneNumber = 4;
+            break;
+#endif
+#if defined(VECTOR_MATH_SSE2)
+        case simdLevel_sse2:
+            i = logDotProduct_sse2(x, y, length, lanes);
+            laneNumber = 2;
+            break;
+#endif
+        default:
+            break;
+    }
+    double total = LOG_ZERO;
+    for (int64_t j = 0; j < laneNumber; j++) {
+        total = logAdd(total, lanes[j]);
+    }
+    for (; i < length; i++) {
+        total = logAdd(total, y == NULL ? x[i] : x[i] + y[i]);
+    }
+    return total;
+}
+
+double vectorMath_logSumExp(const double *x, int64_t length) {
+    return logDotProduct(x, NULL, length);
+}
+
+double vectorMath_logDotProduct(const double *x, const double *y, int64_t length) {
+    return logDotProduct(x, y, length);
+}
+
+void vectorMath_logGaussianPair(double *result, const double *c, double d, double x, const double *xMean,
+                                const double *xScale, double y, const double *yMean, const double *yScale,
+                                double w, int64_t length) {
+    int64_t i = 0;
+    switch (vectorMath_getSimdLevel()) {
+#if defined(VECTOR_MATH_AVX2)
+        case simdLevel_avx2:
+            i = logGaussianPair_avx2(result, c, d, x, xMean, xScale, y, yMean, yScale, w, length);
+            break;
+#endif
+#if defined(VECTOR_MATH_SSE2)
+        case simdLevel_sse2:
+            i = logGaussianPair_sse2(result, c, d, x, xMean, xScale, y, yMean, yScale, w, length);
+            break;
+#endif
+        default:
+            break;
+    }
+    for (; i < length; i++) {
+        double a = (x - xMean[i]) * xScale[i];
+        double b = (y - yMean[i]) * yScale[i];
+        result[i] = (c[i] + d) - (a * a + (b * b) * w) * 0.5;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//Linear-space functions
+//
+//These are plain loops, left for the compiler to vectorise.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void vectorMath_multiplyAccumulate(double *total, const double *x, const double *w, double c, int64_t length) {
+    for (int64_t i = 0; i < length; i++) {
+        total[i] += x[i] * (w[i] * c);
+    }
+}
+
+double vectorMath_dotProduct(const double *x, const double *y, int64_t length) {
+    double total = 0.0;
+    for (int64_t i = 0; i < length; i++) {
+        total += x[i] * y[i];
+    }
+    return total;
+}
@@ -1,5 +1,6 @@
 #ifndef NANOPORE
 #define NANOPORE
+#include <stddef.h>
 #include "sonLibTypes.h"
 #define NB_EVENT_PARAMS 3
 
@@ -25,10 +26,46 @@ typedef struct _nanoporeRead {
 
     int64_t *complementEventMap;
     double *complementEvents;
+
+    // true if the arrays point into a binary npRead file, mapping being the file if the read has it to itself
+    // (NULL for a read of a bundle)
+    bool mapped;
+    void *mapping;
+    size_t mappingLength;
 } NanoporeRead;
 
+// Loads an npRead file, text or binary
 NanoporeRead *nanopore_loadNanoporeReadFromFile(const char *nanoporeReadFile);
 
+// Maps a binary npRead file, which the read's arrays then point into, so nothing is parsed or copied. The events
+// are mapped copy on write, so they can still be changed in place.
+NanoporeRead *nanopore_loadNanoporeReadFromBinaryFile(const char *binaryFile);
+
+// Writes the read in the binary npRead format. Returns false if it couldn't.
+bool nanopore_writeNanoporeReadToBinaryFile(NanoporeRead *npRead, const char *binaryFile);
+
+// Many binary npReads in one file, found by their names.
+typedef struct _nanoporeReadBundle NanoporeReadBundle;
+
+// Writes the npRead files, text or binary, to a bundle, naming the reads by names. Only one read is in memory at
+// a time. Returns false if it couldn't.
+bool nanoporeReadBundle_write(stList *npReadFiles, stList *names, const char *bundleFile);
+
+NanoporeReadBundle *nanoporeReadBundle_open(const char *bundleFile);
+
+// The reads got from the bundle have to be destructed first.
+void nanoporeReadBundle_close(NanoporeReadBundle *bundle);
+
+int64_t nanoporeReadBundle_getReadNumber(NanoporeReadBundle *bundle);
+
+const char *nanoporeReadBundle_getReadName(NanoporeReadBundle *bundle, int64_t readIndex);
+
+// Returns the index of the read with the name, -1 if there isn't one
+int64_t nanoporeReadBundle_findRead(NanoporeReadBundle *bundle, const char *name);
+
+// A read whose arrays point into the bundle, destructed with nanopore_nanoporeReadDestruct
+NanoporeRead *nanoporeReadBundle_getRead(NanoporeReadBundle *bundle, int64_t readIndex);
+
 stList *nanopore_remapAnchorPairs(stList *anchorPairs, int64_t *eventMap);
 
 stList *nanopore_remapAnchorPairsWithOffset(stList *unmappedPairs, int64_t *eventMap, int64_t mapOffset);
@@ -17,7 +17,10 @@
 #include "bioioC.h"
 #include "sonLib.h"
 #include "stateMachine.h"
+#include "nanopore.h"
 #include "sonLibTypes.h"
+#include "threadPool.h"
+#include "seedAnchors.h"
 
 
 //The exception string
@@ -64,8 +67,23 @@ Sequence *sequence_sliceEventSequence(Sequence *inputSequence, int64_t start, in
                                       void *(*getFcn)(void *, int64_t));
 Sequence *sequence_sliceEventSequence2(Sequence *inputSequence, int64_t start, int64_t sliceLength);
 
+/*
+ * Kmer index sequence, the reference of a signal alignment as the index of each of its kmers (see
+ * emissions_discrete_getKmerIndex), worked out once when the sequence is made rather than in every cell. length is
+ * the number of kmers, as given by sequence_correctSeqLength. getFcn is sequence_getKmerIndex or
+ * sequence_getKmerIndex2, for the FromIndex emission functions of the state machine (see
+ * stateMachine_setKmerIndexEmissions). The indices are freed by sequence_destructKmerIndexSequence, slices are
+ * destroyed with sequence_sequenceDestroy.
+ */
+Sequence *sequence_constructKmerIndexSequence(int64_t length, const char *sequence,
+                                              void *(*getFcn)(void *, int64_t));
+
+Sequence *sequence_sliceKmerIndexSequence2(Sequence *inputSequence, int64_t start, int64_t sliceLength);
+
 void sequence_sequenceDestroy(Sequence *seq);
 
+void sequence_destructKmerIndexSequence(Sequence *seq);
+
 void *sequence_getBase(void *elements, int64_t index);
 
 void *sequence_getKmer(void *elements, int64_t index);
@@ -76,6 +94,11 @@ void *sequence_getKmer2(void *elements, int64_t index);
 // for HDP, different 'NULL'
 void *sequence_getKmer3(void *elements, int64_t index);
 
+// kmer index sequence counterparts of sequence_getKmer and sequence_getKmer2
+void *sequence_getKmerIndex(void *elements, int64_t index);
+
+void *sequence_getKmerIndex2(void *elements, int64_t index);
+
 void *sequence_getEvent(void *elements, int64_t index);
 
 int64_t sequence_correctSeqLength(int64_t length, SequenceType type);
@@ -92,6 +115,14 @@ typedef struct _pairwiseAlignmentBandingParameters {
     int64_t splitMatrixBiggerThanThis; //Any matrix in the anchors bigger than this is split into two.
     bool alignAmbiguityCharacters;
     float gapGamma; //The AMAP gap-gamma parameter which controls the degree to which indel probabilities are factored into the alignment.
+    bool scaledProbabilities; //Do the banded forward-backward with scaled linear-space probabilities rather than log probabilities, for state machines that support it (see diagonalCalculation_supportsScaling).
+    int64_t checkpointInterval; //getAlignedPairsWithoutBanding keeps two forward diagonals out of every this many and recomputes the rest during the backward pass. If 0 the square root of the number of diagonals is used.
+    int64_t threadNumber; //Number of threads getAlignedPairsUsingAnchors runs the sub-alignments between split points on.
+    int64_t diagonalThreadNumber; //Number of threads to split the cells of each diagonal of a dp matrix between, for state machines whose kernel supports it (see dpMatrix_setThreadGroup).
+    int64_t minThreadedDiagonalWidth; //Diagonals narrower than this are done by a single thread.
+    int64_t emissionCacheMaxSize; //Most bytes of emission probabilities to keep for reuse between the forward and backward passes, 0 to keep none.
+    double adaptiveBandXDrop; //If greater than 0 the band of getPosteriorProbsWithBanding follows the forward probabilities rather than the anchors, each diagonal spanning the cells of the last within this many log units of its most probable cell, plus diagonalExpansion either side.
+    int64_t adaptiveBandMaxExpansion; //Expansion about the anchors of the band an adaptive band is kept within, or less than 0 for the whole matrix.
 } PairwiseAlignmentParameters;
 
 PairwiseAlignmentParameters *pairwiseAlignmentBandingParameters_construct();
@@ -115,16 +146,16 @@ stList *convertPairwiseForwardStrandAlignmentToAnchorPairs(PairwiseAlignment *pA
 /*
  * Expectation calculation functions for EM algorithms.
  */
-void cell_updateExpectations(double *fromCells, double *toCells, int64_t from, int64_t to, double eP, double tP,
+void cell_updateExpectations(DpCell *fromCells, DpCell *toCells, int64_t from, int64_t to, double eP, double tP,
                              void *extraArgs);
 
-void cell_signal_updateTransAndKmerSkipExpectations(double *fromCells, double *toCells, int64_t from, int64_t to,
+void cell_signal_updateTransAndKmerSkipExpectations(DpCell *fromCells, DpCell *toCells, int64_t from, int64_t to,
                                                     double eP, double tP, void *extraArgs);
 
-void cell_signal_updateTransAndKmerSkipExpectations2(double *fromCells, double *toCells, int64_t from, int64_t to,
+void cell_signal_updateTransAndKmerSkipExpectations2(DpCell *fromCells, DpCell *toCells, int64_t from, int64_t to,
                                                      double eP, double tP, void *extraArgs);
 
-void cell_signal_updateBetaAndAlphaProb(double *fromCells, double *toCells, int64_t from, int64_t to, double eP,
+void cell_signal_updateBetaAndAlphaProb(DpCell *fromCells, DpCell *toCells, int64_t from, int64_t to, double eP,
                                         double tP,
                                         void *extraArgs);
 
@@ -173,6 +204,10 @@ Band *band_construct(stList *anchorPairs, int64_t lX, int64_t lY,
 
 void band_destruct(Band *band);
 
+//Diagonal xay of the band, 0 <= xay <= lX + lY. The band only stores its anchors, the bounds of each diagonal being
+//computed when it is asked for, so this takes time logarithmic in the number of anchors.
+Diagonal band_getDiagonal(Band *band, int64_t xay);
+
 ////Band iterator.
 
 typedef struct _bandIterator BandIterator;
@@ -196,13 +231,13 @@ double logAdd(double x, double y);
 
 //Cell calculations
 
-void cell_calculateForward(StateMachine *sM, double *current, double *lower, double *middle, double *upper, void* cX, void* cY, void *extraArgs);
+void cell_calculateForward(StateMachine *sM, DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper, void* cX, void* cY, void *extraArgs);
 
-void cell_calculateBackward(StateMachine *sM, double *current, double *lower, double *middle, double *upper, void* cX, void* cY, void *extraArgs);
+void cell_calculateBackward(StateMachine *sM, DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper, void* cX, void* cY, void *extraArgs);
 
-double cell_dotProduct(double *cell1, double *cell2, int64_t stateNumber);
+double cell_dotProduct(DpCell *cell1, DpCell *cell2, int64_t stateNumber);
 
-double cell_dotProduct2(double *cell1, StateMachine *sM, double (*getStateValue)(StateMachine *, int64_t));
+double cell_dotProduct2(DpCell *cell1, StateMachine *sM, double (*getStateValue)(StateMachine *, int64_t));
 
 //DpDiagonal
 
@@ -212,11 +247,24 @@ DpDiagonal *dpDiagonal_construct(Diagonal diagonal, int64_t stateNumber);
 
 DpDiagonal *dpDiagonal_clone(DpDiagonal *diagonal);
 
+//True if the cells hold linear-space probabilities divided by exp(dpDiagonal_getLogScale()), rather than log probabilities
+bool dpDiagonal_isScaled(DpDiagonal *diagonal);
+
+//Log of the factor the cells of a scaled diagonal have been divided by, LOG_ZERO if all its cells are zero. The log
+//cells of other diagonals are log probabilities less this, which is 0 unless they are floats (see DpCell).
+double dpDiagonal_getLogScale(DpDiagonal *diagonal);
+
+//The x-y coordinates spanned by the diagonal
+Diagonal dpDiagonal_getDiagonal(DpDiagonal *diagonal);
+
+//Divides the cells of a scaled diagonal by their maximum, adding its log to the diagonal's log scale
+void dpDiagonal_normalise(DpDiagonal *diagonal);
+
 bool dpDiagonal_equals(DpDiagonal *diagonal1, DpDiagonal *diagonal2);
 
 void dpDiagonal_destruct(DpDiagonal *dpDiagonal);
 
-double *dpDiagonal_getCell(DpDiagonal *dpDiagonal, int64_t xmy);
+DpCell *dpDiagonal_getCell(DpDiagonal *dpDiagonal, int64_t xmy);
 
 double dpDiagonal_dotProduct(DpDiagonal *diagonal1, DpDiagonal *diagonal2);
 
@@ -225,28 +273,147 @@ void dpDiagonal_zeroValues(DpDiagonal *diagonal);
 void dpDiagonal_initialiseValues(DpDiagonal *diagonal, StateMachine *sM,
                                  double (*getStateValue)(StateMachine *, int64_t));
 
+//EmissionCache, the emission log probabilities of the cells of a band's diagonals, shared by the forward and
+//backward matrices so each is only computed once per alignment. Used by the vectorised kernels of all the state
+//machines, in the forward and backward passes, the expectation passes and the recomputation of the total probability.
+
+typedef struct _emissionCache EmissionCache;
+
+//Cache for diagonals 0 .. diagonalNumber, holding at most maxSize bytes of emissions at a time, the emissions of
+//deleted diagonals making room for others. Diagonals that don't fit are recomputed each time.
+EmissionCache *emissionCache_construct(int64_t diagonalNumber, int64_t maxSize);
+
+void emissionCache_destruct(EmissionCache *emissionCache);
+
+//Frees the emissions of the diagonal, once nothing will need them again
+void emissionCache_deleteDiagonal(EmissionCache *emissionCache, int64_t xay);
+
+//Number of times a kernel has found the emissions of its diagonal in the cache
+int64_t emissionCache_getHitNumber(EmissionCache *emissionCache);
+
+//Bytes of emissions held, those of the diagonals cached and not yet deleted
+int64_t emissionCache_getSize(EmissionCache *emissionCache);
+
 //DpMatrix
 
 typedef struct _dpMatrix DpMatrix;
 
 DpMatrix *dpMatrix_construct(int64_t diagonalNumber, int64_t stateNumber);
 
+//As dpMatrix_construct, but if scaled is true the diagonals created hold scaled probabilities (see
+//dpDiagonal_isScaled), though the kernels may leave log probabilities in those whose cells span too wide a range
+DpMatrix *dpMatrix_construct2(int64_t diagonalNumber, int64_t stateNumber, bool scaled);
+
+//As dpMatrix_construct2, for a matrix whose number of diagonals isn't known. It takes space for the most diagonals
+//it has had active at once, rather than for all of them.
+DpMatrix *dpMatrix_constructUnbounded(int64_t stateNumber, bool scaled);
+
 void dpMatrix_destruct(DpMatrix *dpMatrix);
 
 DpDiagonal *dpMatrix_getDiagonal(DpMatrix *dpMatrix, int64_t xay);
 
 int64_t dpMatrix_getActiveDiagonalNumber(DpMatrix *dpMatrix);
 
+//Number of heap allocations made for the matrix's diagonals and kernel scratch space. Deleted diagonals (and
+//clones of the matrix's diagonals, once destructed) are recycled, so this stops growing once the band stops widening.
+int64_t dpMatrix_getAllocationNumber(DpMatrix *dpMatrix);
+
+//Lets the kernels of state machines that support it (currently the echelon machine) split the cells of diagonals
+//at least minThreadedWidth wide across threadGroup. The group is not owned by the matrix; NULL turns it off.
+void dpMatrix_setThreadGroup(DpMatrix *dpMatrix, ThreadGroup *threadGroup, int64_t minThreadedWidth);
+
+//Has the kernels take the emissions of the matrix's diagonals from the cache, and add them to it. The cache is not
+//owned by the matrix; NULL turns it off.
+void dpMatrix_setEmissionCache(DpMatrix *dpMatrix, EmissionCache *emissionCache);
+
+//Creates the diagonal, reusing the cells of a deleted one where possible. The cells are not initialised.
 DpDiagonal *dpMatrix_createDiagonal(DpMatrix *dpMatrix, Diagonal diagonal);
 
 void dpMatrix_deleteDiagonal(DpMatrix *dpMatrix, int64_t xay);
 
+//AlignedPairBuffer, aligned pairs held as parallel arrays rather than as a list of stIntTuples (prob, x, y), so
+//making, reweighting and filtering them doesn't take an allocation per pair.
+
+typedef struct _alignedPairBuffer {
+    int64_t length;
+    int64_t maxLength;
+    int64_t *probs; //Posterior match probs, scaled so PAIR_ALIGNMENT_PROB_1 is probability 1, like the tuples
+    int64_t *xs;
+    int64_t *ys;
+    int64_t *states; //State each pair was emitted from, NULL unless the buffer was constructed with states
+} AlignedPairBuffer;
+
+AlignedPairBuffer *alignedPairBuffer_construct(bool withStates);
+
+void alignedPairBuffer_destruct(AlignedPairBuffer *buffer);
+
+//Removes all the pairs, keeping the memory
+void alignedPairBuffer_clear(AlignedPairBuffer *buffer);
+
+//The state is ignored if the buffer has no states
+void alignedPairBuffer_append(AlignedPairBuffer *buffer, int64_t prob, int64_t x, int64_t y, int64_t state);
+
+//Appends the pairs of buffer2 to buffer, their coordinates shifted by offsetX and offsetY
+void alignedPairBuffer_appendBuffer(AlignedPairBuffer *buffer, AlignedPairBuffer *buffer2,
+                                    int64_t offsetX, int64_t offsetY);
+
+//Stable sort of the pairs by x + y, as sortByXPlusYCoordinate2 for lists, in time linear in the number of pairs
+//plus the range of x + y
+void alignedPairBuffer_sortByXPlusY(AlignedPairBuffer *buffer);
+
+//As getIndelProbabilities
+int64_t *alignedPairBuffer_getIndelProbabilities(AlignedPairBuffer *buffer, int64_t seqLength, bool xIfTrueElseY);
+
+//As reweightAlignedPairs2, but reweights the pairs in place
+void alignedPairBuffer_reweight(AlignedPairBuffer *buffer, int64_t seqLengthX, int64_t seqLengthY, double gapGamma);
+
+//Removes the pairs with prob less than minProb in place, keeping the order of the rest
+void alignedPairBuffer_filter(AlignedPairBuffer *buffer, int64_t minProb);
+
+//Adapters to lists of stIntTuples (prob, x, y), in the same order as the buffer. The list returned owns its tuples.
+stList *alignedPairBuffer_toList(AlignedPairBuffer *buffer);
+
+void alignedPairBuffer_appendList(AlignedPairBuffer *buffer, stList *alignedPairs);
+
 //Diagonal calculations
 
 void diagonalCalculationForward(StateMachine *sM, int64_t xay, DpMatrix *dpMatrix, Sequence* sX, Sequence* sY);
 
 void diagonalCalculationBackward(StateMachine *sM, int64_t xay, DpMatrix *dpMatrix, Sequence* sX, Sequence* sY);
 
+typedef void (*DiagonalCalculationFn)(StateMachine *sM, int64_t xay, DpMatrix *dpMatrix, Sequence* sX, Sequence* sY);
+
+//Returns diagonalCalculationForward/Backward, or the equivalent calculation using the state machine's
+//specialised diagonal kernel when it has one
+DiagonalCalculationFn diagonalCalculation_getForwardFn(StateMachine *sM);
+
+DiagonalCalculationFn diagonalCalculation_getBackwardFn(StateMachine *sM);
+
+//True if scaled diagonals can be used with the state machine, currently the five state nucleotide one and the vanilla
+//and echelon signal ones, and none with float cells (see DpCell). Their kernels do the diagonals whose cells span
+//too wide a range for scaling with log probabilities instead.
+bool diagonalCalculation_supportsScaling(StateMachine *sM);
+
+//Specialised diagonal kernels, one per state machine (see StateMachine.diagonalCalculate)
+
+void diagonalKernel_stateMachine5(StateMachine *sM, DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                  DpDiagonal *dpDiagonalM2, Sequence* sX, Sequence* sY, bool forward);
+
+void diagonalKernel_stateMachine4(StateMachine *sM, DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                  DpDiagonal *dpDiagonalM2, Sequence* sX, Sequence* sY, bool forward);
+
+void diagonalKernel_stateMachine3(StateMachine *sM, DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                  DpDiagonal *dpDiagonalM2, Sequence* sX, Sequence* sY, bool forward);
+
+void diagonalKernel_stateMachine3Hdp(StateMachine *sM, DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                     DpDiagonal *dpDiagonalM2, Sequence* sX, Sequence* sY, bool forward);
+
+void diagonalKernel_stateMachine3Vanilla(StateMachine *sM, DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                         DpDiagonal *dpDiagonalM2, Sequence* sX, Sequence* sY, bool forward);
+
+void diagonalKernel_stateMachineEchelon(StateMachine *sM, DpDiagonal *dpDiagonal, DpDiagonal *dpDiagonalM1,
+                                        DpDiagonal *dpDiagonalM2, Sequence* sX, Sequence* sY, bool forward);
+
 double diagonalCalculationTotalProbability(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
                                            DpMatrix *backwardDpMatrix, Sequence* sX, Sequence* sY);
 
@@ -260,6 +427,19 @@ void diagonalCalculationMultiPosteriorMatchProbs(StateMachine *sM, int64_t xay,
                                                  double totalProbability, PairwiseAlignmentParameters *p,
                                                  void *extraArgs);
 
+//As diagonalCalculationPosteriorMatchProbs and diagonalCalculationMultiPosteriorMatchProbs, but the first element
+//of extraArgs is an AlignedPairBuffer. The multi version records the state of each pair, i.e. the number of kmers
+//it was aligned with.
+void diagonalCalculationPosteriorMatchProbsToBuffer(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
+                                                    DpMatrix *backwardDpMatrix, Sequence* sX, Sequence* sY,
+                                                    double totalProbability, PairwiseAlignmentParameters *p,
+                                                    void *extraArgs);
+
+void diagonalCalculationMultiPosteriorMatchProbsToBuffer(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
+                                                         DpMatrix *backwardDpMatrix, Sequence* sX, Sequence* sY,
+                                                         double totalProbability, PairwiseAlignmentParameters *p,
+                                                         void *extraArgs);
+
 void diagonalCalculationExpectations(StateMachine *sM, int64_t xay,
                                      DpMatrix *forwardDpMatrix, DpMatrix *backwardDpMatrix, Sequence* sX, Sequence* sY,
                                      double totalProbability, PairwiseAlignmentParameters *p, void *extraArgs);
@@ -280,6 +460,46 @@ void getPosteriorProbsWithBanding(StateMachine *sM,
                                                                   double, PairwiseAlignmentParameters *, void *),
                                   void *extraArgs);
 
+//Streaming banded alignment
+
+typedef struct _streamingAligner StreamingAligner;
+
+/*
+ * Calculates posterior probs of sX against a sequence sY given a chunk at a time, as getPosteriorProbsWithBanding
+ * does with an adaptive band (see PairwiseAlignmentParameters.adaptiveBandXDrop, which must be greater than 0) that
+ * is kept within the whole matrix. The forward band moves on as far as the elements of sY pushed so far allow. Every
+ * minDiagsBetweenTraceBack diagonals the diagonals up to traceBackDiagonals + 1 before the band are traced back and
+ * passed to diagonalPosteriorProbFn, so the posteriors lag the band by a bounded number of diagonals and only the
+ * diagonals and chunks of sY still to be used are held. The sY passed to diagonalPosteriorProbFn is a view of the
+ * chunks held, with length the number of elements pushed so far. p is copied.
+ */
+StreamingAligner *streamingAligner_construct(StateMachine *sM, Sequence *sX, PairwiseAlignmentParameters *p,
+                                             bool alignmentHasRaggedLeftEnd, bool alignmentHasRaggedRightEnd,
+                                             void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *,
+                                                                             DpMatrix *, Sequence*, Sequence*,
+                                                                             double, PairwiseAlignmentParameters *,
+                                                                             void *),
+                                             void *extraArgs, void (*chunkDestructFn)(Sequence *));
+
+//Adds chunk, the next elements of sY, calculating as much of the alignment as it allows. The aligner calls
+//chunkDestructFn, if not NULL, on the chunk once its elements are no longer needed. Element i of the chunk must be
+//got by chunk->get(chunk->elements, i), as for sequence_getBase or sequence_getEvent.
+void streamingAligner_push(StreamingAligner *aligner, Sequence *chunk);
+
+//Marks the end of sY and finishes the alignment. If no elements were pushed nothing is aligned.
+void streamingAligner_finish(StreamingAligner *aligner);
+
+//Number of elements of sY held by the aligner
+int64_t streamingAligner_getBufferedLength(StreamingAligner *aligner);
+
+//The diagonals up to this one have been passed to diagonalPosteriorProbFn
+int64_t streamingAligner_getTracedBackTo(StreamingAligner *aligner);
+
+void streamingAligner_destruct(StreamingAligner *aligner);
+
+//Posterior match probabilities over the whole dp matrix, without anchors. The forward matrix is checkpointed
+//(see PairwiseAlignmentParameters.checkpointInterval), so memory is O(sqrt(lX+lY) * min(lX, lY)) by default
+//rather than O((lX+lY) * min(lX, lY)); the posteriors are the same whatever the interval.
 stList *getAlignedPairsWithoutBanding(StateMachine *sM, void *cX, void *cY, int64_t lX, int64_t lY,
                                       PairwiseAlignmentParameters *p,
                                       void *(*getXFcn)(void *, int64_t),
@@ -299,6 +519,93 @@ stList *getAlignedPairsUsingAnchors(StateMachine *sM,
                                     bool alignmentHasRaggedLeftEnd,
                                     bool alignmentHasRaggedRightEnd);
 
+//As getAlignedPairsWithoutBanding and getAlignedPairsUsingAnchors, but with one of the ToBuffer posterior functions,
+//giving the pairs in a buffer sorted by x + y
+AlignedPairBuffer *getAlignedPairBufferWithoutBanding(StateMachine *sM, void *cX, void *cY, int64_t lX, int64_t lY,
+                                                      PairwiseAlignmentParameters *p,
+                                                      void *(*getXFcn)(void *, int64_t),
+                                                      void *(*getYFcn)(void *, int64_t),
+                                                      void (*diagonalPosteriorProbFn)(StateMachine *, int64_t,
+                                                                                      DpMatrix *, DpMatrix *,
+                                                                                      Sequence *, Sequence *, double,
+                                                                                      PairwiseAlignmentParameters *,
+                                                                                      void *),
+                                                      bool withStates,
+                                                      bool alignmentHasRaggedLeftEnd,
+                                                      bool alignmentHasRaggedRightEnd);
+
+AlignedPairBuffer *getAlignedPairBufferUsingAnchors(StateMachine *sM,
+                                                    Sequence *SsX, Sequence *SsY,
+                                                    stList *anchorPairs,
+                                                    PairwiseAlignmentParameters *p,
+                                                    void (*diagonalPosteriorProbFn)(StateMachine *, int64_t,
+                                                                                    DpMatrix *, DpMatrix *,
+                                                                                    Sequence *, Sequence *, double,
+                                                                                    PairwiseAlignmentParameters *,
+                                                                                    void *),
+                                                    bool withStates,
+                                                    bool alignmentHasRaggedLeftEnd,
+                                                    bool alignmentHasRaggedRightEnd);
+
+/*
+ * A batch of independent alignments, each of a pair of sequences with its own anchors, state machine (e.g. one
+ * for each strand) and ragged ends, run by getAlignedPairsForBatch. The signal jobs of a batch of reads are best
+ * made with alignmentJob_constructForRead, from one pore model (e.g. from a PoreModelCache) that all their state
+ * machines share rather than each parsing the model file.
+ */
+typedef struct _alignmentJob {
+    StateMachine *sM;
+    Sequence *sX;
+    Sequence *sY;
+    stList *anchorPairs;
+    void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *, DpMatrix *, Sequence *, Sequence *, double,
+                                    PairwiseAlignmentParameters *, void *); //One writing to a buffer
+    bool withStates;
+    bool alignmentHasRaggedLeftEnd;
+    bool alignmentHasRaggedRightEnd;
+    AlignedPairBuffer *alignedPairs; //Result of getAlignedPairBufferUsingAnchors for the job, NULL until it is run.
+    PoreModel *poreModel; //Base model sM was made from by alignmentJob_constructForRead, which the job owns, or NULL
+    NanoporeReadAdjustmentParameters readParams; //What sM's match model is scaled by, if poreModel isn't NULL
+} AlignmentJob;
+
+//The job doesn't own sM, the sequences or the anchor pairs, which have to outlast it. diagonalPosteriorProbFn and
+//withStates are as for getAlignedPairBufferUsingAnchors, e.g. diagonalCalculationPosteriorMatchProbsToBuffer.
+AlignmentJob *alignmentJob_construct(StateMachine *sM, Sequence *sX, Sequence *sY, stList *anchorPairs,
+                                     void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *,
+                                                                     DpMatrix *, Sequence *, Sequence *, double,
+                                                                     PairwiseAlignmentParameters *, void *),
+                                     bool withStates, bool alignmentHasRaggedLeftEnd,
+                                     bool alignmentHasRaggedRightEnd);
+
+//As alignmentJob_construct, with a state machine of the given type made from poreModel by
+//poreModel_getStateMachine, with the strand's transitions if it is vanilla, and scaled to the read by readParams.
+//The job owns the state machine, poreModel has to outlast it. For a target made with
+//sequence_constructKmerIndexSequence switch job->sM with stateMachine_setKmerIndexEmissions before the job is run.
+AlignmentJob *alignmentJob_constructForRead(PoreModel *poreModel, StateMachineType type, Strand strand,
+                                            NanoporeReadAdjustmentParameters readParams, Sequence *sX,
+                                            Sequence *sY, stList *anchorPairs,
+                                            void (*diagonalPosteriorProbFn)(StateMachine *, int64_t, DpMatrix *,
+                                                                            DpMatrix *, Sequence *, Sequence *,
+                                                                            double, PairwiseAlignmentParameters *,
+                                                                            void *),
+                                            bool withStates, bool alignmentHasRaggedLeftEnd,
+                                            bool alignmentHasRaggedRightEnd);
+
+//Destroys the job and its aligned pairs, unless they have been taken with alignmentJob_takeAlignedPairs, and its
+//state machine if made by alignmentJob_constructForRead.
+void alignmentJob_destruct(AlignmentJob *job);
+
+//Hands the job's aligned pairs over to the caller.
+AlignedPairBuffer *alignmentJob_takeAlignedPairs(AlignmentJob *job);
+
+/*
+ * Runs getAlignedPairBufferUsingAnchors for each of the AlignmentJobs in jobs on p->threadNumber threads, the jobs
+ * going to whichever thread is free next, largest first. Any threads left over once every job has one split the
+ * jobs' sub-alignments between them. State machines can be shared between jobs. The pairs of each job are the
+ * same as for running it on its own.
+ */
+void getAlignedPairsForBatch(stList *jobs, PairwiseAlignmentParameters *p);
+
 // EM stuff
 void getExpectationsUsingAnchors(StateMachine *sM, Hmm *hmmExpectations,
                                  Sequence *SsX, Sequence *SsY,
@@ -325,6 +632,9 @@ stList *getBlastPairs(const char *sX, const char *sY, int64_t trim, bool repeatM
 
 stList *getBlastPairsForPairwiseAlignmentParameters(void *sX, void *sY, PairwiseAlignmentParameters *p);
 
+//As getBlastPairsForPairwiseAlignmentParameters, but anchoring with getSeedPairs rather than lastz, in process
+stList *getSeedPairsForPairwiseAlignmentParameters(void *sX, void *sY, PairwiseAlignmentParameters *p);
+
 stList *filterToRemoveOverlap(stList *overlappingPairs);
 
 //Split over large gaps
@@ -0,0 +1,56 @@
+/*
+ * posteriorWriter.h
+ *
+ * Writes the aligned pairs of signal alignments, with the events and model expectations they pair, as the
+ * tab separated posteriors table vanillaAlign has always written, or as compact binary records that can be
+ * converted to the table later. Rows are formatted into a large buffer that's written out when full, so a run
+ * costs a handful of writes rather than a call to fprintf per pair.
+ */
+
+#ifndef POSTERIOR_WRITER_H_
+#define POSTERIOR_WRITER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "sonLib.h"
+#include "stateMachine.h"
+#include "pairwiseAligner.h"
+
+typedef enum {
+    posteriors_tsv = 0,
+    posteriors_binary = 1
+} PosteriorsFormat;
+
+typedef struct _posteriorWriter PosteriorWriter;
+
+//Opens posteriorsFile to append to, aborting if it can't
+PosteriorWriter *posteriorWriter_construct(const char *posteriorsFile, PosteriorsFormat format);
+
+//Writes to fH, which is left open by posteriorWriter_destruct
+PosteriorWriter *posteriorWriter_constructForFileHandle(FILE *fH, PosteriorsFormat format);
+
+//Flushes the buffer and closes the file, if the writer opened it
+void posteriorWriter_destruct(PosteriorWriter *posteriorWriter);
+
+//Writes out the buffered rows
+void posteriorWriter_flush(PosteriorWriter *posteriorWriter);
+
+//Writes the aligned pairs of one strand of a read, one row each:
+//contig, reference position, reference kmer, read label, strand (t or c), event index, event mean, noise and
+//duration, target kmer, expected level and noise, posterior probability, descaled event mean and descaled expected
+//level.
+//target is the reference slice the strand was aligned to and matchModel the (scaled) match model it was aligned
+//with. The event indices are offset by eventSequenceOffset into events. The reference positions are offset by
+//referenceSequenceOffset, and counted back from it on the strand aligned to the reverse complement of the
+//reference (the complement of a forward read or the template of a backward one), whose reference kmers are those of
+//the reference, the reverse complements of the target kmers.
+void posteriorWriter_writeStrand(PosteriorWriter *posteriorWriter, const char *readLabel, const char *contig,
+                                 Strand strand, bool forward, const char *target, const double *matchModel,
+                                 double scale, double shift, const double *events, int64_t eventSequenceOffset,
+                                 int64_t referenceSequenceOffset, AlignedPairBuffer *alignedPairs);
+
+//Rewrites the binary posteriors in binaryFile to posteriorWriter, returning false if binaryFile can't be read or
+//isn't binary posteriors, having written the strands before the problem.
+bool posteriorWriter_convertBinaryFile(PosteriorWriter *posteriorWriter, const char *binaryFile);
+
+#endif /* POSTERIOR_WRITER_H_ */
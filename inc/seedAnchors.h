@@ -0,0 +1,40 @@
+/*
+ * seedAnchors.h
+ *
+ * In-process anchoring of a pair of nucleotide sequences: exact kmer seeds, chained along their diagonals and
+ * joined by gapped alignment into anchor pairs. A drop in replacement for the lastz pipe of getBlastPairs that
+ * doesn't start a process or touch the file system.
+ */
+
+#ifndef SEED_ANCHORS_H_
+#define SEED_ANCHORS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sonLib.h"
+
+//Length of the exact kmer seeds
+#define SEED_KMER_LENGTH 11
+//Kmers occurring more often than this in sX are too repetitive to seed from
+#define SEED_MAX_OCCURRENCES 32
+//Number of earlier segments, in x order, each segment tries to chain to
+#define SEED_CHAIN_LOOKBACK 50
+//Score lost for each diagonal a chain moves between two segments
+#define SEED_GAP_PENALTY 1
+//Least score, roughly the number of seeded bases, of a chain worth making anchors from
+#define SEED_MIN_CHAIN_SCORE 25
+//Gaps between the segments of a chain are aligned if they are no bigger than this many cells
+#define SEED_MAX_FILL_CELLS (1000 * 1000)
+//Score lost for each gapped base when aligning the gaps between segments, matches scoring 1 and mismatches -1
+#define SEED_FILL_GAP_PENALTY 2
+//Ungapped extension of the ends of the chain stops once its score drops this far below the best
+#define SEED_X_DROP 10
+
+/*
+ * As getBlastPairs: anchor pairs (x, y), sorted by x + y, from the best chain of seeds between sX and sY, each run of
+ * aligned columns trimmed by trim at either end. Seeds contain only A, C, G and T; if repeatMask is true lowercase
+ * bases are treated as masked and not seeded from, otherwise case is ignored.
+ */
+stList *getSeedPairs(const char *sX, const char *sY, int64_t trim, bool repeatMask);
+
+#endif /* SEED_ANCHORS_H_ */
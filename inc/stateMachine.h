@@ -15,6 +15,31 @@
 #define SYMBOL_NUMBER_NO_N 4
 #define MODEL_PARAMS 5 // level_mean, level_sd, fluctuation_mean, fluctuation_noise, fluctuation_lambda
 
+// Per-kmer terms of the Gaussian and inverse Gaussian densities, derived from a signal model by
+// emissions_signal_deriveKmerParams so the emission functions neither take logs of the model nor divide by it per
+// cell. One cache line per kmer.
+typedef struct _signalKmerParams {
+    double levelMean;
+    double levelInvSd; // 1 / levelSd
+    double levelLogNorm; // log(1 / sqrt(2 * pi)) - log(levelSd)
+    double noiseMean;
+    double noiseInvSd; // 1 / noiseSd
+    double noiseLogNorm; // log(1 / sqrt(2 * pi)) - log(noiseSd)
+    double noiseScale; // sqrt(noiseLambda) / noiseMean
+    double logNorm; // levelLogNorm + (log(noiseLambda) - log(2 * pi)) / 2, of the level and noise densities together
+} SignalKmerParams;
+
+// type of the cells of the dp matrices, building with -DDP_FLOAT_CELLS stores them as floats, halving the memory
+// taken by the live diagonals at the cost of some precision in the posteriors. Arithmetic is still done in double,
+// and the log cells of a diagonal are stored relative to its largest one (see dpDiagonal_getLogScale). The
+// posteriors of nucleotide alignments stay within a few hundred PAIR_ALIGNMENT_PROB_1 units of those of double
+// cells, mostly a few. Those of signal alignments, with emissions far from 0, move by up to ~1000 units.
+#ifdef DP_FLOAT_CELLS
+typedef float DpCell;
+#else
+typedef double DpCell;
+#endif
+
 
 typedef enum {
     fiveState=0,
@@ -31,6 +56,11 @@ typedef enum {
     match = 0, shortGapX = 1, shortGapY = 2, longGapX = 3, longGapY = 4
 } State;
 
+// states of the echelon machine, match[n] is a kmer run of length n, match0 is an extra event
+typedef enum {
+    match0 = 0, match1 = 1, match2 = 2, match3 = 3, match4 = 4, match5 = 5, gapX = 6
+} SignalState;
+
 typedef enum _strand {
     template = 0,
     complement = 1
@@ -39,6 +69,10 @@ typedef enum _strand {
 typedef struct _stateMachine StateMachine;
 typedef struct _hmm Hmm;
 
+// defined in pairwiseAligner.h
+struct _dpDiagonal;
+struct _sequence;
+
 /*
  * Hmm for loading/unloading HMMs and storing expectations.
  * Maybe move these definitions to stateMachine.c to clean this up?
@@ -91,13 +125,19 @@ struct _stateMachine {
     double (*raggedStartStateProb)(StateMachine *sM, int64_t state);
 
     //Cells (states at a given coordinate)
-    void (*cellCalculate)(StateMachine *sM, double *current, double *lower, double *middle, double *upper,
+    void (*cellCalculate)(StateMachine *sM, DpCell *current, DpCell *lower, DpCell *middle, DpCell *upper,
                           void* cX, void* cY,
-                          void(*doTransition)(double *, double *, int64_t, int64_t, double, double, void *),
+                          void(*doTransition)(DpCell *, DpCell *, int64_t, int64_t, double, double, void *),
                           void *extraArgs);
 
-    void (*cellCalculateUpdateExpectations) (double *fromCells, double *toCells, int64_t from, int64_t to,
+    void (*cellCalculateUpdateExpectations) (DpCell *fromCells, DpCell *toCells, int64_t from, int64_t to,
                                              double eP, double tP, void *extraArgs);
+
+    //Forward/backward recursion for a whole diagonal, specialised to this machine's topology. Gives the same
+    //result as calling cellCalculate on every cell. NULL if the machine doesn't have one.
+    void (*diagonalCalculate)(StateMachine *sM, struct _dpDiagonal *dpDiagonal,
+                              struct _dpDiagonal *dpDiagonalM1, struct _dpDiagonal *dpDiagonalM2,
+                              struct _sequence *sX, struct _sequence *sY, bool forward);
 };
 
 typedef struct _StateMachine5 StateMachine5;
@@ -214,6 +254,26 @@ struct _StateMachine3_HDP {
     double (*getMatchProbFcn)(NanoporeHDP *hdp, void *x, void *y);
 };
 
+// Log transitions out of the match and kmer-skip states at one target position, for the vanilla and echelon
+// machines (see stateMachine3Vanilla_cellCalculate and stateMachineEchelon_cellCalculate). For the echelon machine
+// matchToMatch and matchToExtra are both log(1 - beta) and skipToMatch is log(1 - alpha).
+typedef struct _kmerSkipTransitions {
+    double matchToSkip;  // log a_mx
+    double matchToExtra; // log a_my
+    double matchToMatch; // log a_mm
+    double skipToSkip;   // log a_xx
+    double skipToMatch;  // log a_xm
+} KmerSkipTransitions;
+
+// The KmerSkipTransitions of every position of one target, keyed by the address of the element the
+// sequence's get function returns for that position.
+typedef struct _kmerSkipTable {
+    const char *elements;
+    int64_t elementSize;
+    int64_t length;
+    KmerSkipTransitions *transitions;
+} KmerSkipTable;
+
 typedef struct _StateMachine3vanilla {
     // reimplementation of nanopolish HMM by JTS.
     StateMachine model;
@@ -227,8 +287,21 @@ typedef struct _StateMachine3vanilla {
     double (*getKmerSkipProb)(StateMachine *sM, void *kmerList, bool getAlpha);
     double (*getScaledMatchProbFcn)(const double *scaledEventModel, void *kmer, void *event);
     double (*getMatchProbFcn)(const double *eventModel, void *kmer, void *event);
+
+    KmerSkipTable *kmerSkipTable; // NULL unless set with stateMachine_setKmerSkipTable
 } StateMachine3Vanilla;
 
+// getDurationProb(event, n) for n = match0 to match5 of every event of an event sequence, keyed like the
+// KmerSkipTable by the address of the event
+#define ECHELON_DURATION_PROBS 6
+
+typedef struct _eventDurationTable {
+    const char *events;
+    int64_t eventSize;
+    int64_t length;
+    double *durationProbs; // ECHELON_DURATION_PROBS per event
+} EventDurationTable;
+
 typedef struct _StateMachineEchelon {
     // 8-state general hmm
     StateMachine model;
@@ -242,6 +315,8 @@ typedef struct _StateMachineEchelon {
     double (*getMatchProbFcn)(const double *eventModel, void *kmers, void *event, int64_t n); // P(ej|xi..xn)
     double (*getScaledMatchProbFcn)(const double *scaledEventModel, void *kmer, void *event);
 
+    KmerSkipTable *kmerSkipTable; // NULL unless set with stateMachine_setKmerSkipTable
+    EventDurationTable *durationTable; // NULL unless set with stateMachineEchelon_setDurationTable
 } StateMachineEchelon;
 
 typedef struct _StateMachineEchelonB {
@@ -275,7 +350,7 @@ StateMachine *stateMachine5_construct(StateMachineType type, int64_t parameterSe
                                       double (*gapXProbFcn)(const double *, void *),
                                       double (*gapYProbFcn)(const double *, void *),
                                       double (*matchProbFcn)(const double *, void *, void *),
-                                      void (*cellCalcUpdateExpFcn)(double *fromCells, double *toCells,
+                                      void (*cellCalcUpdateExpFcn)(DpCell *fromCells, DpCell *toCells,
                                                                    int64_t from, int64_t to,
                                                                    double eP, double tP, void *extraArgs));
 
@@ -286,7 +361,7 @@ StateMachine *stateMachine3Hdp_construct(StateMachineType type, int64_t paramete
                                          double (*gapXProbFcn)(const double *, void *),
                                          double (*gapYProbFcn)(NanoporeHDP *, void *, void *),
                                          double (*matchProbFcn)(NanoporeHDP *, void *, void *),
-                                         void (*cellCalcUpdateExpFcn)(double *fromCells, double *toCells,
+                                         void (*cellCalcUpdateExpFcn)(DpCell *fromCells, DpCell *toCells,
                                                                       int64_t from, int64_t to,
                                                                       double eP, double tP, void *extraArgs));
 
@@ -296,7 +371,7 @@ StateMachine *stateMachine3_construct(StateMachineType type, int64_t parameterSe
                                       double (*gapXProbFcn)(const double *, void *),
                                       double (*gapYProbFcn)(const double *, void *, void *),
                                       double (*matchProbFcn)(const double *, void *, void *),
-                                      void (*cellCalcUpdateExpFcn)(double *fromCells, double *toCells,
+                                      void (*cellCalcUpdateExpFcn)(DpCell *fromCells, DpCell *toCells,
                                                                    int64_t from, int64_t to,
                                                                    double eP, double tP, void *extraArgs));
 
@@ -305,7 +380,7 @@ StateMachine *stateMachine4_construct(StateMachineType type, int64_t parameterSe
                                       double (*gapXProbFcn)(const double *, void *),
                                       double (*gapYProbFcn)(const double *, void *, void *),
                                       double (*matchProbFcn)(const double *, void *, void *),
-                                      void (*cellCalcUpdateFcn)(double *, double *, int64_t from, int64_t to,
+                                      void (*cellCalcUpdateFcn)(DpCell *, DpCell *, int64_t from, int64_t to,
                                                                 double eP, double tP, void *));
 
 StateMachine *stateMachine3Vanilla_construct(StateMachineType type, int64_t parameterSetSize,
@@ -313,7 +388,7 @@ StateMachine *stateMachine3Vanilla_construct(StateMachineType type, int64_t para
                                              double (*xSkipProbFcn)(StateMachine *, void *, bool),
                                              double (*scaledMatchProbFcn)(const double *, void *, void *),
                                              double (*matchProbFcn)(const double *, void *, void *),
-                                             void (*cellCalcUpdateExpFcn)(double *fromCells, double *toCells,
+                                             void (*cellCalcUpdateExpFcn)(DpCell *fromCells, DpCell *toCells,
                                                                           int64_t from, int64_t to,
                                                                           double eP, double tP, void *extraArgs));
 
@@ -323,7 +398,7 @@ StateMachine *stateMachineEchelon_construct(StateMachineType type, int64_t param
                                             double (*skipProbFcn)(StateMachine *sM, void *kmerList),
                                             double (*matchProbFcn)(const double *, void *, void *, int64_t n),
                                             double (*scaledMatchProbFcn)(const double *, void *, void *),
-                                            void (*cellCalcUpdateExpFcn)(double *fromCells, double *toCells,
+                                            void (*cellCalcUpdateExpFcn)(DpCell *fromCells, DpCell *toCells,
                                                                          int64_t from, int64_t to,
                                                                          double eP, double tP, void *extraArgs));
 
@@ -337,6 +412,10 @@ int64_t emissions_discrete_getKmerIndex(void *kmer);
 // Returns index of kmer from pointer to array
 int64_t emissions_discrete_getKmerIndexFromKmer(void *kmer);
 
+// Fills kmerIndices with the index of each of the first kmerNumber kmers of sequence, as
+// emissions_discrete_getKmerIndex would give them
+void emissions_discrete_getKmerIndices(const char *sequence, int32_t *kmerIndices, int64_t kmerNumber);
+
 // transition defaults
 void stateMachine3_setTransitionsToNucleotideDefaults(StateMachine *sM);
 
@@ -362,27 +441,71 @@ double emissions_symbol_getMatchProb(const double *emissionMatchProbs, void *x,
 
 double emissions_kmer_getGapProb(const double *emissionGapProbs, void *kmer);
 
+// The FromIndex emission functions take a pointer into the kmer indices of a sequence made with
+// sequence_constructKmerIndexSequence, from sequence_getKmerIndex where the kmer version works with
+// sequence_getKmer and from sequence_getKmerIndex2 where it works with sequence_getKmer2, and give the same
+// probabilities without going through the kmer string.
+double emissions_kmer_getGapProbFromIndex(const double *emissionGapProbs, void *kmerIndex);
+
 double emissions_kmer_getMatchProb(const double *emissionMatchProbs, void *x, void *y);
 
 int64_t emissions_signal_getKmerSkipBin(double *matchModel, void *kmers);
 
+int64_t emissions_signal_getKmerSkipBinFromIndex(double *matchModel, void *kmerIndices);
+
 double emissions_signal_getBetaOrAlphaSkipProb(StateMachine *sM, void *kmers, bool getAlpha);
 
+double emissions_signal_getBetaOrAlphaSkipProbFromIndex(StateMachine *sM, void *kmerIndices, bool getAlpha);
+
 double emissions_signal_getKmerSkipProb(StateMachine *sM, void *kmers);
 
 double emissions_signal_logGaussMatchProb(const double *eventModel, void *kmer, void *event);
 
+double emissions_signal_logGaussMatchProbFromIndex(const double *eventModel, void *kmerIndex, void *event);
+
 // returns log of the probability density function for a Gaussian distribution
 double emissions_signal_getBivariateGaussPdfMatchProb(const double *eventModel, void *kmer, void *event);
 
+double emissions_signal_getBivariateGaussPdfMatchProbFromIndex(const double *eventModel, void *kmerIndex,
+                                                               void *event);
+
 double emissions_signal_getEventMatchProbWithTwoDists(const double *eventModel, void *kmer, void *event);
 
+double emissions_signal_getEventMatchProbWithTwoDistsFromIndex(const double *eventModel, void *kmerIndex,
+                                                               void *event);
+
+// log of the mean match prob of the n kmers from kmers + 1 to the event, the echelon match emission
+double emissions_signal_multipleKmerMatchProb(const double *eventModel, void *kmers, void *event, int64_t n);
+
+// matchProbs[n] = emissions_signal_multipleKmerMatchProb(eventModel, kmers, event, n) for n = 1 to maxN, the
+// runs sharing the match probs of their common kmers
+void emissions_signal_multipleKmerMatchProbs(const double *eventModel, void *kmers, void *event, int64_t maxN,
+                                             double *matchProbs);
+
+double emissions_signal_strawManGetKmerEventMatchProb(const double *eventModel, void *kmer, void *event);
+
+double emissions_signal_strawManGetKmerEventMatchProbFromIndex(const double *eventModel, void *kmerIndex,
+                                                               void *event);
+
 void emissions_signal_scaleModel(StateMachine *sM, double scale, double shift, double var,
                                  double scale_sd, double var_sd);
 
 void emissions_signal_scaleModelNoiseOnly(StateMachine *sM, double scale, double shift, double var, double scale_sd,
                                           double var_sd);
 
+// The EMISSION_MATCH_PROBS and EMISSION_GAP_Y_PROBS of the signal stateMachines hold the 1 + NUM_OF_KMERS *
+// MODEL_PARAMS model values followed by a SignalKmerParams per kmer, which the TwoDists and strawMan FromIndex
+// emission functions, emissions_signal_getEventMatchProbsWithTwoDists and emissions_signal_multipleKmerMatchProb
+// read instead, giving the probabilities of the model values to within rounding. Loading and scaling the model
+// refreshes them, anything else changing the model values has to call this afterwards.
+void emissions_signal_deriveKmerParams(double *eventModel);
+
+// matchProbs[i] = emissions_signal_getEventMatchProbWithTwoDistsFromIndex for kmerIndices[i], matching the one
+// event against each of the kmerNumber kmers with vectorMath_logGaussianPair. eventModel has to have derived kmer
+// params.
+void emissions_signal_getEventMatchProbsWithTwoDists(const double *eventModel, const int32_t *kmerIndices,
+                                                     int64_t kmerNumber, void *event, double *matchProbs);
+
 double emissions_signal_getDurationProb(void *event, int64_t n);
 
 StateMachine *getStrawManStateMachine3(const char *modelFile);
@@ -395,9 +518,103 @@ StateMachine *getSignalStateMachine3Vanilla(const char *modelFile);
 
 StateMachine *getStateMachineEchelon(const char *modelFile);
 
+/*
+ * A signal pore model parsed once from its model file, to make any number of stateMachines from. The
+ * get*StateMachine(modelFile) functions above parse the file for every stateMachine.
+ */
+typedef struct _poreModel PoreModel;
+
+// Parses a model file, in the format read by getSignalStateMachine3Vanilla.
+PoreModel *poreModel_loadFromFile(const char *modelFile);
+
+// Maps a model written by poreModel_writeBinary. Returns NULL if binaryFile is missing, was written by a build
+// with a different model layout or, if modelFile isn't NULL, wasn't made from modelFile as it is now.
+PoreModel *poreModel_loadBinary(const char *binaryFile, const char *modelFile);
+
+// Writes the model in a binary format that poreModel_loadBinary maps without parsing, recording the size and
+// modification time of modelFile, if given, so that stale files are ignored. Returns false if it couldn't.
+bool poreModel_writeBinary(PoreModel *poreModel, const char *binaryFile, const char *modelFile);
+
+// With binarySidecar, loads modelFile from modelFile.bin, writing that first if it is missing or stale, otherwise
+// parses modelFile.
+PoreModel *poreModel_load(const char *modelFile, bool binarySidecar);
+
+// The stateMachines made from the model must be destructed first.
+void poreModel_destruct(PoreModel *poreModel);
+
+// A threeState, fourState, vanilla or echelon stateMachine with the unscaled model, the same as the
+// get*StateMachine(modelFile) function for the type gives. The stateMachine has its own copy of the match model,
+// for scaling, and uses the pore model's Y gap model, so the pore model has to outlast it.
+StateMachine *poreModel_getStateMachine(PoreModel *poreModel, StateMachineType type);
+
+// Sets the match model of a stateMachine made from poreModel to the pore model's, scaled as by
+// emissions_signal_scaleModel, however often the stateMachine was scaled before. For reusing it across reads.
+void poreModel_scaleStateMachine(PoreModel *poreModel, StateMachine *sM, double scale, double shift, double var,
+                                 double scale_sd, double var_sd);
+
+// Destructs a stateMachine made from poreModel, with its emission arrays but not the Y gap model it shares.
+void poreModel_destructStateMachine(PoreModel *poreModel, StateMachine *sM);
+
+// Pore models by model file, each loaded the first time it is asked for. Safe to use from several threads.
+typedef struct _poreModelCache PoreModelCache;
+
+// With binarySidecars the models are loaded as by poreModel_load with binarySidecar.
+PoreModelCache *poreModelCache_construct(bool binarySidecars);
+
+// Destructs the cached pore models too.
+void poreModelCache_destruct(PoreModelCache *cache);
+
+PoreModel *poreModelCache_get(PoreModelCache *cache, const char *modelFile);
+
+// Switches a stateMachine from getStrawManStateMachine3, getStateMachine4 or getSignalStateMachine3Vanilla to
+// the FromIndex emission functions, for aligning to a sequence made with sequence_constructKmerIndexSequence.
+// The expectation functions still take kmer strings. Switching a stateMachine that has been switched already does
+// nothing.
+void stateMachine_setKmerIndexEmissions(StateMachine *sM);
+
+// Computes the KmerSkipTransitions of positions 0 to length - 1 of the target whose elements are given (char kmers,
+// or int32_t kmer indices if elementSize is sizeof(int32_t)) and attaches them to a vanilla or echelon stateMachine,
+// replacing any previous table. Cells whose target element lies in the table then look their transitions up
+// instead of calling getKmerSkipProb. The table has to be rebuilt if the skip model or TRANSITION_M_TO_Y_NOT_X
+// change, and cleared, by passing NULL elements, before the target is freed.
+void stateMachine_setKmerSkipTable(StateMachine *sM, void *elements, int64_t length, int64_t elementSize);
+
+// Fills transitions with the KmerSkipTransitions of the kmer(s) at cX.
+void stateMachine_calculateKmerSkipTransitions(StateMachine *sM, void *cX, KmerSkipTransitions *transitions);
+
+// Returns the table entry for cX if there is one, otherwise calculates the transitions into scratch.
+static inline const KmerSkipTransitions *stateMachine_getKmerSkipTransitions(StateMachine *sM,
+                                                                             KmerSkipTable *kmerSkipTable,
+                                                                             void *cX,
+                                                                             KmerSkipTransitions *scratch) {
+    if (kmerSkipTable != NULL) {
+        uintptr_t offset = (uintptr_t) cX - (uintptr_t) kmerSkipTable->elements;
+        if (offset < (uintptr_t) (kmerSkipTable->length * kmerSkipTable->elementSize)) {
+            return &kmerSkipTable->transitions[offset / kmerSkipTable->elementSize];
+        }
+    }
+    stateMachine_calculateKmerSkipTransitions(sM, cX, scratch);
+    return scratch;
+}
+
+// Computes the duration probs of the length events (of NB_EVENT_PARAMS doubles each) and attaches them to an
+// echelon stateMachine, replacing any previous table; NULL events clears it, which has to be done before the
+// events are freed.
+void stateMachineEchelon_setDurationTable(StateMachine *sM, void *events, int64_t length);
+
+// The emissions of the echelon cell for the kmers at cX and the event at cY, shared by all the transitions into
+// the match states: matchProbs[n] = getMatchProbFcn(..., cX, cY, n) for n = 1 to 5, unless matchProbs is NULL,
+// and durationProbs[n] = getDurationProb(cY, n) for n = 0 to 5.
+void stateMachineEchelon_getCellEmissions(StateMachine *sM, void *cX, void *cY, double *matchProbs,
+                                          double *durationProbs);
+
 // EM
 StateMachine *getStateMachine5(Hmm *hmmD, StateMachineFunctions *sMfs);
 
 void stateMachine_destruct(StateMachine *stateMachine);
 
+// stateMachine_destruct for the signal stateMachines, which also frees the match, X gap and Y gap emission arrays
+// they were made with. For one made by poreModel_getStateMachine use poreModel_destructStateMachine.
+void stateMachine_destructSignal(StateMachine *sM);
+
 #endif /* STATEMACHINE_H_ */
@@ -0,0 +1,33 @@
+/*
+ * threadPool.h
+ *
+ * Runs a list of independent tasks on a fixed number of pthreads, or a function on a group of threads that are
+ * kept waiting between calls, for work too fine grained to start threads for.
+ */
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <stdint.h>
+#include "sonLib.h"
+
+//Calls taskFn on each element of tasks using up to threadNumber threads, returning once all of them are done.
+//Tasks are started in list order. With threadNumber <= 1, or a single task, they are run in the calling thread.
+void threadPool_runTasks(stList *tasks, void (*taskFn)(void *), int64_t threadNumber);
+
+typedef struct _threadGroup ThreadGroup;
+
+//Starts threadNumber - 1 threads, the calling thread being the last member of the group
+ThreadGroup *threadGroup_construct(int64_t threadNumber);
+
+//Stops and joins the threads
+void threadGroup_destruct(ThreadGroup *threadGroup);
+
+int64_t threadGroup_getThreadNumber(ThreadGroup *threadGroup);
+
+//Calls fn(arg, thread, threadNumber) once for each thread = 0 .. threadNumber - 1, thread 0 being the calling
+//thread, and returns once they have all returned. Calls can't overlap.
+void threadGroup_run(ThreadGroup *threadGroup, void (*fn)(void *arg, int64_t thread, int64_t threadNumber),
+                     void *arg);
+
+#endif /* THREAD_POOL_H_ */
@@ -0,0 +1,64 @@
+/*
+ * vectorMath.h
+ *
+ * Batched arithmetic for the dp recursions. The log-space functions give the same values as running logAdd
+ * over the arrays (logSumExp and logDotProduct add the terms in a different order), several elements at a
+ * time using SSE2 or AVX2 when they are available.
+ */
+
+#ifndef VECTOR_MATH_H_
+#define VECTOR_MATH_H_
+
+#include <stdint.h>
+
+//Differences larger than this are treated as underflow by logAdd, which then returns the larger value
+#define LOG_ADD_UNDERFLOW_THRESHOLD 7.5
+
+//Instruction sets the batched functions can use
+typedef enum {
+    simdLevel_none = 0,
+    simdLevel_sse2 = 1,
+    simdLevel_avx2 = 2
+} SimdLevel;
+
+//Best instruction set available on this build and CPU
+SimdLevel vectorMath_getSupportedSimdLevel(void);
+
+//Instruction set in use, defaults to vectorMath_getSupportedSimdLevel()
+SimdLevel vectorMath_getSimdLevel(void);
+
+//Sets the instruction set to use, capped at vectorMath_getSupportedSimdLevel(). Not thread safe.
+void vectorMath_setSimdLevel(SimdLevel level);
+
+//Number of doubles processed at once with the current instruction set, 1 without one
+int64_t vectorMath_getVectorWidth(void);
+
+//result[i] = logAdd(x[i], y[i]). result may be x or y.
+void vectorMath_logAdd(const double *x, const double *y, double *result, int64_t length);
+
+//total[i] = logAdd(total[i], x[i] + (eP[i] + tP)), the update done for a transition of the dp recursion
+void vectorMath_logAddAccumulate(double *total, const double *x, const double *eP, double tP, int64_t length);
+
+//log(exp(x[0]) + ... + exp(x[length-1])), LOG_ZERO if length is 0
+double vectorMath_logSumExp(const double *x, int64_t length);
+
+//log(exp(x[0] + y[0]) + ... + exp(x[length-1] + y[length-1])), LOG_ZERO if length is 0
+double vectorMath_logDotProduct(const double *x, const double *y, int64_t length);
+
+//result[i] = (c[i] + d) - (a * a + (b * b) * w) * 0.5, where a = (x - xMean[i]) * xScale[i] and
+//b = (y - yMean[i]) * yScale[i]: the log density of the pair x, y under each of length pairs of independent
+//Gaussian-like distributions, with log normalising terms c[i] + d. Each element gives the same value whatever
+//the instruction set.
+void vectorMath_logGaussianPair(double *result, const double *c, double d, double x, const double *xMean,
+                                const double *xScale, double y, const double *yMean, const double *yScale,
+                                double w, int64_t length);
+
+//Linear-space counterparts, used with scaled probabilities
+
+//total[i] += x[i] * (w[i] * c)
+void vectorMath_multiplyAccumulate(double *total, const double *x, const double *w, double c, int64_t length);
+
+//x[0] * y[0] + ... + x[length-1] * y[length-1]
+double vectorMath_dotProduct(const double *x, const double *y, int64_t length);
+
+#endif /* VECTOR_MATH_H_ */
@@ -7,5 +7,9 @@ libPath=${sonLibPath}
 
 include  ${sonLibRootPath}/include.mk
 
-basicLibs = ${sonLibPath}/sonLib.a ${sonLibPath}/cuTest.a ${dblibs}
+basicLibs = ${sonLibPath}/sonLib.a ${sonLibPath}/cuTest.a ${dblibs} -lpthread
 basicLibsDependencies = ${sonLibPath}/sonLib.a ${sonLibPath}/cuTest.a 
+
+#Uncomment to store the dp matrix cells as floats rather than doubles (see DpCell in inc/stateMachine.h), for
+#nucleotide alignments more than signal ones, whose posteriors move further
+#cflags += -DDP_FLOAT_CELLS
@@ -0,0 +1,74 @@
+#include <getopt.h>
+#include "sonLib.h"
+#include "nanopore.h"
+
+
+void usage() {
+    fprintf(stderr, "npReadConvert - converts npRead files to the binary npRead format\n");
+    fprintf(stderr, "usage: npReadConvert [options] npRead [npRead ...]\n");
+    fprintf(stderr, "\t-o, --out <file>     binary npRead to write, for a single npRead\n");
+    fprintf(stderr, "\t-b, --bundle <file>  bundle to write all of the npReads to, each named by its path as given\n");
+    fprintf(stderr, "\t-h, --help           print this message\n");
+}
+
+int main(int argc, char *argv[]) {
+    char *outFile = NULL;
+    char *bundleFile = NULL;
+
+    int key;
+    while (1) {
+        static struct option long_options[] = {
+                {"help",    no_argument,        0,  'h'},
+                {"out",     required_argument,  0,  'o'},
+                {"bundle",  required_argument,  0,  'b'},
+                {0, 0, 0, 0} };
+
+        int option_index = 0;
+
+        key = getopt_long(argc, argv, "ho:b:", long_options, &option_index);
+
+        if (key == -1) {
+            break;
+        }
+        switch (key) {
+            case 'h':
+                usage();
+                return 0;
+            case 'o':
+                outFile = stString_copy(optarg);
+                break;
+            case 'b':
+                bundleFile = stString_copy(optarg);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    int64_t npReadNumber = argc - optind;
+    if ((outFile == NULL) == (bundleFile == NULL) || npReadNumber < 1 || (outFile != NULL && npReadNumber != 1)) {
+        usage();
+        return 1;
+    }
+
+    if (outFile != NULL) {
+        NanoporeRead *npRead = nanopore_loadNanoporeReadFromFile(argv[optind]);
+        if (!nanopore_writeNanoporeReadToBinaryFile(npRead, outFile)) {
+            st_errAbort("npReadConvert - couldn't write %s", outFile);
+        }
+        nanopore_nanoporeReadDestruct(npRead);
+        fprintf(stderr, "npReadConvert - wrote %s to %s\n", argv[optind], outFile);
+    } else {
+        stList *npReadFiles = stList_construct();
+        for (int64_t i = optind; i < argc; i++) {
+            stList_append(npReadFiles, argv[i]);
+        }
+        if (!nanoporeReadBundle_write(npReadFiles, npReadFiles, bundleFile)) {
+            st_errAbort("npReadConvert - couldn't write %s", bundleFile);
+        }
+        fprintf(stderr, "npReadConvert - wrote %lld npReads to %s\n", npReadNumber, bundleFile);
+        stList_destruct(npReadFiles);
+    }
+    return 0;
+}
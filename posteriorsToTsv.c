@@ -0,0 +1,58 @@
+#include <getopt.h>
+#include "sonLib.h"
+#include "posteriorWriter.h"
+
+
+void usage() {
+    fprintf(stderr, "posteriorsToTsv - converts binary posteriors, from vanillaAlign --binaryPosteriors, to tsv\n");
+    fprintf(stderr, "usage: posteriorsToTsv [options] posteriors [posteriors ...]\n");
+    fprintf(stderr, "\t-o, --out <file>     tsv to append the rows to, stdout by default\n");
+    fprintf(stderr, "\t-h, --help           print this message\n");
+}
+
+int main(int argc, char *argv[]) {
+    char *outFile = NULL;
+
+    int key;
+    while (1) {
+        static struct option long_options[] = {
+                {"help",    no_argument,        0,  'h'},
+                {"out",     required_argument,  0,  'o'},
+                {0, 0, 0, 0} };
+
+        int option_index = 0;
+
+        key = getopt_long(argc, argv, "ho:", long_options, &option_index);
+
+        if (key == -1) {
+            break;
+        }
+        switch (key) {
+            case 'h':
+                usage();
+                return 0;
+            case 'o':
+                outFile = stString_copy(optarg);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    PosteriorWriter *posteriors = outFile != NULL ? posteriorWriter_construct(outFile, posteriors_tsv)
+                                                  : posteriorWriter_constructForFileHandle(stdout, posteriors_tsv);
+    for (int64_t i = optind; i < argc; i++) {
+        if (!posteriorWriter_convertBinaryFile(posteriors, argv[i])) {
+            posteriorWriter_destruct(posteriors);
+            st_errAbort("posteriorsToTsv - %s isn't binary posteriors, or is cut short", argv[i]);
+        }
+    }
+    posteriorWriter_destruct(posteriors);
+    return 0;
+}
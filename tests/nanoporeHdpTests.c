@@ -490,8 +490,8 @@ static void test_sm3hdp_cell(CuTest *testCase) {
 
     StateMachine *sM = getHdpStateMachine3(nHdp);
 
-    double lowerF[sM->stateNumber], middleF[sM->stateNumber], upperF[sM->stateNumber], currentF[sM->stateNumber];
-    double lowerB[sM->stateNumber], middleB[sM->stateNumber], upperB[sM->stateNumber], currentB[sM->stateNumber];
+    DpCell lowerF[sM->stateNumber], middleF[sM->stateNumber], upperF[sM->stateNumber], currentF[sM->stateNumber];
+    DpCell lowerB[sM->stateNumber], middleB[sM->stateNumber], upperB[sM->stateNumber], currentB[sM->stateNumber];
     for (int64_t i = 0; i < sM->stateNumber; i++) {
         middleF[i] = sM->startStateProb(sM, i);
         middleB[i] = LOG_ZERO;
@@ -570,10 +570,10 @@ static void test_sm3Hdp_dpDiagonal(CuTest *testCase) {
     DpDiagonal *dpDiagonal = dpDiagonal_construct(diagonal, sM->stateNumber);
 
     //Get cell
-    double *c1 = dpDiagonal_getCell(dpDiagonal, -1);
+    DpCell *c1 = dpDiagonal_getCell(dpDiagonal, -1);
     CuAssertTrue(testCase, c1 != NULL);
 
-    double *c2 = dpDiagonal_getCell(dpDiagonal, 1);
+    DpCell *c2 = dpDiagonal_getCell(dpDiagonal, 1);
     CuAssertTrue(testCase, c2 != NULL);
 
     CuAssertTrue(testCase, dpDiagonal_getCell(dpDiagonal, 3) == NULL);
@@ -582,8 +582,8 @@ static void test_sm3Hdp_dpDiagonal(CuTest *testCase) {
     dpDiagonal_initialiseValues(dpDiagonal, sM, sM->endStateProb); //Test initialise values
     double totalProb = LOG_ZERO;
     for (int64_t i = 0; i < sM->stateNumber; i++) {
-        CuAssertDblEquals(testCase, c1[i], sM->endStateProb(sM, i), 0.0);
-        CuAssertDblEquals(testCase, c2[i], sM->endStateProb(sM, i), 0.0);
+        CuAssertDblEquals(testCase, c1[i], (DpCell) sM->endStateProb(sM, i), 0.0);
+        CuAssertDblEquals(testCase, c2[i], (DpCell) sM->endStateProb(sM, i), 0.0);
         totalProb = logAdd(totalProb, 2 * c1[i]);
         totalProb = logAdd(totalProb, 2 * c2[i]);
     }
@@ -661,10 +661,12 @@ static void test_sm3Hdp_diagonalDPCalculations(CuTest *testCase) {
     }
 
     //Calculate total probabilities
-    double totalProbForward = cell_dotProduct2(
-            dpDiagonal_getCell(dpMatrix_getDiagonal(dpMatrixForward, lX + lY), lX - lY), sM, sM->endStateProb);
-    double totalProbBackward = cell_dotProduct2(
-            dpDiagonal_getCell(dpMatrix_getDiagonal(dpMatrixBackward, 0), 0), sM, sM->startStateProb);
+    DpDiagonal *endDiagonal = dpMatrix_getDiagonal(dpMatrixForward, lX + lY);
+    DpDiagonal *startDiagonal = dpMatrix_getDiagonal(dpMatrixBackward, 0);
+    double totalProbForward = cell_dotProduct2(dpDiagonal_getCell(endDiagonal, lX - lY), sM, sM->endStateProb)
+                              + dpDiagonal_getLogScale(endDiagonal);
+    double totalProbBackward = cell_dotProduct2(dpDiagonal_getCell(startDiagonal, 0), sM, sM->startStateProb)
+                               + dpDiagonal_getLogScale(startDiagonal);
     //st_uglyf("Total forward and backward prob %f %f\n", (float) totalProbForward, (float) totalProbBackward);
 
     // Test the posterior probabilities along the diagonals of the matrix.
@@ -10,7 +10,10 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <ctype.h>
+#include <sys/time.h>
 #include "randomSequences.h"
+#include "testHelpers.h"
 #include "stateMachine.h"
 #include "CuTest.h"
 #include "sonLib.h"
@@ -18,6 +21,7 @@
 #include "multipleAligner.h"
 #include "emissionMatrix.h"
 #include "discreteHmm.h"
+#include "vectorMath.h"
 
 static void test_diagonal(CuTest *testCase) {
     //Construct an example diagonal.
@@ -148,6 +152,83 @@ static void test_logAdd(CuTest *testCase) {
     }
 }
 
+static double getRandomLogProb(void) {
+    // mix in some LOG_ZEROs, ties and values far enough apart to underflow
+    switch (st_randomInt(0, 10)) {
+        case 0:
+            return LOG_ZERO;
+        case 1:
+            return -1.0;
+        default:
+            return -st_random() * 20.0;
+    }
+}
+
+static void test_vectorMath(CuTest *testCase) {
+    int64_t length = 103;
+    double *x = st_malloc(length * sizeof(double));
+    double *y = st_malloc(length * sizeof(double));
+    double *eP = st_malloc(length * sizeof(double));
+    double *result = st_malloc(length * sizeof(double));
+    double *expected = st_malloc(length * sizeof(double));
+    SimdLevel supportedLevel = vectorMath_getSupportedSimdLevel();
+    for (int64_t level = simdLevel_none; level <= supportedLevel; level++) {
+        vectorMath_setSimdLevel((SimdLevel) level);
+        for (int64_t test = 0; test < 100; test++) {
+            int64_t n = st_randomInt(0, length);
+            for (int64_t i = 0; i < n; i++) {
+                x[i] = getRandomLogProb();
+                y[i] = getRandomLogProb();
+                eP[i] = -st_random() * 5.0;
+            }
+            // element-wise logAdd should be exactly the scalar one
+            vectorMath_logAdd(x, y, result, n);
+            for (int64_t i = 0; i < n; i++) {
+                CuAssertTrue(testCase, result[i] == logAdd(x[i], y[i]));
+            }
+            for (int64_t i = 0; i < n; i++) {
+                result[i] = y[i];
+                expected[i] = logAdd(y[i], x[i] + (eP[i] + -0.5));
+            }
+            vectorMath_logAddAccumulate(result, x, eP, -0.5, n);
+            for (int64_t i = 0; i < n; i++) {
+                CuAssertTrue(testCase, result[i] == expected[i]);
+            }
+            // the reductions add in a different order, so compare against the exact sums
+            double sum = 0.0, dotProduct = 0.0;
+            for (int64_t i = 0; i < n; i++) {
+                sum += exp(x[i]);
+                dotProduct += exp(x[i] + y[i]);
+            }
+            if (sum > 0.0) {
+                CuAssertDblEquals(testCase, log(sum), vectorMath_logSumExp(x, n), 0.01);
+            } else {
+                CuAssertTrue(testCase, vectorMath_logSumExp(x, n) == LOG_ZERO);
+            }
+            if (dotProduct > 0.0) {
+                CuAssertDblEquals(testCase, log(dotProduct), vectorMath_logDotProduct(x, y, n), 0.01);
+            } else {
+                CuAssertTrue(testCase, vectorMath_logDotProduct(x, y, n) == LOG_ZERO);
+            }
+            // the Gaussian pair log densities should be exactly the scalar expression, eP and y standing in for the
+            // means and x for the reciprocal sds
+            double u = st_random() * 100.0, v = st_random() * 3.0 + 0.1;
+            vectorMath_logGaussianPair(result, x, -0.5, u, eP, y, v, y, eP, 1.0 / v, n);
+            for (int64_t i = 0; i < n; i++) {
+                double a = (u - eP[i]) * y[i];
+                double b = (v - y[i]) * eP[i];
+                CuAssertTrue(testCase, result[i] == (x[i] + -0.5) - (a * a + (b * b) * (1.0 / v)) * 0.5);
+            }
+        }
+    }
+    vectorMath_setSimdLevel(supportedLevel);
+    free(x);
+    free(y);
+    free(eP);
+    free(result);
+    free(expected);
+}
+
 static void test_sequenceConstruct(CuTest* testCase) {
     char *tS = getRandomSequence(100);
     Sequence* testSequence = sequence_construct(100, tS, sequence_getBase);
@@ -165,8 +246,8 @@ static void test_cell(CuTest *testCase) {
                                                emissions_symbol_getMatchProb,
                                                cell_updateExpectations);
 
-    double lowerF[sM->stateNumber], middleF[sM->stateNumber], upperF[sM->stateNumber], currentF[sM->stateNumber];
-    double lowerB[sM->stateNumber], middleB[sM->stateNumber], upperB[sM->stateNumber], currentB[sM->stateNumber];
+    DpCell lowerF[sM->stateNumber], middleF[sM->stateNumber], upperF[sM->stateNumber], currentF[sM->stateNumber];
+    DpCell lowerB[sM->stateNumber], middleB[sM->stateNumber], upperB[sM->stateNumber], currentB[sM->stateNumber];
     for (int64_t i = 0; i < sM->stateNumber; i++) {
         middleF[i] = sM->startStateProb(sM, i);
         middleB[i] = LOG_ZERO;
@@ -212,10 +293,10 @@ static void test_dpDiagonal(CuTest *testCase) {
     DpDiagonal *dpDiagonal = dpDiagonal_construct(diagonal, sM->stateNumber);
 
     //Get cell
-    double *c1 = dpDiagonal_getCell(dpDiagonal, -1);
+    DpCell *c1 = dpDiagonal_getCell(dpDiagonal, -1);
     CuAssertTrue(testCase, c1 != NULL);
 
-    double *c2 = dpDiagonal_getCell(dpDiagonal, 1);
+    DpCell *c2 = dpDiagonal_getCell(dpDiagonal, 1);
     CuAssertTrue(testCase, c2 != NULL);
 
     CuAssertTrue(testCase, dpDiagonal_getCell(dpDiagonal, 3) == NULL);
@@ -224,8 +305,8 @@ static void test_dpDiagonal(CuTest *testCase) {
     dpDiagonal_initialiseValues(dpDiagonal, sM, sM->endStateProb); //Test initialise values
     double totalProb = LOG_ZERO;
     for (int64_t i = 0; i < sM->stateNumber; i++) {
-        CuAssertDblEquals(testCase, c1[i], sM->endStateProb(sM, i), 0.0);
-        CuAssertDblEquals(testCase, c2[i], sM->endStateProb(sM, i), 0.0);
+        CuAssertDblEquals(testCase, c1[i], (DpCell) sM->endStateProb(sM, i), 0.0);
+        CuAssertDblEquals(testCase, c2[i], (DpCell) sM->endStateProb(sM, i), 0.0);
         totalProb = logAdd(totalProb, 2 * c1[i]);
         totalProb = logAdd(totalProb, 2 * c2[i]);
     }
@@ -273,6 +354,63 @@ static void test_dpMatrix(CuTest *testCase) {
     dpMatrix_destruct(dpMatrix);
 }
 
+static void test_dpMatrixPool(CuTest *testCase) {
+    StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                               emissions_symbol_setEmissionsToDefaults,
+                                               emissions_symbol_getGapProb,
+                                               emissions_symbol_getGapProb,
+                                               emissions_symbol_getMatchProb,
+                                               cell_updateExpectations);
+    char *sX = getRandomSequence(1000);
+    char *sY = evolveSequence(sX);
+    Sequence *SsX = sequence_construct(strlen(sX), sX, sequence_getBase);
+    Sequence *SsY = sequence_construct(strlen(sY), sY, sequence_getBase);
+    DiagonalCalculationFn forwardFn = diagonalCalculation_getForwardFn(sM);
+
+    // slide a window of diagonals down the band, as the forward pass of the banded alignment does
+    int64_t diagonalNumber = SsX->length + SsY->length, window = 3;
+    DpMatrix *dpMatrix = dpMatrix_construct(diagonalNumber, sM->stateNumber);
+    stList *anchorPairs = stList_construct();
+    Band *band = band_construct(anchorPairs, SsX->length, SsY->length, 20);
+    BandIterator *bandIt = bandIterator_construct(band);
+    dpDiagonal_initialiseValues(dpMatrix_createDiagonal(dpMatrix, bandIterator_getNext(bandIt)), sM,
+                                sM->startStateProb);
+    int64_t allocationsHalfWay = 0;
+    for (int64_t i = 1; i <= diagonalNumber; i++) {
+        dpDiagonal_zeroValues(dpMatrix_createDiagonal(dpMatrix, bandIterator_getNext(bandIt)));
+        forwardFn(sM, i, dpMatrix, SsX, SsY);
+        if (i >= window) {
+            dpMatrix_deleteDiagonal(dpMatrix, i - window);
+        }
+        if (i == diagonalNumber / 2) {
+            allocationsHalfWay = dpMatrix_getAllocationNumber(dpMatrix);
+        }
+    }
+    // once the band is at its widest the diagonals are recycled, without allocating
+    st_logInfo("Filled %" PRIi64 " diagonals with %" PRIi64 " allocations\n", diagonalNumber + 1,
+               dpMatrix_getAllocationNumber(dpMatrix));
+    CuAssertIntEquals(testCase, allocationsHalfWay, dpMatrix_getAllocationNumber(dpMatrix));
+    CuAssertTrue(testCase, dpMatrix_getAllocationNumber(dpMatrix) < 100);
+
+    // cloning a diagonal of the matrix reuses a deleted one too
+    DpDiagonal *dpDiagonal = dpDiagonal_clone(dpMatrix_getDiagonal(dpMatrix, diagonalNumber));
+    CuAssertTrue(testCase, dpDiagonal_equals(dpDiagonal, dpMatrix_getDiagonal(dpMatrix, diagonalNumber)));
+    dpDiagonal_destruct(dpDiagonal);
+    CuAssertIntEquals(testCase, allocationsHalfWay, dpMatrix_getAllocationNumber(dpMatrix));
+
+    for (int64_t i = diagonalNumber - window + 1; i <= diagonalNumber; i++) {
+        dpMatrix_deleteDiagonal(dpMatrix, i);
+    }
+    dpMatrix_destruct(dpMatrix);
+    bandIterator_destruct(bandIt);
+    band_destruct(band);
+    stateMachine_destruct(sM);
+    sequence_sequenceDestroy(SsX);
+    sequence_sequenceDestroy(SsY);
+    free(sX);
+    free(sY);
+}
+
 static void test_diagonalDPCalculations(CuTest *testCase) {
     // make some simple DNA sequences
     char *sX = "AGCG";
@@ -322,8 +460,12 @@ static void test_diagonalDPCalculations(CuTest *testCase) {
     }
 
     //Calculate total probabilities
-    double totalProbForward = cell_dotProduct2(dpDiagonal_getCell(dpMatrix_getDiagonal(dpMatrixForward, lX + lY), lX - lY), sM, sM->endStateProb);
-    double totalProbBackward = cell_dotProduct2(dpDiagonal_getCell(dpMatrix_getDiagonal(dpMatrixBackward, 0), 0), sM, sM->startStateProb);
+    DpDiagonal *endDiagonal = dpMatrix_getDiagonal(dpMatrixForward, lX + lY);
+    DpDiagonal *startDiagonal = dpMatrix_getDiagonal(dpMatrixBackward, 0);
+    double totalProbForward = cell_dotProduct2(dpDiagonal_getCell(endDiagonal, lX - lY), sM, sM->endStateProb)
+                              + dpDiagonal_getLogScale(endDiagonal);
+    double totalProbBackward = cell_dotProduct2(dpDiagonal_getCell(startDiagonal, 0), sM, sM->startStateProb)
+                               + dpDiagonal_getLogScale(startDiagonal);
     st_logInfo("Total forward and backward prob %f %f\n", (float) totalProbForward, (float) totalProbBackward);
     //st_uglyf("Total forward and backward prob %f %f\n", (float) totalProbForward, (float) totalProbBackward);
     //Check the forward and back probabilities are about equal
@@ -371,6 +513,249 @@ static void test_diagonalDPCalculations(CuTest *testCase) {
 
 }
 
+static void test_diagonalKernels(CuTest *testCase) {
+    for (int64_t test = 0; test < 10; test++) {
+        //Make a pair of sequences
+        char *sX = getRandomSequence(st_randomInt(0, 100));
+        char *sY = evolveSequence(sX);
+        int64_t lX = strlen(sX);
+        int64_t lY = strlen(sY);
+        Sequence* sX2 = sequence_construct(lX, sX, sequence_getBase);
+        Sequence* sY2 = sequence_construct(lY, sY, sequence_getBase);
+
+        StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                                   emissions_symbol_setEmissionsToDefaults,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getMatchProb,
+                                                   cell_updateExpectations);
+        checkDiagonalKernel(testCase, sM, sX2, sY2);
+
+        //Cleanup
+        stateMachine_destruct(sM);
+        free(sX);
+        free(sY);
+        sequence_sequenceDestroy(sX2);
+        sequence_sequenceDestroy(sY2);
+    }
+}
+
+static void test_vectorDiagonalKernels(CuTest *testCase) {
+    // every instruction set the kernels can use should give the same matrices as the generic calculation
+    SimdLevel supportedLevel = vectorMath_getSupportedSimdLevel();
+    for (int64_t level = simdLevel_none; level <= supportedLevel; level++) {
+        vectorMath_setSimdLevel((SimdLevel) level);
+        CuAssertIntEquals(testCase, level, vectorMath_getSimdLevel());
+        for (int64_t test = 0; test < 5; test++) {
+            // long enough for most diagonals to go through the vector path
+            char *sX = getRandomSequence(st_randomInt(20, 200));
+            char *sY = evolveSequence(sX);
+            Sequence* sX2 = sequence_construct(strlen(sX), sX, sequence_getBase);
+            Sequence* sY2 = sequence_construct(strlen(sY), sY, sequence_getBase);
+
+            StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                                       emissions_symbol_setEmissionsToDefaults,
+                                                       emissions_symbol_getGapProb,
+                                                       emissions_symbol_getGapProb,
+                                                       emissions_symbol_getMatchProb,
+                                                       cell_updateExpectations);
+            checkDiagonalKernel(testCase, sM, sX2, sY2);
+
+            stateMachine_destruct(sM);
+            free(sX);
+            free(sY);
+            sequence_sequenceDestroy(sX2);
+            sequence_sequenceDestroy(sY2);
+        }
+    }
+    vectorMath_setSimdLevel(supportedLevel);
+}
+
+//Double precision forward or backward cells for every x, y, the cells of the cell calculations standing in for the
+//cells of the reference, so the state machine's transitions can be run on them whatever the DpCell type
+typedef struct _referenceCells {
+    double *cells;
+    int64_t lY;
+    int64_t stateNumber;
+    DpCell *dpCells[4]; //current, lower, middle and upper
+    double *referenceCells[4];
+} ReferenceCells;
+
+static double *referenceCells_get(ReferenceCells *r, int64_t x, int64_t y) {
+    return r->cells + (x * (r->lY + 1) + y) * r->stateNumber;
+}
+
+static double *referenceCells_getStandIn(ReferenceCells *r, DpCell *dpCells) {
+    for (int64_t i = 0; i < 4; i++) {
+        if (r->dpCells[i] == dpCells) {
+            return r->referenceCells[i];
+        }
+    }
+    assert(0);
+    return NULL;
+}
+
+static void referenceCells_doTransitionForward(DpCell *fromCells, DpCell *toCells, int64_t from, int64_t to,
+                                               double eP, double tP, void *extraArgs) {
+    double *from2 = referenceCells_getStandIn(extraArgs, fromCells);
+    double *to2 = referenceCells_getStandIn(extraArgs, toCells);
+    to2[to] = logAdd(to2[to], from2[from] + (eP + tP));
+}
+
+static void referenceCells_doTransitionBackward(DpCell *fromCells, DpCell *toCells, int64_t from, int64_t to,
+                                                double eP, double tP, void *extraArgs) {
+    double *from2 = referenceCells_getStandIn(extraArgs, fromCells);
+    double *to2 = referenceCells_getStandIn(extraArgs, toCells);
+    from2[from] = logAdd(from2[from], to2[to] + (eP + tP));
+}
+
+//Runs the cell calculation of x, y on the reference cells, in the order of the diagonals and cells of a
+//diagonalCalculationForward or diagonalCalculationBackward over the whole matrix
+static void referenceCells_calculate(ReferenceCells *r, StateMachine *sM, Sequence *sX, Sequence *sY, bool forward) {
+    int64_t lX = sX->length, lY = sY->length;
+    DpCell dpCells[4][sM->stateNumber];
+    for (int64_t i = 0; i < 4; i++) {
+        r->dpCells[i] = dpCells[i];
+    }
+    for (int64_t j = 1; j <= lX + lY; j++) {
+        int64_t xay = forward ? j : lX + lY + 1 - j;
+        for (int64_t x = xay - lY > 0 ? xay - lY : 0; x <= (xay < lX ? xay : lX); x++) {
+            int64_t y = xay - x;
+            r->referenceCells[0] = referenceCells_get(r, x, y);
+            r->referenceCells[1] = x > 0 ? referenceCells_get(r, x - 1, y) : NULL;
+            r->referenceCells[2] = x > 0 && y > 0 ? referenceCells_get(r, x - 1, y - 1) : NULL;
+            r->referenceCells[3] = y > 0 ? referenceCells_get(r, x, y - 1) : NULL;
+            sM->cellCalculate(sM, dpCells[0], x > 0 ? dpCells[1] : NULL, x > 0 && y > 0 ? dpCells[2] : NULL,
+                              y > 0 ? dpCells[3] : NULL, sX->get(sX->elements, x - 1), sY->get(sY->elements, y - 1),
+                              forward ? referenceCells_doTransitionForward : referenceCells_doTransitionBackward, r);
+        }
+    }
+}
+
+static ReferenceCells *referenceCells_construct(StateMachine *sM, Sequence *sX, Sequence *sY, bool forward) {
+    ReferenceCells *r = st_calloc(1, sizeof(ReferenceCells));
+    r->lY = sY->length;
+    r->stateNumber = sM->stateNumber;
+    int64_t cellNumber = (sX->length + 1) * (sY->length + 1) * sM->stateNumber;
+    r->cells = st_malloc(sizeof(double) * cellNumber);
+    for (int64_t i = 0; i < cellNumber; i++) {
+        r->cells[i] = LOG_ZERO;
+    }
+    double *cell = forward ? referenceCells_get(r, 0, 0) : referenceCells_get(r, sX->length, sY->length);
+    for (int64_t s = 0; s < sM->stateNumber; s++) {
+        cell[s] = forward ? sM->startStateProb(sM, s) : sM->endStateProb(sM, s);
+    }
+    referenceCells_calculate(r, sM, sX, sY, forward);
+    return r;
+}
+
+static void referenceCells_destruct(ReferenceCells *r) {
+    free(r->cells);
+    free(r);
+}
+
+//Float cells are rounded relative to the largest cell of their diagonal, which keeps the posteriors of nucleotide
+//alignments within a few hundred units of the reference's, whatever their length: rounding now and then moves a
+//difference logAdd takes across a breakpoint of its approximation, moving the cell by up to ~5e-4. Double cells give
+//the reference's.
+#ifdef DP_FLOAT_CELLS
+#define MAX_TOTAL_PROBABILITY_DIFFERENCE 0.01
+#define MAX_POSTERIOR_DIFFERENCE (PAIR_ALIGNMENT_PROB_1 / 10000)
+#else
+#define MAX_TOTAL_PROBABILITY_DIFFERENCE 0.0
+#define MAX_POSTERIOR_DIFFERENCE 0
+#endif
+
+static void test_dpCellPrecision(CuTest *testCase) {
+    // the posteriors of whole matrices of cells against those of the same recursion in double precision
+    for (int64_t test = 0; test < 5; test++) {
+        char *sX = getRandomSequence(st_randomInt(1, 500));
+        char *sY = evolveSequence(sX);
+        int64_t lX = strlen(sX), lY = strlen(sY);
+        Sequence* sX2 = sequence_construct(lX, sX, sequence_getBase);
+        Sequence* sY2 = sequence_construct(lY, sY, sequence_getBase);
+        StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                                   emissions_symbol_setEmissionsToDefaults,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getMatchProb,
+                                                   cell_updateExpectations);
+
+        DpMatrix *dpMatrixForward = dpMatrix_construct(lX + lY, sM->stateNumber);
+        DpMatrix *dpMatrixBackward = dpMatrix_construct(lX + lY, sM->stateNumber);
+        stList *anchorPairs = stList_construct();
+        Band *band = band_construct(anchorPairs, lX, lY, 2 * (lX + lY));
+        BandIterator *bandIt = bandIterator_construct(band);
+        for (int64_t i = 0; i <= lX + lY; i++) {
+            Diagonal d = bandIterator_getNext(bandIt);
+            dpDiagonal_zeroValues(dpMatrix_createDiagonal(dpMatrixBackward, d));
+            dpDiagonal_zeroValues(dpMatrix_createDiagonal(dpMatrixForward, d));
+        }
+        dpDiagonal_initialiseValues(dpMatrix_getDiagonal(dpMatrixForward, 0), sM, sM->startStateProb);
+        dpDiagonal_initialiseValues(dpMatrix_getDiagonal(dpMatrixBackward, lX + lY), sM, sM->endStateProb);
+        for (int64_t i = 1; i <= lX + lY; i++) {
+            diagonalCalculationForward(sM, i, dpMatrixForward, sX2, sY2);
+        }
+        for (int64_t i = lX + lY; i > 0; i--) {
+            diagonalCalculationBackward(sM, i, dpMatrixBackward, sX2, sY2);
+        }
+        ReferenceCells *forward = referenceCells_construct(sM, sX2, sY2, 1);
+        ReferenceCells *backward = referenceCells_construct(sM, sX2, sY2, 0);
+
+        // the total probabilities, as cell_dotProduct2 sums them, each giving the posteriors of its own cells
+        double *endCell = referenceCells_get(forward, lX, lY);
+        double totalProbability = endCell[0] + sM->endStateProb(sM, 0);
+        for (int64_t s = 1; s < sM->stateNumber; s++) {
+            totalProbability = logAdd(totalProbability, endCell[s] + sM->endStateProb(sM, s));
+        }
+        DpDiagonal *endDiagonal = dpMatrix_getDiagonal(dpMatrixForward, lX + lY);
+        double dpTotalProbability = cell_dotProduct2(dpDiagonal_getCell(endDiagonal, lX - lY), sM, sM->endStateProb)
+                                    + dpDiagonal_getLogScale(endDiagonal);
+        CuAssertDblEquals(testCase, totalProbability, dpTotalProbability, MAX_TOTAL_PROBABILITY_DIFFERENCE);
+
+        // every match posterior
+        stList *alignedPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+        void *extraArgs[1] = { alignedPairs };
+        PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+        p->threshold = 0.0;
+        for (int64_t i = 1; i <= lX + lY; i++) {
+            diagonalCalculationPosteriorMatchProbs(sM, i, dpMatrixForward, dpMatrixBackward, sX2, sY2,
+                                                   dpTotalProbability, p, extraArgs);
+        }
+        CuAssertIntEquals(testCase, lX * lY, stList_length(alignedPairs));
+        for (int64_t i = 0; i < stList_length(alignedPairs); i++) {
+            stIntTuple *pair = stList_get(alignedPairs, i);
+            int64_t x = stIntTuple_get(pair, 1) + 1, y = stIntTuple_get(pair, 2) + 1;
+            double posteriorProbability = exp((referenceCells_get(forward, x, y)[sM->matchState]
+                                               + referenceCells_get(backward, x, y)[sM->matchState])
+                                              - totalProbability);
+            int64_t expectedProb = (int64_t) floor((posteriorProbability > 1.0 ? 1.0 : posteriorProbability)
+                                                   * PAIR_ALIGNMENT_PROB_1);
+            CuAssertTrue(testCase, llabs(stIntTuple_get(pair, 0) - expectedProb) <= MAX_POSTERIOR_DIFFERENCE);
+        }
+
+        //Cleanup
+        stList_destruct(alignedPairs);
+        pairwiseAlignmentBandingParameters_destruct(p);
+        for (int64_t i = 0; i <= lX + lY; i++) {
+            dpMatrix_deleteDiagonal(dpMatrixForward, i);
+            dpMatrix_deleteDiagonal(dpMatrixBackward, i);
+        }
+        referenceCells_destruct(forward);
+        referenceCells_destruct(backward);
+        dpMatrix_destruct(dpMatrixForward);
+        dpMatrix_destruct(dpMatrixBackward);
+        bandIterator_destruct(bandIt);
+        band_destruct(band);
+        stList_destruct(anchorPairs);
+        stateMachine_destruct(sM);
+        free(sX);
+        free(sY);
+        sequence_sequenceDestroy(sX2);
+        sequence_sequenceDestroy(sY2);
+    }
+}
+
 stList *getRandomAnchorPairs(int64_t lX, int64_t lY) {
     stList *anchorPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
     int64_t x = -1;
@@ -388,6 +773,97 @@ stList *getRandomAnchorPairs(int64_t lX, int64_t lY) {
     return anchorPairs;
 }
 
+//The diagonals of the band as band_construct used to make them, all at once, to test the lazy band against
+static int64_t eagerBand_avoidOffByOne(int64_t xay, int64_t xmy) {
+    return (xay + xmy) % 2 == 0 ? xmy : xmy + 1;
+}
+
+static void eagerBand_boundXmy(int64_t *xmy, int64_t i, int64_t j, int64_t k) {
+    if (i < j) {
+        *xmy += 2 * (j - i) * k;
+    }
+}
+
+static Diagonal eagerBand_getDiagonal(int64_t xay, int64_t xL, int64_t yL, int64_t xU, int64_t yU) {
+    int64_t xmyL = eagerBand_avoidOffByOne(xay, xL - yL);
+    int64_t xmyR = eagerBand_avoidOffByOne(xay, xU - yU);
+    eagerBand_boundXmy(&xmyL, diagonal_getXCoordinate(xay, xmyL), xL, 1);
+    eagerBand_boundXmy(&xmyL, yL, diagonal_getYCoordinate(xay, xmyL), 1);
+    eagerBand_boundXmy(&xmyR, xU, diagonal_getXCoordinate(xay, xmyR), -1);
+    eagerBand_boundXmy(&xmyR, diagonal_getYCoordinate(xay, xmyR), yU, -1);
+    return diagonal_construct(xay, xmyL, xmyR);
+}
+
+static int64_t eagerBand_boundCoordinate(int64_t z, int64_t lZ) {
+    return z < 0 ? 0 : (z > lZ ? lZ : z);
+}
+
+static Diagonal *eagerBand_construct(stList *anchorPairs, int64_t lX, int64_t lY, int64_t expansion) {
+    Diagonal *diagonals = st_malloc(sizeof(Diagonal) * (lX + lY + 1));
+    int64_t anchorPairIndex = 0, xay = 0;
+    int64_t pxay = 0, pxmy = 0, nxay = 0, nxmy = 0;
+    int64_t xL = 0, yL = 0, xU = 0, yU = 0;
+    while (xay <= lX + lY) {
+        diagonals[xay] = eagerBand_getDiagonal(xay, xL, yL, xU, yU);
+        if (nxay == xay++) {
+            pxay = nxay;
+            pxmy = nxmy;
+            int64_t x = lX, y = lY;
+            if (anchorPairIndex < stList_length(anchorPairs)) {
+                stIntTuple *anchorPair = stList_get(anchorPairs, anchorPairIndex++);
+                x = stIntTuple_get(anchorPair, 0) + 1;
+                y = stIntTuple_get(anchorPair, 1) + 1;
+            }
+            nxay = x + y;
+            nxmy = x - y;
+            xL = eagerBand_boundCoordinate(diagonal_getXCoordinate(pxay, pxmy - expansion), lX);
+            yL = eagerBand_boundCoordinate(diagonal_getYCoordinate(nxay, nxmy - expansion), lY);
+            xU = eagerBand_boundCoordinate(diagonal_getXCoordinate(nxay, nxmy + expansion), lX);
+            yU = eagerBand_boundCoordinate(diagonal_getYCoordinate(pxay, pxmy + expansion), lY);
+        }
+    }
+    return diagonals;
+}
+
+static void test_lazyBand(CuTest *testCase) {
+    for (int64_t test = 0; test < 100; test++) {
+        int64_t lX = st_randomInt(0, 300), lY = st_randomInt(0, 300);
+        int64_t expansion = 2 * st_randomInt(0, 10);
+        stList *anchorPairs = getRandomAnchorPairs(lX, lY);
+        Band *band = band_construct(anchorPairs, lX, lY, expansion);
+        Diagonal *diagonals = eagerBand_construct(anchorPairs, lX, lY, expansion);
+
+        //Walk forward to the end, and past it
+        BandIterator *bandIt = bandIterator_construct(band);
+        for (int64_t i = 0; i <= lX + lY + 1; i++) {
+            CuAssertTrue(testCase, testDiagonalsEqual(bandIterator_getNext(bandIt),
+                                                      diagonals[i <= lX + lY ? i : lX + lY]));
+        }
+        //Then back and forth at random, as the traceback does
+        int64_t index = lX + lY + 1;
+        for (int64_t i = 0; i < 2 * (lX + lY); i++) {
+            if (st_random() > 0.5) {
+                CuAssertTrue(testCase, testDiagonalsEqual(bandIterator_getNext(bandIt),
+                                                          diagonals[index <= lX + lY ? index : lX + lY]));
+                index += index <= lX + lY ? 1 : 0;
+            } else {
+                index -= index > 0 ? 1 : 0;
+                CuAssertTrue(testCase, testDiagonalsEqual(bandIterator_getPrevious(bandIt), diagonals[index]));
+            }
+        }
+        //And in any order
+        for (int64_t i = 0; i <= lX + lY; i++) {
+            int64_t xay = st_randomInt(0, lX + lY + 1);
+            CuAssertTrue(testCase, testDiagonalsEqual(band_getDiagonal(band, xay), diagonals[xay]));
+        }
+
+        bandIterator_destruct(bandIt);
+        band_destruct(band);
+        free(diagonals);
+        stList_destruct(anchorPairs);
+    }
+}
+
 static void checkAlignedPairs(CuTest *testCase, stList *blastPairs, int64_t lX, int64_t lY) {
     st_logInfo("I got %" PRIi64 " pairs to check\n", stList_length(blastPairs));
     stSortedSet *pairs = stSortedSet_construct3((int (*)(const void *, const void *)) stIntTuple_cmpFn,
@@ -464,6 +940,757 @@ static void test_getAlignedPairsWithBanding(CuTest *testCase) {
     }
 }
 
+//Fills probs, a lX by lY array, with the scores of the aligned pairs
+static void getAlignedPairProbs(stList *alignedPairs, int64_t lY, int64_t *probs) {
+    for (int64_t i = 0; i < stList_length(alignedPairs); i++) {
+        stIntTuple *j = stList_get(alignedPairs, i);
+        probs[stIntTuple_get(j, 1) * lY + stIntTuple_get(j, 2)] = stIntTuple_get(j, 0);
+    }
+}
+
+static void test_scaledProbabilities(CuTest *testCase) {
+    for (int64_t test = 0; test < 10; test++) {
+        //Make a pair of sequences, long enough for the log and scaled recursions to differ in rounding
+        char *sX = getRandomSequence(st_randomInt(0, 500));
+        char *sY = evolveSequence(sX);
+        int64_t lX = strlen(sX);
+        int64_t lY = strlen(sY);
+
+        Sequence* sX2 = sequence_construct2(lX, sX, sequence_getBase, sequence_sliceNucleotideSequence2);
+        Sequence* sY2 = sequence_construct2(lY, sY, sequence_getBase, sequence_sliceNucleotideSequence2);
+
+        PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+        p->traceBackDiagonals = st_randomInt(1, 10);
+        p->minDiagsBetweenTraceBack = p->traceBackDiagonals + st_randomInt(2, 100);
+        p->diagonalExpansion = st_randomInt(0, 10) * 2;
+
+        StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                                   emissions_symbol_setEmissionsToDefaults,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getMatchProb,
+                                                   cell_updateExpectations);
+
+        stList *anchorPairs = getRandomAnchorPairs(lX, lY);
+
+        //Do the alignment in log space then with scaled probabilities
+        int64_t *probs[2];
+        for (int64_t scaled = 0; scaled < 2; scaled++) {
+            p->scaledProbabilities = scaled;
+            stList *alignedPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+            void *extraArgs[1] = { alignedPairs };
+            getPosteriorProbsWithBanding(sM, anchorPairs, sX2, sY2, p, 0, 0,
+                                         diagonalCalculationPosteriorMatchProbs, extraArgs);
+            checkAlignedPairs(testCase, alignedPairs, lX, lY);
+            probs[scaled] = st_calloc(lX * lY + 1, sizeof(int64_t));
+            getAlignedPairProbs(alignedPairs, lY, probs[scaled]);
+            stList_destruct(alignedPairs);
+        }
+
+        //The posteriors should agree, up to the approximation made by logAdd, pairs only being reported
+        //by one of them if they are close to the threshold. The log recursion's logAdd errors build up over the
+        //diagonals, so the tolerance grows with the length of the sequences.
+        int64_t tolerance = 0.005 * (1.0 + (lX + lY) / 1000.0) * PAIR_ALIGNMENT_PROB_1;
+        int64_t threshold = p->threshold * PAIR_ALIGNMENT_PROB_1;
+        for (int64_t i = 0; i < lX * lY; i++) {
+            if (probs[0][i] == 0 || probs[1][i] == 0) {
+                CuAssertTrue(testCase, probs[0][i] + probs[1][i] <= threshold + tolerance);
+            } else {
+                CuAssertTrue(testCase, llabs(probs[0][i] - probs[1][i]) <= tolerance);
+            }
+        }
+
+        //Cleanup
+        stateMachine_destruct(sM);
+        pairwiseAlignmentBandingParameters_destruct(p);
+        stList_destruct(anchorPairs);
+        free(probs[0]);
+        free(probs[1]);
+        free(sX);
+        free(sY);
+        sequence_sequenceDestroy(sX2);
+        sequence_sequenceDestroy(sY2);
+    }
+}
+
+//As diagonalCalculationPosteriorMatchProbs, also adding the number of cells of the diagonal to the count in
+//extraArgs[1]
+static void diagonalCalculationPosteriorMatchProbsCountingCells(StateMachine *sM, int64_t xay,
+                                                                DpMatrix *forwardDpMatrix, DpMatrix *backwardDpMatrix,
+                                                                Sequence *sX, Sequence *sY, double totalProbability,
+                                                                PairwiseAlignmentParameters *p, void *extraArgs) {
+    diagonalCalculationPosteriorMatchProbs(sM, xay, forwardDpMatrix, backwardDpMatrix, sX, sY,
+                                           totalProbability, p, extraArgs);
+    int64_t *cellNumber = ((void **) extraArgs)[1];
+    *cellNumber += diagonal_getWidth(dpDiagonal_getDiagonal(dpMatrix_getDiagonal(forwardDpMatrix, xay)));
+}
+
+static void test_adaptiveBanding(CuTest *testCase) {
+    for (int64_t test = 0; test < 10; test++) {
+        //Make a pair of sequences, the second half of the time differing only by substitutions
+        char *sX = getRandomSequence(st_randomInt(200, 500));
+        char *sY;
+        if (test < 5) {
+            sY = evolveSequence(sX);
+        } else {
+            sY = stString_copy(sX);
+            for (int64_t i = 0; sY[i] != '\0'; i++) {
+                if (st_random() > 0.9) {
+                    sY[i] = getRandomChar();
+                }
+            }
+        }
+        int64_t lX = strlen(sX);
+        int64_t lY = strlen(sY);
+
+        Sequence* sX2 = sequence_construct2(lX, sX, sequence_getBase, sequence_sliceNucleotideSequence2);
+        Sequence* sY2 = sequence_construct2(lY, sY, sequence_getBase, sequence_sliceNucleotideSequence2);
+
+        PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+        p->traceBackDiagonals = st_randomInt(1, 10);
+        //No intermediate tracebacks, which would make the posteriors depend on the widths of the bands
+        p->minDiagsBetweenTraceBack = lX + lY + p->traceBackDiagonals + 2;
+        p->scaledProbabilities = test % 2;
+
+        StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                                   emissions_symbol_setEmissionsToDefaults,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getMatchProb,
+                                                   cell_updateExpectations);
+
+        //Align in a band covering the whole matrix, then in an adaptive band
+        stList *anchorPairs = stList_construct();
+        int64_t *probs[2];
+        int64_t cellNumbers[2] = { 0, 0 };
+        for (int64_t adaptive = 0; adaptive < 2; adaptive++) {
+            p->diagonalExpansion = adaptive ? 4 : 2 * (lX + lY);
+            p->adaptiveBandXDrop = adaptive ? 20.0 : 0.0;
+            stList *alignedPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+            void *extraArgs[2] = { alignedPairs, &cellNumbers[adaptive] };
+            getPosteriorProbsWithBanding(sM, anchorPairs, sX2, sY2, p, 0, 0,
+                                         diagonalCalculationPosteriorMatchProbsCountingCells, extraArgs);
+            checkAlignedPairs(testCase, alignedPairs, lX, lY);
+            probs[adaptive] = st_calloc(lX * lY + 1, sizeof(int64_t));
+            getAlignedPairProbs(alignedPairs, lY, probs[adaptive]);
+            stList_destruct(alignedPairs);
+        }
+        st_logInfo("Cells in the full band: %" PRIi64 ", in the adaptive band: %" PRIi64 "\n",
+                   cellNumbers[0], cellNumbers[1]);
+        CuAssertTrue(testCase, cellNumbers[1] <= cellNumbers[0]);
+        if (test >= 5) { //Where the sequences are similar the band should be a small part of the matrix
+            CuAssertTrue(testCase, cellNumbers[1] * 2 < cellNumbers[0]);
+        }
+
+        //The mass the adaptive band leaves out is too small to move the posteriors
+        int64_t tolerance = 0.005 * PAIR_ALIGNMENT_PROB_1;
+        int64_t threshold = p->threshold * PAIR_ALIGNMENT_PROB_1;
+        for (int64_t i = 0; i < lX * lY; i++) {
+            if (probs[0][i] == 0 || probs[1][i] == 0) {
+                CuAssertTrue(testCase, probs[0][i] + probs[1][i] <= threshold + tolerance);
+            } else {
+                CuAssertTrue(testCase, llabs(probs[0][i] - probs[1][i]) <= tolerance);
+            }
+        }
+        stList_destruct(anchorPairs);
+
+        //An adaptive band kept within a band around anchors
+        anchorPairs = getRandomAnchorPairs(lX, lY);
+        p->adaptiveBandMaxExpansion = st_randomInt(0, 10) * 2;
+        stList *alignedPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+        void *extraArgs[1] = { alignedPairs };
+        getPosteriorProbsWithBanding(sM, anchorPairs, sX2, sY2, p, 0, 0,
+                                     diagonalCalculationPosteriorMatchProbs, extraArgs);
+        checkAlignedPairs(testCase, alignedPairs, lX, lY);
+
+        //Cleanup
+        stList_destruct(alignedPairs);
+        stList_destruct(anchorPairs);
+        stateMachine_destruct(sM);
+        pairwiseAlignmentBandingParameters_destruct(p);
+        free(probs[0]);
+        free(probs[1]);
+        free(sX);
+        free(sY);
+        sequence_sequenceDestroy(sX2);
+        sequence_sequenceDestroy(sY2);
+    }
+}
+
+static void destructStringChunk(Sequence *chunk) {
+    free(chunk->elements);
+    sequence_sequenceDestroy(chunk);
+}
+
+//Aligns sX2 to sY with a streaming aligner, pushing sY in chunks of random length, checking the aligner holds no
+//more than maxBufferedLength elements of sY at once
+static stList *getAlignedPairsByStreaming(CuTest *testCase, StateMachine *sM, Sequence *sX2, char *sY,
+                                          PairwiseAlignmentParameters *p, int64_t maxBufferedLength) {
+    stList *alignedPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+    void *extraArgs[1] = { alignedPairs };
+    StreamingAligner *aligner = streamingAligner_construct(sM, sX2, p, 0, 0, diagonalCalculationPosteriorMatchProbs,
+                                                           extraArgs, destructStringChunk);
+    int64_t lY = strlen(sY);
+    for (int64_t i = 0; i < lY;) {
+        int64_t chunkLength = st_randomInt(0, 100);
+        if (i + chunkLength > lY) {
+            chunkLength = lY - i;
+        }
+        streamingAligner_push(aligner, sequence_construct2(chunkLength, stString_getSubString(sY, i, chunkLength),
+                                                           sequence_getBase, sequence_sliceNucleotideSequence2));
+        i += chunkLength;
+        CuAssertTrue(testCase, streamingAligner_getBufferedLength(aligner) <= maxBufferedLength);
+        CuAssertTrue(testCase, streamingAligner_getTracedBackTo(aligner) <= sX2->length + i);
+    }
+    streamingAligner_finish(aligner);
+    CuAssertIntEquals(testCase, sX2->length + lY, streamingAligner_getTracedBackTo(aligner));
+    streamingAligner_destruct(aligner);
+    return alignedPairs;
+}
+
+static void test_streamingAlignment(CuTest *testCase) {
+    for (int64_t test = 0; test < 10; test++) {
+        //Make a pair of sequences, differing only by substitutions
+        char *sX = getRandomSequence(st_randomInt(0, 2000));
+        char *sY = stString_copy(sX);
+        for (int64_t i = 0; sY[i] != '\0'; i++) {
+            if (st_random() > 0.9) {
+                sY[i] = getRandomChar();
+            }
+        }
+        int64_t lX = strlen(sX);
+        int64_t lY = strlen(sY);
+
+        Sequence* sX2 = sequence_construct2(lX, sX, sequence_getBase, sequence_sliceNucleotideSequence2);
+        Sequence* sY2 = sequence_construct2(lY, sY, sequence_getBase, sequence_sliceNucleotideSequence2);
+
+        PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+        p->traceBackDiagonals = st_randomInt(1, 10);
+        p->diagonalExpansion = st_randomInt(0, 5) * 2;
+        p->adaptiveBandXDrop = 20.0;
+        p->scaledProbabilities = test % 2;
+
+        StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                                   emissions_symbol_setEmissionsToDefaults,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getMatchProb,
+                                                   cell_updateExpectations);
+
+        //With only the final traceback streaming gives the same posteriors as aligning the whole sequences
+        p->minDiagsBetweenTraceBack = lX + lY + p->traceBackDiagonals + 2;
+        stList *anchorPairs = stList_construct();
+        stList *alignedPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+        void *extraArgs[1] = { alignedPairs };
+        getPosteriorProbsWithBanding(sM, anchorPairs, sX2, sY2, p, 0, 0,
+                                     diagonalCalculationPosteriorMatchProbs, extraArgs);
+        stList *streamedAlignedPairs = getAlignedPairsByStreaming(testCase, sM, sX2, sY, p, lY);
+        CuAssertIntEquals(testCase, stList_length(alignedPairs), stList_length(streamedAlignedPairs));
+        for (int64_t i = 0; i < stList_length(alignedPairs); i++) {
+            CuAssertTrue(testCase, stIntTuple_equalsFn(stList_get(alignedPairs, i),
+                                                       stList_get(streamedAlignedPairs, i)));
+        }
+        stList_destruct(streamedAlignedPairs);
+
+        //With intermediate tracebacks the aligner only holds the part of sY near the band
+        p->minDiagsBetweenTraceBack = p->traceBackDiagonals + st_randomInt(2, 100);
+        streamedAlignedPairs = getAlignedPairsByStreaming(testCase, sM, sX2, sY, p, 500);
+        checkAlignedPairs(testCase, streamedAlignedPairs, lX, lY);
+
+        //Cleanup
+        stList_destruct(streamedAlignedPairs);
+        stList_destruct(alignedPairs);
+        stList_destruct(anchorPairs);
+        stateMachine_destruct(sM);
+        pairwiseAlignmentBandingParameters_destruct(p);
+        free(sX);
+        free(sY);
+        sequence_sequenceDestroy(sX2);
+        sequence_sequenceDestroy(sY2);
+    }
+}
+
+static stList *getAlignedPairsWithoutBandingOrCheckpointing(StateMachine *sM, Sequence *sX, Sequence *sY,
+                                                             PairwiseAlignmentParameters *p) {
+    //Keeps every diagonal of the forward and backward matrices, as the unbanded alignment used to
+    int64_t diagonalNumber = sX->length + sY->length;
+    DpMatrix *forwardDpMatrix = dpMatrix_construct(diagonalNumber, sM->stateNumber);
+    DpMatrix *backwardDpMatrix = dpMatrix_construct(diagonalNumber, sM->stateNumber);
+    stList *anchorPairs = stList_construct();
+    Band *band = band_construct(anchorPairs, sX->length, sY->length, 2);
+    BandIterator *bandIt = bandIterator_construct(band);
+    for (int64_t i = 0; i <= diagonalNumber; i++) {
+        Diagonal d = bandIterator_getNext(bandIt);
+        dpDiagonal_zeroValues(dpMatrix_createDiagonal(backwardDpMatrix, d));
+        dpDiagonal_zeroValues(dpMatrix_createDiagonal(forwardDpMatrix, d));
+    }
+    dpDiagonal_initialiseValues(dpMatrix_getDiagonal(forwardDpMatrix, 0), sM, sM->startStateProb);
+    dpDiagonal_initialiseValues(dpMatrix_getDiagonal(backwardDpMatrix, diagonalNumber), sM, sM->endStateProb);
+    DiagonalCalculationFn forwardFn = diagonalCalculation_getForwardFn(sM);
+    for (int64_t i = 1; i <= diagonalNumber; i++) {
+        forwardFn(sM, i, forwardDpMatrix, sX, sY);
+    }
+    DiagonalCalculationFn backwardFn = diagonalCalculation_getBackwardFn(sM);
+    for (int64_t i = diagonalNumber; i > 0; i--) {
+        backwardFn(sM, i, backwardDpMatrix, sX, sY);
+    }
+    double totalProbability = diagonalCalculationTotalProbability(sM, diagonalNumber, forwardDpMatrix,
+                                                                  backwardDpMatrix, sX, sY);
+    stList *alignedPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+    void *extraArgs[1] = { alignedPairs };
+    for (int64_t i = 0; i <= diagonalNumber; i++) {
+        diagonalCalculationPosteriorMatchProbs(sM, i, forwardDpMatrix, backwardDpMatrix, sX, sY,
+                                               totalProbability, p, extraArgs);
+        dpMatrix_deleteDiagonal(forwardDpMatrix, i);
+        dpMatrix_deleteDiagonal(backwardDpMatrix, i);
+    }
+    dpMatrix_destruct(forwardDpMatrix);
+    dpMatrix_destruct(backwardDpMatrix);
+    bandIterator_destruct(bandIt);
+    band_destruct(band);
+    stList_destruct(anchorPairs);
+    return alignedPairs;
+}
+
+static void test_checkpointedAlignmentWithoutBanding(CuTest *testCase) {
+    for (int64_t test = 0; test < 10; test++) {
+        char *sX = getRandomSequence(st_randomInt(0, 200));
+        char *sY = evolveSequence(sX);
+        int64_t lX = strlen(sX);
+        int64_t lY = strlen(sY);
+        Sequence* sX2 = sequence_construct(lX, sX, sequence_getBase);
+        Sequence* sY2 = sequence_construct(lY, sY, sequence_getBase);
+
+        StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                                   emissions_symbol_setEmissionsToDefaults,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getMatchProb,
+                                                   cell_updateExpectations);
+        PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+
+        stList *alignedPairs = getAlignedPairsWithoutBandingOrCheckpointing(sM, sX2, sY2, p);
+        int64_t *probs = st_calloc(lX * lY + 1, sizeof(int64_t));
+        getAlignedPairProbs(alignedPairs, lY, probs);
+
+        //Recomputing the forward diagonals gives exactly the same posteriors, whatever the interval
+        int64_t intervals[4] = { 0, 1, 2, st_randomInt(3, 50) };
+        for (int64_t i = 0; i < 4; i++) {
+            p->checkpointInterval = intervals[i];
+            stList *alignedPairs2 = getAlignedPairsWithoutBanding(sM, sX, sY, lX, lY, p,
+                                                                  sequence_getBase, sequence_getBase,
+                                                                  diagonalCalculationPosteriorMatchProbs, 0, 0);
+            checkAlignedPairs(testCase, alignedPairs2, lX, lY);
+            CuAssertIntEquals(testCase, stList_length(alignedPairs), stList_length(alignedPairs2));
+            int64_t *probs2 = st_calloc(lX * lY + 1, sizeof(int64_t));
+            getAlignedPairProbs(alignedPairs2, lY, probs2);
+            for (int64_t j = 0; j < lX * lY; j++) {
+                CuAssertIntEquals(testCase, probs[j], probs2[j]);
+            }
+            free(probs2);
+            stList_destruct(alignedPairs2);
+        }
+
+        //Cleanup
+        free(probs);
+        stList_destruct(alignedPairs);
+        stateMachine_destruct(sM);
+        pairwiseAlignmentBandingParameters_destruct(p);
+        free(sX);
+        free(sY);
+        sequence_sequenceDestroy(sX2);
+        sequence_sequenceDestroy(sY2);
+    }
+}
+
+static void test_getAlignedPairsUsingAnchorsInParallel(CuTest *testCase) {
+    for (int64_t test = 0; test < 10; test++) {
+        char *sX = getRandomSequence(st_randomInt(0, 1000));
+        char *sY = evolveSequence(sX);
+        int64_t lX = strlen(sX);
+        int64_t lY = strlen(sY);
+        Sequence* sX2 = sequence_construct2(lX, sX, sequence_getBase, sequence_sliceNucleotideSequence2);
+        Sequence* sY2 = sequence_construct2(lY, sY, sequence_getBase, sequence_sliceNucleotideSequence2);
+
+        StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                                   emissions_symbol_setEmissionsToDefaults,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getMatchProb,
+                                                   cell_updateExpectations);
+        PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+        //Small enough for the gaps between the anchors to split the matrix
+        p->splitMatrixBiggerThanThis = st_randomInt(0, 100) * st_randomInt(0, 100);
+        stList *anchorPairs = getRandomAnchorPairs(lX, lY);
+
+        stList *alignedPairs = getAlignedPairsUsingAnchors(sM, sX2, sY2, anchorPairs, p,
+                                                           diagonalCalculationPosteriorMatchProbs, 0, 0);
+        checkAlignedPairs(testCase, alignedPairs, lX, lY);
+
+        //The sub-alignments are merged in order, so the pairs come out the same as for one thread
+        p->threadNumber = st_randomInt(2, 9);
+        stList *alignedPairs2 = getAlignedPairsUsingAnchors(sM, sX2, sY2, anchorPairs, p,
+                                                            diagonalCalculationPosteriorMatchProbs, 0, 0);
+        CuAssertIntEquals(testCase, stList_length(alignedPairs), stList_length(alignedPairs2));
+        for (int64_t i = 0; i < stList_length(alignedPairs); i++) {
+            CuAssertTrue(testCase, stIntTuple_cmpFn(stList_get(alignedPairs, i), stList_get(alignedPairs2, i)) == 0);
+        }
+
+        //Cleanup
+        stList_destruct(alignedPairs);
+        stList_destruct(alignedPairs2);
+        stList_destruct(anchorPairs);
+        stateMachine_destruct(sM);
+        pairwiseAlignmentBandingParameters_destruct(p);
+        free(sX);
+        free(sY);
+        sequence_sequenceDestroy(sX2);
+        sequence_sequenceDestroy(sY2);
+    }
+}
+
+//Runs the state machine's forward and backward kernels over the whole band, with the matrices sharing emissionCache
+static void emissionCache_fillMatrices(StateMachine *sM, Band *band, Sequence *sX, Sequence *sY,
+                                       DpMatrix *dpMatrixForward, DpMatrix *dpMatrixBackward,
+                                       EmissionCache *emissionCache) {
+    int64_t diagonalNumber = sX->length + sY->length;
+    dpMatrix_setEmissionCache(dpMatrixForward, emissionCache);
+    dpMatrix_setEmissionCache(dpMatrixBackward, emissionCache);
+    BandIterator *bandIt = bandIterator_construct(band);
+    for (int64_t i = 0; i <= diagonalNumber; i++) {
+        Diagonal d = bandIterator_getNext(bandIt);
+        dpDiagonal_zeroValues(dpMatrix_createDiagonal(dpMatrixBackward, d));
+        dpDiagonal_zeroValues(dpMatrix_createDiagonal(dpMatrixForward, d));
+    }
+    dpDiagonal_initialiseValues(dpMatrix_getDiagonal(dpMatrixForward, 0), sM, sM->startStateProb);
+    dpDiagonal_initialiseValues(dpMatrix_getDiagonal(dpMatrixBackward, diagonalNumber), sM, sM->endStateProb);
+    for (int64_t i = 1; i <= diagonalNumber; i++) {
+        diagonalCalculation_getForwardFn(sM)(sM, i, dpMatrixForward, sX, sY);
+    }
+    for (int64_t i = diagonalNumber; i > 0; i--) {
+        diagonalCalculation_getBackwardFn(sM)(sM, i, dpMatrixBackward, sX, sY);
+    }
+    bandIterator_destruct(bandIt);
+}
+
+static void test_emissionCache(CuTest *testCase) {
+    for (int64_t test = 0; test < 10; test++) {
+        char *sX = getRandomSequence(st_randomInt(0, 500));
+        char *sY = evolveSequence(sX);
+        int64_t lX = strlen(sX);
+        int64_t lY = strlen(sY);
+        Sequence* sX2 = sequence_construct2(lX, sX, sequence_getBase, sequence_sliceNucleotideSequence2);
+        Sequence* sY2 = sequence_construct2(lY, sY, sequence_getBase, sequence_sliceNucleotideSequence2);
+
+        StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                                   emissions_symbol_setEmissionsToDefaults,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getMatchProb,
+                                                   cell_updateExpectations);
+        PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+        p->scaledProbabilities = st_random() > 0.5;
+        stList *anchorPairs = getRandomAnchorPairs(lX, lY);
+
+        //The backward pass takes the emissions the forward pass cached, so gets exactly the same values
+        Band *band = band_construct(anchorPairs, lX, lY, 2);
+        DpMatrix *dpMatrixForward = dpMatrix_construct2(lX + lY, sM->stateNumber, 1);
+        DpMatrix *dpMatrixBackward = dpMatrix_construct2(lX + lY, sM->stateNumber, 1);
+        emissionCache_fillMatrices(sM, band, sX2, sY2, dpMatrixForward, dpMatrixBackward, NULL);
+        DpMatrix *dpMatrixForward2 = dpMatrix_construct2(lX + lY, sM->stateNumber, 1);
+        DpMatrix *dpMatrixBackward2 = dpMatrix_construct2(lX + lY, sM->stateNumber, 1);
+        EmissionCache *emissionCache = emissionCache_construct(lX + lY, p->emissionCacheMaxSize);
+        emissionCache_fillMatrices(sM, band, sX2, sY2, dpMatrixForward2, dpMatrixBackward2, emissionCache);
+        if (lX + lY > 1) {
+            CuAssertTrue(testCase, emissionCache_getHitNumber(emissionCache) > 0);
+        }
+        for (int64_t i = 0; i <= lX + lY; i++) {
+            CuAssertTrue(testCase, dpDiagonal_equals(dpMatrix_getDiagonal(dpMatrixForward, i),
+                                                     dpMatrix_getDiagonal(dpMatrixForward2, i)));
+            CuAssertTrue(testCase, dpDiagonal_equals(dpMatrix_getDiagonal(dpMatrixBackward, i),
+                                                     dpMatrix_getDiagonal(dpMatrixBackward2, i)));
+            dpMatrix_deleteDiagonal(dpMatrixForward, i);
+            dpMatrix_deleteDiagonal(dpMatrixBackward, i);
+            dpMatrix_deleteDiagonal(dpMatrixForward2, i);
+            dpMatrix_deleteDiagonal(dpMatrixBackward2, i);
+        }
+        emissionCache_destruct(emissionCache);
+        dpMatrix_destruct(dpMatrixForward);
+        dpMatrix_destruct(dpMatrixBackward);
+        dpMatrix_destruct(dpMatrixForward2);
+        dpMatrix_destruct(dpMatrixBackward2);
+        band_destruct(band);
+
+        //Posteriors are the same with the cache off, with it too small for most diagonals and with the default
+        int64_t maxSizes[3] = { 0, 1024, p->emissionCacheMaxSize };
+        stList *alignedPairs = NULL;
+        for (int64_t i = 0; i < 3; i++) {
+            p->emissionCacheMaxSize = maxSizes[i];
+            stList *alignedPairs2 = getAlignedPairsUsingAnchors(sM, sX2, sY2, anchorPairs, p,
+                                                                diagonalCalculationPosteriorMatchProbs, 0, 0);
+            checkAlignedPairs(testCase, alignedPairs2, lX, lY);
+            if (alignedPairs == NULL) {
+                alignedPairs = alignedPairs2;
+                continue;
+            }
+            CuAssertIntEquals(testCase, stList_length(alignedPairs), stList_length(alignedPairs2));
+            for (int64_t j = 0; j < stList_length(alignedPairs); j++) {
+                CuAssertTrue(testCase,
+                             stIntTuple_cmpFn(stList_get(alignedPairs, j), stList_get(alignedPairs2, j)) == 0);
+            }
+            stList_destruct(alignedPairs2);
+        }
+
+        //Cleanup
+        stList_destruct(alignedPairs);
+        stList_destruct(anchorPairs);
+        stateMachine_destruct(sM);
+        pairwiseAlignmentBandingParameters_destruct(p);
+        free(sX);
+        free(sY);
+        sequence_sequenceDestroy(sX2);
+        sequence_sequenceDestroy(sY2);
+    }
+}
+
+static void test_emissionCacheWindows(CuTest *testCase) {
+    //The cache holds at most its maximum size at a time, not in all, so with the diagonals of each traceback window
+    //deleted once it's done a small cache takes emissions in every one of many windows
+    int64_t lX = 1000, windowLength = 40;
+    char *sX = getRandomSequence(lX);
+    Sequence* sX2 = sequence_construct2(lX, sX, sequence_getBase, sequence_sliceNucleotideSequence2);
+    Sequence* sY2 = sequence_construct2(lX, sX, sequence_getBase, sequence_sliceNucleotideSequence2);
+    StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                               emissions_symbol_setEmissionsToDefaults,
+                                               emissions_symbol_getGapProb,
+                                               emissions_symbol_getGapProb,
+                                               emissions_symbol_getMatchProb,
+                                               cell_updateExpectations);
+    stList *anchorPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+    for (int64_t i = 1; i < lX; i++) {
+        stList_append(anchorPairs, stIntTuple_construct2(i, i));
+    }
+    int64_t diagonalNumber = 2 * lX;
+    Band *band = band_construct(anchorPairs, lX, lX, 2);
+    BandIterator *bandIt = bandIterator_construct(band);
+    DpMatrix *dpMatrixForward = dpMatrix_construct2(diagonalNumber, sM->stateNumber, 1);
+    DpMatrix *dpMatrixBackward = dpMatrix_construct2(diagonalNumber, sM->stateNumber, 1);
+    for (int64_t i = 0; i <= diagonalNumber; i++) {
+        Diagonal d = bandIterator_getNext(bandIt);
+        dpDiagonal_zeroValues(dpMatrix_createDiagonal(dpMatrixBackward, d));
+        dpDiagonal_zeroValues(dpMatrix_createDiagonal(dpMatrixForward, d));
+    }
+    dpDiagonal_initialiseValues(dpMatrix_getDiagonal(dpMatrixForward, 0), sM, sM->startStateProb);
+    //room for the emissions of about ten diagonals. Scaled diagonals always go through the vector kernels, which
+    //use the cache, however narrow
+    EmissionCache *emissionCache = emissionCache_construct(diagonalNumber, 10 * 3 * 5 * sizeof(double));
+    dpMatrix_setEmissionCache(dpMatrixForward, emissionCache);
+    dpMatrix_setEmissionCache(dpMatrixBackward, emissionCache);
+
+    for (int64_t start = 1; start <= diagonalNumber; start += windowLength) {
+        int64_t end = start + windowLength - 1 < diagonalNumber ? start + windowLength - 1 : diagonalNumber;
+        int64_t hits = emissionCache_getHitNumber(emissionCache);
+        for (int64_t i = start; i <= end; i++) {
+            diagonalCalculation_getForwardFn(sM)(sM, i, dpMatrixForward, sX2, sY2);
+        }
+        CuAssertTrue(testCase, emissionCache_getSize(emissionCache) <= 10 * 3 * 5 * sizeof(double));
+        for (int64_t i = end; i >= start; i--) {
+            diagonalCalculation_getBackwardFn(sM)(sM, i, dpMatrixBackward, sX2, sY2);
+        }
+        CuAssertTrue(testCase, emissionCache_getHitNumber(emissionCache) > hits);
+        for (int64_t i = start; i <= end; i++) {
+            emissionCache_deleteDiagonal(emissionCache, i);
+        }
+        CuAssertIntEquals(testCase, 0, emissionCache_getSize(emissionCache));
+    }
+    emissionCache_destruct(emissionCache);
+    for (int64_t i = 0; i <= diagonalNumber; i++) {
+        dpMatrix_deleteDiagonal(dpMatrixForward, i);
+        dpMatrix_deleteDiagonal(dpMatrixBackward, i);
+    }
+    dpMatrix_destruct(dpMatrixForward);
+    dpMatrix_destruct(dpMatrixBackward);
+    bandIterator_destruct(bandIt);
+    band_destruct(band);
+    stList_destruct(anchorPairs);
+    stateMachine_destruct(sM);
+    sequence_sequenceDestroy(sX2);
+    sequence_sequenceDestroy(sY2);
+    free(sX);
+}
+
+static void checkAlignedPairBuffer(CuTest *testCase, AlignedPairBuffer *buffer, stList *alignedPairs) {
+    //Sorted by x + y, and the same pairs as the list
+    for (int64_t i = 1; i < buffer->length; i++) {
+        CuAssertTrue(testCase, buffer->xs[i - 1] + buffer->ys[i - 1] <= buffer->xs[i] + buffer->ys[i]);
+    }
+    stList *alignedPairs2 = alignedPairBuffer_toList(buffer);
+    CuAssertIntEquals(testCase, stList_length(alignedPairs), stList_length(alignedPairs2));
+    stList_sort(alignedPairs, (int (*)(const void *, const void *)) stIntTuple_cmpFn);
+    stList_sort(alignedPairs2, (int (*)(const void *, const void *)) stIntTuple_cmpFn);
+    for (int64_t i = 0; i < stList_length(alignedPairs); i++) {
+        CuAssertTrue(testCase, stIntTuple_cmpFn(stList_get(alignedPairs, i), stList_get(alignedPairs2, i)) == 0);
+    }
+    stList_destruct(alignedPairs2);
+}
+
+static void test_getAlignedPairsForBatch(CuTest *testCase) {
+    for (int64_t test = 0; test < 5; test++) {
+        StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                                   emissions_symbol_setEmissionsToDefaults,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getMatchProb,
+                                                   cell_updateExpectations);
+        PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+        p->splitMatrixBiggerThanThis = st_randomInt(0, 100) * st_randomInt(0, 100);
+        //The jobs share the state machine, but each has its own sequences, anchors and ends
+        int64_t jobNumber = st_randomInt(0, 10);
+        stList *sequences = stList_construct3(0, (void (*)(void *)) sequence_sequenceDestroy);
+        stList *strings = stList_construct3(0, free);
+        stList *anchorPairLists = stList_construct3(0, (void (*)(void *)) stList_destruct);
+        stList *jobs = stList_construct3(0, (void (*)(void *)) alignmentJob_destruct);
+        stList *expectedAlignedPairs = stList_construct3(0, (void (*)(void *)) stList_destruct);
+        for (int64_t i = 0; i < jobNumber; i++) {
+            char *sX = getRandomSequence(st_randomInt(0, 500));
+            char *sY = evolveSequence(sX);
+            int64_t lX = strlen(sX);
+            int64_t lY = strlen(sY);
+            Sequence *sX2 = sequence_construct2(lX, sX, sequence_getBase, sequence_sliceNucleotideSequence2);
+            Sequence *sY2 = sequence_construct2(lY, sY, sequence_getBase, sequence_sliceNucleotideSequence2);
+            stList *anchorPairs = getRandomAnchorPairs(lX, lY);
+            bool raggedLeftEnd = st_random() > 0.5, raggedRightEnd = st_random() > 0.5, withStates = st_random() > 0.5;
+            stList_append(strings, sX);
+            stList_append(strings, sY);
+            stList_append(sequences, sX2);
+            stList_append(sequences, sY2);
+            stList_append(anchorPairLists, anchorPairs);
+            stList_append(jobs, alignmentJob_construct(sM, sX2, sY2, anchorPairs,
+                                                       diagonalCalculationPosteriorMatchProbsToBuffer,
+                                                       withStates, raggedLeftEnd, raggedRightEnd));
+            stList_append(expectedAlignedPairs,
+                          getAlignedPairsUsingAnchors(sM, sX2, sY2, anchorPairs, p,
+                                                      diagonalCalculationPosteriorMatchProbs,
+                                                      raggedLeftEnd, raggedRightEnd));
+        }
+
+        //Each job's pairs are the same as for aligning it on its own, whatever the number of threads
+        p->threadNumber = st_randomInt(1, 9);
+        getAlignedPairsForBatch(jobs, p);
+        for (int64_t i = 0; i < jobNumber; i++) {
+            AlignmentJob *job = stList_get(jobs, i);
+            stList *alignedPairs = stList_get(expectedAlignedPairs, i);
+            CuAssertTrue(testCase, job->alignedPairs != NULL);
+            checkAlignedPairBuffer(testCase, job->alignedPairs, alignedPairs);
+            CuAssertTrue(testCase, (job->alignedPairs->states != NULL) == job->withStates);
+        }
+        if (jobNumber > 0) {
+            AlignedPairBuffer *alignedPairs = alignmentJob_takeAlignedPairs(stList_get(jobs, 0));
+            CuAssertTrue(testCase, ((AlignmentJob *) stList_get(jobs, 0))->alignedPairs == NULL);
+            alignedPairBuffer_destruct(alignedPairs);
+        }
+
+        //Cleanup
+        stList_destruct(jobs);
+        stList_destruct(expectedAlignedPairs);
+        stList_destruct(anchorPairLists);
+        stList_destruct(sequences);
+        stList_destruct(strings);
+        stateMachine_destruct(sM);
+        pairwiseAlignmentBandingParameters_destruct(p);
+    }
+}
+
+static void test_alignedPairBuffer(CuTest *testCase) {
+    for (int64_t test = 0; test < 10; test++) {
+        char *sX = getRandomSequence(st_randomInt(0, 1000));
+        char *sY = evolveSequence(sX);
+        int64_t lX = strlen(sX);
+        int64_t lY = strlen(sY);
+        Sequence* sX2 = sequence_construct2(lX, sX, sequence_getBase, sequence_sliceNucleotideSequence2);
+        Sequence* sY2 = sequence_construct2(lY, sY, sequence_getBase, sequence_sliceNucleotideSequence2);
+
+        StateMachine *sM = stateMachine5_construct(fiveState, SYMBOL_NUMBER_NO_N,
+                                                   emissions_symbol_setEmissionsToDefaults,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getGapProb,
+                                                   emissions_symbol_getMatchProb,
+                                                   cell_updateExpectations);
+        PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+        p->splitMatrixBiggerThanThis = st_randomInt(0, 100) * st_randomInt(0, 100);
+        p->threadNumber = st_randomInt(1, 4);
+        stList *anchorPairs = getRandomAnchorPairs(lX, lY);
+
+        //The buffer holds the same pairs as the list
+        stList *alignedPairs = getAlignedPairsUsingAnchors(sM, sX2, sY2, anchorPairs, p,
+                                                           diagonalCalculationPosteriorMatchProbs, 0, 0);
+        AlignedPairBuffer *buffer = getAlignedPairBufferUsingAnchors(sM, sX2, sY2, anchorPairs, p,
+                                                                     diagonalCalculationPosteriorMatchProbsToBuffer,
+                                                                     1, 0, 0);
+        checkAlignedPairBuffer(testCase, buffer, alignedPairs);
+        for (int64_t i = 0; i < buffer->length; i++) {
+            CuAssertIntEquals(testCase, sM->matchState, buffer->states[i]);
+        }
+        AlignedPairBuffer *buffer4 = getAlignedPairBufferUsingAnchors(sM, sX2, sY2, anchorPairs, p,
+                                                                      diagonalCalculationPosteriorMatchProbsToBuffer,
+                                                                      0, 0, 0);
+        CuAssertTrue(testCase, buffer4->states == NULL);
+        checkAlignedPairBuffer(testCase, buffer4, alignedPairs);
+
+        //Reweighting in place gives the same weights as reweighting the list
+        alignedPairs = reweightAlignedPairs2(alignedPairs, lX, lY, p->gapGamma);
+        alignedPairBuffer_reweight(buffer, lX, lY, p->gapGamma);
+        checkAlignedPairBuffer(testCase, buffer, alignedPairs);
+
+        //Filtering keeps the pairs with at least the given prob
+        int64_t minProb = PAIR_ALIGNMENT_PROB_1 / 2;
+        stList *filteredPairs = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+        while (stList_length(alignedPairs) > 0) {
+            stIntTuple *aPair = stList_pop(alignedPairs);
+            if (stIntTuple_get(aPair, 0) >= minProb) {
+                stList_append(filteredPairs, aPair);
+            } else {
+                stIntTuple_destruct(aPair);
+            }
+        }
+        alignedPairBuffer_filter(buffer, minProb);
+        checkAlignedPairBuffer(testCase, buffer, filteredPairs);
+
+        //And back from the list
+        AlignedPairBuffer *buffer2 = alignedPairBuffer_construct(0);
+        alignedPairBuffer_appendList(buffer2, filteredPairs);
+        alignedPairBuffer_sortByXPlusY(buffer2);
+        checkAlignedPairBuffer(testCase, buffer2, filteredPairs);
+
+        //Without banding
+        stList *alignedPairs2 = getAlignedPairsWithoutBanding(sM, sX, sY, lX, lY, p, sequence_getBase,
+                                                              sequence_getBase,
+                                                              diagonalCalculationPosteriorMatchProbs, 0, 0);
+        AlignedPairBuffer *buffer3 = getAlignedPairBufferWithoutBanding(sM, sX, sY, lX, lY, p, sequence_getBase,
+                                                                        sequence_getBase,
+                                                                        diagonalCalculationPosteriorMatchProbsToBuffer,
+                                                                        0, 0, 0);
+        CuAssertTrue(testCase, buffer3->states == NULL);
+        checkAlignedPairBuffer(testCase, buffer3, alignedPairs2);
+
+        //Cleanup
+        stList_destruct(alignedPairs);
+        stList_destruct(alignedPairs2);
+        stList_destruct(filteredPairs);
+        alignedPairBuffer_destruct(buffer);
+        alignedPairBuffer_destruct(buffer2);
+        alignedPairBuffer_destruct(buffer3);
+        alignedPairBuffer_destruct(buffer4);
+        stList_destruct(anchorPairs);
+        stateMachine_destruct(sM);
+        pairwiseAlignmentBandingParameters_destruct(p);
+        free(sX);
+        free(sY);
+        sequence_sequenceDestroy(sX2);
+        sequence_sequenceDestroy(sY2);
+    }
+}
+
 static void checkBlastPairs(CuTest *testCase, stList *blastPairs, int64_t lX, int64_t lY, bool checkNonOverlapping) {
     //st_logInfo("I got %" PRIi64 " pairs to check\n", stList_length(blastPairs));
     //printf("I got %" PRIi64 " pairs to check\n", stList_length(blastPairs));
@@ -592,6 +1819,106 @@ static void test_getBlastPairsWithRecursion(CuTest *testCase) {
     }
 }
 
+static void test_getSeedPairs(CuTest *testCase) {
+    for (int64_t test = 0; test < 10; test++) {
+        //Make a pair of sequences
+        char *sX = getRandomSequence(st_randomInt(0, 10000));
+        char *sY = evolveSequence(sX);
+        int64_t lX = strlen(sX), lY = strlen(sY);
+        int64_t trim = st_randomInt(0, 5);
+        bool repeatMask = st_random() > 0.5;
+        stList *seedPairs = getSeedPairs(sX, sY, trim, repeatMask);
+        //The pairs come from one chain, so are already non-overlapping
+        checkBlastPairs(testCase, seedPairs, lX, lY, 1);
+        stList_destruct(seedPairs);
+
+        //With only substitutions nearly all the pairs are on the diagonal (a few may be shifted where the
+        //alignment is ambiguous), and they cover most of it
+        char *sZ = stString_copy(sX);
+        for (int64_t i = 0; i < lX; i++) {
+            if (st_random() > 0.9) {
+                sZ[i] = getRandomChar();
+            }
+        }
+        seedPairs = getSeedPairs(sX, sZ, trim, repeatMask);
+        checkBlastPairs(testCase, seedPairs, lX, lX, 1);
+        int64_t diagonalPairs = 0;
+        for (int64_t i = 0; i < stList_length(seedPairs); i++) {
+            stIntTuple *pair = stList_get(seedPairs, i);
+            diagonalPairs += stIntTuple_get(pair, 0) == stIntTuple_get(pair, 1);
+        }
+        CuAssertTrue(testCase, diagonalPairs >= 0.99 * stList_length(seedPairs));
+        if (lX >= 1000) {
+            CuAssertTrue(testCase, diagonalPairs >= lX / 2);
+        }
+        stList_destruct(seedPairs);
+
+        //Masked bases are not seeded from
+        char *sXMasked = stString_copy(sX);
+        for (int64_t i = 0; i < lX; i++) {
+            sXMasked[i] = tolower(sX[i]);
+        }
+        seedPairs = getSeedPairs(sXMasked, sZ, trim, 1);
+        CuAssertIntEquals(testCase, 0, stList_length(seedPairs));
+        stList_destruct(seedPairs);
+        seedPairs = getSeedPairs(sXMasked, sZ, trim, 0);
+        if (lX >= 1000) {
+            CuAssertTrue(testCase, stList_length(seedPairs) >= lX / 2);
+        }
+        stList_destruct(seedPairs);
+
+        free(sX);
+        free(sY);
+        free(sZ);
+        free(sXMasked);
+    }
+}
+
+static double getSeconds() {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec / 1000000.0;
+}
+
+static void test_getSeedPairsWithRecursion(CuTest *testCase) {
+    /*
+     * As test_getBlastPairsWithRecursion, and compares the anchors with those from lastz: the fraction of the
+     * lastz anchors also found, and the time each takes.
+     */
+    for (int64_t test = 0; test < 10; test++) {
+        char *seqX = getRandomSequence(st_randomInt(0, 10000));
+        char *seqY = evolveSequence(seqX);
+        int64_t lX = strlen(seqX), lY = strlen(seqY);
+
+        PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+
+        double start = getSeconds();
+        stList *seedPairs = getSeedPairsForPairwiseAlignmentParameters(seqX, seqY, p);
+        double seedSeconds = getSeconds() - start;
+        checkBlastPairs(testCase, seedPairs, lX, lY, 1);
+
+        start = getSeconds();
+        stList *blastPairs = getBlastPairsForPairwiseAlignmentParameters(seqX, seqY, p);
+        double blastSeconds = getSeconds() - start;
+        stSortedSet *seedPairSet = stList_getSortedSet(seedPairs,
+                                                       (int (*)(const void *, const void *)) stIntTuple_cmpFn);
+        int64_t sharedPairs = 0;
+        for (int64_t i = 0; i < stList_length(blastPairs); i++) {
+            sharedPairs += stSortedSet_search(seedPairSet, stList_get(blastPairs, i)) != NULL;
+        }
+        st_logInfo("Lengths %" PRIi64 " %" PRIi64 ": %" PRIi64 " seed anchors in %f s, %" PRIi64
+                   " lastz anchors in %f s, %" PRIi64 " of them shared\n", lX, lY, stList_length(seedPairs),
+                   seedSeconds, stList_length(blastPairs), blastSeconds, sharedPairs);
+
+        stSortedSet_destruct(seedPairSet);
+        stList_destruct(seedPairs);
+        stList_destruct(blastPairs);
+        pairwiseAlignmentBandingParameters_destruct(p);
+        free(seqX);
+        free(seqY);
+    }
+}
+
 static void test_getSplitPoints(CuTest *testCase) {
     int64_t matrixSize = 2000 * 2000;
 
@@ -963,5 +2290,22 @@ CuSuite* pairwiseAlignmentTestSuite(void) {
     SUITE_ADD_TEST(suite, test_hmmDiscrete_5StateAsymmetric_symbols);
     SUITE_ADD_TEST(suite, test_hmmDiscrete_EM_5State_symbols);
     */
+    SUITE_ADD_TEST(suite, test_vectorMath);
+    SUITE_ADD_TEST(suite, test_diagonalKernels);
+    SUITE_ADD_TEST(suite, test_vectorDiagonalKernels);
+    SUITE_ADD_TEST(suite, test_dpCellPrecision);
+    SUITE_ADD_TEST(suite, test_scaledProbabilities);
+    SUITE_ADD_TEST(suite, test_dpMatrixPool);
+    SUITE_ADD_TEST(suite, test_checkpointedAlignmentWithoutBanding);
+    SUITE_ADD_TEST(suite, test_getAlignedPairsUsingAnchorsInParallel);
+    SUITE_ADD_TEST(suite, test_emissionCache);
+    SUITE_ADD_TEST(suite, test_emissionCacheWindows);
+    SUITE_ADD_TEST(suite, test_getAlignedPairsForBatch);
+    SUITE_ADD_TEST(suite, test_alignedPairBuffer);
+    SUITE_ADD_TEST(suite, test_getSeedPairs);
+    SUITE_ADD_TEST(suite, test_getSeedPairsWithRecursion);
+    SUITE_ADD_TEST(suite, test_lazyBand);
+    SUITE_ADD_TEST(suite, test_adaptiveBanding);
+    SUITE_ADD_TEST(suite, test_streamingAlignment);
     return suite;
 }
@@ -4,6 +4,7 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <ctype.h>
 #include <nanopore.h>
 #include "stateMachine.h"
 #include "CuTest.h"
@@ -14,6 +15,9 @@
 #include "emissionMatrix.h"
 #include "multipleAligner.h"
 #include "randomSequences.h"
+#include "testHelpers.h"
+#include "vectorMath.h"
+#include "posteriorWriter.h"
 
 
 // brute force probability formulae
@@ -173,12 +177,104 @@ static void test_twoDistributionPdf(CuTest *testCase) {
     stateMachine_destruct(sM);
 }
 
+// equal, counting the NaNs the model gives kmers with Ns as equal to each other
+static bool sameProb(double a, double b) {
+    return a == b || (isnan(a) && isnan(b));
+}
+
+// the TwoDists and strawMan log densities, worked out from the model values of the kmer at kmerIndex
+static double test_twoDistsModelProb(const double *model, int64_t kmerIndex, const double *event) {
+    const double *k = model + 1 + kmerIndex * MODEL_PARAMS;
+    double a = (event[0] - k[0]) / k[1];
+    double b = (event[1] - k[2]) / k[2];
+    return -0.5 * log(2 * M_PI) - log(k[1]) - 0.5 * a * a
+           + 0.5 * (log(k[4]) - log(2 * M_PI) - 3 * log(event[1])) - k[4] * b * b / (2 * event[1]);
+}
+
+static double test_strawManModelProb(const double *model, int64_t kmerIndex, const double *event) {
+    const double *k = model + 1 + kmerIndex * MODEL_PARAMS;
+    double a = (event[0] - k[0]) / k[1];
+    double b = (event[1] - k[2]) / k[3];
+    return -log(2 * M_PI) - log(k[1]) - log(k[3]) - 0.5 * (a * a + b * b);
+}
+
+static void test_signalKmerParams(CuTest *testCase) {
+    // the emissions using the derived kmer params agree exactly with each other and with the model to within
+    // rounding, scaled or not
+    char *modelFile = stString_print("../../cPecan/models/template_median68pA.model");
+    StateMachine *sM = getSignalStateMachine3Vanilla(modelFile);
+    for (int64_t scaled = 0; scaled < 2; scaled++) {
+        if (scaled) {
+            emissions_signal_scaleModel(sM, 1.02, 0.5, 1.1, 0.98, 1.2);
+        }
+        for (int64_t test = 0; test < 20; test++) {
+            char *seq = getRandomSequence(st_randomInt(KMER_LENGTH + 6, 100));
+            int64_t nb = strlen(seq);
+            if (st_random() > 0.5) {
+                seq[st_randomInt(0, nb)] = 'N';
+            }
+            int64_t kmerNumber = sequence_correctSeqLength(nb, kmer);
+            int32_t *kmerIndices = st_malloc(kmerNumber * sizeof(int32_t));
+            double *matchProbs = st_malloc(kmerNumber * sizeof(double));
+            emissions_discrete_getKmerIndices(seq, kmerIndices, kmerNumber);
+            double event[] = {st_random() * 30 + 50, st_random() * 1.5 + 0.5, st_random() * 0.02};
+
+            emissions_signal_getEventMatchProbsWithTwoDists(sM->EMISSION_MATCH_PROBS, kmerIndices, kmerNumber, event,
+                                                            matchProbs);
+            for (int64_t i = 0; i < kmerNumber - 1; i++) {
+                double control = emissions_signal_getEventMatchProbWithTwoDists(sM->EMISSION_MATCH_PROBS, seq + i,
+                                                                                event);
+                CuAssertTrue(testCase, sameProb(control, matchProbs[i + 1]));
+                if (kmerIndices[i + 1] >= 0 && kmerIndices[i + 1] < NUM_OF_KMERS) {
+                    double modelProb = test_twoDistsModelProb(sM->EMISSION_MATCH_PROBS, kmerIndices[i + 1], event);
+                    CuAssertDblEquals(testCase, modelProb, control, 1e-9 * (1.0 + fabs(modelProb)));
+                }
+                if (kmerIndices[i] >= 0 && kmerIndices[i] < NUM_OF_KMERS) {
+                    double modelProb = test_strawManModelProb(sM->EMISSION_MATCH_PROBS, kmerIndices[i], event);
+                    CuAssertDblEquals(testCase, modelProb, emissions_signal_strawManGetKmerEventMatchProb(
+                            sM->EMISSION_MATCH_PROBS, seq + i, event), 1e-9 * (1.0 + fabs(modelProb)));
+                }
+                CuAssertTrue(testCase, sameProb(control, emissions_signal_getEventMatchProbWithTwoDistsFromIndex(
+                        sM->EMISSION_MATCH_PROBS, kmerIndices + i, event)));
+                CuAssertTrue(testCase, sameProb(
+                        emissions_signal_getEventMatchProbWithTwoDists(sM->EMISSION_GAP_Y_PROBS, seq + i, event),
+                        emissions_signal_getEventMatchProbWithTwoDistsFromIndex(sM->EMISSION_GAP_Y_PROBS,
+                                                                                kmerIndices + i, event)));
+                CuAssertTrue(testCase, sameProb(
+                        emissions_signal_strawManGetKmerEventMatchProb(sM->EMISSION_MATCH_PROBS, seq + i, event),
+                        emissions_signal_strawManGetKmerEventMatchProbFromIndex(sM->EMISSION_MATCH_PROBS,
+                                                                                kmerIndices + i, event)));
+            }
+            // the echelon emission over a run of kmers (not with Ns, whose NaNs logAdd won't take)
+            for (int64_t n = 1; n < 6 && KMER_LENGTH * n < nb && strchr(seq, 'N') == NULL; n++) {
+                double control = 0.0;
+                if (isupper(seq[KMER_LENGTH * n])) {
+                    for (int64_t i = 0; i < n; i++) {
+                        control = logAdd(control, emissions_signal_getEventMatchProbWithTwoDists(
+                                sM->EMISSION_MATCH_PROBS, seq + i, event));
+                    }
+                    control -= log(n);
+                } else {
+                    control = LOG_ZERO;
+                }
+                CuAssertTrue(testCase,
+                             sameProb(control, emissions_signal_multipleKmerMatchProb(sM->EMISSION_MATCH_PROBS, seq,
+                                                                                      event, n)));
+            }
+            free(matchProbs);
+            free(kmerIndices);
+            free(seq);
+        }
+    }
+    stateMachine_destruct(sM);
+}
+
 static void test_strawMan_cell(CuTest *testCase) {
     // load model and make stateMachine
     char *modelFile = stString_print("../../cPecan/models/template_median68pA.model");
     StateMachine *sM = getStrawManStateMachine3(modelFile);
-    double lowerF[sM->stateNumber], middleF[sM->stateNumber], upperF[sM->stateNumber], currentF[sM->stateNumber];
-    double lowerB[sM->stateNumber], middleB[sM->stateNumber], upperB[sM->stateNumber], currentB[sM->stateNumber];
+    DpCell lowerF[sM->stateNumber], middleF[sM->stateNumber], upperF[sM->stateNumber], currentF[sM->stateNumber];
+    DpCell lowerB[sM->stateNumber], middleB[sM->stateNumber], upperB[sM->stateNumber], currentB[sM->stateNumber];
     for (int64_t i = 0; i < sM->stateNumber; i++) {
         middleF[i] = sM->startStateProb(sM, i);
         middleB[i] = LOG_ZERO;
@@ -242,8 +338,8 @@ static void test_stateMachine4_cell(CuTest *testCase) {
     // load model and make stateMachine
     char *modelFile = stString_print("../../cPecan/models/template_median68pA.model");
     StateMachine *sM = getStateMachine4(modelFile);
-    double lowerF[sM->stateNumber], middleF[sM->stateNumber], upperF[sM->stateNumber], currentF[sM->stateNumber];
-    double lowerB[sM->stateNumber], middleB[sM->stateNumber], upperB[sM->stateNumber], currentB[sM->stateNumber];
+    DpCell lowerF[sM->stateNumber], middleF[sM->stateNumber], upperF[sM->stateNumber], currentF[sM->stateNumber];
+    DpCell lowerB[sM->stateNumber], middleB[sM->stateNumber], upperB[sM->stateNumber], currentB[sM->stateNumber];
     for (int64_t i = 0; i < sM->stateNumber; i++) {
         middleF[i] = sM->startStateProb(sM, i);
         middleB[i] = LOG_ZERO;
@@ -301,8 +397,8 @@ static void test_vanilla_cell(CuTest *testCase) {
     // load model and make stateMachine
     char *modelFile = stString_print("../../cPecan/models/template_median68pA.model");
     StateMachine *sM = getSignalStateMachine3Vanilla(modelFile);
-    double lowerF[sM->stateNumber], middleF[sM->stateNumber], upperF[sM->stateNumber], currentF[sM->stateNumber];
-    double lowerB[sM->stateNumber], middleB[sM->stateNumber], upperB[sM->stateNumber], currentB[sM->stateNumber];
+    DpCell lowerF[sM->stateNumber], middleF[sM->stateNumber], upperF[sM->stateNumber], currentF[sM->stateNumber];
+    DpCell lowerB[sM->stateNumber], middleB[sM->stateNumber], upperB[sM->stateNumber], currentB[sM->stateNumber];
     for (int64_t i = 0; i < sM->stateNumber; i++) {
         middleF[i] = sM->startStateProb(sM, i);
         middleB[i] = LOG_ZERO;
@@ -366,8 +462,8 @@ static void test_echelon_cell(CuTest *testCase) {
     // load model and stateMachine
     char *modelFile = stString_print("../../cPecan/models/template_median68pA.model");
     StateMachine *sM = getStateMachineEchelon(modelFile);
-    double lowerF[sM->stateNumber], middleF[sM->stateNumber], upperF[sM->stateNumber], currentF[sM->stateNumber];
-    double lowerB[sM->stateNumber], middleB[sM->stateNumber], upperB[sM->stateNumber], currentB[sM->stateNumber];
+    DpCell lowerF[sM->stateNumber], middleF[sM->stateNumber], upperF[sM->stateNumber], currentF[sM->stateNumber];
+    DpCell lowerB[sM->stateNumber], middleB[sM->stateNumber], upperB[sM->stateNumber], currentB[sM->stateNumber];
     for (int64_t i = 0; i < sM->stateNumber; i++) {
         middleF[i] = sM->startStateProb(sM, i);
         middleB[i] = LOG_ZERO;
@@ -434,10 +530,10 @@ static void test_strawMan_dpDiagonal(CuTest *testCase) {
     DpDiagonal *dpDiagonal = dpDiagonal_construct(diagonal, sM->stateNumber);
 
     //Get cell
-    double *c1 = dpDiagonal_getCell(dpDiagonal, -1);
+    DpCell *c1 = dpDiagonal_getCell(dpDiagonal, -1);
     CuAssertTrue(testCase, c1 != NULL);
 
-    double *c2 = dpDiagonal_getCell(dpDiagonal, 1);
+    DpCell *c2 = dpDiagonal_getCell(dpDiagonal, 1);
     CuAssertTrue(testCase, c2 != NULL);
 
     CuAssertTrue(testCase, dpDiagonal_getCell(dpDiagonal, 3) == NULL);
@@ -446,8 +542,8 @@ static void test_strawMan_dpDiagonal(CuTest *testCase) {
     dpDiagonal_initialiseValues(dpDiagonal, sM, sM->endStateProb); //Test initialise values
     double totalProb = LOG_ZERO;
     for (int64_t i = 0; i < sM->stateNumber; i++) {
-        CuAssertDblEquals(testCase, c1[i], sM->endStateProb(sM, i), 0.0);
-        CuAssertDblEquals(testCase, c2[i], sM->endStateProb(sM, i), 0.0);
+        CuAssertDblEquals(testCase, c1[i], (DpCell) sM->endStateProb(sM, i), 0.0);
+        CuAssertDblEquals(testCase, c2[i], (DpCell) sM->endStateProb(sM, i), 0.0);
         totalProb = logAdd(totalProb, 2 * c1[i]);
         totalProb = logAdd(totalProb, 2 * c2[i]);
     }
@@ -472,10 +568,10 @@ static void test_stateMachine4_dpDiagonal(CuTest *testCase) {
     DpDiagonal *dpDiagonal = dpDiagonal_construct(diagonal, sM->stateNumber);
 
     //Get cell
-    double *c1 = dpDiagonal_getCell(dpDiagonal, -1);
+    DpCell *c1 = dpDiagonal_getCell(dpDiagonal, -1);
     CuAssertTrue(testCase, c1 != NULL);
 
-    double *c2 = dpDiagonal_getCell(dpDiagonal, 1);
+    DpCell *c2 = dpDiagonal_getCell(dpDiagonal, 1);
     CuAssertTrue(testCase, c2 != NULL);
 
     CuAssertTrue(testCase, dpDiagonal_getCell(dpDiagonal, 3) == NULL);
@@ -484,8 +580,8 @@ static void test_stateMachine4_dpDiagonal(CuTest *testCase) {
     dpDiagonal_initialiseValues(dpDiagonal, sM, sM->endStateProb); //Test initialise values
     double totalProb = LOG_ZERO;
     for (int64_t i = 0; i < sM->stateNumber; i++) {
-        CuAssertDblEquals(testCase, c1[i], sM->endStateProb(sM, i), 0.0);
-        CuAssertDblEquals(testCase, c2[i], sM->endStateProb(sM, i), 0.0);
+        CuAssertDblEquals(testCase, c1[i], (DpCell) sM->endStateProb(sM, i), 0.0);
+        CuAssertDblEquals(testCase, c2[i], (DpCell) sM->endStateProb(sM, i), 0.0);
         totalProb = logAdd(totalProb, 2 * c1[i]);
         totalProb = logAdd(totalProb, 2 * c2[i]);
     }
@@ -510,10 +606,10 @@ static void test_echelon_dpDiagonal(CuTest *testCase) {
     DpDiagonal *dpDiagonal = dpDiagonal_construct(diagonal, sM->stateNumber);
 
     //Get cell
-    double *c1 = dpDiagonal_getCell(dpDiagonal, -1);
+    DpCell *c1 = dpDiagonal_getCell(dpDiagonal, -1);
     CuAssertTrue(testCase, c1 != NULL);
 
-    double *c2 = dpDiagonal_getCell(dpDiagonal, 1);
+    DpCell *c2 = dpDiagonal_getCell(dpDiagonal, 1);
     CuAssertTrue(testCase, c2 != NULL);
 
     CuAssertTrue(testCase, dpDiagonal_getCell(dpDiagonal, 3) == NULL);
@@ -522,8 +618,8 @@ static void test_echelon_dpDiagonal(CuTest *testCase) {
     dpDiagonal_initialiseValues(dpDiagonal, sM, sM->endStateProb); //Test initialise values
     double totalProb = LOG_ZERO;
     for (int64_t i = 0; i < sM->stateNumber; i++) {
-        CuAssertDblEquals(testCase, c1[i], sM->endStateProb(sM, i), 0.0);
-        CuAssertDblEquals(testCase, c2[i], sM->endStateProb(sM, i), 0.0);
+        CuAssertDblEquals(testCase, c1[i], (DpCell) sM->endStateProb(sM, i), 0.0);
+        CuAssertDblEquals(testCase, c2[i], (DpCell) sM->endStateProb(sM, i), 0.0);
         totalProb = logAdd(totalProb, 2 * c1[i]);
         totalProb = logAdd(totalProb, 2 * c2[i]);
     }
@@ -548,10 +644,10 @@ static void test_vanilla_dpDiagonal(CuTest *testCase) {
     DpDiagonal *dpDiagonal = dpDiagonal_construct(diagonal, sM->stateNumber);
 
     //Get cell
-    double *c1 = dpDiagonal_getCell(dpDiagonal, -1);
+    DpCell *c1 = dpDiagonal_getCell(dpDiagonal, -1);
     CuAssertTrue(testCase, c1 != NULL);
 
-    double *c2 = dpDiagonal_getCell(dpDiagonal, 1);
+    DpCell *c2 = dpDiagonal_getCell(dpDiagonal, 1);
     CuAssertTrue(testCase, c2 != NULL);
 
     CuAssertTrue(testCase, dpDiagonal_getCell(dpDiagonal, 3) == NULL);
@@ -560,8 +656,8 @@ static void test_vanilla_dpDiagonal(CuTest *testCase) {
     dpDiagonal_initialiseValues(dpDiagonal, sM, sM->endStateProb); //Test initialise values
     double totalProb = LOG_ZERO;
     for (int64_t i = 0; i < sM->stateNumber; i++) {
-        CuAssertDblEquals(testCase, c1[i], sM->endStateProb(sM, i), 0.0);
-        CuAssertDblEquals(testCase, c2[i], sM->endStateProb(sM, i), 0.0);
+        CuAssertDblEquals(testCase, c1[i], (DpCell) sM->endStateProb(sM, i), 0.0);
+        CuAssertDblEquals(testCase, c2[i], (DpCell) sM->endStateProb(sM, i), 0.0);
         totalProb = logAdd(totalProb, 2 * c1[i]);
         totalProb = logAdd(totalProb, 2 * c2[i]);
     }
@@ -628,10 +724,12 @@ static void test_strawMan_diagonalDPCalculations(CuTest *testCase) {
     }
 
     //Calculate total probabilities
-    double totalProbForward = cell_dotProduct2(
-            dpDiagonal_getCell(dpMatrix_getDiagonal(dpMatrixForward, lX + lY), lX - lY), sM, sM->endStateProb);
-    double totalProbBackward = cell_dotProduct2(
-            dpDiagonal_getCell(dpMatrix_getDiagonal(dpMatrixBackward, 0), 0), sM, sM->startStateProb);
+    DpDiagonal *endDiagonal = dpMatrix_getDiagonal(dpMatrixForward, lX + lY);
+    DpDiagonal *startDiagonal = dpMatrix_getDiagonal(dpMatrixBackward, 0);
+    double totalProbForward = cell_dotProduct2(dpDiagonal_getCell(endDiagonal, lX - lY), sM, sM->endStateProb)
+                              + dpDiagonal_getLogScale(endDiagonal);
+    double totalProbBackward = cell_dotProduct2(dpDiagonal_getCell(startDiagonal, 0), sM, sM->startStateProb)
+                               + dpDiagonal_getLogScale(startDiagonal);
     st_logInfo("Total forward and backward prob %f %f\n", (float) totalProbForward, (float) totalProbBackward);
 
     // Test the posterior probabilities along the diagonals of the matrix.
@@ -735,10 +833,12 @@ static void test_stateMachine4_diagonalDPCalculations(CuTest *testCase) {
     }
 
     //Calculate total probabilities
-    double totalProbForward = cell_dotProduct2(
-            dpDiagonal_getCell(dpMatrix_getDiagonal(dpMatrixForward, lX + lY), lX - lY), sM, sM->endStateProb);
-    double totalProbBackward = cell_dotProduct2(
-            dpDiagonal_getCell(dpMatrix_getDiagonal(dpMatrixBackward, 0), 0), sM, sM->startStateProb);
+    DpDiagonal *endDiagonal = dpMatrix_getDiagonal(dpMatrixForward, lX + lY);
+    DpDiagonal *startDiagonal = dpMatrix_getDiagonal(dpMatrixBackward, 0);
+    double totalProbForward = cell_dotProduct2(dpDiagonal_getCell(endDiagonal, lX - lY), sM, sM->endStateProb)
+                              + dpDiagonal_getLogScale(endDiagonal);
+    double totalProbBackward = cell_dotProduct2(dpDiagonal_getCell(startDiagonal, 0), sM, sM->startStateProb)
+                               + dpDiagonal_getLogScale(startDiagonal);
     st_logInfo("Total forward and backward prob %f %f\n", (float) totalProbForward, (float) totalProbBackward);
 
     // Test the posterior probabilities along the diagonals of the matrix.
@@ -841,10 +941,12 @@ static void test_vanilla_diagonalDPCalculations(CuTest *testCase) {
     }
 
     //Calculate total probabilities
-    double totalProbForward = cell_dotProduct2(
-            dpDiagonal_getCell(dpMatrix_getDiagonal(dpMatrixForward, lX + lY), lX - lY), sM, sM->endStateProb);
-    double totalProbBackward = cell_dotProduct2(
-            dpDiagonal_getCell(dpMatrix_getDiagonal(dpMatrixBackward, 0), 0), sM, sM->startStateProb);
+    DpDiagonal *endDiagonal = dpMatrix_getDiagonal(dpMatrixForward, lX + lY);
+    DpDiagonal *startDiagonal = dpMatrix_getDiagonal(dpMatrixBackward, 0);
+    double totalProbForward = cell_dotProduct2(dpDiagonal_getCell(endDiagonal, lX - lY), sM, sM->endStateProb)
+                              + dpDiagonal_getLogScale(endDiagonal);
+    double totalProbBackward = cell_dotProduct2(dpDiagonal_getCell(startDiagonal, 0), sM, sM->startStateProb)
+                               + dpDiagonal_getLogScale(startDiagonal);
     st_logInfo("Total forward and backward prob %f %f\n", (float) totalProbForward, (float) totalProbBackward);
 
     // Test the posterior probabilities along the diagonals of the matrix.
@@ -944,10 +1046,12 @@ static void test_echelon_diagonalDPCalculations(CuTest *testCase) {
     }
 
     //Calculate total probabilities
-    double totalProbForward = cell_dotProduct2(
-            dpDiagonal_getCell(dpMatrix_getDiagonal(dpMatrixForward, lX + lY), lX - lY), sM, sM->endStateProb);
-    double totalProbBackward = cell_dotProduct2(
-            dpDiagonal_getCell(dpMatrix_getDiagonal(dpMatrixBackward, 0), 0), sM, sM->startStateProb);
+    DpDiagonal *endDiagonal = dpMatrix_getDiagonal(dpMatrixForward, lX + lY);
+    DpDiagonal *startDiagonal = dpMatrix_getDiagonal(dpMatrixBackward, 0);
+    double totalProbForward = cell_dotProduct2(dpDiagonal_getCell(endDiagonal, lX - lY), sM, sM->endStateProb)
+                              + dpDiagonal_getLogScale(endDiagonal);
+    double totalProbBackward = cell_dotProduct2(dpDiagonal_getCell(startDiagonal, 0), sM, sM->startStateProb)
+                               + dpDiagonal_getLogScale(startDiagonal);
     st_logInfo("Total forward and backward prob %f %f\n", (float) totalProbForward, (float) totalProbBackward);
 
     // Test the posterior probabilities along the diagonals of the matrix.
@@ -1000,6 +1104,56 @@ static void test_echelon_diagonalDPCalculations(CuTest *testCase) {
     sequence_sequenceDestroy(SsY);
 }
 
+static void test_diagonalKernels(CuTest *testCase) {
+    // make some DNA sequences and fake nanopore read data
+    char *sX = "CCAAATATATTACAACACACGATACGGACATCCAAATATATTACAACACCCAAATATAGCGTAACAC";
+    double sY[21] = {
+            58.743435, 0.887833, 0.0571, //ACGATA 0
+            53.604965, 0.816836, 0.0571, //CGATAC 1
+            58.432015, 0.735143, 0.0571, //GATACG 2
+            63.684352, 0.795437, 0.0571, //ATACGG 3
+            58.921430, 0.812959, 0.0571, //ACGGAC 4
+            59.895882, 0.740952, 0.0571, //CGGACA 5
+            61.684303, 0.722332, 0.0571, //GGACAT 6
+    };
+    int64_t lX = sequence_correctSeqLength(strlen(sX), event);
+    int64_t lY = 7;
+    char *modelFile = stString_print("../../cPecan/models/template_median68pA.model");
+
+    // straw man and four-state machines use single kmers, check them with each instruction set
+    Sequence *SsX = sequence_construct(lX, sX, sequence_getKmer);
+    Sequence *SsY = sequence_construct(lY, sY, sequence_getEvent);
+    SimdLevel supportedLevel = vectorMath_getSupportedSimdLevel();
+    StateMachine *sM;
+    for (int64_t level = simdLevel_none; level <= supportedLevel; level++) {
+        vectorMath_setSimdLevel((SimdLevel) level);
+        sM = getStrawManStateMachine3(modelFile);
+        checkDiagonalKernel(testCase, sM, SsX, SsY);
+        stateMachine_destruct(sM);
+        sM = getStateMachine4(modelFile);
+        checkDiagonalKernel(testCase, sM, SsX, SsY);
+        stateMachine_destruct(sM);
+    }
+    vectorMath_setSimdLevel(supportedLevel);
+    sequence_sequenceDestroy(SsX);
+
+    // vanilla uses pairs of kmers
+    SsX = sequence_construct(lX, sX, sequence_getKmer2);
+    sM = getSignalStateMachine3Vanilla(modelFile);
+    checkDiagonalKernel(testCase, sM, SsX, SsY);
+    stateMachine_destruct(sM);
+
+    // echelon uses pairs of kmers and a padded reference
+    sequence_padSequence(SsX);
+    sM = getStateMachineEchelon(modelFile);
+    checkDiagonalKernel(testCase, sM, SsX, SsY);
+    stateMachine_destruct(sM);
+
+    sequence_sequenceDestroy(SsX);
+    sequence_sequenceDestroy(SsY);
+    free(modelFile);
+}
+
 static void test_scaleModel(CuTest *testCase) {
     char *modelFile = stString_print("../../cPecan/models/template_median68pA.model");
     StateMachine *sM = getSignalStateMachine3Vanilla(modelFile);
@@ -1242,6 +1396,271 @@ static void test_stateMachine4_getAlignedPairsWithBanding(CuTest *testCase) {
     stateMachine_destruct(sMt);
 }
 
+//Orders aligned pairs by their x then y coordinates
+static int alignedPairs_cmpCoordinates(const void *a, const void *b) {
+    for (int64_t i = 1; i < 3; i++) {
+        int64_t j = stIntTuple_get((stIntTuple *) a, i), k = stIntTuple_get((stIntTuple *) b, i);
+        if (j != k) {
+            return j < k ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static void test_scaledProbabilities(CuTest *testCase) {
+    // load the reference sequence and the nanopore read
+    char *ZymoReference = stString_print("../../cPecan/tests/test_npReads/ZymoRef.txt");
+    FILE *fH = fopen(ZymoReference, "r");
+    char *ZymoReferenceSeq = stFile_getLineFromFile(fH);
+    char *npReadFile = stString_print("../../cPecan/tests/test_npReads/ZymoC_ch_1_file1.npRead");
+    NanoporeRead *npRead = nanopore_loadNanoporeReadFromFile(npReadFile);
+
+    // get sequence lengths
+    int64_t lX = sequence_correctSeqLength(strlen(ZymoReferenceSeq), event);
+    int64_t lY = npRead->nbTemplateEvents;
+
+    // parameters for pairwise alignment using defaults
+    PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+
+    // get anchors using lastz, remap and filter
+    stList *anchorPairs = getBlastPairsForPairwiseAlignmentParameters(ZymoReferenceSeq, npRead->twoDread, p);
+    stList *remappedAnchors = nanopore_remapAnchorPairs(anchorPairs, npRead->templateEventMap);
+    stList *filteredRemappedAnchors = filterToRemoveOverlap(remappedAnchors);
+
+    Sequence *templateSeq = sequence_construct2(lY, npRead->templateEvents, sequence_getEvent,
+                                                sequence_sliceEventSequence2);
+
+    // the machines without vector kernels don't support scaling, so asking for it should leave the alignment as
+    // it is, while for the vanilla and echelon machines the posteriors should agree with the log ones, up to the
+    // approximation made by logAdd, pairs only being reported by one of them if they are close to the threshold
+    char *templateModelFile = stString_print("../../cPecan/models/template_median68pA.model");
+    for (int64_t i = 0; i < 4; i++) {
+        StateMachine *sMt = i == 0 ? getStrawManStateMachine3(templateModelFile) :
+                            i == 1 ? getStateMachine4(templateModelFile) :
+                            i == 2 ? getSignalStateMachine3Vanilla(templateModelFile) :
+                            getStateMachineEchelon(templateModelFile);
+#ifdef DP_FLOAT_CELLS
+        CuAssertTrue(testCase, !diagonalCalculation_supportsScaling(sMt)); //float cells support it for none
+#else
+        CuAssertTrue(testCase, diagonalCalculation_supportsScaling(sMt) == (i >= 2));
+#endif
+        emissions_signal_scaleModel(sMt, npRead->templateParams.scale, npRead->templateParams.shift,
+                                    npRead->templateParams.var, npRead->templateParams.scale_sd,
+                                    npRead->templateParams.var_sd);
+        Sequence *refSeq = sequence_construct2(lX, ZymoReferenceSeq, i < 2 ? sequence_getKmer : sequence_getKmer2,
+                                               sequence_sliceNucleotideSequence2);
+        if (i == 3) {
+            sequence_padSequence(refSeq);
+        }
+
+        stList *alignedPairs[2];
+        for (int64_t scaled = 0; scaled < 2; scaled++) {
+            p->scaledProbabilities = scaled;
+            alignedPairs[scaled] = getAlignedPairsUsingAnchors(sMt, refSeq, templateSeq, filteredRemappedAnchors, p,
+                                                               diagonalCalculationPosteriorMatchProbs,
+                                                               0, 0);
+            checkAlignedPairs(testCase, alignedPairs[scaled], lX, lY);
+            stList_sort(alignedPairs[scaled], alignedPairs_cmpCoordinates);
+        }
+        CuAssertTrue(testCase, stList_length(alignedPairs[0]) > 0);
+        int64_t tolerance = i < 2 ? 0 : 0.005 * PAIR_ALIGNMENT_PROB_1;
+        int64_t threshold = p->threshold * PAIR_ALIGNMENT_PROB_1;
+        int64_t j = 0, k = 0;
+        while (j < stList_length(alignedPairs[0]) || k < stList_length(alignedPairs[1])) {
+            stIntTuple *pair = j < stList_length(alignedPairs[0]) ? stList_get(alignedPairs[0], j) : NULL;
+            stIntTuple *pair2 = k < stList_length(alignedPairs[1]) ? stList_get(alignedPairs[1], k) : NULL;
+            int64_t c = pair == NULL ? 1 : pair2 == NULL ? -1 : alignedPairs_cmpCoordinates(pair, pair2);
+            if (c == 0) {
+                CuAssertTrue(testCase, llabs(stIntTuple_get(pair, 0) - stIntTuple_get(pair2, 0)) <= tolerance);
+                j++;
+                k++;
+            } else if (c < 0) {
+                CuAssertTrue(testCase, tolerance > 0 && stIntTuple_get(pair, 0) <= threshold + tolerance);
+                j++;
+            } else {
+                CuAssertTrue(testCase, tolerance > 0 && stIntTuple_get(pair2, 0) <= threshold + tolerance);
+                k++;
+            }
+        }
+        stList_destruct(alignedPairs[0]);
+        stList_destruct(alignedPairs[1]);
+        sequence_sequenceDestroy(refSeq);
+        stateMachine_destruct(sMt);
+    }
+
+    // clean
+    pairwiseAlignmentBandingParameters_destruct(p);
+    nanopore_nanoporeReadDestruct(npRead);
+    sequence_sequenceDestroy(templateSeq);
+}
+
+static void test_echelon_diagonalThreads(CuTest *testCase) {
+    // load the reference sequence and the nanopore read
+    char *ZymoReference = stString_print("../../cPecan/tests/test_npReads/ZymoRef.txt");
+    FILE *fH = fopen(ZymoReference, "r");
+    char *ZymoReferenceSeq = stFile_getLineFromFile(fH);
+    char *npReadFile = stString_print("../../cPecan/tests/test_npReads/ZymoC_ch_1_file1.npRead");
+    NanoporeRead *npRead = nanopore_loadNanoporeReadFromFile(npReadFile);
+
+    // get sequence lengths
+    int64_t lX = sequence_correctSeqLength(strlen(ZymoReferenceSeq), event);
+    int64_t lY = npRead->nbTemplateEvents;
+
+    // load stateMachine and model file
+    char *templateModelFile = stString_print("../../cPecan/models/template_median68pA.model");
+    StateMachine *sMt = getStateMachineEchelon(templateModelFile);
+    emissions_signal_scaleModel(sMt, npRead->templateParams.scale, npRead->templateParams.shift,
+                                npRead->templateParams.var, npRead->templateParams.scale_sd,
+                                npRead->templateParams.var_sd);
+
+    PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+    p->threshold = 0.15;
+
+    // get anchors using lastz, remap and filter
+    stList *anchorPairs = getBlastPairsForPairwiseAlignmentParameters(ZymoReferenceSeq, npRead->twoDread, p);
+    stList *remappedAnchors = nanopore_remapAnchorPairs(anchorPairs, npRead->templateEventMap);
+    stList *filteredRemappedAnchors = filterToRemoveOverlap(remappedAnchors);
+
+    // make Sequences for reference and template events
+    Sequence *refSeq = sequence_construct2(lX, ZymoReferenceSeq, sequence_getKmer2,
+                                           sequence_sliceNucleotideSequence2);
+    sequence_padSequence(refSeq);
+    Sequence *templateSeq = sequence_construct2(lY, npRead->templateEvents, sequence_getEvent,
+                                                sequence_sliceEventSequence2);
+
+    // splitting the diagonals between threads, including narrow ones so some of the threads get no cells,
+    // shouldn't change the alignment at all
+    stList *alignedPairs = getAlignedPairsUsingAnchors(sMt, refSeq, templateSeq, filteredRemappedAnchors, p,
+                                                       diagonalCalculationMultiPosteriorMatchProbs, 0, 0);
+    checkAlignedPairsForEchelon(testCase, alignedPairs, lX, lY);
+    p->diagonalThreadNumber = 4;
+    p->minThreadedDiagonalWidth = 2;
+    stList *alignedPairs2 = getAlignedPairsUsingAnchors(sMt, refSeq, templateSeq, filteredRemappedAnchors, p,
+                                                        diagonalCalculationMultiPosteriorMatchProbs, 0, 0);
+    CuAssertIntEquals(testCase, stList_length(alignedPairs), stList_length(alignedPairs2));
+    for (int64_t i = 0; i < stList_length(alignedPairs); i++) {
+        CuAssertTrue(testCase, stIntTuple_cmpFn(stList_get(alignedPairs, i), stList_get(alignedPairs2, i)) == 0);
+    }
+
+    // with the default minimum width and the vector kernel on, the diagonals of a band wide enough are split
+    // between the threads rather than left to the vector kernel, which again shouldn't change the alignment
+    SimdLevel simdLevel = vectorMath_getSimdLevel();
+    vectorMath_setSimdLevel(vectorMath_getSupportedSimdLevel());
+    PairwiseAlignmentParameters *p2 = pairwiseAlignmentBandingParameters_construct();
+    p2->threshold = 0.15;
+    p2->diagonalExpansion = 4 * p2->minThreadedDiagonalWidth;
+    stList *alignedPairs3 = getAlignedPairsUsingAnchors(sMt, refSeq, templateSeq, filteredRemappedAnchors, p2,
+                                                        diagonalCalculationMultiPosteriorMatchProbs, 0, 0);
+    p2->diagonalThreadNumber = 4;
+    stList *alignedPairs4 = getAlignedPairsUsingAnchors(sMt, refSeq, templateSeq, filteredRemappedAnchors, p2,
+                                                        diagonalCalculationMultiPosteriorMatchProbs, 0, 0);
+    checkAlignedPairsForEchelon(testCase, alignedPairs3, lX, lY);
+    CuAssertIntEquals(testCase, stList_length(alignedPairs3), stList_length(alignedPairs4));
+    for (int64_t i = 0; i < stList_length(alignedPairs3); i++) {
+        CuAssertTrue(testCase, stIntTuple_cmpFn(stList_get(alignedPairs3, i), stList_get(alignedPairs4, i)) == 0);
+    }
+    vectorMath_setSimdLevel(simdLevel);
+
+    // clean
+    pairwiseAlignmentBandingParameters_destruct(p);
+    pairwiseAlignmentBandingParameters_destruct(p2);
+    nanopore_nanoporeReadDestruct(npRead);
+    sequence_sequenceDestroy(refSeq);
+    sequence_sequenceDestroy(templateSeq);
+    stList_destruct(alignedPairs);
+    stList_destruct(alignedPairs2);
+    stList_destruct(alignedPairs3);
+    stList_destruct(alignedPairs4);
+    stateMachine_destruct(sMt);
+}
+
+static void test_signalEmissionCache(CuTest *testCase) {
+    // load the reference sequence and the nanopore read
+    char *ZymoReference = stString_print("../../cPecan/tests/test_npReads/ZymoRef.txt");
+    FILE *fH = fopen(ZymoReference, "r");
+    char *ZymoReferenceSeq = stFile_getLineFromFile(fH);
+    char *npReadFile = stString_print("../../cPecan/tests/test_npReads/ZymoC_ch_1_file1.npRead");
+    NanoporeRead *npRead = nanopore_loadNanoporeReadFromFile(npReadFile);
+
+    // get sequence lengths
+    int64_t lX = sequence_correctSeqLength(strlen(ZymoReferenceSeq), event);
+    int64_t lY = npRead->nbTemplateEvents;
+
+    char *templateModelFile = stString_print("../../cPecan/models/template_median68pA.model");
+    PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+    p->threshold = 0.15;
+
+    // get anchors using lastz, remap and filter
+    stList *anchorPairs = getBlastPairsForPairwiseAlignmentParameters(ZymoReferenceSeq, npRead->twoDread, p);
+    stList *remappedAnchors = nanopore_remapAnchorPairs(anchorPairs, npRead->templateEventMap);
+    stList *filteredRemappedAnchors = filterToRemoveOverlap(remappedAnchors);
+
+    Sequence *templateSeq = sequence_construct2(lY, npRead->templateEvents, sequence_getEvent,
+                                                sequence_sliceEventSequence2);
+
+    // the kernels of both signal machines reuse the emissions of the forward pass in the backward pass and in the
+    // posteriors, which shouldn't change the alignment at all
+    for (int64_t echelon = 0; echelon < 2; echelon++) {
+        StateMachine *sMt = echelon ? getStateMachineEchelon(templateModelFile)
+                                    : getSignalStateMachine3Vanilla(templateModelFile);
+        emissions_signal_scaleModel(sMt, npRead->templateParams.scale, npRead->templateParams.shift,
+                                    npRead->templateParams.var, npRead->templateParams.scale_sd,
+                                    npRead->templateParams.var_sd);
+        Sequence *refSeq = sequence_construct2(lX, ZymoReferenceSeq, sequence_getKmer2,
+                                               sequence_sliceNucleotideSequence2);
+        if (echelon) {
+            sequence_padSequence(refSeq);
+        }
+        void (*posteriorFn)(StateMachine *, int64_t, DpMatrix *, DpMatrix *, Sequence *, Sequence *, double,
+                            PairwiseAlignmentParameters *, void *) =
+                echelon ? diagonalCalculationMultiPosteriorMatchProbs : diagonalCalculationPosteriorMatchProbs;
+
+        int64_t emissionCacheMaxSize = p->emissionCacheMaxSize;
+        p->emissionCacheMaxSize = 0;
+        stList *alignedPairs = getAlignedPairsUsingAnchors(sMt, refSeq, templateSeq, filteredRemappedAnchors, p,
+                                                           posteriorFn, 0, 0);
+        p->emissionCacheMaxSize = emissionCacheMaxSize;
+        stList *alignedPairs2 = getAlignedPairsUsingAnchors(sMt, refSeq, templateSeq, filteredRemappedAnchors, p,
+                                                            posteriorFn, 0, 0);
+        CuAssertTrue(testCase, stList_length(alignedPairs) > 0);
+        CuAssertIntEquals(testCase, stList_length(alignedPairs), stList_length(alignedPairs2));
+        for (int64_t i = 0; i < stList_length(alignedPairs); i++) {
+            CuAssertTrue(testCase, stIntTuple_cmpFn(stList_get(alignedPairs, i), stList_get(alignedPairs2, i)) == 0);
+        }
+        stList_destruct(alignedPairs);
+        stList_destruct(alignedPairs2);
+
+        // nor should it change the expectations
+        if (!echelon) {
+            Hmm *hmms[2];
+            for (int64_t i = 0; i < 2; i++) {
+                p->emissionCacheMaxSize = i ? emissionCacheMaxSize : 0;
+                hmms[i] = vanillaHmm_constructEmpty(0.0, 3, NUM_OF_KMERS, vanilla,
+                                                    vanillaHmm_addToKmerSkipBinExpectation,
+                                                    vanillaHmm_setKmerSkipBinExpectation,
+                                                    vanillaHmm_getKmerSkipBinExpectation);
+                vanillaHmm_implantMatchModelsintoHmm(sMt, hmms[i]);
+                getExpectationsUsingAnchors(sMt, hmms[i], refSeq, templateSeq, filteredRemappedAnchors,
+                                            p, diagonalCalculation_signal_Expectations, 0, 0);
+            }
+            CuAssertTrue(testCase, hmms[0]->likelihood == hmms[1]->likelihood);
+            for (int64_t bin = 0; bin < 60; bin++) {
+                CuAssertTrue(testCase, hmms[0]->getTransitionsExpFcn(hmms[0], bin, 0)
+                                       == hmms[1]->getTransitionsExpFcn(hmms[1], bin, 0));
+            }
+            vanillaHmm_destruct(hmms[0]);
+            vanillaHmm_destruct(hmms[1]);
+        }
+        sequence_sequenceDestroy(refSeq);
+        stateMachine_destruct(sMt);
+    }
+
+    // clean
+    pairwiseAlignmentBandingParameters_destruct(p);
+    nanopore_nanoporeReadDestruct(npRead);
+    sequence_sequenceDestroy(templateSeq);
+}
+
 static void test_vanilla_getAlignedPairsWithBanding(CuTest *testCase) {
     // load the reference sequence and the nanopore read
     char *ZymoReference = stString_print("../../cPecan/tests/test_npReads/ZymoRef.txt");
@@ -1379,6 +1798,425 @@ static void test_vanilla_getAlignedPairsWithoutScaling(CuTest *testCase) {
     stateMachine_destruct(sMt);
 }
 
+static void test_kmerIndexSequence(CuTest *testCase) {
+    // the rolling encoding gives the same index as the kmer string, with or without Ns about
+    for (int64_t test = 0; test < 100; test++) {
+        char *seq = getRandomSequence(st_randomInt(KMER_LENGTH, 200));
+        int64_t nb = strlen(seq);
+        if (st_random() > 0.5) {
+            seq[st_randomInt(0, nb)] = 'N';
+        }
+        int64_t kmerNumber = sequence_correctSeqLength(nb, kmer);
+        int32_t *kmerIndices = st_malloc(kmerNumber * sizeof(int32_t));
+        emissions_discrete_getKmerIndices(seq, kmerIndices, kmerNumber);
+        for (int64_t i = 0; i < kmerNumber; i++) {
+            CuAssertIntEquals(testCase, emissions_discrete_getKmerIndexFromKmer(seq + i), kmerIndices[i]);
+        }
+        free(kmerIndices);
+        free(seq);
+    }
+
+    // aligning to the kmer indices gives the same pairs as aligning to the kmers
+    char *ZymoReference = stString_print("../../cPecan/tests/test_npReads/ZymoRef.txt");
+    FILE *fH = fopen(ZymoReference, "r");
+    char *ZymoReferenceSeq = stFile_getLineFromFile(fH);
+    char *npReadFile = stString_print("../../cPecan/tests/test_npReads/ZymoC_ch_1_file1.npRead");
+    NanoporeRead *npRead = nanopore_loadNanoporeReadFromFile(npReadFile);
+    int64_t lX = sequence_correctSeqLength(strlen(ZymoReferenceSeq), event);
+    int64_t lY = npRead->nbTemplateEvents;
+    char *templateModelFile = stString_print("../../cPecan/models/template_median68pA.model");
+    PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+    stList *anchorPairs = getBlastPairsForPairwiseAlignmentParameters(ZymoReferenceSeq, npRead->twoDread, p);
+    stList *remappedAnchors = nanopore_remapAnchorPairs(anchorPairs, npRead->templateEventMap);
+    stList *filteredRemappedAnchors = filterToRemoveOverlap(remappedAnchors);
+    Sequence *templateSeq = sequence_construct2(lY, npRead->templateEvents, sequence_getEvent,
+                                                sequence_sliceEventSequence2);
+
+    for (int64_t i = 0; i < 3; i++) {
+        StateMachine *(*getStateMachine)(const char *) = i == 0 ? getStrawManStateMachine3 :
+                                                         i == 1 ? getStateMachine4 : getSignalStateMachine3Vanilla;
+        void *(*getKmerFcn)(void *, int64_t) = i < 2 ? sequence_getKmer : sequence_getKmer2;
+        void *(*getKmerIndexFcn)(void *, int64_t) = i < 2 ? sequence_getKmerIndex : sequence_getKmerIndex2;
+        StateMachine *sM = getStateMachine(templateModelFile);
+        StateMachine *sM2 = getStateMachine(templateModelFile);
+        emissions_signal_scaleModel(sM, npRead->templateParams.scale, npRead->templateParams.shift,
+                                    npRead->templateParams.var, npRead->templateParams.scale_sd,
+                                    npRead->templateParams.var_sd);
+        emissions_signal_scaleModel(sM2, npRead->templateParams.scale, npRead->templateParams.shift,
+                                    npRead->templateParams.var, npRead->templateParams.scale_sd,
+                                    npRead->templateParams.var_sd);
+        stateMachine_setKmerIndexEmissions(sM2);
+
+        Sequence *refSeq = sequence_construct2(lX, ZymoReferenceSeq, getKmerFcn, sequence_sliceNucleotideSequence2);
+        Sequence *refSeq2 = sequence_constructKmerIndexSequence(lX, ZymoReferenceSeq, getKmerIndexFcn);
+        stList *alignedPairs = getAlignedPairsUsingAnchors(sM, refSeq, templateSeq, filteredRemappedAnchors, p,
+                                                           diagonalCalculationPosteriorMatchProbs, 0, 0);
+        stList *alignedPairs2 = getAlignedPairsUsingAnchors(sM2, refSeq2, templateSeq, filteredRemappedAnchors, p,
+                                                            diagonalCalculationPosteriorMatchProbs, 0, 0);
+        checkAlignedPairs(testCase, alignedPairs2, lX, lY);
+        CuAssertIntEquals(testCase, stList_length(alignedPairs), stList_length(alignedPairs2));
+        for (int64_t j = 0; j < stList_length(alignedPairs); j++) {
+            CuAssertTrue(testCase,
+                         stIntTuple_cmpFn(stList_get(alignedPairs, j), stList_get(alignedPairs2, j)) == 0);
+        }
+
+        stList_destruct(alignedPairs);
+        stList_destruct(alignedPairs2);
+        sequence_sequenceDestroy(refSeq);
+        sequence_destructKmerIndexSequence(refSeq2);
+        stateMachine_destruct(sM);
+        stateMachine_destruct(sM2);
+    }
+
+    // clean
+    pairwiseAlignmentBandingParameters_destruct(p);
+    nanopore_nanoporeReadDestruct(npRead);
+    sequence_sequenceDestroy(templateSeq);
+}
+
+static void test_kmerSkipTable(CuTest *testCase) {
+    char *ZymoReference = stString_print("../../cPecan/tests/test_npReads/ZymoRef.txt");
+    FILE *fH = fopen(ZymoReference, "r");
+    char *ZymoReferenceSeq = stFile_getLineFromFile(fH);
+    char *npReadFile = stString_print("../../cPecan/tests/test_npReads/ZymoC_ch_1_file1.npRead");
+    NanoporeRead *npRead = nanopore_loadNanoporeReadFromFile(npReadFile);
+    int64_t lX = sequence_correctSeqLength(strlen(ZymoReferenceSeq), event);
+    int64_t lY = npRead->nbTemplateEvents;
+    char *templateModelFile = stString_print("../../cPecan/models/template_median68pA.model");
+    PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+    p->threshold = 0.15;
+    stList *anchorPairs = getBlastPairsForPairwiseAlignmentParameters(ZymoReferenceSeq, npRead->twoDread, p);
+    stList *remappedAnchors = nanopore_remapAnchorPairs(anchorPairs, npRead->templateEventMap);
+    stList *filteredRemappedAnchors = filterToRemoveOverlap(remappedAnchors);
+    Sequence *templateSeq = sequence_construct2(lY, npRead->templateEvents, sequence_getEvent,
+                                                sequence_sliceEventSequence2);
+
+    // aligning with the table gives the same pairs as calculating the skip transitions in every cell, for the
+    // vanilla machine on kmer indices and the echelon machine on padded kmers
+    for (int64_t i = 0; i < 2; i++) {
+        StateMachine *sM = i == 0 ? getSignalStateMachine3Vanilla(templateModelFile) :
+                           getStateMachineEchelon(templateModelFile);
+        emissions_signal_scaleModel(sM, npRead->templateParams.scale, npRead->templateParams.shift,
+                                    npRead->templateParams.var, npRead->templateParams.scale_sd,
+                                    npRead->templateParams.var_sd);
+        Sequence *refSeq;
+        int64_t elementSize;
+        if (i == 0) {
+            stateMachine_setKmerIndexEmissions(sM);
+            refSeq = sequence_constructKmerIndexSequence(lX, ZymoReferenceSeq, sequence_getKmerIndex2);
+            elementSize = sizeof(int32_t);
+        } else {
+            refSeq = sequence_construct2(lX, ZymoReferenceSeq, sequence_getKmer2, sequence_sliceNucleotideSequence2);
+            sequence_padSequence(refSeq);
+            elementSize = sizeof(char);
+        }
+        void (*posteriorProbFcn)(StateMachine *, int64_t, DpMatrix *, DpMatrix *, Sequence *, Sequence *, double,
+                                 PairwiseAlignmentParameters *, void *) =
+                i == 0 ? diagonalCalculationPosteriorMatchProbs : diagonalCalculationMultiPosteriorMatchProbs;
+
+        stList *alignedPairs = getAlignedPairsUsingAnchors(sM, refSeq, templateSeq, filteredRemappedAnchors, p,
+                                                           posteriorProbFcn, 1, 1);
+        stateMachine_setKmerSkipTable(sM, refSeq->elements, lX, elementSize);
+
+        // the table holds the transitions the machine calculates
+        KmerSkipTable *kmerSkipTable = i == 0 ? ((StateMachine3Vanilla *) sM)->kmerSkipTable :
+                                       ((StateMachineEchelon *) sM)->kmerSkipTable;
+        CuAssertTrue(testCase, kmerSkipTable != NULL);
+        for (int64_t x = 0; x < lX; x++) {
+            KmerSkipTransitions expected, scratch;
+            void *cX = refSeq->get(refSeq->elements, x);
+            stateMachine_calculateKmerSkipTransitions(sM, cX, &expected);
+            const KmerSkipTransitions *t = stateMachine_getKmerSkipTransitions(sM, kmerSkipTable, cX, &scratch);
+            CuAssertTrue(testCase, t != &scratch);
+            CuAssertTrue(testCase, memcmp(t, &expected, sizeof(KmerSkipTransitions)) == 0);
+        }
+
+        stList *alignedPairs2 = getAlignedPairsUsingAnchors(sM, refSeq, templateSeq, filteredRemappedAnchors, p,
+                                                            posteriorProbFcn, 1, 1);
+        if (i == 0) {
+            checkAlignedPairs(testCase, alignedPairs2, lX, lY);
+        } else {
+            checkAlignedPairsForEchelon(testCase, alignedPairs2, lX, lY);
+        }
+        CuAssertIntEquals(testCase, stList_length(alignedPairs), stList_length(alignedPairs2));
+        for (int64_t j = 0; j < stList_length(alignedPairs); j++) {
+            CuAssertTrue(testCase,
+                         stIntTuple_cmpFn(stList_get(alignedPairs, j), stList_get(alignedPairs2, j)) == 0);
+        }
+
+        // clearing the table goes back to calculating the transitions
+        stateMachine_setKmerSkipTable(sM, NULL, 0, 0);
+        CuAssertTrue(testCase, (i == 0 ? ((StateMachine3Vanilla *) sM)->kmerSkipTable :
+                                ((StateMachineEchelon *) sM)->kmerSkipTable) == NULL);
+
+        stList_destruct(alignedPairs);
+        stList_destruct(alignedPairs2);
+        if (i == 0) {
+            sequence_destructKmerIndexSequence(refSeq);
+        } else {
+            sequence_sequenceDestroy(refSeq);
+        }
+        stateMachine_destruct(sM);
+    }
+
+    // clean
+    pairwiseAlignmentBandingParameters_destruct(p);
+    nanopore_nanoporeReadDestruct(npRead);
+    sequence_sequenceDestroy(templateSeq);
+}
+
+static void checkSameSignalModels(CuTest *testCase, StateMachine *sM, StateMachine *sM2) {
+    for (int64_t i = 0; i < 1 + (NUM_OF_KMERS * MODEL_PARAMS); i++) {
+        CuAssertDblEquals(testCase, sM2->EMISSION_MATCH_PROBS[i], sM->EMISSION_MATCH_PROBS[i], 0.0);
+        CuAssertDblEquals(testCase, sM2->EMISSION_GAP_Y_PROBS[i], sM->EMISSION_GAP_Y_PROBS[i], 0.0);
+    }
+    for (int64_t i = 0; i < 60; i++) {
+        CuAssertDblEquals(testCase, sM2->EMISSION_GAP_X_PROBS[i], sM->EMISSION_GAP_X_PROBS[i], 0.0);
+    }
+    // and the derived kmer params, through the emissions that use them
+    for (int64_t test = 0; test < 100; test++) {
+        int32_t kmerIndices[] = {0, st_randomInt(0, NUM_OF_KMERS)}; // the FromIndex emissions read the second
+        double event[] = {st_random() * 30 + 50, st_random() * 1.5 + 0.5, st_random() * 0.02};
+        CuAssertDblEquals(testCase,
+                          emissions_signal_getEventMatchProbWithTwoDistsFromIndex(sM2->EMISSION_MATCH_PROBS,
+                                                                                  kmerIndices, event),
+                          emissions_signal_getEventMatchProbWithTwoDistsFromIndex(sM->EMISSION_MATCH_PROBS,
+                                                                                  kmerIndices, event), 0.0);
+        CuAssertDblEquals(testCase,
+                          emissions_signal_getEventMatchProbWithTwoDistsFromIndex(sM2->EMISSION_GAP_Y_PROBS,
+                                                                                  kmerIndices, event),
+                          emissions_signal_getEventMatchProbWithTwoDistsFromIndex(sM->EMISSION_GAP_Y_PROBS,
+                                                                                  kmerIndices, event), 0.0);
+    }
+}
+
+static void test_poreModel(CuTest *testCase) {
+    char *modelFile = stString_print("../../cPecan/models/template_median68pA.model");
+    char *otherModelFile = stString_print("../../cPecan/models/complement_median68pA_pop2.model");
+    char *binaryFile = stString_print("test_poreModel.bin");
+    PoreModel *poreModel = poreModel_loadFromFile(modelFile);
+
+    // the stateMachines made from the pore model are those made from the model file
+    StateMachineType types[] = {threeState, fourState, vanilla, echelon};
+    for (int64_t t = 0; t < 4; t++) {
+        StateMachine *sM = poreModel_getStateMachine(poreModel, types[t]);
+        StateMachine *sM2 = types[t] == threeState ? getStrawManStateMachine3(modelFile) :
+                            types[t] == fourState ? getStateMachine4(modelFile) :
+                            types[t] == vanilla ? getSignalStateMachine3Vanilla(modelFile) :
+                            getStateMachineEchelon(modelFile);
+        CuAssertIntEquals(testCase, sM2->type, sM->type);
+        checkSameSignalModels(testCase, sM, sM2);
+        poreModel_destructStateMachine(poreModel, sM);
+        stateMachine_destructSignal(sM2);
+    }
+
+    // rescaling from the pore model gives the scaled model, however many times the stateMachine was scaled before
+    StateMachine *sM = poreModel_getStateMachine(poreModel, vanilla);
+    StateMachine *sM2 = getSignalStateMachine3Vanilla(modelFile);
+    poreModel_scaleStateMachine(poreModel, sM, 0.9, 3.0, 1.3, 1.1, 0.8);
+    poreModel_scaleStateMachine(poreModel, sM, 1.02, 0.5, 1.1, 0.98, 1.2);
+    emissions_signal_scaleModel(sM2, 1.02, 0.5, 1.1, 0.98, 1.2);
+    checkSameSignalModels(testCase, sM, sM2);
+    poreModel_destructStateMachine(poreModel, sM);
+
+    // the binary model maps to the same model, unless it's stale
+    CuAssertTrue(testCase, poreModel_writeBinary(poreModel, binaryFile, modelFile));
+    CuAssertTrue(testCase, poreModel_loadBinary(binaryFile, otherModelFile) == NULL);
+    PoreModel *mappedPoreModel = poreModel_loadBinary(binaryFile, modelFile);
+    CuAssertTrue(testCase, mappedPoreModel != NULL);
+    sM = poreModel_getStateMachine(mappedPoreModel, vanilla);
+    poreModel_scaleStateMachine(mappedPoreModel, sM, 1.02, 0.5, 1.1, 0.98, 1.2);
+    checkSameSignalModels(testCase, sM, sM2);
+    poreModel_destructStateMachine(mappedPoreModel, sM);
+    poreModel_destruct(mappedPoreModel);
+    remove(binaryFile);
+
+    // the cache loads each model file once
+    PoreModelCache *cache = poreModelCache_construct(0);
+    PoreModel *cachedPoreModel = poreModelCache_get(cache, modelFile);
+    CuAssertTrue(testCase, poreModelCache_get(cache, modelFile) == cachedPoreModel);
+    CuAssertTrue(testCase, poreModelCache_get(cache, otherModelFile) != cachedPoreModel);
+    poreModelCache_destruct(cache);
+
+    stateMachine_destructSignal(sM2);
+    poreModel_destruct(poreModel);
+    free(modelFile);
+    free(otherModelFile);
+    free(binaryFile);
+}
+
+static void checkSameNanoporeReads(CuTest *testCase, NanoporeRead *npRead, NanoporeRead *npRead2) {
+    CuAssertIntEquals(testCase, npRead->readLength, npRead2->readLength);
+    CuAssertIntEquals(testCase, npRead->nbTemplateEvents, npRead2->nbTemplateEvents);
+    CuAssertIntEquals(testCase, npRead->nbComplementEvents, npRead2->nbComplementEvents);
+    CuAssertTrue(testCase, memcmp(&npRead->templateParams, &npRead2->templateParams,
+                                  sizeof(NanoporeReadAdjustmentParameters)) == 0);
+    CuAssertTrue(testCase, memcmp(&npRead->complementParams, &npRead2->complementParams,
+                                  sizeof(NanoporeReadAdjustmentParameters)) == 0);
+    CuAssertTrue(testCase, strncmp(npRead->twoDread, npRead2->twoDread, npRead->readLength) == 0);
+    CuAssertTrue(testCase, memcmp(npRead->templateEventMap, npRead2->templateEventMap,
+                                  npRead->readLength * sizeof(int64_t)) == 0);
+    CuAssertTrue(testCase, memcmp(npRead->complementEventMap, npRead2->complementEventMap,
+                                  npRead->readLength * sizeof(int64_t)) == 0);
+    CuAssertTrue(testCase, memcmp(npRead->templateEvents, npRead2->templateEvents,
+                                  npRead->nbTemplateEvents * NB_EVENT_PARAMS * sizeof(double)) == 0);
+    CuAssertTrue(testCase, memcmp(npRead->complementEvents, npRead2->complementEvents,
+                                  npRead->nbComplementEvents * NB_EVENT_PARAMS * sizeof(double)) == 0);
+}
+
+static void test_nanoporeReadBinary(CuTest *testCase) {
+    char *npReadFile = stString_print("../../cPecan/tests/test_npReads/ZymoC_ch_1_file1.npRead");
+    char *binaryFile = stString_print("test_nanoporeReadBinary.npRead");
+    char *bundleFile = stString_print("test_nanoporeReadBinary.bundle");
+    NanoporeRead *npRead = nanopore_loadNanoporeReadFromFile(npReadFile);
+    CuAssertTrue(testCase, !npRead->mapped);
+
+    // the binary read is the text one, whether it's loaded as binary or as any npRead file
+    CuAssertTrue(testCase, nanopore_writeNanoporeReadToBinaryFile(npRead, binaryFile));
+    NanoporeRead *binaryNpRead = nanopore_loadNanoporeReadFromFile(binaryFile);
+    CuAssertTrue(testCase, binaryNpRead->mapped);
+    checkSameNanoporeReads(testCase, npRead, binaryNpRead);
+    // the mapping is copy on write
+    binaryNpRead->templateEvents[0] += 1.0;
+    nanopore_nanoporeReadDestruct(binaryNpRead);
+    binaryNpRead = nanopore_loadNanoporeReadFromBinaryFile(binaryFile);
+    checkSameNanoporeReads(testCase, npRead, binaryNpRead);
+    nanopore_nanoporeReadDestruct(binaryNpRead);
+
+    // a bundle of reads from text and binary files
+    stList *npReadFiles = stList_construct();
+    stList *names = stList_construct();
+    for (int64_t i = 0; i < 5; i++) {
+        stList_append(npReadFiles, i % 2 ? binaryFile : npReadFile);
+        stList_append(names, stString_print("read_%lld", i));
+    }
+    CuAssertTrue(testCase, nanoporeReadBundle_write(npReadFiles, names, bundleFile));
+    NanoporeReadBundle *bundle = nanoporeReadBundle_open(bundleFile);
+    CuAssertIntEquals(testCase, 5, nanoporeReadBundle_getReadNumber(bundle));
+    for (int64_t i = 0; i < 5; i++) {
+        CuAssertStrEquals(testCase, stList_get(names, i), nanoporeReadBundle_getReadName(bundle, i));
+        CuAssertIntEquals(testCase, i, nanoporeReadBundle_findRead(bundle, stList_get(names, i)));
+        NanoporeRead *bundledNpRead = nanoporeReadBundle_getRead(bundle, i);
+        checkSameNanoporeReads(testCase, npRead, bundledNpRead);
+        nanopore_nanoporeReadDestruct(bundledNpRead);
+    }
+    CuAssertIntEquals(testCase, -1, nanoporeReadBundle_findRead(bundle, "read_5"));
+    nanoporeReadBundle_close(bundle);
+
+    remove(binaryFile);
+    remove(bundleFile);
+    stList_destruct(npReadFiles);
+    for (int64_t i = 0; i < 5; i++) {
+        free(stList_get(names, i));
+    }
+    stList_destruct(names);
+    nanopore_nanoporeReadDestruct(npRead);
+    free(npReadFile);
+    free(binaryFile);
+    free(bundleFile);
+}
+
+static void test_echelon_cellEmissions(CuTest *testCase) {
+    char *templateModelFile = stString_print("../../cPecan/models/template_median68pA.model");
+    StateMachine *sM = getStateMachineEchelon(templateModelFile);
+    StateMachineEchelon *sMe = (StateMachineEchelon *) sM;
+
+    // the emissions of a cell are the ones the machine's functions give, with and without a duration table
+    for (int64_t test = 0; test < 20; test++) {
+        char *seq = getRandomSequence(st_randomInt(KMER_LENGTH, 40));
+        char *paddedSeq = stString_print("%s%s", seq, "nnnnnnnnnnnnnnnnnnnnnnnnnnnnnn");
+        int64_t nbEvents = st_randomInt(1, 10);
+        double *events = st_malloc(nbEvents * NB_EVENT_PARAMS * sizeof(double));
+        for (int64_t i = 0; i < nbEvents; i++) {
+            events[i * NB_EVENT_PARAMS] = st_random() * 30 + 50;
+            events[i * NB_EVENT_PARAMS + 1] = st_random() * 1.5 + 0.5;
+            events[i * NB_EVENT_PARAMS + 2] = st_random() * 0.02 + 0.001;
+        }
+        for (int64_t table = 0; table < 2; table++) {
+            stateMachineEchelon_setDurationTable(sM, table ? events : NULL, nbEvents);
+            for (int64_t x = 0; x < (int64_t) strlen(seq); x++) {
+                for (int64_t y = 0; y < nbEvents; y++) {
+                    double *event = &events[y * NB_EVENT_PARAMS];
+                    double eP[6], durationProbs[ECHELON_DURATION_PROBS];
+                    stateMachineEchelon_getCellEmissions(sM, paddedSeq + x, event, eP, durationProbs);
+                    for (int64_t n = 0; n < ECHELON_DURATION_PROBS; n++) {
+                        CuAssertTrue(testCase, durationProbs[n] == sMe->getDurationProb(event, n));
+                        if (n > 0) {
+                            CuAssertTrue(testCase, eP[n] == sMe->getMatchProbFcn(sM->EMISSION_MATCH_PROBS,
+                                                                                 paddedSeq + x, event, n));
+                        }
+                    }
+                }
+            }
+        }
+        stateMachineEchelon_setDurationTable(sM, NULL, 0);
+        free(events);
+        free(paddedSeq);
+        free(seq);
+    }
+
+    // aligning with the duration table gives the same pairs
+    char *ZymoReference = stString_print("../../cPecan/tests/test_npReads/ZymoRef.txt");
+    FILE *fH = fopen(ZymoReference, "r");
+    char *ZymoReferenceSeq = stFile_getLineFromFile(fH);
+    char *npReadFile = stString_print("../../cPecan/tests/test_npReads/ZymoC_ch_1_file1.npRead");
+    NanoporeRead *npRead = nanopore_loadNanoporeReadFromFile(npReadFile);
+    int64_t lX = sequence_correctSeqLength(strlen(ZymoReferenceSeq), event);
+    int64_t lY = npRead->nbTemplateEvents;
+    emissions_signal_scaleModel(sM, npRead->templateParams.scale, npRead->templateParams.shift,
+                                npRead->templateParams.var, npRead->templateParams.scale_sd,
+                                npRead->templateParams.var_sd);
+    PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+    p->threshold = 0.15;
+    stList *anchorPairs = getBlastPairsForPairwiseAlignmentParameters(ZymoReferenceSeq, npRead->twoDread, p);
+    stList *remappedAnchors = nanopore_remapAnchorPairs(anchorPairs, npRead->templateEventMap);
+    stList *filteredRemappedAnchors = filterToRemoveOverlap(remappedAnchors);
+    Sequence *refSeq = sequence_construct2(lX, ZymoReferenceSeq, sequence_getKmer2,
+                                           sequence_sliceNucleotideSequence2);
+    sequence_padSequence(refSeq);
+    Sequence *templateSeq = sequence_construct2(lY, npRead->templateEvents, sequence_getEvent,
+                                                sequence_sliceEventSequence2);
+
+    stList *alignedPairs = getAlignedPairsUsingAnchors(sM, refSeq, templateSeq, filteredRemappedAnchors, p,
+                                                       diagonalCalculationMultiPosteriorMatchProbs, 1, 1);
+    stateMachineEchelon_setDurationTable(sM, templateSeq->elements, templateSeq->length);
+    stList *alignedPairs2 = getAlignedPairsUsingAnchors(sM, refSeq, templateSeq, filteredRemappedAnchors, p,
+                                                        diagonalCalculationMultiPosteriorMatchProbs, 1, 1);
+    stateMachineEchelon_setDurationTable(sM, NULL, 0);
+    checkAlignedPairsForEchelon(testCase, alignedPairs2, lX, lY);
+    CuAssertIntEquals(testCase, stList_length(alignedPairs), stList_length(alignedPairs2));
+    for (int64_t j = 0; j < stList_length(alignedPairs); j++) {
+        CuAssertTrue(testCase, stIntTuple_cmpFn(stList_get(alignedPairs, j), stList_get(alignedPairs2, j)) == 0);
+    }
+
+    // and so does aligning into a buffer, which comes sorted by x + y with the state of each pair
+    AlignedPairBuffer *buffer = getAlignedPairBufferUsingAnchors(sM, refSeq, templateSeq, filteredRemappedAnchors, p,
+                                                                 diagonalCalculationMultiPosteriorMatchProbsToBuffer,
+                                                                 1, 1, 1);
+    stList *alignedPairs3 = alignedPairBuffer_toList(buffer);
+    CuAssertIntEquals(testCase, stList_length(alignedPairs), stList_length(alignedPairs3));
+    stList_sort(alignedPairs, (int (*)(const void *, const void *)) stIntTuple_cmpFn);
+    stList_sort(alignedPairs3, (int (*)(const void *, const void *)) stIntTuple_cmpFn);
+    for (int64_t j = 0; j < stList_length(alignedPairs); j++) {
+        CuAssertTrue(testCase, stIntTuple_cmpFn(stList_get(alignedPairs, j), stList_get(alignedPairs3, j)) == 0);
+    }
+    for (int64_t j = 0; j < buffer->length; j++) {
+        CuAssertTrue(testCase, j == 0 || buffer->xs[j - 1] + buffer->ys[j - 1] <= buffer->xs[j] + buffer->ys[j]);
+        CuAssertTrue(testCase, buffer->states[j] >= sM->matchState && buffer->states[j] < 6);
+    }
+
+    // clean
+    stList_destruct(alignedPairs);
+    stList_destruct(alignedPairs2);
+    stList_destruct(alignedPairs3);
+    alignedPairBuffer_destruct(buffer);
+    pairwiseAlignmentBandingParameters_destruct(p);
+    nanopore_nanoporeReadDestruct(npRead);
+    sequence_sequenceDestroy(refSeq);
+    sequence_sequenceDestroy(templateSeq);
+    stateMachine_destruct(sM);
+}
+
 static void test_echelon_getAlignedPairsWithBanding(CuTest *testCase) {
     // load the reference sequence and the nanopore read
     char *ZymoReference = stString_print("../../cPecan/tests/test_npReads/ZymoRef.txt");
@@ -1822,6 +2660,243 @@ static void test_vanillaHmm_em(CuTest *testCase) {
     stateMachine_destruct(sMt);
 }
 
+static void test_stateMachineReuse(CuTest *testCase) {
+    // vanillaAlign's manifest mode aligns every read with the same stateMachines, rescaled to each read, which
+    // aligns as stateMachines made for the read would, as do batch jobs made for the reads from the pore model
+    char *ZymoReference = stString_print("../../cPecan/tests/test_npReads/ZymoRef.txt");
+    FILE *fH = fopen(ZymoReference, "r");
+    char *ZymoReferenceSeq = stFile_getLineFromFile(fH);
+    fclose(fH);
+    char *npReadFile = stString_print("../../cPecan/tests/test_npReads/ZymoC_ch_1_file1.npRead");
+    NanoporeRead *npRead = nanopore_loadNanoporeReadFromFile(npReadFile);
+    int64_t lX = sequence_correctSeqLength(strlen(ZymoReferenceSeq), event);
+    char *templateModelFile = stString_print("../../cPecan/models/template_median68pA.model");
+    PoreModel *poreModel = poreModel_loadFromFile(templateModelFile);
+    PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
+    p->threshold = 0.15;
+    stList *anchorPairs = getBlastPairsForPairwiseAlignmentParameters(ZymoReferenceSeq, npRead->twoDread, p);
+
+    // the template and then the complement events, as two reads
+    Sequence *eventSeqs[2];
+    stList *readAnchors[2];
+    NanoporeReadAdjustmentParameters readParams[2] = { npRead->templateParams, npRead->complementParams };
+    for (int64_t r = 0; r < 2; r++) {
+        eventSeqs[r] = sequence_construct2(r == 0 ? npRead->nbTemplateEvents : npRead->nbComplementEvents,
+                                           r == 0 ? npRead->templateEvents : npRead->complementEvents,
+                                           sequence_getEvent, sequence_sliceEventSequence2);
+        stList *remappedAnchors = nanopore_remapAnchorPairs(anchorPairs, r == 0 ? npRead->templateEventMap
+                                                                                : npRead->complementEventMap);
+        readAnchors[r] = filterToRemoveOverlap(remappedAnchors);
+        stList_destruct(remappedAnchors);
+    }
+
+    StateMachineType types[] = {threeState, fourState, vanilla};
+    for (int64_t t = 0; t < 3; t++) {
+        void *(*getKmerIndexFcn)(void *, int64_t) = types[t] == vanilla ? sequence_getKmerIndex2
+                                                                         : sequence_getKmerIndex;
+        Sequence *refSeq = sequence_constructKmerIndexSequence(lX, ZymoReferenceSeq, getKmerIndexFcn);
+        StateMachine *sM = poreModel_getStateMachine(poreModel, types[t]);
+        for (int64_t r = 0; r < 2; r++) {
+            NanoporeReadAdjustmentParameters npp = readParams[r];
+            poreModel_scaleStateMachine(poreModel, sM, npp.scale, npp.shift, npp.var, npp.scale_sd, npp.var_sd);
+            stateMachine_setKmerIndexEmissions(sM);
+            StateMachine *sM2 = poreModel_getStateMachine(poreModel, types[t]);
+            poreModel_scaleStateMachine(poreModel, sM2, npp.scale, npp.shift, npp.var, npp.scale_sd, npp.var_sd);
+            stateMachine_setKmerIndexEmissions(sM2);
+
+            stList *alignedPairs = getAlignedPairsUsingAnchors(sM, refSeq, eventSeqs[r], readAnchors[r], p,
+                                                               diagonalCalculationPosteriorMatchProbs, 0, 0);
+            stList *alignedPairs2 = getAlignedPairsUsingAnchors(sM2, refSeq, eventSeqs[r], readAnchors[r], p,
+                                                                diagonalCalculationPosteriorMatchProbs, 0, 0);
+            CuAssertTrue(testCase, stList_length(alignedPairs) > 0);
+            CuAssertIntEquals(testCase, stList_length(alignedPairs2), stList_length(alignedPairs));
+            for (int64_t j = 0; j < stList_length(alignedPairs); j++) {
+                CuAssertTrue(testCase,
+                             stIntTuple_cmpFn(stList_get(alignedPairs, j), stList_get(alignedPairs2, j)) == 0);
+            }
+            stList_destruct(alignedPairs);
+            stList_destruct(alignedPairs2);
+            poreModel_destructStateMachine(poreModel, sM2);
+        }
+        poreModel_destructStateMachine(poreModel, sM);
+        sequence_destructKmerIndexSequence(refSeq);
+    }
+
+    // a batch of jobs made for the reads from the one pore model aligns as stateMachines built for each read do
+    Sequence *refSeq = sequence_constructKmerIndexSequence(lX, ZymoReferenceSeq, sequence_getKmerIndex2);
+    stList *jobs = stList_construct3(0, (void (*)(void *)) alignmentJob_destruct);
+    for (int64_t r = 0; r < 2; r++) {
+        AlignmentJob *job = alignmentJob_constructForRead(poreModel, vanilla, r == 0 ? template : complement,
+                                                          readParams[r], refSeq, eventSeqs[r], readAnchors[r],
+                                                          diagonalCalculationPosteriorMatchProbsToBuffer, 0, 0, 0);
+        CuAssertTrue(testCase, job->poreModel == poreModel);
+        stateMachine_setKmerIndexEmissions(job->sM);
+        stList_append(jobs, job);
+    }
+    getAlignedPairsForBatch(jobs, p);
+    for (int64_t r = 0; r < 2; r++) {
+        NanoporeReadAdjustmentParameters npp = readParams[r];
+        StateMachine *sM = poreModel_getStateMachine(poreModel, vanilla);
+        stateMachine3Vanilla_setStrandTransitionsToDefaults(sM, r == 0 ? template : complement);
+        poreModel_scaleStateMachine(poreModel, sM, npp.scale, npp.shift, npp.var, npp.scale_sd, npp.var_sd);
+        stateMachine_setKmerIndexEmissions(sM);
+        stList *alignedPairs = getAlignedPairsUsingAnchors(sM, refSeq, eventSeqs[r], readAnchors[r], p,
+                                                           diagonalCalculationPosteriorMatchProbs, 0, 0);
+        stList *alignedPairs2 = alignedPairBuffer_toList(((AlignmentJob *) stList_get(jobs, r))->alignedPairs);
+        CuAssertTrue(testCase, stList_length(alignedPairs) > 0);
+        CuAssertIntEquals(testCase, stList_length(alignedPairs), stList_length(alignedPairs2));
+        stList_sort(alignedPairs, (int (*)(const void *, const void *)) stIntTuple_cmpFn);
+        stList_sort(alignedPairs2, (int (*)(const void *, const void *)) stIntTuple_cmpFn);
+        for (int64_t j = 0; j < stList_length(alignedPairs); j++) {
+            CuAssertTrue(testCase, stIntTuple_cmpFn(stList_get(alignedPairs, j), stList_get(alignedPairs2, j)) == 0);
+        }
+        stList_destruct(alignedPairs);
+        stList_destruct(alignedPairs2);
+        poreModel_destructStateMachine(poreModel, sM);
+    }
+    stList_destruct(jobs);
+    sequence_destructKmerIndexSequence(refSeq);
+
+    for (int64_t r = 0; r < 2; r++) {
+        sequence_sequenceDestroy(eventSeqs[r]);
+        stList_destruct(readAnchors[r]);
+    }
+    stList_destruct(anchorPairs);
+    pairwiseAlignmentBandingParameters_destruct(p);
+    poreModel_destruct(poreModel);
+    nanopore_nanoporeReadDestruct(npRead);
+    free(ZymoReferenceSeq);
+    free(ZymoReference);
+    free(npReadFile);
+    free(templateModelFile);
+}
+
+static char *readWholeFile(const char *file) {
+    FILE *fH = fopen(file, "r");
+    if (fH == NULL) {
+        return stString_copy("");
+    }
+    fseek(fH, 0, SEEK_END);
+    int64_t length = ftell(fH);
+    fseek(fH, 0, SEEK_SET);
+    char *contents = st_malloc(length + 1);
+    contents[fread(contents, 1, length, fH)] = '\0';
+    fclose(fH);
+    return contents;
+}
+
+// the rows, one fprintf each, as vanillaAlign used to write them
+static void writeExpectedPosteriors(FILE *fH, const char *readLabel, const char *contig, Strand strand, bool forward,
+                                    char *target, double *matchModel, double scale, double shift, double *events,
+                                    int64_t eventSequenceOffset, int64_t referenceSequenceOffset,
+                                    AlignedPairBuffer *alignedPairs) {
+    bool reversed = (strand == complement && forward) || (strand == template && (!forward));
+    for (int64_t i = 0; i < alignedPairs->length; i++) {
+        int64_t x_i = alignedPairs->xs[i];
+        int64_t refLength = (int64_t) strlen(target);
+        int64_t x_adj = reversed ? (refLength - KMER_LENGTH) - (x_i + (refLength - referenceSequenceOffset))
+                                 : x_i + referenceSequenceOffset;
+        int64_t y = alignedPairs->ys[i] + eventSequenceOffset;
+        char *k_i = stString_getSubString(target, x_i, KMER_LENGTH);
+        char *refKmer = reversed ? stString_reverseComplementString(k_i) : stString_copy(k_i);
+        int64_t kmerIndex = emissions_discrete_getKmerIndexFromKmer(k_i);
+        double E_levelu = matchModel[1 + (kmerIndex * MODEL_PARAMS)];
+        double E_noiseu = matchModel[1 + (kmerIndex * MODEL_PARAMS + 2)];
+        double eventMean = events[y * NB_EVENT_PARAMS];
+        fprintf(fH, "%s\t%lld\t%s\t%s\t%s\t%lld\t%f\t%f\t%f\t%s\t%f\t%f\t%f\t%f\t%f\n",
+                contig, x_adj, refKmer, readLabel, strand == template ? "t" : "c", y, eventMean,
+                events[y * NB_EVENT_PARAMS + 1], events[y * NB_EVENT_PARAMS + 2], k_i, E_levelu, E_noiseu,
+                ((double) alignedPairs->probs[i]) / PAIR_ALIGNMENT_PROB_1, (eventMean - shift) / scale,
+                (E_levelu - shift) / scale);
+        free(k_i);
+        free(refKmer);
+    }
+}
+
+static void test_posteriorWriter(CuTest *testCase) {
+    char *expectedFile = stString_print("test_posteriorWriter.expected.tsv");
+    char *tsvFile = stString_print("test_posteriorWriter.tsv");
+    char *binaryFile = stString_print("test_posteriorWriter.bin");
+    char *convertedFile = stString_print("test_posteriorWriter.converted.tsv");
+    // values that are awkward to format, among random ones
+    double awkward[] = { 0.0, -0.0, 0.0000005, -0.0000004, 0.0000015, 2.5e-7, 1.0e7, -123456.7890125, 999999.9999996,
+                         0.1, 1.0 / 3.0, INFINITY };
+    int64_t nbAwkward = sizeof(awkward) / sizeof(double);
+
+    for (int64_t test = 0; test < 20; test++) {
+        remove(expectedFile);
+        remove(tsvFile);
+        remove(binaryFile);
+        remove(convertedFile);
+        FILE *expected = fopen(expectedFile, "w");
+        PosteriorWriter *tsvPosteriors = posteriorWriter_construct(tsvFile, posteriors_tsv);
+        PosteriorWriter *binaryPosteriors = posteriorWriter_construct(binaryFile, posteriors_binary);
+        double *matchModel = st_malloc((1 + NUM_OF_KMERS * MODEL_PARAMS) * sizeof(double));
+        for (int64_t i = 0; i < 1 + NUM_OF_KMERS * MODEL_PARAMS; i++) {
+            matchModel[i] = st_random() * 100.0 - 20.0;
+        }
+        for (int64_t i = 0; i < 4; i++) {
+            Strand strand = i % 2 ? complement : template;
+            bool forward = i < 2;
+            char *target = getRandomSequence(st_randomInt(KMER_LENGTH, 100));
+            int64_t kmerNumber = strlen(target) - KMER_LENGTH + 1;
+            int64_t nbEvents = st_randomInt(1, 100);
+            double *events = st_malloc(nbEvents * NB_EVENT_PARAMS * sizeof(double));
+            for (int64_t j = 0; j < nbEvents * NB_EVENT_PARAMS; j++) {
+                events[j] = st_random() > 0.2 ? st_random() * 200.0 - 50.0 : awkward[st_randomInt(0, nbAwkward)];
+            }
+            int64_t eventSequenceOffset = st_randomInt(0, nbEvents);
+            int64_t referenceSequenceOffset = st_randomInt(0, 1000);
+            double scale = st_random() + 0.5;
+            double shift = st_random() * 10.0;
+            AlignedPairBuffer *alignedPairs = alignedPairBuffer_construct(0);
+            int64_t nbPairs = st_randomInt(0, 200);
+            for (int64_t j = 0; j < nbPairs; j++) {
+                alignedPairBuffer_append(alignedPairs, st_randomInt(0, PAIR_ALIGNMENT_PROB_1 + 1),
+                                         st_randomInt(0, kmerNumber), st_randomInt(0, nbEvents - eventSequenceOffset),
+                                         0);
+            }
+            writeExpectedPosteriors(expected, "read", "contig", strand, forward, target, matchModel, scale, shift,
+                                    events, eventSequenceOffset, referenceSequenceOffset, alignedPairs);
+            posteriorWriter_writeStrand(tsvPosteriors, "read", "contig", strand, forward, target, matchModel, scale,
+                                        shift, events, eventSequenceOffset, referenceSequenceOffset, alignedPairs);
+            posteriorWriter_writeStrand(binaryPosteriors, "read", "contig", strand, forward, target, matchModel,
+                                        scale, shift, events, eventSequenceOffset, referenceSequenceOffset,
+                                        alignedPairs);
+            alignedPairBuffer_destruct(alignedPairs);
+            free(events);
+            free(target);
+        }
+        fclose(expected);
+        posteriorWriter_destruct(tsvPosteriors);
+        posteriorWriter_destruct(binaryPosteriors);
+
+        // the binary posteriors convert to the same table
+        PosteriorWriter *convertedPosteriors = posteriorWriter_construct(convertedFile, posteriors_tsv);
+        CuAssertTrue(testCase, posteriorWriter_convertBinaryFile(convertedPosteriors, binaryFile));
+        CuAssertTrue(testCase, !posteriorWriter_convertBinaryFile(convertedPosteriors, expectedFile));
+        posteriorWriter_destruct(convertedPosteriors);
+
+        char *expectedRows = readWholeFile(expectedFile);
+        char *tsvRows = readWholeFile(tsvFile);
+        char *convertedRows = readWholeFile(convertedFile);
+        CuAssertStrEquals(testCase, expectedRows, tsvRows);
+        CuAssertStrEquals(testCase, expectedRows, convertedRows);
+        free(expectedRows);
+        free(tsvRows);
+        free(convertedRows);
+        free(matchModel);
+    }
+    remove(expectedFile);
+    remove(tsvFile);
+    remove(binaryFile);
+    remove(convertedFile);
+    free(expectedFile);
+    free(tsvFile);
+    free(binaryFile);
+    free(convertedFile);
+}
+
 CuSuite *signalPairwiseTestSuite(void) {
     CuSuite *suite = CuSuiteNew();
     /*
@@ -1855,5 +2930,17 @@ CuSuite *signalPairwiseTestSuite(void) {
     SUITE_ADD_TEST(suite, test_continuousPairHmm_em);
     SUITE_ADD_TEST(suite, test_vanillaHmm_em);
     */
+    SUITE_ADD_TEST(suite, test_diagonalKernels);
+    SUITE_ADD_TEST(suite, test_scaledProbabilities);
+    SUITE_ADD_TEST(suite, test_echelon_diagonalThreads);
+    SUITE_ADD_TEST(suite, test_signalEmissionCache);
+    SUITE_ADD_TEST(suite, test_kmerIndexSequence);
+    SUITE_ADD_TEST(suite, test_kmerSkipTable);
+    SUITE_ADD_TEST(suite, test_signalKmerParams);
+    SUITE_ADD_TEST(suite, test_echelon_cellEmissions);
+    SUITE_ADD_TEST(suite, test_poreModel);
+    SUITE_ADD_TEST(suite, test_nanoporeReadBinary);
+    SUITE_ADD_TEST(suite, test_posteriorWriter);
+    SUITE_ADD_TEST(suite, test_stateMachineReuse);
     return suite;
 }
@@ -0,0 +1,74 @@
+/*
+ * testHelpers.c
+ *
+ * Checks shared by the nucleotide and signal test suites.
+ */
+
+#include <stdlib.h>
+#include "sonLib.h"
+#include "CuTest.h"
+#include "stateMachine.h"
+#include "pairwiseAligner.h"
+#include "testHelpers.h"
+
+void checkDiagonalKernel(CuTest *testCase, StateMachine *sM, Sequence *SsX, Sequence *SsY) {
+    // the aligner should pick the state machine's own kernel
+    CuAssertTrue(testCase, sM->diagonalCalculate != NULL);
+    DiagonalCalculationFn forwardFn = diagonalCalculation_getForwardFn(sM);
+    DiagonalCalculationFn backwardFn = diagonalCalculation_getBackwardFn(sM);
+    CuAssertTrue(testCase, forwardFn != diagonalCalculationForward);
+    CuAssertTrue(testCase, backwardFn != diagonalCalculationBackward);
+
+    // fill in one pair of matrices with the generic calculation and one with the kernel
+    int64_t diagonalNumber = SsX->length + SsY->length;
+    DpMatrix *dpMatrixForward = dpMatrix_construct(diagonalNumber, sM->stateNumber);
+    DpMatrix *dpMatrixBackward = dpMatrix_construct(diagonalNumber, sM->stateNumber);
+    DpMatrix *kernelDpMatrixForward = dpMatrix_construct(diagonalNumber, sM->stateNumber);
+    DpMatrix *kernelDpMatrixBackward = dpMatrix_construct(diagonalNumber, sM->stateNumber);
+    stList *anchorPairs = stList_construct();
+    Band *band = band_construct(anchorPairs, SsX->length, SsY->length, 2);
+    BandIterator *bandIt = bandIterator_construct(band);
+    for (int64_t i = 0; i <= diagonalNumber; i++) {
+        Diagonal d = bandIterator_getNext(bandIt);
+        dpDiagonal_zeroValues(dpMatrix_createDiagonal(dpMatrixForward, d));
+        dpDiagonal_zeroValues(dpMatrix_createDiagonal(dpMatrixBackward, d));
+        dpDiagonal_zeroValues(dpMatrix_createDiagonal(kernelDpMatrixForward, d));
+        dpDiagonal_zeroValues(dpMatrix_createDiagonal(kernelDpMatrixBackward, d));
+    }
+    dpDiagonal_initialiseValues(dpMatrix_getDiagonal(dpMatrixForward, 0), sM, sM->startStateProb);
+    dpDiagonal_initialiseValues(dpMatrix_getDiagonal(kernelDpMatrixForward, 0), sM, sM->startStateProb);
+    dpDiagonal_initialiseValues(dpMatrix_getDiagonal(dpMatrixBackward, diagonalNumber), sM, sM->endStateProb);
+    dpDiagonal_initialiseValues(dpMatrix_getDiagonal(kernelDpMatrixBackward, diagonalNumber), sM, sM->endStateProb);
+
+    for (int64_t i = 1; i <= diagonalNumber; i++) {
+        diagonalCalculationForward(sM, i, dpMatrixForward, SsX, SsY);
+        forwardFn(sM, i, kernelDpMatrixForward, SsX, SsY);
+    }
+    for (int64_t i = diagonalNumber; i > 0; i--) {
+        diagonalCalculationBackward(sM, i, dpMatrixBackward, SsX, SsY);
+        backwardFn(sM, i, kernelDpMatrixBackward, SsX, SsY);
+    }
+
+    // the matrices should be exactly the same
+    for (int64_t i = 0; i <= diagonalNumber; i++) {
+        CuAssertTrue(testCase, dpDiagonal_equals(dpMatrix_getDiagonal(dpMatrixForward, i),
+                                                 dpMatrix_getDiagonal(kernelDpMatrixForward, i)));
+        CuAssertTrue(testCase, dpDiagonal_equals(dpMatrix_getDiagonal(dpMatrixBackward, i),
+                                                 dpMatrix_getDiagonal(kernelDpMatrixBackward, i)));
+    }
+
+    // clean up
+    for (int64_t i = 0; i <= diagonalNumber; i++) {
+        dpMatrix_deleteDiagonal(dpMatrixForward, i);
+        dpMatrix_deleteDiagonal(dpMatrixBackward, i);
+        dpMatrix_deleteDiagonal(kernelDpMatrixForward, i);
+        dpMatrix_deleteDiagonal(kernelDpMatrixBackward, i);
+    }
+    dpMatrix_destruct(dpMatrixForward);
+    dpMatrix_destruct(dpMatrixBackward);
+    dpMatrix_destruct(kernelDpMatrixForward);
+    dpMatrix_destruct(kernelDpMatrixBackward);
+    bandIterator_destruct(bandIt);
+    band_destruct(band);
+    stList_destruct(anchorPairs);
+}
@@ -0,0 +1,18 @@
+/*
+ * testHelpers.h
+ *
+ * Checks shared by the nucleotide and signal test suites.
+ */
+
+#ifndef TESTHELPERS_H_
+#define TESTHELPERS_H_
+
+#include "CuTest.h"
+#include "stateMachine.h"
+#include "pairwiseAligner.h"
+
+//Checks that the aligner picks sM's own diagonal kernel, and that the kernel fills in the forward and backward
+//matrices of SsX and SsY exactly as the generic diagonal calculation does.
+void checkDiagonalKernel(CuTest *testCase, StateMachine *sM, Sequence *SsX, Sequence *SsY);
+
+#endif /* TESTHELPERS_H_ */
@@ -5,6 +5,8 @@
 #include "stateMachine.h"
 #include "nanopore.h"
 #include "continuousHmm.h"
+#include "threadPool.h"
+#include "posteriorWriter.h"
 
 
 void usage() {
@@ -23,112 +25,35 @@ void printPairwiseAlignmentSummary(struct PairwiseAlignment *pA) {
     st_uglyf("end    2: %lld\n", pA->end2);
 }
 
-void writePosteriorProbs(char *posteriorProbsFile, char *readFile, double *matchModel, double scale, double shift,
-                         double *events, char *target, bool forward, char *contig,
-                         int64_t eventSequenceOffset, int64_t referenceSequenceOffset,
-                         stList *alignedPairs, Strand strand) {
-    // label for tsv output
-    char *strandLabel;
-    if (strand == template) {
-        strandLabel = "t";
-    }
-    if (strand == complement) {
-        strandLabel = "c";
-    }
-
-    // open the file for output
-    FILE *fH = fopen(posteriorProbsFile, "a");
-    for(int64_t i = 0; i < stList_length(alignedPairs); i++) {
-        // grab the aligned pair
-        stIntTuple *aPair = stList_get(alignedPairs, i);
-        int64_t x_i = stIntTuple_get(aPair, 1);
-        int64_t x_adj;  // x is the reference coordinate that we record in the aligned pairs w
-        if ((strand == template && forward) || (strand == complement && (!forward))) {
-            x_adj = stIntTuple_get(aPair, 1) + referenceSequenceOffset;
-        }
-        if ((strand == complement && forward) || (strand == template && (!forward))) {
-            int64_t refLength = (int64_t)strlen(target);
-            int64_t refLengthInEvents = refLength - KMER_LENGTH;
-            x_adj = refLengthInEvents - (x_i + (refLength - referenceSequenceOffset));
-        }
-        int64_t y = stIntTuple_get(aPair, 2) + eventSequenceOffset;             // event index
-        double p = ((double)stIntTuple_get(aPair, 0)) / PAIR_ALIGNMENT_PROB_1;  // posterior prob
-
-        // get the observations from the events
-        double eventMean = events[(y * NB_EVENT_PARAMS)];
-        double eventNoise = events[(y * NB_EVENT_PARAMS) + 1];
-        double eventDuration = events[(y * NB_EVENT_PARAMS) + 2];
-        double descaledMean = (eventMean - shift) / scale;
-
-        // make the kmer string at the target index,
-        char *k_i = st_malloc(KMER_LENGTH * sizeof(char));
-        for (int64_t k = 0; k < KMER_LENGTH; k++) {
-            k_i[k] = *(target + (x_i + k));
-        }
-        // get the kmer index
-        int64_t targetKmerIndex = emissions_discrete_getKmerIndexFromKmer(k_i);
-
-        // get the expected event mean amplitude and noise
-        double E_levelu = matchModel[1 + (targetKmerIndex * MODEL_PARAMS)];
-        double E_noiseu = matchModel[1 + (targetKmerIndex * MODEL_PARAMS + 2)];
-        double deScaled_E_levelu = (E_levelu - shift) / scale;
-
-        // make reference kmer
-        char *refKmer;
-        if ((strand == template && forward) || (strand == complement && (!forward))) {
-            refKmer = k_i;
-        }
-        if ((strand == complement && forward) || (strand == template && (!forward))) {
-            refKmer = stString_reverseComplementString(k_i);
-        }
-        // write to disk
-        fprintf(fH, "%s\t%lld\t%s\t%s\t%s\t%lld\t%f\t%f\t%f\t%s\t%f\t%f\t%f\t%f\t%f\n",
-                contig, x_adj, refKmer, readFile, strandLabel, y, eventMean, eventNoise, eventDuration, k_i, E_levelu,
-                E_noiseu, p, descaledMean, deScaled_E_levelu);
-        // old format
-        //fprintf(fH, "%lld\t%lld\t%s\t%s\t%s\t%f\t%f\t%f\t%f\t%f\t%f\n",
-        //        x_adj, y, k_i, readFile, strandLabel, eventMean, eventNoise, eventDuration, p, E_levelu, E_noiseu);
-        // cleanup
-        free(k_i);
-    }
-    fclose(fH);
-}
-
 stList *getRemappedAnchorPairs(stList *unmappedAnchors, int64_t *eventMap, int64_t mapOffset) {
     stList *remapedAnchors = nanopore_remapAnchorPairsWithOffset(unmappedAnchors, eventMap, mapOffset);
 
     stList *filteredRemappedAnchors = filterToRemoveOverlap(remapedAnchors);
+    stList_destruct(remapedAnchors);
     return filteredRemappedAnchors;
 }
 
-StateMachine *buildStateMachine(const char *modelFile, NanoporeReadAdjustmentParameters npp, StateMachineType type,
-                                Strand strand) {
+StateMachine *loadStateMachine(PoreModel *poreModel, StateMachineType type, Strand strand) {
     if ((type != threeState) && (type != vanilla) && (type != echelon) && (type != fourState)) {
         st_errAbort("vanillaAlign - incompatable stateMachine type request");
     }
 
+    StateMachine *sM = poreModel_getStateMachine(poreModel, type);
     if (type == vanilla) {
-        StateMachine *sM = getSignalStateMachine3Vanilla(modelFile);
-        emissions_signal_scaleModel(sM, npp.scale, npp.shift, npp.var, npp.scale_sd, npp.var_sd);
         stateMachine3Vanilla_setStrandTransitionsToDefaults(sM, strand);
-        return sM;
-    }
-    if (type == threeState) {
-        StateMachine *sM = getStrawManStateMachine3(modelFile);
-        emissions_signal_scaleModel(sM, npp.scale, npp.shift, npp.var, npp.scale_sd, npp.var_sd);
-        return sM;
-    }
-    if (type == fourState) {
-        StateMachine *sM = getStateMachine4(modelFile);
-        emissions_signal_scaleModel(sM, npp.scale, npp.shift, npp.var, npp.scale_sd, npp.var_sd);
-        return sM;
     }
-    if (type == echelon) {
-        StateMachine *sM = getStateMachineEchelon(modelFile);
-        emissions_signal_scaleModel(sM, npp.scale, npp.shift, npp.var, npp.scale_sd, npp.var_sd);
-        return sM;
-    }
-    return 0; // else return 1 to check?
+    return sM;
+}
+
+void scaleStateMachineToRead(PoreModel *poreModel, StateMachine *sM, NanoporeReadAdjustmentParameters npp) {
+    poreModel_scaleStateMachine(poreModel, sM, npp.scale, npp.shift, npp.var, npp.scale_sd, npp.var_sd);
+}
+
+StateMachine *buildStateMachine(PoreModel *poreModel, NanoporeReadAdjustmentParameters npp, StateMachineType type,
+                                Strand strand) {
+    StateMachine *sM = loadStateMachine(poreModel, type, strand);
+    scaleStateMachineToRead(poreModel, sM, npp);
+    return sM;
 }
 
 void loadHmmRoutine(const char *hmmFile, StateMachine *sM, StateMachineType type) {
@@ -137,23 +62,22 @@ void loadHmmRoutine(const char *hmmFile, StateMachine *sM, StateMachineType type
     hmmContinuous_destruct(hmm, type);
 }
 
-static double totalScore(stList *alignedPairs) {
+static double totalScore(AlignedPairBuffer *alignedPairs) {
     double score = 0.0;
-    for (int64_t i = 0; i < stList_length(alignedPairs); i++) {
-        stIntTuple *aPair = stList_get(alignedPairs, i);
-        score += stIntTuple_get(aPair, 0);
+    for (int64_t i = 0; i < alignedPairs->length; i++) {
+        score += alignedPairs->probs[i];
     }
     return score;
 }
 
-double scoreByPosteriorProbabilityIgnoringGaps(stList *alignedPairs) {
+double scoreByPosteriorProbabilityIgnoringGaps(AlignedPairBuffer *alignedPairs) {
     /*
      * Gives the average posterior match probability per base of the two sequences, ignoring indels.
      */
-    return 100.0 * totalScore(alignedPairs) / ((double) stList_length(alignedPairs) * PAIR_ALIGNMENT_PROB_1);
+    return 100.0 * totalScore(alignedPairs) / ((double) alignedPairs->length * PAIR_ALIGNMENT_PROB_1);
 }
 
-stList *performSignalAlignmentP(StateMachine *sM, Sequence *sY, int64_t *eventMap, int64_t mapOffset, char *target,
+AlignedPairBuffer *performSignalAlignmentP(StateMachine *sM, Sequence *sY, int64_t *eventMap, int64_t mapOffset, char *target,
                                 PairwiseAlignmentParameters *p, stList *unmappedAnchors,
                                 void *(*targetGetFcn)(void *, int64_t),
                                 void (*posteriorProbFcn)(StateMachine *sM, int64_t xay, DpMatrix *forwardDpMatrix,
@@ -162,6 +86,16 @@ stList *performSignalAlignmentP(StateMachine *sM, Sequence *sY, int64_t *eventMa
                                                          void *extraArgs),
                                 bool banded) {
     int64_t lX = sequence_correctSeqLength(strlen(target), event);
+    // the echelon model reads the kmers of the target, the others take their indices
+    bool kmerIndices = sM->type != echelon;
+    int64_t elementSize = kmerIndices ? sizeof(int32_t) : sizeof(char);
+    // the vanilla and echelon models look their kmer skip transitions up in a table made for this target
+    bool skipTable = (sM->type == vanilla) || (sM->type == echelon);
+    // and the echelon model its duration probs in one made for the events
+    if (sM->type == echelon) {
+        stateMachineEchelon_setDurationTable(sM, sY->elements, sY->length);
+    }
+    AlignedPairBuffer *alignedPairs;
     if (banded) {
         fprintf(stderr, "vanillaAlign - doing banded alignment\n");
 
@@ -169,26 +103,55 @@ stList *performSignalAlignmentP(StateMachine *sM, Sequence *sY, int64_t *eventMa
         stList *filteredRemappedAnchors = getRemappedAnchorPairs(unmappedAnchors, eventMap, mapOffset);
 
         // make sequences
-        Sequence *sX = sequence_construct2(lX, target, targetGetFcn, sequence_sliceNucleotideSequence2);
+        Sequence *sX = kmerIndices ? sequence_constructKmerIndexSequence(lX, target, targetGetFcn) :
+                       sequence_construct2(lX, target, targetGetFcn, sequence_sliceNucleotideSequence2);
 
         if (sM->type == echelon) {
             sequence_padSequence(sX);
         }
+        if (skipTable) {
+            stateMachine_setKmerSkipTable(sM, sX->elements, lX, elementSize);
+        }
 
         // do alignment
-        stList *alignedPairs = getAlignedPairsUsingAnchors(sM, sX, sY, filteredRemappedAnchors, p,
-                                                           posteriorProbFcn, 1, 1);
-        return alignedPairs;
+        alignedPairs = getAlignedPairBufferUsingAnchors(sM, sX, sY, filteredRemappedAnchors, p, posteriorProbFcn,
+                                                        0, 1, 1);
+        if (skipTable) {
+            stateMachine_setKmerSkipTable(sM, NULL, 0, 0);
+        }
+        if (kmerIndices) {
+            sequence_destructKmerIndexSequence(sX);
+        } else {
+            free(sX->elements); // the padded copy of the target
+            sequence_sequenceDestroy(sX);
+        }
+        stList_destruct(filteredRemappedAnchors);
     } else {
         fprintf(stderr, "vanillaAlign - doing non-banded alignment\n");
 
-        stList *alignedPairs = getAlignedPairsWithoutBanding(sM, target, sY->elements, lX, sY->length, p, targetGetFcn,
-                                                             sequence_getEvent, posteriorProbFcn, 1, 1);
-        return alignedPairs;
+        Sequence *sX = kmerIndices ? sequence_constructKmerIndexSequence(lX, target, targetGetFcn) : NULL;
+        // the echelon target gets padded into a new string by getAlignedPairsWithoutBanding, so only the index
+        // sequence can be tabulated here
+        if (skipTable && kmerIndices) {
+            stateMachine_setKmerSkipTable(sM, sX->elements, lX, elementSize);
+        }
+        alignedPairs = getAlignedPairBufferWithoutBanding(sM, kmerIndices ? sX->elements : target, sY->elements,
+                                                          lX, sY->length, p, targetGetFcn,
+                                                          sequence_getEvent, posteriorProbFcn, 0, 1, 1);
+        if (skipTable && kmerIndices) {
+            stateMachine_setKmerSkipTable(sM, NULL, 0, 0);
+        }
+        if (kmerIndices) {
+            sequence_destructKmerIndexSequence(sX);
+        }
     }
+    if (sM->type == echelon) {
+        stateMachineEchelon_setDurationTable(sM, NULL, 0);
+    }
+    return alignedPairs;
 }
 
-stList *performSignalAlignment(StateMachine *sM, const char *hmmFile, Sequence *eventSequence, int64_t *eventMap,
+AlignedPairBuffer *performSignalAlignment(StateMachine *sM, const char *hmmFile, Sequence *eventSequence, int64_t *eventMap,
                                int64_t mapOffset,
                                char *target, PairwiseAlignmentParameters *p, stList *unmappedAncors, bool banded) {
     if ((sM->type != threeState) && (sM->type != vanilla) && (sM->type != echelon) && (sM->type != fourState)) {
@@ -204,21 +167,27 @@ stList *performSignalAlignment(StateMachine *sM, const char *hmmFile, Sequence *
     // decision tree for different stateMachine types
     if ((sM->type == vanilla) || (sM->type == echelon)) {
         if (sM->type == vanilla) {
-            stList *alignedPairs = performSignalAlignmentP(sM, eventSequence, eventMap, mapOffset,
-                                                           target, p, unmappedAncors, sequence_getKmer2,
-                                                           diagonalCalculationPosteriorMatchProbs, banded);
+            stateMachine_setKmerIndexEmissions(sM);
+            AlignedPairBuffer *alignedPairs = performSignalAlignmentP(sM, eventSequence, eventMap, mapOffset,
+                                                                      target, p, unmappedAncors,
+                                                                      sequence_getKmerIndex2,
+                                                                      diagonalCalculationPosteriorMatchProbsToBuffer,
+                                                                      banded);
             return alignedPairs;
         } else {
-            stList *alignedPairs = performSignalAlignmentP(sM, eventSequence, eventMap, mapOffset,
-                                                           target, p, unmappedAncors, sequence_getKmer2,
-                                                           diagonalCalculationMultiPosteriorMatchProbs, banded);
+            AlignedPairBuffer *alignedPairs = performSignalAlignmentP(sM, eventSequence, eventMap, mapOffset,
+                                                                      target, p, unmappedAncors, sequence_getKmer2,
+                                                                      diagonalCalculationMultiPosteriorMatchProbsToBuffer,
+                                                                      banded);
             return alignedPairs;
         }
     }
     if ((sM->type == threeState) || (sM->type == fourState)) {
-        stList *alignedPairs = performSignalAlignmentP(sM, eventSequence, eventMap, mapOffset, target, p,
-                                                       unmappedAncors, sequence_getKmer,
-                                                       diagonalCalculationPosteriorMatchProbs, banded);
+        stateMachine_setKmerIndexEmissions(sM);
+        AlignedPairBuffer *alignedPairs = performSignalAlignmentP(sM, eventSequence, eventMap, mapOffset, target, p,
+                                                                  unmappedAncors, sequence_getKmerIndex,
+                                                                  diagonalCalculationPosteriorMatchProbsToBuffer,
+                                                                  banded);
         return alignedPairs;
     }
     return 0;
@@ -265,6 +234,7 @@ stList *guideAlignmentToRebasedAnchorPairs(struct PairwiseAlignment *pA, Pairwis
 
     // filter
     stList *anchorPairs = filterToRemoveOverlap(unfilteredAnchorPairs);
+    stList_destruct(unfilteredAnchorPairs);
 
     return anchorPairs;
 }
@@ -286,7 +256,7 @@ Sequence *makeEventSequenceFromPairwiseAlignment(double *events, int64_t querySt
     return eventS;
 }
 
-void getSignalExpectations(const char *model, const char *inputHmm, Hmm *hmmExpectations, StateMachineType type,
+void getSignalExpectations(PoreModel *model, const char *inputHmm, Hmm *hmmExpectations, StateMachineType type,
                            NanoporeReadAdjustmentParameters npp, Sequence *eventSequence,
                            int64_t *eventMap, int64_t mapOffset, char *trainingTarget, PairwiseAlignmentParameters *p,
                            stList *unmappedAnchors, Strand strand) {
@@ -321,6 +291,249 @@ void getSignalExpectations(const char *model, const char *inputHmm, Hmm *hmmExpe
         getExpectationsUsingAnchors(sM, hmmExpectations, target, eventSequence, filteredRemappedAnchors, p,
                                     diagonalCalculation_signal_Expectations, 1, 1);
     }
+    poreModel_destructStateMachine(model, sM);
+}
+
+// the arguments of getSignalExpectations for one strand, so that the strands can be run on two threads
+typedef struct _strandExpectations {
+    PoreModel *model;
+    const char *inputHmm;
+    Hmm *hmmExpectations;
+    StateMachineType type;
+    NanoporeReadAdjustmentParameters npp;
+    Sequence *eventSequence;
+    int64_t *eventMap;
+    int64_t mapOffset;
+    char *trainingTarget;
+    PairwiseAlignmentParameters *p;
+    stList *unmappedAnchors;
+    Strand strand;
+} StrandExpectations;
+
+static void strandExpectations_get(StrandExpectations *sE) {
+    getSignalExpectations(sE->model, sE->inputHmm, sE->hmmExpectations, sE->type, sE->npp, sE->eventSequence,
+                          sE->eventMap, sE->mapOffset, sE->trainingTarget, sE->p, sE->unmappedAnchors, sE->strand);
+}
+
+// the arguments and result of performSignalAlignment for one strand
+typedef struct _strandAlignment {
+    StateMachine *sM;
+    const char *hmmFile;
+    Sequence *eventSequence;
+    int64_t *eventMap;
+    int64_t mapOffset;
+    char *target;
+    PairwiseAlignmentParameters *p;
+    stList *unmappedAnchors;
+    bool banded;
+    AlignedPairBuffer *alignedPairs;
+} StrandAlignment;
+
+static void strandAlignment_align(StrandAlignment *sA) {
+    sA->alignedPairs = performSignalAlignment(sA->sM, sA->hmmFile, sA->eventSequence, sA->eventMap, sA->mapOffset,
+                                              sA->target, sA->p, sA->unmappedAnchors, sA->banded);
+}
+
+//Runs fn on both strands' tasks at once. The strands share only read-only inputs (the reference slices, the anchors,
+//the parameters and the read), each has its own state machine and events.
+static void runOnBothStrands(void *templateTask, void *complementTask, void (*fn)(void *)) {
+    stList *tasks = stList_construct();
+    stList_append(tasks, templateTask);
+    stList_append(tasks, complementTask);
+    threadPool_runTasks(tasks, fn, 2);
+    stList_destruct(tasks);
+}
+
+/*
+ * A read set up for alignment by its guide alignment: the slice of the reference it aligns to, in both orientations,
+ * the template and complement events the guide covers and the anchors the guide gives.
+ */
+typedef struct _guidedRead {
+    char *trimmedRefSeq;
+    char *rc_trimmedRefSeq;
+    Sequence *tEventSequence;
+    Sequence *cEventSequence;
+    // the aligned pairs start at (0,0) so they're corrected by the guide alignment's pre-zeroed start and end
+    // coordinates, for the events
+    int64_t tCoordinateShift;
+    int64_t cCoordinateShift;
+    // and for the reference
+    int64_t rCoordinateShift_t;
+    int64_t rCoordinateShift_c;
+    int64_t queryStart;
+    bool forward;  // keep track of whether this is a forward mapped read or not
+    stList *anchorPairs;
+} GuidedRead;
+
+GuidedRead *guidedRead_construct(char *referenceSequence, NanoporeRead *npRead, struct PairwiseAlignment *pA,
+                                 PairwiseAlignmentParameters *p) {
+    GuidedRead *gR = st_malloc(sizeof(GuidedRead));
+
+    // slice out the section of the reference we're aligning to
+    char *refSlice = getSubSequence(referenceSequence, pA->start1, pA->end1, pA->strand1);
+    if (pA->strand1) {
+        gR->trimmedRefSeq = refSlice;
+    } else {
+        gR->trimmedRefSeq = stString_reverseComplementString(refSlice);
+        free(refSlice);
+    }
+
+    // reverse complement for complement event sequence
+    gR->rc_trimmedRefSeq = stString_reverseComplementString(gR->trimmedRefSeq);
+
+    // constrain the event sequence to the positions given by the guide alignment
+    gR->tEventSequence = makeEventSequenceFromPairwiseAlignment(npRead->templateEvents, pA->start2, pA->end2,
+                                                                npRead->templateEventMap);
+    gR->cEventSequence = makeEventSequenceFromPairwiseAlignment(npRead->complementEvents, pA->start2, pA->end2,
+                                                                npRead->complementEventMap);
+
+    gR->tCoordinateShift = npRead->templateEventMap[pA->start2];
+    gR->cCoordinateShift = npRead->complementEventMap[pA->start2];
+    gR->rCoordinateShift_t = pA->start1;
+    gR->rCoordinateShift_c = pA->end1;
+    gR->queryStart = pA->start2;
+    gR->forward = pA->strand1;
+
+    // rebases pA, so comes after everything taken from it
+    gR->anchorPairs = guideAlignmentToRebasedAnchorPairs(pA, p);
+    return gR;
+}
+
+void guidedRead_destruct(GuidedRead *gR) {
+    free(gR->trimmedRefSeq);
+    free(gR->rc_trimmedRefSeq);
+    // the event sequences point into the read's events
+    sequence_sequenceDestroy(gR->tEventSequence);
+    sequence_sequenceDestroy(gR->cEventSequence);
+    stList_destruct(gR->anchorPairs);
+    free(gR);
+}
+
+void alignGuidedRead(StateMachine *sMt, StateMachine *sMc, const char *templateHmmFile, const char *complementHmmFile,
+                     NanoporeRead *npRead, GuidedRead *gR, char *contig, PairwiseAlignmentParameters *p,
+                     char *readLabel, PosteriorWriter *posteriors, bool banded) {
+    // Template and complement alignment, on a thread each
+    fprintf(stderr, "vanillaAlign - starting template and complement alignment\n");
+    StrandAlignment templateAlignment = { sMt, templateHmmFile, gR->tEventSequence, npRead->templateEventMap,
+                                          gR->queryStart, gR->trimmedRefSeq, p, gR->anchorPairs, banded, NULL };
+    StrandAlignment complementAlignment = { sMc, complementHmmFile, gR->cEventSequence, npRead->complementEventMap,
+                                            gR->queryStart, gR->rc_trimmedRefSeq, p, gR->anchorPairs, banded, NULL };
+    runOnBothStrands(&templateAlignment, &complementAlignment, (void (*)(void *)) strandAlignment_align);
+
+    // the results are reported template first, as when the strands were aligned one after the other
+    AlignedPairBuffer *templateAlignedPairs = templateAlignment.alignedPairs;
+    AlignedPairBuffer *complementAlignedPairs = complementAlignment.alignedPairs;
+
+    double templatePosteriorScore = scoreByPosteriorProbabilityIgnoringGaps(templateAlignedPairs);
+    double complementPosteriorScore = scoreByPosteriorProbabilityIgnoringGaps(complementAlignedPairs);
+
+    fprintf(stdout, "%s %lld\t%lld(%f)\t%lld(%f)\n", readLabel, stList_length(gR->anchorPairs),
+            templateAlignedPairs->length, templatePosteriorScore,
+            complementAlignedPairs->length, complementPosteriorScore);
+
+    // the pairs come sorted by x + y
+
+    // write to file
+    if (posteriors != NULL) {
+        posteriorWriter_writeStrand(posteriors, readLabel, contig, template, gR->forward, gR->trimmedRefSeq,
+                                    sMt->EMISSION_MATCH_PROBS, npRead->templateParams.scale,
+                                    npRead->templateParams.shift, npRead->templateEvents, gR->tCoordinateShift,
+                                    gR->rCoordinateShift_t, templateAlignedPairs);
+        posteriorWriter_writeStrand(posteriors, readLabel, contig, complement, gR->forward, gR->rc_trimmedRefSeq,
+                                    sMc->EMISSION_MATCH_PROBS, npRead->complementParams.scale,
+                                    npRead->complementParams.shift, npRead->complementEvents, gR->cCoordinateShift,
+                                    gR->rCoordinateShift_c, complementAlignedPairs);
+    }
+    alignedPairBuffer_destruct(templateAlignedPairs);
+    alignedPairBuffer_destruct(complementAlignedPairs);
+}
+
+NanoporeRead *loadNanoporeRead(NanoporeReadBundle *npReads, const char *npRead) {
+    if (npReads == NULL) {
+        return nanopore_loadNanoporeReadFromFile(npRead);
+    }
+    int64_t readIndex = nanoporeReadBundle_findRead(npReads, npRead);
+    if (readIndex < 0) {
+        st_errAbort("vanillaAlign - no read %s in the npRead bundle", npRead);
+    }
+    return nanoporeReadBundle_getRead(npReads, readIndex);
+}
+
+void alignManifest(const char *manifestFile, FILE *guideAlignments, char *referenceSequence,
+                   PoreModel *templatePoreModel, PoreModel *complementPoreModel,
+                   const char *templateHmmFile, const char *complementHmmFile, StateMachineType sMtype,
+                   PairwiseAlignmentParameters *p, PosteriorWriter *posteriors, PosteriorsFormat posteriorsFormat,
+                   NanoporeReadBundle *npReads, bool banded) {
+    /*
+     * Aligns every read of the manifest, one per line as "readLabel npReadFile [posteriorsFile]", to the reference.
+     * The guide alignments are read from guideAlignments in the same order, one CIGAR per read. The stateMachines
+     * and HMMs are loaded once, the models are rescaled to each read's adjustment parameters. Reads without a
+     * posteriors file of their own are written to posteriors, if given, those with one have it opened (in
+     * posteriorsFormat) for their rows. With an npRead bundle the second
+     * field is the name of the read in the bundle rather than a file.
+     */
+    FILE *fH = fopen(manifestFile, "r");
+    if (fH == NULL) {
+        st_errAbort("vanillaAlign - couldn't open manifest %s", manifestFile);
+    }
+
+    StateMachine *sMt = loadStateMachine(templatePoreModel, sMtype, template);
+    StateMachine *sMc = loadStateMachine(complementPoreModel, sMtype, complement);
+    if (templateHmmFile != NULL) {
+        fprintf(stderr, "loading HMM from file, %s\n", templateHmmFile);
+        loadHmmRoutine(templateHmmFile, sMt, sMtype);
+    }
+    if (complementHmmFile != NULL) {
+        fprintf(stderr, "loading HMM from file, %s\n", complementHmmFile);
+        loadHmmRoutine(complementHmmFile, sMc, sMtype);
+    }
+    int64_t nbReads = 0;
+    char *line;
+    while ((line = stFile_getLineFromFile(fH)) != NULL) {
+        stList *tokens = stString_split(line);
+        free(line);
+        if (stList_length(tokens) == 0) {
+            stList_destruct(tokens);
+            continue;
+        }
+        if ((stList_length(tokens) < 2) || (stList_length(tokens) > 3)) {
+            st_errAbort("vanillaAlign - manifest line %lld has %lld fields, expected 2 or 3", nbReads + 1,
+                        stList_length(tokens));
+        }
+        char *readLabel = stList_get(tokens, 0);
+        char *npReadFile = stList_get(tokens, 1);
+        PosteriorWriter *readPosteriors = stList_length(tokens) > 2
+                                          ? posteriorWriter_construct(stList_get(tokens, 2), posteriorsFormat)
+                                          : posteriors;
+
+        struct PairwiseAlignment *pA = cigarRead(guideAlignments);
+        if (pA == NULL) {
+            st_errAbort("vanillaAlign - ran out of guide alignments at read %s, line %lld of the manifest",
+                        readLabel, nbReads + 1);
+        }
+
+        NanoporeRead *npRead = loadNanoporeRead(npReads, npReadFile);
+        scaleStateMachineToRead(templatePoreModel, sMt, npRead->templateParams);
+        scaleStateMachineToRead(complementPoreModel, sMc, npRead->complementParams);
+
+        GuidedRead *gR = guidedRead_construct(referenceSequence, npRead, pA, p);
+        alignGuidedRead(sMt, sMc, NULL, NULL, npRead, gR, pA->contig1, p, readLabel, readPosteriors, banded);
+        fprintf(stderr, "vanillaAlign - finished alignment of query %s\n", readLabel);
+
+        if (readPosteriors != posteriors) {
+            posteriorWriter_destruct(readPosteriors);
+        }
+        guidedRead_destruct(gR);
+        nanopore_nanoporeReadDestruct(npRead);
+        destructPairwiseAlignment(pA);
+        stList_destruct(tokens);
+        nbReads++;
+    }
+    fclose(fH);
+
+    poreModel_destructStateMachine(templatePoreModel, sMt);
+    poreModel_destructStateMachine(complementPoreModel, sMc);
+    fprintf(stderr, "vanillaAlign - SUCCESS: finished alignment of %lld queries, exiting\n", nbReads);
 }
 
 int main(int argc, char *argv[]) {
@@ -330,10 +543,15 @@ int main(int argc, char *argv[]) {
     int64_t diagExpansion = 20;
     double threshold = 0.01;
     int64_t constraintTrim = 14;
+    double adaptiveBandXDrop = 0.0;
+    bool binaryModels = FALSE;
+    PosteriorsFormat posteriorsFormat = posteriors_tsv;
     char *templateModelFile = stString_print("../../cPecan/models/template_median68pA.model");
     char *complementModelFile = stString_print("../../cPecan/models/complement_median68pA_pop2.model");
     char *readLabel = NULL;
     char *npReadFile = NULL;
+    char *manifestFile = NULL;
+    char *npReadBundleFile = NULL;
     char *targetFile = NULL;
     char *posteriorProbsFile = NULL;
     char *templateHmmFile = NULL;
@@ -362,12 +580,17 @@ int main(int argc, char *argv[]) {
                 {"diagonalExpansion",       required_argument,  0,  'x'},
                 {"threshold",               required_argument,  0,  'd'},
                 {"constraintTrim",          required_argument,  0,  'm'},
+                {"adaptiveBandXDrop",       required_argument,  0,  'a'},
+                {"manifest",                required_argument,  0,  'M'},
+                {"binaryModels",            no_argument,        0,  'B'},
+                {"npReadBundle",            required_argument,  0,  'N'},
+                {"binaryPosteriors",        no_argument,        0,  'P'},
 
                 {0, 0, 0, 0} };
 
         int option_index = 0;
 
-        key = getopt_long(argc, argv, "h:s:f:e:b:T:C:L:q:r:u:y:z:t:c:i:x:d:m:", long_options, &option_index);
+        key = getopt_long(argc, argv, "h:s:f:e:b:T:C:L:q:r:u:y:z:t:c:i:x:d:m:a:M:BN:P", long_options, &option_index);
 
         if (key == -1) {
             //usage();
@@ -401,6 +624,18 @@ int main(int argc, char *argv[]) {
             case 'q':
                 npReadFile = stString_copy(optarg);
                 break;
+            case 'M':
+                manifestFile = stString_copy(optarg);
+                break;
+            case 'B':
+                binaryModels = TRUE;
+                break;
+            case 'N':
+                npReadBundleFile = stString_copy(optarg);
+                break;
+            case 'P':
+                posteriorsFormat = posteriors_binary;
+                break;
             case 'r':
                 targetFile = stString_copy(optarg);
                 break;
@@ -436,6 +671,11 @@ int main(int argc, char *argv[]) {
                 assert (constraintTrim >= 0);
                 constraintTrim = (int64_t)constraintTrim;
                 break;
+            case 'a':
+                j = sscanf(optarg, "%lf", &adaptiveBandXDrop);
+                assert (j == 1);
+                assert (adaptiveBandXDrop >= 0);
+                break;
             default:
                 usage();
                 return 1;
@@ -458,19 +698,48 @@ int main(int argc, char *argv[]) {
     // load reference sequence (reference sequence)
     FILE *reference = fopen(targetFile, "r");
     char *referenceSequence = stFile_getLineFromFile(reference);
+    fclose(reference);
 
-    // load nanopore read
-    NanoporeRead *npRead = nanopore_loadNanoporeReadFromFile(npReadFile);
+    // the npReads are named by -q or the manifest in the bundle, if there is one, otherwise they are files
+    NanoporeReadBundle *npReads = npReadBundleFile != NULL ? nanoporeReadBundle_open(npReadBundleFile) : NULL;
+
+    // load the pore models, once even if both strands use the same one
+    PoreModelCache *poreModels = poreModelCache_construct(binaryModels);
+    PoreModel *templatePoreModel = poreModelCache_get(poreModels, templateModelFile);
+    PoreModel *complementPoreModel = poreModelCache_get(poreModels, complementModelFile);
 
     // make some params
     PairwiseAlignmentParameters *p = pairwiseAlignmentBandingParameters_construct();
     p->threshold = threshold;
     p->constraintDiagonalTrim = constraintTrim;
     p->diagonalExpansion = diagExpansion;
+    p->adaptiveBandXDrop = adaptiveBandXDrop;
 
     // get pairwise alignment from stdin, in exonerate CIGAR format
     FILE *fileHandleIn = stdin;
 
+    if (manifestFile != NULL) {
+        // Batch alignment, every read of the manifest with its guide alignment from stdin //
+        if ((templateExpectationsFile != NULL) || (complementExpectationsFile != NULL)) {
+            st_errAbort("vanillaAlign - getting expectations not allowed with a manifest, yet");
+        }
+        PosteriorWriter *posteriors = posteriorProbsFile != NULL
+                                      ? posteriorWriter_construct(posteriorProbsFile, posteriorsFormat) : NULL;
+        alignManifest(manifestFile, fileHandleIn, referenceSequence, templatePoreModel, complementPoreModel,
+                      templateHmmFile, complementHmmFile, sMtype, p, posteriors, posteriorsFormat, npReads, banded);
+        if (posteriors != NULL) {
+            posteriorWriter_destruct(posteriors);
+        }
+        if (npReads != NULL) {
+            nanoporeReadBundle_close(npReads);
+        }
+        poreModelCache_destruct(poreModels);
+        return 0;
+    }
+
+    // load nanopore read
+    NanoporeRead *npRead = loadNanoporeRead(npReads, npReadFile);
+
     // parse input
     struct PairwiseAlignment *pA;
     pA = cigarRead(fileHandleIn);
@@ -478,34 +747,7 @@ int main(int argc, char *argv[]) {
     // todo put in to help with debuging:
     //printPairwiseAlignmentSummary(pA);
 
-    // slice out the section of the reference we're aligning to
-    char *trimmedRefSeq = getSubSequence(referenceSequence, pA->start1, pA->end1, pA->strand1);
-    trimmedRefSeq = (pA->strand1 ? trimmedRefSeq : stString_reverseComplementString(trimmedRefSeq));
-
-    // reverse complement for complement event sequence
-    char *rc_trimmedRefSeq = stString_reverseComplementString(trimmedRefSeq);
-
-    // constrain the event sequence to the positions given by the guide alignment
-    Sequence *tEventSequence = makeEventSequenceFromPairwiseAlignment(npRead->templateEvents,
-                                                                      pA->start2, pA->end2,
-                                                                      npRead->templateEventMap);
-
-    Sequence *cEventSequence = makeEventSequenceFromPairwiseAlignment(npRead->complementEvents,
-                                                                      pA->start2, pA->end2,
-                                                                      npRead->complementEventMap);
-
-
-    // the aligned pairs start at (0,0) so we need to correct them based on the guide alignment later.
-    // record the pre-zeroed alignment start and end coordinates here
-    // for the events:
-    int64_t tCoordinateShift = npRead->templateEventMap[pA->start2];
-    int64_t cCoordinateShift = npRead->complementEventMap[pA->start2];
-    // and for the reference:
-    int64_t rCoordinateShift_t = pA->start1;
-    int64_t rCoordinateShift_c = pA->end1;
-    bool forward = pA->strand1;  // keep track of whether this is a forward mapped read or not
-
-    stList *anchorPairs = guideAlignmentToRebasedAnchorPairs(pA, p);
+    GuidedRead *gR = guidedRead_construct(referenceSequence, npRead, pA, p);
 
     if ((templateExpectationsFile != NULL) && (complementExpectationsFile != NULL)) {
         // Expectation Routine //
@@ -519,23 +761,21 @@ int main(int argc, char *argv[]) {
         Hmm *complementExpectations = hmmContinuous_getEmptyHmm(sMtype, 0.0001);
 
 
-        // get expectations for template
-        fprintf(stderr, "vanillaAlign - getting expectations for template\n");
-        getSignalExpectations(templateModelFile, templateHmmFile, templateExpectations, sMtype, npRead->templateParams,
-                              tEventSequence, npRead->templateEventMap, pA->start2, trimmedRefSeq, p,
-                              anchorPairs, template);
+        // get expectations for the template and the complement, on a thread each
+        fprintf(stderr, "vanillaAlign - getting expectations for template and complement\n");
+        StrandExpectations templateTask = { templatePoreModel, templateHmmFile, templateExpectations, sMtype,
+                                            npRead->templateParams, gR->tEventSequence, npRead->templateEventMap,
+                                            gR->queryStart, gR->trimmedRefSeq, p, gR->anchorPairs, template };
+        StrandExpectations complementTask = { complementPoreModel, complementHmmFile, complementExpectations, sMtype,
+                                              npRead->complementParams, gR->cEventSequence,
+                                              npRead->complementEventMap, gR->queryStart, gR->rc_trimmedRefSeq, p,
+                                              gR->anchorPairs, complement };
+        runOnBothStrands(&templateTask, &complementTask, (void (*)(void *)) strandExpectations_get);
 
         // write to file
         fprintf(stderr, "vanillaAlign - writing expectations to file: %s\n\n", templateExpectationsFile);
         hmmContinuous_writeToFile(templateExpectationsFile, templateExpectations, sMtype);
 
-        // get expectations for the complement
-        fprintf(stderr, "vanillaAlign - getting expectations for complement\n");
-        getSignalExpectations(complementModelFile, complementHmmFile, complementExpectations, sMtype,
-                              npRead->complementParams, cEventSequence, npRead->complementEventMap, pA->start2,
-                              rc_trimmedRefSeq, p, anchorPairs, complement);
-
-        // write to file
         fprintf(stderr, "vanillaAlign - writing expectations to file: %s\n\n", complementExpectationsFile);
         hmmContinuous_writeToFile(complementExpectationsFile, complementExpectations, sMtype);
         // todo make hmm destruct, test
@@ -543,68 +783,27 @@ int main(int argc, char *argv[]) {
     } else {
         // Alignment Procedure //
 
-        // Template alignment
-        fprintf(stderr, "vanillaAlign - starting template alignment\n");
+        // make stateMachines
+        StateMachine *sMt = buildStateMachine(templatePoreModel, npRead->templateParams, sMtype, template);
+        StateMachine *sMc = buildStateMachine(complementPoreModel, npRead->complementParams, sMtype, complement);
 
-        // make template stateMachine
-        StateMachine *sMt = buildStateMachine(templateModelFile, npRead->templateParams, sMtype, template);
-
-        // get aligned pairs
-        stList *templateAlignedPairs = performSignalAlignment(sMt, templateHmmFile, tEventSequence,
-                                                              npRead->templateEventMap, pA->start2, trimmedRefSeq,
-                                                              p, anchorPairs, banded);
-
-        double templatePosteriorScore = scoreByPosteriorProbabilityIgnoringGaps(templateAlignedPairs);
-
-        fprintf(stdout, "%s %lld\t%lld(%f)\t", readLabel, stList_length(anchorPairs),
-                stList_length(templateAlignedPairs), templatePosteriorScore);
-
-        // sort
-        stList_sort(templateAlignedPairs, sortByXPlusYCoordinate2); //Ensure the coordinates are increasing
-
-        // write to file
-        if (posteriorProbsFile != NULL) {
-            writePosteriorProbs(posteriorProbsFile, readLabel, sMt->EMISSION_MATCH_PROBS,
-                                npRead->templateParams.scale, npRead->templateParams.shift,
-                                npRead->templateEvents, trimmedRefSeq, forward, pA->contig1,
-                                tCoordinateShift, rCoordinateShift_t,
-                                templateAlignedPairs, template);
+        PosteriorWriter *posteriors = posteriorProbsFile != NULL
+                                      ? posteriorWriter_construct(posteriorProbsFile, posteriorsFormat) : NULL;
+        alignGuidedRead(sMt, sMc, templateHmmFile, complementHmmFile, npRead, gR, pA->contig1, p, readLabel,
+                        posteriors, banded);
+        if (posteriors != NULL) {
+            posteriorWriter_destruct(posteriors);
         }
 
-        // intermediate clean up
-        stateMachine_destruct(sMt);
-        sequence_sequenceDestroy(tEventSequence);
-        stList_destruct(templateAlignedPairs);
-
-        // Complement alignment
-        fprintf(stderr, "vanillaAlign - starting complement alignment\n");
-        StateMachine *sMc = buildStateMachine(complementModelFile, npRead->complementParams, sMtype, complement);
-
-        // get aligned pairs
-        stList *complementAlignedPairs = performSignalAlignment(sMc, complementHmmFile, cEventSequence,
-                                                                npRead->complementEventMap, pA->start2,
-                                                                rc_trimmedRefSeq, p, anchorPairs, banded);
-
-        double complementPosteriorScore = scoreByPosteriorProbabilityIgnoringGaps(complementAlignedPairs);
-
-        fprintf(stdout, "%lld(%f)\n", stList_length(complementAlignedPairs), complementPosteriorScore);
-
-        // sort
-        stList_sort(complementAlignedPairs, sortByXPlusYCoordinate2); //Ensure the coordinates are increasing
-
-        // write to file
-        if (posteriorProbsFile != NULL) {
-            writePosteriorProbs(posteriorProbsFile, readLabel, sMc->EMISSION_MATCH_PROBS,
-                                npRead->complementParams.scale, npRead->complementParams.shift,
-                                npRead->complementEvents, rc_trimmedRefSeq,
-                                forward, pA->contig1, cCoordinateShift, rCoordinateShift_c,
-                                complementAlignedPairs, complement);
+        // clean up
+        poreModel_destructStateMachine(templatePoreModel, sMt);
+        poreModel_destructStateMachine(complementPoreModel, sMc);
+        guidedRead_destruct(gR);
+        nanopore_nanoporeReadDestruct(npRead);
+        if (npReads != NULL) {
+            nanoporeReadBundle_close(npReads);
         }
-
-        // final alignment clean up
-        stateMachine_destruct(sMc);
-        sequence_sequenceDestroy(cEventSequence);
-        stList_destruct(complementAlignedPairs);
+        poreModelCache_destruct(poreModels);
         fprintf(stderr, "vanillaAlign - SUCCESS: finished alignment of query %s, exiting\n", readLabel);
     }
 